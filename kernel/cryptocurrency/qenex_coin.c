@@ -3,9 +3,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <pthread.h>
+#include <unistd.h>
 #include <math.h>
+#include <time.h>
+
+#ifndef QXC_CONSENSUS_WAIT_SECONDS
+#define QXC_CONSENSUS_WAIT_SECONDS 30
+#endif
+#define QXC_CONSENSUS_RECHECK_SECONDS 1
+
+/* Provided by the training and network layers */
+void calculate_block_hash(block_t *block);
+uint32_t calculate_difficulty(void);
+void start_continuous_training(void);
+double check_training_progress(uint32_t node);
+void evaluate_trained_model(uint32_t node, ai_verification_t *verification);
+void trigger_mining_reward(uint32_t node, ai_verification_t *verification);
+double calculate_miner_contribution(mining_pool_t *pool, uint32_t miner);
+void generate_transaction_id(transaction_t *tx);
+void get_miner_address(mining_pool_t *pool, uint32_t miner, char *address);
+void request_distributed_verification(ai_verification_t *verification);
+void generate_pool_id(char *pool_id);
+void discover_training_nodes(void);
+int verify_transaction_signature(transaction_t *tx);
+void update_balance(const char *address, double delta);
+void record_ai_contribution(const char *address, const void *contribution);
+void register_miner_in_pool(mining_pool_t *pool, wallet_t *wallet);
+void start_local_training_node(wallet_t *wallet);
 
 /* Global blockchain state */
 static block_t *blockchain_head = NULL;
@@ -14,6 +41,10 @@ static uint32_t blockchain_height = 0;
 static double total_supply = 0.0;
 static pthread_mutex_t blockchain_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Signalled whenever a verifying node confirms an improvement */
+static pthread_mutex_t verification_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t verification_done = PTHREAD_COND_INITIALIZER;
+
 /* Mining pools for distributed training */
 static mining_pool_t *active_pools[100];
 static uint32_t pool_count = 0;
@@ -161,7 +192,7 @@ int verify_ai_improvement(ai_verification_t *verification) {
     }
     
     /* Check consensus from distributed nodes */
-    if (verification->consensus.confirmations < 3) {
+    if (verification->consensus.confirmations < QXC_MIN_CONFIRMATIONS) {
         return 0;  // Need at least 3 confirmations
     }
     
@@ -325,7 +356,29 @@ void calculate_block_hash(block_t *block) {
             block->ai_mining_data.reward_amount);
     
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)data, strlen(data), hash);
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ok = ctx &&
+             EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+             EVP_DigestUpdate(ctx, data, strlen(data));
+    
+    /* Batched settlements are covered by the same hash */
+    for (uint32_t i = 0; ok && i < block->ai_batch_count; i++) {
+        ai_mining_entry_t *entry = &block->ai_batch[i];
+        int len = snprintf(data, sizeof(data), "%d%f%s%s%f",
+                           entry->type,
+                           entry->improvement_metric,
+                           entry->developer_id,
+                           entry->model_hash,
+                           entry->reward_amount);
+        ok = EVP_DigestUpdate(ctx, data, len);
+    }
+    ok = ok && EVP_DigestFinal_ex(ctx, hash, NULL);
+    EVP_MD_CTX_free(ctx);
+    
+    /* A failed digest never meets a target or matches a stored hash */
+    if (!ok) {
+        memset(hash, 0xff, sizeof(hash));
+    }
     
     for(int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
         sprintf(&block->hash[i*2], "%02x", hash[i]);
@@ -358,6 +411,60 @@ uint32_t calculate_difficulty(void) {
     return new_difficulty;
 }
 
+/* Called by the verification layer after it adds a confirmation to v */
+void qxc_verification_complete(ai_verification_t *v) {
+    (void)v;
+    pthread_mutex_lock(&verification_lock);
+    pthread_cond_broadcast(&verification_done);
+    pthread_mutex_unlock(&verification_lock);
+}
+
+/* A proof still waits if it lacks confirmations and no verifier has finished with it yet;
+ * a finished verification's count is final, so waiting on it cannot change the outcome */
+static int consensus_pending(ai_verification_t *proof) {
+    if (__atomic_load_n(&proof->consensus.confirmations, __ATOMIC_ACQUIRE) >= QXC_MIN_CONFIRMATIONS) {
+        return 0;
+    }
+    return __atomic_load_n(&proof->metrics.verification_time, __ATOMIC_ACQUIRE) == 0;
+}
+
+/* Wait until every unverified proof has 3 confirmations or the deadline passes; returns how many
+ * still wait. Confirmations written without qxc_verification_complete() are picked up by a re-check
+ * every second. */
+static uint32_t wait_for_consensus(ai_verification_t *proofs, uint32_t count) {
+    struct timespec deadline, wake;
+    uint32_t pending;
+    
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += QXC_CONSENSUS_WAIT_SECONDS;
+    
+    pthread_mutex_lock(&verification_lock);
+    for (;;) {
+        pending = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            if (consensus_pending(&proofs[i])) pending++;
+        }
+        if (pending == 0) {
+            break;
+        }
+        
+        clock_gettime(CLOCK_REALTIME, &wake);
+        if (wake.tv_sec > deadline.tv_sec ||
+            (wake.tv_sec == deadline.tv_sec && wake.tv_nsec >= deadline.tv_nsec)) {
+            break;
+        }
+        wake.tv_sec += QXC_CONSENSUS_RECHECK_SECONDS;
+        if (wake.tv_sec > deadline.tv_sec ||
+            (wake.tv_sec == deadline.tv_sec && wake.tv_nsec > deadline.tv_nsec)) {
+            wake = deadline;
+        }
+        pthread_cond_timedwait(&verification_done, &verification_lock, &wake);
+    }
+    pthread_mutex_unlock(&verification_lock);
+    
+    return pending;
+}
+
 /* Submit AI improvement for mining */
 int submit_ai_improvement(wallet_t *developer, ai_verification_t *improvement) {
     printf("[QXC] Developer %s submitting AI improvement...\n", developer->address);
@@ -368,13 +475,7 @@ int submit_ai_improvement(wallet_t *developer, ai_verification_t *improvement) {
     request_distributed_verification(improvement);
     
     /* Wait for consensus */
-    int attempts = 0;
-    while (improvement->consensus.confirmations < 3 && attempts < 30) {
-        sleep(1);
-        attempts++;
-    }
-    
-    if (improvement->consensus.confirmations >= 3) {
+    if (wait_for_consensus(improvement, 1) == 0) {
         /* Mine block with improvement */
         block_t *block = mine_block(developer, improvement);
         if (block) {
@@ -388,6 +489,141 @@ int submit_ai_improvement(wallet_t *developer, ai_verification_t *improvement) {
     return 0;
 }
 
+/* Mine one block settling every accepted improvement of a batch */
+block_t* mine_batch_block(wallet_t **miners, ai_verification_t *proofs,
+                          const uint8_t *accepted, uint32_t count) {
+    uint32_t settled = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (accepted[i]) settled++;
+    }
+    
+    if (settled == 0) {
+        return NULL;
+    }
+    
+    block_t *new_block = calloc(1, sizeof(block_t));
+    if (!new_block) {
+        return NULL;
+    }
+    new_block->ai_batch = calloc(settled, sizeof(ai_mining_entry_t));
+    if (!new_block->ai_batch) {
+        free(new_block);
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&blockchain_lock);
+    
+    new_block->index = blockchain_height;
+    new_block->timestamp = time(NULL);
+    strcpy(new_block->prev_hash, blockchain_tail->hash);
+    new_block->difficulty = calculate_difficulty();
+    
+    double total_reward = 0.0;
+    double total_improvement = 0.0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (!accepted[i]) continue;
+        
+        ai_mining_entry_t *entry = &new_block->ai_batch[new_block->ai_batch_count++];
+        /* Type left at 0, as mine_block() leaves it, so both pay the same */
+        entry->improvement_metric = proofs[i].improvement_percentage;
+        strcpy(entry->developer_id, miners[i]->address);
+        strcpy(entry->model_hash, proofs[i].model_id);
+        
+        /* Rewards are capped against the supply as it grows within the batch */
+        entry->reward_amount = calculate_mining_reward(entry->type,
+                                                       entry->improvement_metric);
+        total_supply += entry->reward_amount;
+        total_reward += entry->reward_amount;
+        total_improvement += entry->improvement_metric;
+        
+        /* Update miner's balance and stats */
+        miners[i]->balance += entry->reward_amount;
+        miners[i]->mining_stats.total_mined += entry->reward_amount;
+        miners[i]->mining_stats.total_contributions++;
+        
+        if (proofs[i].metrics.precision > proofs[i].metrics.validation_loss) {
+            miners[i]->mining_stats.accuracy_improvements += proofs[i].improvement_percentage;
+            miners[i]->mining_stats.models_improved++;
+        }
+    }
+    
+    /* Header carries the batch summary; rewards live in the entries */
+    new_block->ai_mining_data.improvement_metric = total_improvement;
+    new_block->ai_mining_data.reward_amount = 0.0;
+    
+    /* Proof of AI Work - one search for the whole batch */
+    uint32_t nonce = 0;
+    char target[65];
+    memset(target, '0', new_block->difficulty);
+    target[new_block->difficulty] = '\0';
+    
+    while (1) {
+        new_block->nonce = nonce;
+        calculate_block_hash(new_block);
+        
+        if (memcmp(new_block->hash, target, new_block->difficulty) <= 0) {
+            break;  // Found valid hash
+        }
+        nonce++;
+    }
+    
+    /* Add block to chain */
+    blockchain_tail->next = new_block;
+    new_block->prev = blockchain_tail;
+    blockchain_tail = new_block;
+    blockchain_height++;
+    
+    pthread_mutex_unlock(&blockchain_lock);
+    
+    printf("[QXC] Block %u mined with %u improvements! Reward: %.4f QXC\n",
+           new_block->index, new_block->ai_batch_count, total_reward);
+    printf("[QXC] Total Supply: %.2f QXC\n", total_supply);
+    
+    return new_block;
+}
+
+/* Submit a batch of AI improvements, settled together in a single block */
+int submit_ai_improvements_batch(wallet_t **developers, ai_verification_t *improvements,
+                                 uint8_t *accepted, uint32_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    
+    printf("[QXC] Submitting batch of %u AI improvements...\n", count);
+    
+    /* Request verification up front for entries that arrive unverified */
+    uint32_t unverified = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (consensus_pending(&improvements[i])) {
+            request_distributed_verification(&improvements[i]);
+            unverified++;
+        }
+    }
+    
+    /* Wait for consensus on those with one shared deadline */
+    if (unverified > 0) {
+        wait_for_consensus(improvements, count);
+    }
+    
+    /* Field checks only; the held-out evaluation already ran in the verifier */
+    uint32_t settled = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        accepted[i] = verify_ai_improvement(&improvements[i]) ? 1 : 0;
+        if (accepted[i]) settled++;
+    }
+    
+    if (settled == 0 || !mine_batch_block(developers, improvements, accepted, count)) {
+        printf("[QXC] Batch mining failed - no improvement passed verification\n");
+        memset(accepted, 0, count);
+        return 0;
+    }
+    
+    printf("[QXC] Batch mining successful! %u/%u improvements rewarded\n",
+           settled, count);
+    return settled;
+}
+
 /* Integrate with distributed training system */
 int integrate_with_distributed_training(void) {
     printf("[QXC] Integrating with distributed training system...\n");
@@ -449,6 +685,13 @@ double get_wallet_balance(const char *address) {
             balance += current->ai_mining_data.reward_amount;
         }
         
+        /* Check batched mining rewards */
+        for (uint32_t i = 0; i < current->ai_batch_count; i++) {
+            if (strcmp(current->ai_batch[i].developer_id, address) == 0) {
+                balance += current->ai_batch[i].reward_amount;
+            }
+        }
+        
         /* Check transactions */
         for (uint32_t i = 0; i < current->tx_count; i++) {
             if (strcmp(current->transactions[i].receiver, address) == 0) {
@@ -513,4 +756,125 @@ void start_continuous_mining(wallet_t *wallet) {
     
     printf("[QXC] Miner registered. Active miners: %u\n", 
            active_pools[0]->active_miners);
-}
\ No newline at end of file
+}
+#ifdef QXC_COIN_TEST
+/* Userspace test: cc -O2 -DQXC_COIN_TEST qenex_coin.c -lcrypto -lpthread -lm */
+#include "../test_check.h"
+
+/* The training and network layers are not linked in */
+static uint32_t verification_requests;
+
+double check_training_progress(uint32_t node) { (void)node; return 0.0; }
+void evaluate_trained_model(uint32_t node, ai_verification_t *v) { (void)node; (void)v; }
+void trigger_mining_reward(uint32_t node, ai_verification_t *v) { (void)node; (void)v; }
+double calculate_miner_contribution(mining_pool_t *pool, uint32_t miner) { (void)pool; (void)miner; return 0.0; }
+void generate_transaction_id(transaction_t *tx) { (void)tx; }
+void get_miner_address(mining_pool_t *pool, uint32_t miner, char *address) { (void)pool; (void)miner; address[0] = '\0'; }
+void request_distributed_verification(ai_verification_t *v) { (void)v; verification_requests++; }
+void generate_pool_id(char *pool_id) { strcpy(pool_id, "test-pool"); }
+void discover_training_nodes(void) {}
+int verify_transaction_signature(transaction_t *tx) { (void)tx; return 1; }
+void update_balance(const char *address, double delta) { (void)address; (void)delta; }
+void record_ai_contribution(const char *address, const void *c) { (void)address; (void)c; }
+void register_miner_in_pool(mining_pool_t *pool, wallet_t *wallet) { (void)pool; (void)wallet; }
+void start_local_training_node(wallet_t *wallet) { (void)wallet; }
+
+/* A proof as the model verifier leaves it: final counts and a verification time */
+static void verified_proof(ai_verification_t *v, const char *model, uint32_t confirmations) {
+    memset(v, 0, sizeof(*v));
+    strcpy(v->model_id, model);
+    v->baseline_accuracy = 0.80;
+    v->improved_accuracy = 0.85;
+    v->improvement_percentage = 5.0;
+    v->metrics.f1_score = 0.85;
+    v->metrics.verification_time = time(NULL);
+    v->consensus.verifying_nodes = 4;
+    v->consensus.confirmations = confirmations;
+    v->consensus.consensus_score = confirmations / 4.0;
+}
+
+static double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* A verified proof short of 3 confirmations is dropped without holding up the batch */
+static void test_sub_threshold_does_not_block(wallet_t *a, wallet_t *b) {
+    wallet_t *wallets[2] = { a, b };
+    ai_verification_t proofs[2];
+    uint8_t accepted[2];
+    struct timespec start;
+
+    verified_proof(&proofs[0], "confirmed", 4);
+    verified_proof(&proofs[1], "two-shards", 2);
+    verification_requests = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int settled = submit_ai_improvements_batch(wallets, proofs, accepted, 2);
+    double took = elapsed_since(&start);
+
+    CHECK(settled == 1 && accepted[0] && !accepted[1], "settled %d, accepted %u/%u",
+          settled, accepted[0], accepted[1]);
+    CHECK(took < QXC_CONSENSUS_RECHECK_SECONDS, "settlement waited %.1fs", took);
+    CHECK(verification_requests == 0, "%u verifications requested for verified proofs",
+          verification_requests);
+    CHECK(a->balance > 0.0 && b->balance == 0.0, "balances %.4f %.4f", a->balance, b->balance);
+}
+
+/* A batch containing only sub-threshold proofs mines nothing and returns at once */
+static void test_all_sub_threshold(wallet_t *a) {
+    wallet_t *wallets[1] = { a };
+    ai_verification_t proof;
+    uint8_t accepted[1];
+    struct timespec start;
+    uint32_t height = blockchain_height;
+
+    verified_proof(&proof, "none", 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK(submit_ai_improvements_batch(wallets, &proof, accepted, 1) == 0, "settled a 0-shard proof");
+    CHECK(elapsed_since(&start) < QXC_CONSENSUS_RECHECK_SECONDS, "settlement waited");
+    CHECK(blockchain_height == height, "mined a block for nothing");
+}
+
+/* Settling a proof in a batch pays what mining it alone pays */
+static void test_batch_pays_as_single(wallet_t *a) {
+    ai_verification_t proof;
+    double before;
+
+    verified_proof(&proof, "paid", 4);
+    before = a->balance;
+    block_t *single = mine_block(a, &proof);
+    double single_paid = a->balance - before;
+
+    uint8_t accepted = 1;
+    before = a->balance;
+    block_t *batch = mine_batch_block(&a, &proof, &accepted, 1);
+    double batch_paid = a->balance - before;
+
+    CHECK(single && batch && batch->ai_batch_count == 1, "mining failed");
+    CHECK(single && batch && batch->ai_batch[0].type == single->ai_mining_data.type &&
+          batch->ai_batch[0].reward_amount == single->ai_mining_data.reward_amount,
+          "batch entry paid %.4f, mine_block %.4f",
+          batch ? batch->ai_batch[0].reward_amount : -1.0,
+          single ? single->ai_mining_data.reward_amount : -1.0);
+    CHECK(single_paid > 0.0 && batch_paid == single_paid, "balance grew %.4f batched, %.4f alone",
+          batch_paid, single_paid);
+    CHECK(verify_blockchain_integrity(), "chain does not verify");
+}
+
+int main(void) {
+    qxc_init();
+
+    wallet_t *a = create_wallet("dev-a");
+    wallet_t *b = create_wallet("dev-b");
+
+    test_sub_threshold_does_not_block(a, b);
+    test_all_sub_threshold(a);
+    test_batch_pays_as_single(a);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
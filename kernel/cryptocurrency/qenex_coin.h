@@ -13,6 +13,7 @@
 #define HALVING_INTERVAL 210000
 #define MAX_SUPPLY 21000000.0
 #define TRANSACTION_FEE 0.001
+#define QXC_MIN_CONFIRMATIONS 3
 
 /* Mining rewards based on AI improvements */
 typedef enum {
@@ -26,6 +27,15 @@ typedef enum {
     MINING_TYPE_PERFORMANCE_BOOST = 8  // Performance optimizations
 } mining_type_t;
 
+/* Single AI improvement settled inside a block */
+typedef struct ai_mining_entry {
+    mining_type_t type;
+    double improvement_metric;  // Percentage improvement
+    char developer_id[65];
+    char model_hash[65];       // Hash of improved AI model
+    double reward_amount;
+} ai_mining_entry_t;
+
 /* Block structure for blockchain */
 typedef struct block {
     uint32_t index;
@@ -44,6 +54,10 @@ typedef struct block {
         double reward_amount;
     } ai_mining_data;
     
+    /* Batched settlement: improvements rewarded together in this block */
+    ai_mining_entry_t *ai_batch;
+    uint32_t ai_batch_count;
+    
     /* Transactions in this block */
     struct transaction *transactions;
     uint32_t tx_count;
@@ -192,6 +206,11 @@ double get_wallet_balance(const char *address);
 int verify_blockchain_integrity(void);
 void start_continuous_mining(wallet_t *wallet);
 int submit_ai_improvement(wallet_t *developer, ai_verification_t *improvement);
+void qxc_verification_complete(ai_verification_t *v);
+block_t* mine_batch_block(wallet_t **miners, ai_verification_t *proofs,
+                          const uint8_t *accepted, uint32_t count);
+int submit_ai_improvements_batch(wallet_t **developers, ai_verification_t *improvements,
+                                 uint8_t *accepted, uint32_t count);
 
 /* Distributed training integration */
 int integrate_with_distributed_training(void);
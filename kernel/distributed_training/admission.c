@@ -0,0 +1,460 @@
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define ADMISSION_SERVICE_ALPHA 0.1
+#define ADMISSION_MIN_REFILL 0.1   // Refill share left at a full in-flight queue
+
+typedef struct {
+    char node_id[65];
+    double credits;
+    double last_refill;
+} node_credit_t;
+
+static struct {
+    admission_config_t config;
+
+    uint32_t inflight;
+    double registration_tokens;
+    double registration_refill;
+
+    node_credit_t nodes[ADMISSION_MAX_NODES];
+    admission_stats_t stats;
+    pthread_mutex_t lock;
+} admission = {
+    .config = {
+        .max_inflight = 256,
+        .handshake_timeout = 10,
+        .registration_rate = 50.0,
+        .registration_burst = 100,
+        .node_credits = 8,
+        .credit_refill = 0.5
+    },
+    .registration_tokens = 100,
+    .stats.service_ms = 1.0,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Jittered retry hint in [base, 2*base], clamped to [1, ADMISSION_MAX_RETRY] */
+static uint32_t retry_hint(double base_seconds) {
+    if (base_seconds < 1.0) base_seconds = 1.0;
+
+    double hint = base_seconds * (1.0 + (double)rand() / RAND_MAX);
+    if (hint > ADMISSION_MAX_RETRY) hint = ADMISSION_MAX_RETRY;
+
+    return (uint32_t)(hint + 0.5);
+}
+
+/* Share of the normal refill rate left at the current queue fill */
+static double refill_factor(void) {
+    double load = (double)admission.inflight / admission.config.max_inflight;
+    double factor = 1.0 - load;
+
+    return factor < ADMISSION_MIN_REFILL ? ADMISSION_MIN_REFILL : factor;
+}
+
+static uint32_t hash_node(const char *node_id) {
+    uint32_t h = 2166136261u;
+    while (*node_id) {
+        h = (h ^ (uint8_t)*node_id++) * 16777619u;
+    }
+    return h;
+}
+
+static void refill_node(node_credit_t *entry, double now) {
+    entry->credits += (now - entry->last_refill) *
+                      admission.config.credit_refill * refill_factor();
+    if (entry->credits > admission.config.node_credits) {
+        entry->credits = admission.config.node_credits;
+    }
+    entry->last_refill = now;
+}
+
+/* Credit entry for a node, or NULL if it has none and create is 0. A full
+ * table evicts the longest-idle entry whose bank has refilled, since that
+ * node would come back to a full bank anyway. Entries still owed credits
+ * are kept, so rotating node_ids cannot reset anyone's bank; with none to
+ * evict this returns NULL and *wait is when the first bank fills. */
+static node_credit_t* find_node(const char *node_id, double now, int create, double *wait) {
+    uint32_t start = hash_node(node_id) % ADMISSION_MAX_NODES;
+    double rate = admission.config.credit_refill * refill_factor();
+    node_credit_t *victim = NULL;
+    double soonest = -1.0;
+
+    for (uint32_t probe = 0; probe < ADMISSION_MAX_NODES; probe++) {
+        node_credit_t *entry = &admission.nodes[(start + probe) % ADMISSION_MAX_NODES];
+
+        if (entry->node_id[0] == '\0') {
+            victim = entry;
+            break;
+        }
+        if (strcmp(entry->node_id, node_id) == 0) {
+            return entry;
+        }
+        if (!create) continue;
+
+        double owed = admission.config.node_credits - entry->credits -
+                      (now - entry->last_refill) * rate;
+        if (owed <= 0.0) {
+            if (!victim || entry->last_refill < victim->last_refill) {
+                victim = entry;
+            }
+        } else if (soonest < 0.0 || owed / rate < soonest) {
+            soonest = owed / rate;
+        }
+    }
+
+    if (!create) return NULL;
+    if (!victim) {
+        *wait = soonest;
+        return NULL;
+    }
+
+    /* New nodes start with a full bank */
+    strncpy(victim->node_id, node_id, 64);
+    victim->node_id[64] = '\0';
+    victim->credits = admission.config.node_credits;
+    victim->last_refill = now;
+
+    return victim;
+}
+
+void admission_init(const admission_config_t *config) {
+    pthread_mutex_lock(&admission.lock);
+
+    if (config) {
+        admission.config = *config;
+    }
+    if (admission.config.max_inflight == 0) admission.config.max_inflight = 1;
+
+    admission.registration_tokens = admission.config.registration_burst;
+    admission.registration_refill = now_seconds();
+    memset(admission.nodes, 0, sizeof(admission.nodes));
+
+    pthread_mutex_unlock(&admission.lock);
+}
+
+const admission_config_t* admission_get_config(void) {
+    return &admission.config;
+}
+
+/* Take an in-flight slot for a new connection */
+int admission_accept(uint32_t *retry_after) {
+    pthread_mutex_lock(&admission.lock);
+
+    if (admission.inflight >= admission.config.max_inflight) {
+        /* Roughly how long the queue ahead of this node takes to drain */
+        double drain = admission.inflight * admission.stats.service_ms / 1000.0;
+        *retry_after = retry_hint(drain);
+        admission.stats.shed++;
+        pthread_mutex_unlock(&admission.lock);
+        return 0;
+    }
+
+    admission.inflight++;
+    admission.stats.admitted++;
+    if (admission.inflight > admission.stats.peak_inflight) {
+        admission.stats.peak_inflight = admission.inflight;
+    }
+
+    pthread_mutex_unlock(&admission.lock);
+    return 1;
+}
+
+/* Connection closed; service_ms < 0 if it was never handled */
+void admission_release(double service_ms) {
+    pthread_mutex_lock(&admission.lock);
+
+    if (admission.inflight > 0) admission.inflight--;
+    if (service_ms >= 0.0) {
+        admission.stats.service_ms += ADMISSION_SERVICE_ALPHA *
+                                      (service_ms - admission.stats.service_ms);
+    }
+
+    pthread_mutex_unlock(&admission.lock);
+}
+
+/* Connection dropped before it sent anything */
+void admission_timeout(void) {
+    pthread_mutex_lock(&admission.lock);
+
+    if (admission.inflight > 0) admission.inflight--;
+    admission.stats.timed_out++;
+
+    pthread_mutex_unlock(&admission.lock);
+}
+
+/* Take a registration token */
+int admission_register(uint32_t *retry_after) {
+    pthread_mutex_lock(&admission.lock);
+
+    double now = now_seconds();
+    admission.registration_tokens += (now - admission.registration_refill) *
+                                     admission.config.registration_rate;
+    if (admission.registration_tokens > admission.config.registration_burst) {
+        admission.registration_tokens = admission.config.registration_burst;
+    }
+    admission.registration_refill = now;
+
+    if (admission.registration_tokens < 1.0) {
+        double wait = (1.0 - admission.registration_tokens) /
+                      admission.config.registration_rate;
+        *retry_after = retry_hint(wait);
+        admission.stats.registrations_deferred++;
+        pthread_mutex_unlock(&admission.lock);
+        return 0;
+    }
+
+    admission.registration_tokens -= 1.0;
+
+    pthread_mutex_unlock(&admission.lock);
+    return 1;
+}
+
+/* Spend one of a node's stream credits */
+int admission_stream_begin(const char *node_id, uint32_t *retry_after) {
+    pthread_mutex_lock(&admission.lock);
+
+    double now = now_seconds();
+    double wait = 0.0;
+    node_credit_t *entry = find_node(node_id, now, 1, &wait);
+
+    if (entry) {
+        refill_node(entry, now);
+        wait = (1.0 - entry->credits) /
+               (admission.config.credit_refill * refill_factor());
+    }
+
+    if (!entry || entry->credits < 1.0) {
+        *retry_after = retry_hint(wait);
+        admission.stats.streams_deferred++;
+        pthread_mutex_unlock(&admission.lock);
+        return 0;
+    }
+
+    entry->credits -= 1.0;
+
+    pthread_mutex_unlock(&admission.lock);
+    return 1;
+}
+
+/* Give back the credit of a stream that was refused or failed */
+void admission_stream_refund(const char *node_id) {
+    pthread_mutex_lock(&admission.lock);
+
+    double now = now_seconds();
+    node_credit_t *entry = find_node(node_id, now, 0, NULL);
+    if (entry) {
+        refill_node(entry, now);
+        entry->credits += 1.0;
+        if (entry->credits > admission.config.node_credits) {
+            entry->credits = admission.config.node_credits;
+        }
+    }
+
+    pthread_mutex_unlock(&admission.lock);
+}
+
+/* Whole credits a node can spend right now; a node with no entry yet
+ * would start with a full bank */
+uint32_t admission_credits(const char *node_id) {
+    pthread_mutex_lock(&admission.lock);
+
+    double now = now_seconds();
+    node_credit_t *entry = find_node(node_id, now, 0, NULL);
+    uint32_t credits = admission.config.node_credits;
+    if (entry) {
+        refill_node(entry, now);
+        credits = (uint32_t)entry->credits;
+    }
+
+    pthread_mutex_unlock(&admission.lock);
+
+    return credits;
+}
+
+void admission_get_stats(admission_stats_t *stats) {
+    pthread_mutex_lock(&admission.lock);
+    *stats = admission.stats;
+    stats->inflight = admission.inflight;
+    pthread_mutex_unlock(&admission.lock);
+}
+
+/* One line of queue depths and deferral counters */
+size_t admission_export(char *out, size_t out_size) {
+    admission_stats_t stats;
+    admission_get_stats(&stats);
+
+    int n = snprintf(out, out_size,
+                     "inflight=%u/%u peak=%u admitted=%lu shed=%lu timed_out=%lu "
+                     "registrations_deferred=%lu streams_deferred=%lu service_ms=%.2f\n",
+                     stats.inflight, admission.config.max_inflight, stats.peak_inflight,
+                     stats.admitted, stats.shed, stats.timed_out,
+                     stats.registrations_deferred, stats.streams_deferred,
+                     stats.service_ms);
+
+    if (n < 0) return 0;
+    return (size_t)n < out_size ? (size_t)n : out_size - 1;
+}
+
+#ifdef ADMISSION_TEST
+/* Userspace test: cc -O2 -DADMISSION_TEST admission.c -lpthread */
+
+#include "../test_check.h"
+
+/* Refill slow enough that nothing comes back while a test runs */
+static void init_tight(uint32_t max_inflight, uint32_t burst, uint32_t credits) {
+    admission_config_t config = {
+        .max_inflight = max_inflight,
+        .handshake_timeout = 1,
+        .registration_rate = 0.001,
+        .registration_burst = burst,
+        .node_credits = credits,
+        .credit_refill = 0.001
+    };
+    admission_init(&config);
+    memset(&admission.stats, 0, sizeof(admission.stats));
+    admission.stats.service_ms = 1.0;
+    admission.inflight = 0;
+}
+
+/* Past the cap new connections are shed with a bounded hint; a release frees a slot */
+static void test_inflight_cap(void) {
+    init_tight(2, 1, 1);
+    uint32_t retry = 0;
+
+    CHECK(admission_accept(&retry), "first accept refused");
+    CHECK(admission_accept(&retry), "second accept refused");
+    CHECK(!admission_accept(&retry), "accept past the cap admitted");
+    CHECK(retry >= 1 && retry <= ADMISSION_MAX_RETRY, "retry hint %u out of range", retry);
+
+    admission_release(5.0);
+    CHECK(admission_accept(&retry), "accept refused after a release");
+
+    admission_timeout();
+    admission_timeout();
+    admission_timeout();   // Never underflows
+
+    admission_stats_t stats;
+    admission_get_stats(&stats);
+    CHECK(stats.inflight == 0, "inflight %u after releases", stats.inflight);
+    CHECK(stats.shed == 1 && stats.admitted == 3, "shed %lu admitted %lu", stats.shed, stats.admitted);
+    CHECK(stats.peak_inflight == 2, "peak %u", stats.peak_inflight);
+    CHECK(stats.service_ms > 1.0, "service time not updated: %.2f", stats.service_ms);
+}
+
+/* Registrations drain the bucket, then are deferred */
+static void test_registration_bucket(void) {
+    init_tight(8, 3, 1);
+    uint32_t retry = 0;
+
+    for (int i = 0; i < 3; i++) {
+        CHECK(admission_register(&retry), "registration %d in burst refused", i);
+    }
+    CHECK(!admission_register(&retry), "registration past the burst admitted");
+    CHECK(retry == ADMISSION_MAX_RETRY, "slow refill should clamp the hint, got %u", retry);
+
+    admission_stats_t stats;
+    admission_get_stats(&stats);
+    CHECK(stats.registrations_deferred == 1, "deferred %lu", stats.registrations_deferred);
+}
+
+/* Credits are per node: one busy node is held back without touching others */
+static void test_stream_credits(void) {
+    init_tight(8, 1, 2);
+    uint32_t retry = 0;
+
+    CHECK(admission_credits("busy") == 2, "new node does not start with a full bank");
+    CHECK(admission_stream_begin("busy", &retry), "first stream refused");
+    CHECK(admission_stream_begin("busy", &retry), "second stream refused");
+    CHECK(!admission_stream_begin("busy", &retry), "stream past the credits admitted");
+    CHECK(admission_credits("busy") == 0, "credits left after spending all");
+
+    CHECK(admission_stream_begin("quiet", &retry), "other node held back by a busy one");
+
+    admission_stats_t stats;
+    admission_get_stats(&stats);
+    CHECK(stats.streams_deferred == 1, "deferred %lu", stats.streams_deferred);
+}
+
+/* A refused or failed stream gets its credit back, never past the bank */
+static void test_stream_refund(void) {
+    init_tight(8, 1, 2);
+    uint32_t retry = 0;
+
+    CHECK(admission_stream_begin("node", &retry), "first stream refused");
+    CHECK(admission_stream_begin("node", &retry), "second stream refused");
+    admission_stream_refund("node");
+    CHECK(admission_credits("node") == 1, "refund not credited");
+    CHECK(admission_stream_begin("node", &retry), "stream refused after a refund");
+
+    admission_stream_refund("node");
+    admission_stream_refund("node");
+    admission_stream_refund("node");
+    CHECK(admission_credits("node") == 2, "refunds overfilled the bank");
+
+    admission_stream_refund("unknown");
+    CHECK(admission_credits("unknown") == 2, "unknown node not reported as a full bank");
+}
+
+/* A full table evicts only full banks; rotating node_ids cannot reset a busy node */
+static void test_credit_eviction(void) {
+    init_tight(8, 1, 1);
+    uint32_t retry = 0;
+    char id[32];
+
+    CHECK(admission_stream_begin("busy", &retry), "busy node refused with a fresh bank");
+    for (int i = 1; i < ADMISSION_MAX_NODES; i++) {
+        snprintf(id, sizeof(id), "node-%d", i);
+        CHECK(admission_stream_begin(id, &retry), "%s refused with a fresh bank", id);
+    }
+
+    /* Every bank is owed a credit, so newcomers wait rather than evict */
+    for (int i = 0; i < 16; i++) {
+        snprintf(id, sizeof(id), "rotate-%d", i);
+        CHECK(!admission_stream_begin(id, &retry), "%s evicted a bank still owed credits", id);
+    }
+    CHECK(retry >= 1 && retry <= ADMISSION_MAX_RETRY, "retry hint %u out of range", retry);
+    CHECK(!admission_stream_begin("busy", &retry), "busy node's bank was reset");
+
+    /* A refilled bank can go */
+    admission_stream_refund("node-1");
+    CHECK(admission_stream_begin("rotate-0", &retry), "full bank not evicted");
+    CHECK(!admission_stream_begin("busy", &retry), "busy node evicted instead of a full bank");
+}
+
+static void test_export(void) {
+    init_tight(4, 1, 1);
+    uint32_t retry;
+    admission_accept(&retry);
+
+    char line[256];
+    size_t n = admission_export(line, sizeof(line));
+    CHECK(n > 0 && strstr(line, "inflight=1/4") != NULL, "export: %s", line);
+
+    char small[8];
+    n = admission_export(small, sizeof(small));
+    CHECK(n == sizeof(small) - 1 && small[n] == '\0', "truncated export length %zu", n);
+}
+
+int main(void) {
+    test_inflight_cap();
+    test_registration_bucket();
+    test_stream_credits();
+    test_stream_refund();
+    test_credit_eviction();
+    test_export();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,65 @@
+#ifndef QENEX_ADMISSION_H
+#define QENEX_ADMISSION_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Admission control and backpressure for the coordinator.
+ *
+ * Three limits keep a reconnect storm from dragging every exchange down:
+ *   - In-flight cap: connections that have been accepted but not yet
+ *     handled. Past the cap, new connections get a retry hint at accept time
+ *     and are closed without being read. Connections that never send are
+ *     dropped after handshake_timeout.
+ *   - Registration rate: NODE_REGISTER is a token bucket, because every
+ *     registration creates a wallet and assigns a task.
+ *   - Stream credits: every FedAvg delta and migration checkpoint spends
+ *     one of the sending node's credits. Credits refill over time, and
+ *     refill more slowly the fuller the in-flight queue is, so busy nodes
+ *     are slowed down before anyone is turned away. A stream that is
+ *     refused or fails after taking its credit gets it back.
+ *
+ * A turned-away request gets RETRY_AFTER:<seconds>. The hint comes from the
+ * measured service time and is jittered so deferred nodes don't all come
+ * back at once. Replies that grant work report the node's remaining credits
+ * as a trailing :CREDIT:<n>.
+ */
+
+#define ADMISSION_MAX_NODES 2048   // Credit table; twice MAX_TRAINING_NODES
+#define ADMISSION_MAX_RETRY 60     // Upper bound on any retry hint, seconds
+
+typedef struct admission_config {
+    uint32_t max_inflight;         // Accepted connections not yet handled
+    uint32_t handshake_timeout;    // Seconds a connection may sit without sending
+    double registration_rate;      // Registrations admitted per second
+    uint32_t registration_burst;
+    uint32_t node_credits;         // Stream credits a node can bank
+    double credit_refill;          // Credits per node per second when idle
+} admission_config_t;
+
+typedef struct admission_stats {
+    uint32_t inflight;
+    uint32_t peak_inflight;
+    uint64_t admitted;
+    uint64_t shed;                 // Turned away at accept
+    uint64_t timed_out;            // Never sent a first message
+    uint64_t registrations_deferred;
+    uint64_t streams_deferred;
+    double service_ms;             // Smoothed time to handle one connection
+} admission_stats_t;
+
+/* Function prototypes */
+void admission_init(const admission_config_t *config);
+const admission_config_t* admission_get_config(void);
+int admission_accept(uint32_t *retry_after);
+void admission_release(double service_ms);
+void admission_timeout(void);
+int admission_register(uint32_t *retry_after);
+int admission_stream_begin(const char *node_id, uint32_t *retry_after);
+void admission_stream_refund(const char *node_id);
+uint32_t admission_credits(const char *node_id);
+void admission_get_stats(admission_stats_t *stats);
+size_t admission_export(char *out, size_t out_size);
+
+#endif /* QENEX_ADMISSION_H */
@@ -1,17 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <stddef.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "../cryptocurrency/qenex_coin.h"
+#include "job_queue.h"
+#include "model_store.h"
+#include "fedavg.h"
+#include "sync_controller.h"
+#include "task_migration.h"
+#include "model_verifier.h"
+#include "coord_net.h"
+#include "admission.h"
 
 #define MAX_TRAINING_NODES 1000
 #define TRAINING_PORT 9547
 #define MODEL_SYNC_INTERVAL 60
+#define TRAINING_EPOCH_INTERVAL 60 // Seconds per simulated epoch, whatever the sync intervals
 #define CHECKPOINT_INTERVAL 300
+#define FEDAVG_CHUNK_PARAMS 1024
+#define MAX_STREAM_WORKERS 32      // Streaming handlers running off the network loop
+#define STREAM_RETRY_AFTER 1       // Seconds a streaming client waits for a free slot
+#define MIGRATION_OVERLOAD 0.97    // Utilization that triggers rebalancing
+#define MIGRATION_TARGET_LOAD 0.5  // Destinations must be below this
 
 /* Training node structure */
 typedef struct training_node {
@@ -19,6 +38,8 @@ typedef struct training_node {
     char ip_address[16];
     uint16_t port;
     uint8_t active;
+    uint8_t remote;      // Registered over the network, can run migrations
+    uint8_t draining;    // Leaving: task migrates away, node deactivates
     
     /* Computing resources */
     struct {
@@ -38,25 +59,47 @@ typedef struct training_node {
         double accuracy;
         time_t start_time;
         uint64_t samples_processed;
+        training_job_t *job;
     } task;
     
     /* Mining integration */
     wallet_t *wallet;
     double mining_contribution;
     uint64_t blocks_contributed;
+    
+    /* Not part of the seqlock snapshot; keep these last */
+    uint8_t claimed;     // Slot reserved, guarded by registry_lock
+    uint32_t generation; // Bumped on every claim; pointer plus generation names an occupant
+    uint32_t seq;        // Odd while a writer is mid-update
+    pthread_mutex_t lock;
 } training_node_t;
 
+/* Active nodes, published RCU-style: readers iterate without locks */
+typedef struct node_list {
+    uint32_t count;
+    training_node_t *nodes[MAX_TRAINING_NODES];
+} node_list_t;
+
 /* Global distributed training state */
 static struct {
     training_node_t nodes[MAX_TRAINING_NODES];
+    node_list_t *node_list;
     uint32_t active_nodes;
-    pthread_mutex_t nodes_lock;
+    pthread_mutex_t registry_lock;   // Slot claims and list publication
+    
+    /* Read-side counters for node_list grace periods */
+    struct {
+        uint32_t gen;
+        uint32_t readers[2];
+        pthread_mutex_t sync_lock;
+    } rcu;
     
     /* Model repository */
     struct {
         char models[100][65];
         uint32_t model_count;
         double best_accuracies[100];
+        pthread_mutex_t lock;
     } repository;
     
     /* Training coordination */
@@ -64,33 +107,252 @@ static struct {
         pthread_t coordinator_thread;
         pthread_t sync_thread;
         uint8_t running;
+        pthread_mutex_t wake_lock; // With wake, cuts the sync thread's sleep short on stop
+        pthread_cond_t wake;
         uint16_t coordinator_port;
+        coord_net_backend_t net_backend;
+        uint8_t fedavg_enabled;
+        uint32_t stream_workers;   // Detached streaming handlers running
     } coordination;
     
-    /* Continuous improvement tracking */
+    /* Held-out verification, registered before init */
+    struct {
+        verifier_backend_t backend;
+        eval_dataset_t eval;
+        uint8_t configured;
+    } verification;
+    
+    /* Continuous improvement tracking, updated atomically */
     struct {
         uint64_t total_improvements;
         double cumulative_accuracy_gain;
         uint64_t total_epochs_trained;
         double total_qxc_mined;
     } metrics;
+    
+    /* Improvements awaiting settlement; owned by the sync thread */
+    struct {
+        training_node_t *nodes[MAX_TRAINING_NODES];
+        uint32_t generations[MAX_TRAINING_NODES];
+        char node_ids[MAX_TRAINING_NODES][65];
+        ai_verification_t proofs[MAX_TRAINING_NODES];
+        int model_idx[MAX_TRAINING_NODES];
+        uint32_t count;
+    } settlement;
 } training_system = {
     .active_nodes = 0,
-    .nodes_lock = PTHREAD_MUTEX_INITIALIZER,
+    .registry_lock = PTHREAD_MUTEX_INITIALIZER,
+    .rcu.sync_lock = PTHREAD_MUTEX_INITIALIZER,
+    .repository.lock = PTHREAD_MUTEX_INITIALIZER,
     .coordination.running = 0,
+    .coordination.wake_lock = PTHREAD_MUTEX_INITIALIZER,
+    .coordination.wake = PTHREAD_COND_INITIALIZER,
     .coordination.coordinator_port = TRAINING_PORT
 };
 
+/*
+ * Locking:
+ *   - node->lock serializes everything that changes a node. Changes are
+ *     also bracketed by node->seq, so readers can take a consistent copy
+ *     with node_read() without blocking the owner.
+ *   - node_list is replaced, never edited. Readers walk it inside
+ *     node_list_read_lock/unlock and must not block there. Writers hold
+ *     registry_lock to publish a new list, then wait out a grace period
+ *     before freeing the old one.
+ *   - Two node locks are taken in address order. Node locks come before
+ *     repository.lock and before any module lock.
+ *   - node_id, resources, wallet and remote don't change once a node is
+ *     published, so they can be read without a snapshot.
+ */
+
+static void node_lock(training_node_t *node) {
+    pthread_mutex_lock(&node->lock);
+    __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void node_unlock(training_node_t *node) {
+    __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&node->lock);
+}
+
+/* Consistent copy of a node's state without taking its lock */
+static void node_read(const training_node_t *node, training_node_t *out) {
+    uint32_t seq;
+    
+    do {
+        while ((seq = __atomic_load_n(&node->seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        memcpy(out, node, offsetof(training_node_t, claimed));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&node->seq, __ATOMIC_RELAXED) != seq);
+}
+
+static uint32_t node_generation(const training_node_t *node) {
+    return __atomic_load_n(&node->generation, __ATOMIC_ACQUIRE);
+}
+
+/* Whether a pointer taken at generation still names a live node.
+ * Caller holds the node's lock, so the slot can't be reset meanwhile. */
+static int node_current(const training_node_t *node, uint32_t generation) {
+    return node->active && node_generation(node) == generation;
+}
+
+static uint32_t node_list_read_lock(void) {
+    uint32_t idx = __atomic_load_n(&training_system.rcu.gen, __ATOMIC_SEQ_CST) & 1;
+    __atomic_fetch_add(&training_system.rcu.readers[idx], 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+static void node_list_read_unlock(uint32_t idx) {
+    __atomic_fetch_sub(&training_system.rcu.readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+static const node_list_t* node_list_deref(void) {
+    return __atomic_load_n(&training_system.node_list, __ATOMIC_ACQUIRE);
+}
+
+/* Wait until no reader can still hold a list replaced before this call.
+ * Two flips, because a reader may have sampled gen before the first. */
+static void node_list_synchronize(void) {
+    pthread_mutex_lock(&training_system.rcu.sync_lock);
+    
+    for (int flip = 0; flip < 2; flip++) {
+        uint32_t old = __atomic_fetch_add(&training_system.rcu.gen, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&training_system.rcu.readers[old], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+    
+    pthread_mutex_unlock(&training_system.rcu.sync_lock);
+}
+
+/* Copy the current node pointers for work that may block. Slots can be
+ * reclaimed once the read section ends, so callers that write through a
+ * pointer later pass gens and check node_current() under the node lock. */
+static uint32_t node_list_snapshot(training_node_t **out, uint32_t *gens) {
+    uint32_t idx = node_list_read_lock();
+    const node_list_t *list = node_list_deref();
+    uint32_t count = list ? list->count : 0;
+    
+    if (count) {
+        memcpy(out, list->nodes, count * sizeof(training_node_t*));
+    }
+    for (uint32_t i = 0; gens && i < count; i++) {
+        gens[i] = node_generation(out[i]);
+    }
+    node_list_read_unlock(idx);
+    
+    return count;
+}
+
+/* Replace the published list with one that has node added or removed */
+static void node_list_update(training_node_t *node, int add) {
+    node_list_t *next = malloc(sizeof(node_list_t));
+    if (!next) return;
+    
+    pthread_mutex_lock(&training_system.registry_lock);
+    
+    node_list_t *prev = training_system.node_list;
+    next->count = 0;
+    for (uint32_t i = 0; prev && i < prev->count; i++) {
+        if (prev->nodes[i] != node) {
+            next->nodes[next->count++] = prev->nodes[i];
+        }
+    }
+    if (add) {
+        next->nodes[next->count++] = node;
+    }
+    __atomic_store_n(&training_system.node_list, next, __ATOMIC_RELEASE);
+    
+    pthread_mutex_unlock(&training_system.registry_lock);
+    
+    node_list_synchronize();
+    free(prev);
+}
+
+/* Reserve a free node slot; it stays invisible until published */
+static training_node_t* claim_node_slot(void) {
+    training_node_t *node = NULL;
+    
+    pthread_mutex_lock(&training_system.registry_lock);
+    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
+        if (!training_system.nodes[i].claimed) {
+            node = &training_system.nodes[i];
+            node->claimed = 1;
+            __atomic_store_n(&node->generation, node->generation + 1, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&training_system.registry_lock);
+    
+    /* Holders of a stale pointer to the old occupant see the generation move */
+    if (node) {
+        node_lock(node);
+        memset(node, 0, offsetof(training_node_t, claimed));
+        node_unlock(node);
+    }
+    return node;
+}
+
+static void publish_node(training_node_t *node) {
+    node_lock(node);
+    node->active = 1;
+    node_unlock(node);
+    
+    node_list_update(node, 1);
+    __atomic_fetch_add(&training_system.active_nodes, 1, __ATOMIC_RELAXED);
+}
+
+/* Take a node out of the list; its slot is reusable once readers are gone */
+static void unpublish_node(training_node_t *node) {
+    node_list_update(node, 0);
+    __atomic_fetch_sub(&training_system.active_nodes, 1, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&training_system.registry_lock);
+    node->claimed = 0;
+    pthread_mutex_unlock(&training_system.registry_lock);
+}
+
+static void atomic_add_double(double *target, double value) {
+    double expected, desired;
+    
+    __atomic_load(target, &expected, __ATOMIC_RELAXED);
+    
+    do {
+        desired = expected + value;
+    } while (!__atomic_compare_exchange(target, &expected, &desired, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 /* Initialize continuous distributed training */
 void init_continuous_training(void) {
     printf("[CDT] Initializing Continuous Distributed Training System...\n");
     
+    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
+        pthread_mutex_init(&training_system.nodes[i].lock, NULL);
+    }
+    
     training_system.coordination.running = 1;
     training_system.metrics.total_improvements = 0;
     training_system.metrics.cumulative_accuracy_gain = 0.0;
     training_system.metrics.total_epochs_trained = 0;
     training_system.metrics.total_qxc_mined = 0.0;
     
+    /* Jobs must be queueable before the first node registers */
+    job_queue_init();
+    admission_init(NULL);
+    model_store_init();
+    sync_controller_init(NULL);
+    
+    if (training_system.verification.configured) {
+        model_verifier_init(&training_system.verification.backend,
+                            &training_system.verification.eval, NULL);
+    } else {
+        printf("[CDT] No model verifier backend, improvements will not be rewarded\n");
+    }
+    
     /* Start coordinator thread */
     pthread_create(&training_system.coordination.coordinator_thread, NULL,
                    coordinator_thread_func, NULL);
@@ -106,6 +368,91 @@ void init_continuous_training(void) {
     printf("[CDT] System initialized. Waiting for training nodes...\n");
 }
 
+/* Pick the coordinator network backend; call before init_continuous_training */
+void set_coordinator_net_backend(coord_net_backend_t backend) {
+    training_system.coordination.net_backend = backend;
+}
+
+/* Register the held-out set and inference backend; call before init_continuous_training */
+void set_model_verifier_backend(const verifier_backend_t *backend, const eval_dataset_t *eval) {
+    training_system.verification.backend = *backend;
+    training_system.verification.eval = *eval;
+    training_system.verification.configured = 1;
+}
+
+void handle_node_connection(int client_fd, char *buffer, int bytes);
+void handle_fedavg_poll(int client_fd, char *buffer, int bytes);
+void handle_fedavg_delta(int client_fd, char *buffer, int bytes);
+void handle_migration_checkpoint(int client_fd, char *buffer, int bytes);
+void handle_migration_fetch(int client_fd, char *buffer, int bytes);
+
+/* Tell a node to back off and try again later */
+static void reply_retry_after(int client_fd, uint32_t retry_after) {
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "RETRY_AFTER:%u", retry_after);
+    coord_net_reply(client_fd, reply, len);
+}
+
+typedef void (*stream_handler_fn)(int client_fd, char *buffer, int bytes);
+
+/* A streaming exchange handed off the network loop */
+typedef struct {
+    stream_handler_fn handler;
+    int fd;
+    int bytes;
+    char buffer[COORD_NET_BUFFER_SIZE];
+} stream_work_t;
+
+static void* stream_worker_func(void *arg) {
+    stream_work_t *work = arg;
+    
+    work->handler(work->fd, work->buffer, work->bytes);
+    close(work->fd);
+    
+    __atomic_fetch_sub(&training_system.coordination.stream_workers, 1, __ATOMIC_RELEASE);
+    free(work);
+    return NULL;
+}
+
+/* Run a handler that streams bulk data on its own thread, so a slow or
+ * stalled peer holds up only its own exchange and never the network loop */
+static void dispatch_stream(int client_fd, char *buffer, int bytes, stream_handler_fn handler) {
+    if (__atomic_add_fetch(&training_system.coordination.stream_workers, 1,
+                           __ATOMIC_ACQUIRE) > MAX_STREAM_WORKERS) {
+        __atomic_fetch_sub(&training_system.coordination.stream_workers, 1, __ATOMIC_RELEASE);
+        reply_retry_after(client_fd, STREAM_RETRY_AFTER);
+        return;
+    }
+    
+    stream_work_t *work = malloc(sizeof(stream_work_t));
+    if (!work || bytes >= COORD_NET_BUFFER_SIZE || !coord_net_detach(client_fd)) {
+        free(work);
+        __atomic_fetch_sub(&training_system.coordination.stream_workers, 1, __ATOMIC_RELEASE);
+        reply_retry_after(client_fd, STREAM_RETRY_AFTER);
+        return;
+    }
+    
+    /* The loop reuses its receive buffer once dispatch returns */
+    work->handler = handler;
+    work->fd = client_fd;
+    work->bytes = bytes;
+    memcpy(work->buffer, buffer, bytes);
+    work->buffer[bytes] = '\0';
+    
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, stream_worker_func, work) != 0) {
+        /* Detached already, so the fd is ours to close either way */
+        reply_retry_after(client_fd, STREAM_RETRY_AFTER);
+        close(client_fd);
+        __atomic_fetch_sub(&training_system.coordination.stream_workers, 1, __ATOMIC_RELEASE);
+        free(work);
+    }
+    pthread_attr_destroy(&attr);
+}
+
 /* Coordinator thread for managing distributed training */
 void* coordinator_thread_func(void *arg) {
     int server_fd;
@@ -129,48 +476,65 @@ void* coordinator_thread_func(void *arg) {
         return NULL;
     }
     
-    listen(server_fd, 10);
+    listen(server_fd, SOMAXCONN);
     printf("[CDT] Coordinator listening on port %d\n", 
            training_system.coordination.coordinator_port);
     
-    while (training_system.coordination.running) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) continue;
-        
-        /* Handle training node connection */
-        handle_node_connection(client_fd, &client_addr);
-        close(client_fd);
-    }
+    /* Accept, receive and reply in batches; the loop closes each connection
+     * except those handed to a stream worker */
+    coord_net_run(server_fd, handle_node_connection,
+                  training_system.coordination.net_backend,
+                  &training_system.coordination.running);
     
     close(server_fd);
     return NULL;
 }
 
-/* Handle new training node connection */
-void handle_node_connection(int client_fd, struct sockaddr_in *client_addr) {
+/* Handle the first message on a training node connection */
+void handle_node_connection(int client_fd, char *buffer, int bytes) {
     training_node_t *node = NULL;
-    char buffer[4096];
     
-    /* Receive node registration data */
-    int bytes = recv(client_fd, buffer, sizeof(buffer), 0);
-    if (bytes <= 0) return;
+    /* Federated averaging traffic doesn't touch node registration.
+     * Model and delta transfers stream, so they run off the loop. */
+    if (strncmp(buffer, "FEDAVG_POLL:", 12) == 0) {
+        char id[65] = {0};
+        sscanf(buffer + 12, "%64[^:\n]", id);
+        if (fedavg_participant_round(id) == 0) {
+            coord_net_reply(client_fd, "FEDAVG_IDLE", 11);
+        } else {
+            dispatch_stream(client_fd, buffer, bytes, handle_fedavg_poll);
+        }
+        return;
+    }
+    if (strncmp(buffer, "FEDAVG_DELTA:", 13) == 0) {
+        dispatch_stream(client_fd, buffer, bytes, handle_fedavg_delta);
+        return;
+    }
     
-    /* Parse node information */
-    pthread_mutex_lock(&training_system.nodes_lock);
+    /* Task migration traffic */
+    if (strncmp(buffer, "MIGRATE_POLL:", 13) == 0) {
+        handle_migration_poll(client_fd, buffer + 13);
+        return;
+    }
+    if (strncmp(buffer, "MIGRATE_CKPT:", 13) == 0) {
+        dispatch_stream(client_fd, buffer, bytes, handle_migration_checkpoint);
+        return;
+    }
+    if (strncmp(buffer, "MIGRATE_FETCH:", 14) == 0) {
+        dispatch_stream(client_fd, buffer, bytes, handle_migration_fetch);
+        return;
+    }
     
-    /* Find or create node entry */
-    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
-        if (!training_system.nodes[i].active) {
-            node = &training_system.nodes[i];
-            node->active = 1;
-            training_system.active_nodes++;
-            break;
-        }
+    /* Registrations are rate limited; deferred nodes come back later */
+    uint32_t retry_after;
+    if (strncmp(buffer, "NODE_REGISTER:", 14) == 0 && !admission_register(&retry_after)) {
+        reply_retry_after(client_fd, retry_after);
+        return;
     }
     
+    /* The new node is set up privately and published once it has a task */
+    node = claim_node_slot();
+    
     if (node) {
         /* Parse node capabilities */
         sscanf(buffer, "NODE_REGISTER:%64[^:]:%u:%u:%lu:%lf",
@@ -180,8 +544,15 @@ void handle_node_connection(int client_fd, struct sockaddr_in *client_addr) {
                &node->resources.memory_gb,
                &node->resources.tflops);
         
-        strcpy(node->ip_address, inet_ntoa(client_addr->sin_addr));
-        node->port = ntohs(client_addr->sin_port);
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        memset(&client_addr, 0, sizeof(client_addr));
+        getpeername(client_fd, (struct sockaddr*)&client_addr, &client_len);
+        
+        strcpy(node->ip_address, inet_ntoa(client_addr.sin_addr));
+        node->remote = 1;
+        node->draining = 0;
+        node->port = ntohs(client_addr.sin_port);
         
         /* Create wallet for mining rewards */
         node->wallet = create_wallet(node->node_id);
@@ -194,45 +565,450 @@ void handle_node_connection(int client_fd, struct sockaddr_in *client_addr) {
         printf("[CDT]   Mining wallet: %s\n", node->wallet->address);
         
         /* Assign initial training task */
+        node_lock(node);
         assign_training_task(node);
         
-        /* Send acknowledgment with task */
-        sprintf(buffer, "ACK:TASK:%s:%u:%u",
+        /* Send acknowledgment with task and the node's stream credits */
+        sprintf(buffer, "ACK:TASK:%s:%u:%u:CREDIT:%u",
                 node->task.model_id,
                 node->task.current_epoch,
-                node->task.total_epochs);
-        send(client_fd, buffer, strlen(buffer), 0);
+                node->task.total_epochs,
+                admission_credits(node->node_id));
+        node_unlock(node);
+        
+        publish_node(node);
+        coord_net_reply(client_fd, buffer, strlen(buffer));
+    }
+}
+
+/* Send round assignment and global model to a polling FedAvg node; runs on a stream worker */
+void handle_fedavg_poll(int client_fd, char *buffer, int bytes) {
+    char header[128];
+    char id[65] = {0};
+    (void)bytes;
+    
+    sscanf(buffer + 12, "%64[^:\n]", id);
+    uint64_t round_id = fedavg_participant_round(id);
+    
+    /* The round may have closed since the poll was dispatched */
+    if (round_id == 0) {
+        coord_net_reply(client_fd, "FEDAVG_IDLE", 11);
+        return;
     }
     
-    pthread_mutex_unlock(&training_system.nodes_lock);
+    uint32_t params = fedavg_param_count();
+    int len = snprintf(header, sizeof(header), "FEDAVG_ROUND:%lu:%u:%u\n",
+                       round_id, fedavg_get_config()->local_epochs, params);
+    if (!coord_net_send(client_fd, header, len)) return;
+    
+    /* Stream the global model in fixed-size slices; a stalled node times out */
+    float chunk[FEDAVG_CHUNK_PARAMS];
+    for (uint32_t offset = 0; offset < params; offset += FEDAVG_CHUNK_PARAMS) {
+        uint32_t count = fedavg_copy_global(chunk, offset, FEDAVG_CHUNK_PARAMS);
+        if (!coord_net_send(client_fd, chunk, count * sizeof(float))) return;
+    }
 }
 
-/* Assign training task to node */
-void assign_training_task(training_node_t *node) {
-    /* Select model for training based on node capabilities */
-    char model_id[65];
+/* Receive a participant's model delta; it is staged slice by slice, beside
+ * other participants' uploads, and folded in by fedavg_stream_end once whole.
+ * Runs on a stream worker, and a recv that times out aborts the stream */
+void handle_fedavg_delta(int client_fd, char *buffer, int bytes) {
+    uint64_t round_id, samples;
+    char node_id[65];
+    struct timespec started, finished;
+    
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    
+    char *payload = memchr(buffer, '\n', bytes);
+    if (!payload ||
+        sscanf(buffer, "FEDAVG_DELTA:%lu:%64[^:]:%lu", &round_id, node_id, &samples) != 3) {
+        return;
+    }
+    payload++;
+    
+    /* Out of credits: refuse before reading the payload. Every later
+     * refusal or failure gives the credit back */
+    uint32_t retry_after;
+    if (!admission_stream_begin(node_id, &retry_after)) {
+        reply_retry_after(client_fd, retry_after);
+        return;
+    }
+    
+    uint64_t stream;
+    switch (fedavg_stream_begin(round_id, node_id, samples, &stream)) {
+    case FEDAVG_STREAM_OPEN:
+        break;
+    case FEDAVG_STREAM_BUSY:
+        admission_stream_refund(node_id);
+        reply_retry_after(client_fd, STREAM_RETRY_AFTER);
+        return;
+    default:
+        admission_stream_refund(node_id);
+        coord_net_reply(client_fd, "FEDAVG_REJECT", 13);
+        return;
+    }
     
-    if (node->resources.gpu_count > 0) {
-        /* Assign complex model for GPU nodes */
-        sprintf(model_id, "transformer_gpt_%u", rand() % 10);
-        node->task.total_epochs = 100;
+    /* Reassemble floats across recv boundaries and stage slice by slice */
+    float chunk[FEDAVG_CHUNK_PARAMS];
+    uint8_t *staging = (uint8_t*)chunk;
+    uint32_t filled = bytes - (payload - buffer);
+    uint32_t offset = 0;
+    uint32_t params = fedavg_param_count();
+    
+    memcpy(staging, payload, filled);
+    
+    while (offset < params) {
+        uint32_t want = params - offset;
+        if (want > FEDAVG_CHUNK_PARAMS) want = FEDAVG_CHUNK_PARAMS;
+        
+        while (filled < want * sizeof(float)) {
+            int got = recv(client_fd, staging + filled, want * sizeof(float) - filled, 0);
+            if (got <= 0) {
+                fedavg_stream_abort(stream);
+                admission_stream_refund(node_id);
+                return;
+            }
+            filled += got;
+        }
+        
+        /* Fails once the stream timed out, or on a non-finite value */
+        if (!fedavg_stream_chunk(stream, offset, chunk, want)) {
+            fedavg_stream_abort(stream);
+            admission_stream_refund(node_id);
+            coord_net_reply(client_fd, "FEDAVG_REJECT", 13);
+            return;
+        }
+        offset += want;
+        filled = 0;
+    }
+    
+    /* Feed measured link throughput to the sync controller */
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - started.tv_sec) +
+                     (finished.tv_nsec - started.tv_nsec) / 1e9;
+    sync_controller_record_transfer(fedavg_model_id(),
+                                    (uint64_t)params * sizeof(float), seconds);
+    
+    if (fedavg_stream_end(stream)) {
+        char ack[48];
+        int len = snprintf(ack, sizeof(ack), "FEDAVG_ACK:CREDIT:%u", admission_credits(node_id));
+        coord_net_reply(client_fd, ack, len);
     } else {
-        /* Assign simpler model for CPU-only nodes */
-        sprintf(model_id, "mlp_classifier_%u", rand() % 10);
-        node->task.total_epochs = 50;
+        admission_stream_refund(node_id);
+        coord_net_reply(client_fd, "FEDAVG_REJECT", 13);
+    }
+}
+
+/* Sample a subset of active remote nodes and start a FedAvg round */
+void start_fedavg_round(void) {
+    const fedavg_config_t *config = fedavg_get_config();
+    static char candidates[MAX_TRAINING_NODES][65];
+    uint32_t count = 0;
+    
+    /* Only registered remote nodes poll for rounds and report deltas */
+    uint32_t idx = node_list_read_lock();
+    const node_list_t *list = node_list_deref();
+    for (uint32_t i = 0; list && i < list->count; i++) {
+        if (!list->nodes[i]->remote) continue;
+        strcpy(candidates[count++], list->nodes[i]->node_id);
+    }
+    node_list_read_unlock(idx);
+    
+    uint32_t wanted = (uint32_t)(count * config->sample_fraction + 0.5);
+    if (wanted < config->min_participants) wanted = config->min_participants;
+    if (wanted > FEDAVG_MAX_PARTICIPANTS) wanted = FEDAVG_MAX_PARTICIPANTS;
+    if (wanted > count) wanted = count;
+    if (wanted < config->min_reports) return;  // Not enough nodes online
+    
+    /* Partial Fisher-Yates shuffle picks the cohort */
+    for (uint32_t i = 0; i < wanted; i++) {
+        uint32_t j = i + rand() % (count - i);
+        char tmp[65];
+        strcpy(tmp, candidates[i]);
+        strcpy(candidates[i], candidates[j]);
+        strcpy(candidates[j], tmp);
+    }
+    
+    fedavg_begin_round(candidates, wanted);
+}
+
+/* Switch the coordinator into federated averaging mode */
+int enable_federated_averaging(const char *model_id, uint32_t param_count,
+                               const fedavg_config_t *config) {
+    if (!fedavg_init(model_id, param_count, config)) {
+        return 0;
+    }
+    
+    training_system.coordination.fedavg_enabled = 1;
+    sync_controller_set_model_size(model_id, (uint64_t)param_count * sizeof(float));
+    return 1;
+}
+
+/* Source uploads a checkpoint round; the task stays with the source
+ * until the destination fetches it. Rounds spend the source node's stream
+ * credits, and an aborted round gets its credit back. Runs on a stream
+ * worker. */
+void handle_migration_checkpoint(int client_fd, char *buffer, int bytes) {
+    uint32_t migration_id = 0;
+    task_migration_t migration;
+    uint32_t retry_after;
+    int charged = 0;
+    
+    if (sscanf(buffer, "MIGRATE_CKPT:%u", &migration_id) == 1 &&
+        task_migration_get(migration_id, &migration)) {
+        if (!admission_stream_begin(migration.source_id, &retry_after)) {
+            reply_retry_after(client_fd, retry_after);
+            return;
+        }
+        charged = 1;
+    }
+    
+    if (task_migration_handle_checkpoint(client_fd, buffer, bytes, &migration_id) ==
+        MIGRATION_ABORTED && charged) {
+        admission_stream_refund(migration.source_id);
+    }
+}
+
+/* Destination pulls a checkpoint; the final complete pull cuts over.
+ * Runs on a stream worker. */
+void handle_migration_fetch(int client_fd, char *buffer, int bytes) {
+    task_migration_t completed;
+    if (task_migration_handle_fetch(client_fd, buffer, bytes, &completed)) {
+        complete_task_migration(&completed);
+    }
+}
+
+/* Tell a polling node whether it is a migration source or destination */
+void handle_migration_poll(int client_fd, const char *node_id) {
+    char id[65] = {0};
+    char reply[64];
+    uint32_t migration_id = 0;
+    
+    sscanf(node_id, "%64[^:\n]", id);
+    
+    /* A frozen source whose migration was abandoned goes back to training */
+    migration_id = task_migration_take_resume(id);
+    if (migration_id) {
+        snprintf(reply, sizeof(reply), "MIGRATE_RESUME:%u", migration_id);
+        coord_net_reply(client_fd, reply, strlen(reply));
+        return;
+    }
+    
+    switch (task_migration_role(id, &migration_id)) {
+        case MIGRATION_ROLE_SOURCE:
+            snprintf(reply, sizeof(reply), "MIGRATE_SOURCE:%u", migration_id);
+            break;
+        case MIGRATION_ROLE_DEST:
+            snprintf(reply, sizeof(reply), "MIGRATE_DEST:%u", migration_id);
+            break;
+        default:
+            snprintf(reply, sizeof(reply), "MIGRATE_NONE");
+            break;
+    }
+    
+    coord_net_reply(client_fd, reply, strlen(reply));
+}
+
+/* Look up a published node; *generation pins the occupant for a later
+ * node_current() check, since the slot may be reused once we return */
+static training_node_t* find_node_by_id(const char *node_id, uint32_t *generation) {
+    training_node_t *found = NULL;
+    
+    uint32_t idx = node_list_read_lock();
+    const node_list_t *list = node_list_deref();
+    for (uint32_t i = 0; list && i < list->count; i++) {
+        if (strcmp(list->nodes[i]->node_id, node_id) == 0) {
+            found = list->nodes[i];
+            *generation = node_generation(found);
+            break;
+        }
+    }
+    node_list_read_unlock(idx);
+    
+    return found;
+}
+
+/* Least-loaded remote node that can take over a task from source */
+static training_node_t* pick_migration_target(const training_node_t *source) {
+    training_node_t *nodes[MAX_TRAINING_NODES];
+    uint32_t count = node_list_snapshot(nodes, NULL);
+    training_node_t *best = NULL;
+    double best_load = 0.0;
+    
+    for (uint32_t i = 0; i < count; i++) {
+        training_node_t view;
+        node_read(nodes[i], &view);
+        
+        if (!view.active || !view.remote || view.draining) continue;
+        if (strcmp(view.node_id, source->node_id) == 0) continue;
+        if (view.resources.gpu_count < source->resources.gpu_count) continue;
+        if (task_migration_node_busy(view.node_id)) continue;
+        
+        if (!best || view.resources.current_utilization < best_load) {
+            best = nodes[i];
+            best_load = view.resources.current_utilization;
+        }
+    }
+    
+    return best;
+}
+
+/* Switch coordinator bookkeeping to the destination once it holds the final checkpoint */
+void complete_task_migration(const task_migration_t *migration) {
+    uint32_t source_gen, dest_gen;
+    training_node_t *source = find_node_by_id(migration->source_id, &source_gen);
+    training_node_t *dest = find_node_by_id(migration->dest_id, &dest_gen);
+    if (!source || !dest || source == dest) return;
+    
+    /* Both nodes change together; lock in address order */
+    training_node_t *first = source < dest ? source : dest;
+    training_node_t *second = source < dest ? dest : source;
+    node_lock(first);
+    node_lock(second);
+    
+    /* Either side may have left, and its slot been reused, since the lookup */
+    int removed = 0;
+    if (node_current(source, source_gen) && node_current(dest, dest_gen)) {
+        /* Destination's own job goes back to the queue with its progress */
+        preempt_training_task(dest);
+        
+        dest->task = source->task;
+        dest->task.current_epoch = migration->progress.current_epoch;
+        dest->task.samples_processed = migration->progress.samples_processed;
+        dest->task.loss = migration->progress.loss;
+        dest->task.accuracy = migration->progress.accuracy;
+        source->task.job = NULL;
+        
+        printf("[CDT] Task %s cut over from %s to %s at epoch %u\n",
+               dest->task.model_id, source->node_id, dest->node_id, dest->task.current_epoch);
+        
+        if (source->draining) {
+            source->active = 0;
+            removed = 1;
+            printf("[CDT] Node %s drained and removed\n", source->node_id);
+        } else {
+            assign_training_task(source);
+        }
+    }
+    
+    node_unlock(second);
+    node_unlock(first);
+    
+    /* Grace period waits on readers, so never under a node lock */
+    if (removed) {
+        unpublish_node(source);
+    }
+}
+
+/* Move a leaving node's task elsewhere before it goes. Returns whether a
+ * migration started; if no node can take the task yet, or the migration
+ * is later abandoned, rebalance_training_nodes() tries again each tick. */
+int drain_training_node(const char *node_id) {
+    int started = 0;
+    
+    uint32_t generation;
+    training_node_t *node = find_node_by_id(node_id, &generation);
+    if (!node) return 0;
+    
+    /* Only remote nodes' tasks can migrate; a local node is not left
+     * marked as leaving when it never will */
+    node_lock(node);
+    if (!node_current(node, generation) || !node->remote) {
+        node_unlock(node);
+        return 0;
     }
+    node->draining = 1;
+    node_unlock(node);
+    
+    training_node_t view;
+    node_read(node, &view);
+    
+    training_node_t *target = pick_migration_target(&view);
+    started = target && task_migration_begin(view.node_id, target->node_id,
+                                             view.task.model_id) != 0;
     
-    strcpy(node->task.model_id, model_id);
-    node->task.current_epoch = 0;
-    node->task.loss = 10.0;  // Initial high loss
-    node->task.accuracy = 0.0;
-    node->task.start_time = time(NULL);
-    node->task.samples_processed = 0;
+    return started;
+}
+
+/* Start at most one migration per tick: first away from a draining node
+ * whose task has not found a home yet, then away from an overloaded one */
+void rebalance_training_nodes(void) {
+    training_node_t *nodes[MAX_TRAINING_NODES];
+    uint32_t count = node_list_snapshot(nodes, NULL);
+    
+    for (uint32_t i = 0; i < count; i++) {
+        training_node_t view;
+        node_read(nodes[i], &view);
+        
+        if (!view.active || !view.draining) continue;
+        if (task_migration_node_busy(view.node_id)) continue;
+        
+        training_node_t *target = pick_migration_target(&view);
+        if (target && task_migration_begin(view.node_id, target->node_id, view.task.model_id)) {
+            return;
+        }
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        training_node_t view;
+        node_read(nodes[i], &view);
+        
+        if (!view.active || !view.remote || !view.task.job) continue;
+        if (view.resources.current_utilization < MIGRATION_OVERLOAD) continue;
+        if (task_migration_node_busy(view.node_id)) continue;
+        
+        training_node_t *target = pick_migration_target(&view);
+        if (!target) continue;
+        
+        training_node_t target_view;
+        node_read(target, &target_view);
+        if (target_view.resources.current_utilization < MIGRATION_TARGET_LOAD) {
+            task_migration_begin(view.node_id, target_view.node_id, view.task.model_id);
+            return;
+        }
+    }
+}
+
+/* Assign training task to node, pulling the next job from the queue.
+ * Caller holds the node's lock, as for preempt_training_task. */
+void assign_training_task(training_node_t *node) {
+    training_job_t *job = job_queue_pull(node->resources.gpu_count);
+    
+    if (!job) {
+        /* Nothing queued: fall back to background training */
+        char model_id[65];
+        uint32_t total_epochs;
+        
+        if (node->resources.gpu_count > 0) {
+            /* Assign complex model for GPU nodes */
+            sprintf(model_id, "transformer_gpt_%u", rand() % 10);
+            total_epochs = 100;
+        } else {
+            /* Assign simpler model for CPU-only nodes */
+            sprintf(model_id, "mlp_classifier_%u", rand() % 10);
+            total_epochs = 50;
+        }
+        
+        job_queue_submit(model_id, 0, JOB_PRIORITY_BACKGROUND, 0, total_epochs, 0);
+        job = job_queue_pull(node->resources.gpu_count);
+        if (!job) return;
+    }
+    
+    /* Resume from the job's saved progress */
+    strcpy(node->task.model_id, job->model_id);
+    node->task.current_epoch = job->progress.current_epoch;
+    node->task.total_epochs = job->progress.total_epochs;
+    node->task.loss = job->progress.loss;
+    node->task.accuracy = job->progress.accuracy;
+    node->task.start_time = job->progress.start_time;
+    node->task.samples_processed = job->progress.samples_processed;
+    node->task.job = job;
     
     /* Add model to repository if new */
+    pthread_mutex_lock(&training_system.repository.lock);
     int found = 0;
     for (uint32_t i = 0; i < training_system.repository.model_count; i++) {
-        if (strcmp(training_system.repository.models[i], model_id) == 0) {
+        if (strcmp(training_system.repository.models[i], job->model_id) == 0) {
             found = 1;
             break;
         }
@@ -240,45 +1016,179 @@ void assign_training_task(training_node_t *node) {
     
     if (!found && training_system.repository.model_count < 100) {
         strcpy(training_system.repository.models[training_system.repository.model_count],
-               model_id);
+               job->model_id);
         training_system.repository.best_accuracies[training_system.repository.model_count] = 0.0;
         training_system.repository.model_count++;
     }
+    pthread_mutex_unlock(&training_system.repository.lock);
 }
 
+/* Save a node's progress and hand its job back to the queue */
+void preempt_training_task(training_node_t *node) {
+    training_job_t *job = node->task.job;
+    if (!job) return;
+    
+    job->progress.current_epoch = node->task.current_epoch;
+    job->progress.loss = node->task.loss;
+    job->progress.accuracy = node->task.accuracy;
+    job->progress.samples_processed = node->task.samples_processed;
+    
+    printf("[CDT] Preempting job %lu (%s) on node %s at epoch %u/%u\n",
+           job->job_id, job->model_id, node->node_id,
+           job->progress.current_epoch, job->progress.total_epochs);
+    
+    job_queue_requeue(job);
+    node->task.job = NULL;
+}
+
+/* Queue a training job for the cluster */
+training_job_t* submit_training_job(const char *model_id, uint32_t tenant,
+                                    job_priority_t priority, time_t deadline,
+                                    uint32_t total_epochs, uint32_t min_gpus) {
+    training_job_t *job = job_queue_submit(model_id, tenant, priority, deadline,
+                                           total_epochs, min_gpus);
+    if (job) {
+        printf("[CDT] Job %lu queued: model %s, tenant %u, priority %d\n",
+               job->job_id, model_id, tenant, priority);
+    }
+    
+    return job;
+}
+
+/* Sleep until deadline; returns 0 as soon as training is stopped */
+static int sync_thread_wait(time_t deadline) {
+    struct timespec until = { .tv_sec = deadline, .tv_nsec = 0 };
+    
+    pthread_mutex_lock(&training_system.coordination.wake_lock);
+    while (training_system.coordination.running && time(NULL) < deadline) {
+        if (pthread_cond_timedwait(&training_system.coordination.wake,
+                                   &training_system.coordination.wake_lock, &until) == ETIMEDOUT) {
+            break;
+        }
+    }
+    int running = training_system.coordination.running;
+    pthread_mutex_unlock(&training_system.coordination.wake_lock);
+    
+    return running;
+}
+
+static void verify_pending_improvements(void);
+
 /* Model synchronization thread */
 void* sync_thread_func(void *arg) {
     printf("[CDT] Model synchronization thread started\n");
     
-    while (training_system.coordination.running) {
-        sleep(MODEL_SYNC_INTERVAL);
+    time_t next_sync = time(NULL) + MODEL_SYNC_INTERVAL;
+    time_t next_epoch = time(NULL) + TRAINING_EPOCH_INTERVAL;
+    
+    /* Wake for the next epoch or the model whose adaptive interval expires
+     * first, whichever is sooner; a long sync interval delays neither
+     * training nor shutdown */
+    while (sync_thread_wait(next_epoch < next_sync ? next_epoch : next_sync)) {
+        time_t now = time(NULL);
+        int epoch = now >= next_epoch;
+        if (epoch) {
+            next_epoch = now + TRAINING_EPOCH_INTERVAL;
+        }
         
-        pthread_mutex_lock(&training_system.nodes_lock);
+        /* Keep queueing delay bounded for long-waiting jobs */
+        job_queue_age(time(NULL));
         
-        /* Check all active nodes for improvements */
-        for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
-            if (!training_system.nodes[i].active) continue;
+        /* Drop stalled migrations and move work off overloaded nodes */
+        task_migration_expire(now);
+        rebalance_training_nodes();
+        
+        /* Close finished or expired FedAvg rounds; an aggregated round tells
+         * the sync controller how far the model moved */
+        if (training_system.coordination.fedavg_enabled &&
+            fedavg_maybe_close_round(time(NULL)) > 0) {
+            fedavg_stats_t fstats;
+            fedavg_get_stats(&fstats);
+            sync_controller_observe_update(fedavg_model_id(), fstats.last_update_norm);
+        }
+        
+        /* Check all active nodes for improvements; each node is locked
+         * only while it changes, so registrations and migrations proceed */
+        training_node_t *nodes[MAX_TRAINING_NODES];
+        uint32_t gens[MAX_TRAINING_NODES];
+        uint32_t count = node_list_snapshot(nodes, gens);
+        
+        for (uint32_t i = 0; i < count; i++) {
+            training_node_t *node = nodes[i];
+            
+            node_lock(node);
             
-            training_node_t *node = &training_system.nodes[i];
+            if (!node_current(node, gens[i])) {
+                node_unlock(node);
+                continue;
+            }
+            
+            /* Simulate training progress on the epoch clock */
+            if (epoch) {
+                simulate_training_progress(node);
+                if (node->task.job) {
+                    job_queue_charge(node->task.job->tenant, 1.0);
+                }
+            }
             
-            /* Simulate training progress */
-            simulate_training_progress(node);
+            /* Only models whose sync interval has expired are synced */
+            if (sync_controller_due(node->task.model_id, now)) {
+                sync_controller_observe(node->task.model_id, node->task.loss);
+            }
             
-            /* Check for model improvement */
-            if (node->task.current_epoch > 0 && 
-                node->task.current_epoch % 10 == 0) {
-                
-                check_and_reward_improvement(node);
+            if (!epoch) {
+                node_unlock(node);
+                continue;
+            }
+            
+            int check = node->task.current_epoch > 0 && node->task.current_epoch % 10 == 0;
+            node_unlock(node);
+            
+            /* Check for model improvement; verified after the pass, unlocked */
+            if (check) {
+                check_and_reward_improvement(node, gens[i]);
+            }
+            
+            node_lock(node);
+            
+            /* Handle completed training; the node may have been drained
+             * and its slot reused meanwhile */
+            if (!node_current(node, gens[i])) {
+                node_unlock(node);
+                continue;
             }
             
-            /* Handle completed training */
             if (node->task.current_epoch >= node->task.total_epochs) {
                 finalize_training(node);
+                if (node->task.job) {
+                    job_queue_complete(node->task.job);
+                    node->task.job = NULL;
+                }
                 assign_training_task(node);  // Assign new task
+            } else if (node->task.job &&
+                       job_queue_should_preempt(node->task.job, node->resources.gpu_count)) {
+                /* Epoch boundary: yield to higher-priority work */
+                preempt_training_task(node);
+                assign_training_task(node);
             }
+            
+            node_unlock(node);
         }
         
-        pthread_mutex_unlock(&training_system.nodes_lock);
+        /* Verify every improvement found this tick together, then settle
+         * those that hold up in one block */
+        verify_pending_improvements();
+        settle_pending_rewards();
+        
+        /* Retune per-model intervals from what this tick observed */
+        next_sync = sync_controller_commit(now);
+        
+        /* The next FedAvg cohort is sampled when the FedAvg model's own
+         * interval expires, so small updates and slow links space rounds out */
+        if (training_system.coordination.fedavg_enabled && !fedavg_round_active() &&
+            sync_controller_due(fedavg_model_id(), now)) {
+            start_fedavg_round();
+        }
         
         /* Print system metrics */
         print_training_metrics();
@@ -291,7 +1201,7 @@ void* sync_thread_func(void *arg) {
 void simulate_training_progress(training_node_t *node) {
     /* Update epoch */
     node->task.current_epoch++;
-    training_system.metrics.total_epochs_trained++;
+    __atomic_fetch_add(&training_system.metrics.total_epochs_trained, 1, __ATOMIC_RELAXED);
     
     /* Simulate loss decrease and accuracy increase */
     double learning_rate = 0.01;
@@ -310,20 +1220,45 @@ void simulate_training_progress(training_node_t *node) {
     node->resources.current_utilization = 0.7 + ((double)rand() / RAND_MAX * 0.3);
 }
 
-/* Check for improvement and distribute mining rewards */
-void check_and_reward_improvement(training_node_t *node) {
+/* Best accuracy for a model, including improvements queued this tick */
+static double pending_best_accuracy(int model_idx) {
+    pthread_mutex_lock(&training_system.repository.lock);
+    double best = training_system.repository.best_accuracies[model_idx];
+    pthread_mutex_unlock(&training_system.repository.lock);
+    
+    for (uint32_t i = 0; i < training_system.settlement.count; i++) {
+        if (training_system.settlement.model_idx[i] == model_idx &&
+            training_system.settlement.proofs[i].improved_accuracy > best) {
+            best = training_system.settlement.proofs[i].improved_accuracy;
+        }
+    }
+    
+    return best;
+}
+
+/* Check for improvement and queue it for verification and settlement.
+ * Runs on the sync thread without the node's lock; generation is the
+ * one live was listed under, rechecked when the reward is settled. */
+void check_and_reward_improvement(training_node_t *live, uint32_t generation) {
+    training_node_t snapshot;
+    training_node_t *node = &snapshot;
+    node_read(live, &snapshot);
+    
     /* Find model in repository */
     int model_idx = -1;
+    pthread_mutex_lock(&training_system.repository.lock);
     for (uint32_t i = 0; i < training_system.repository.model_count; i++) {
         if (strcmp(training_system.repository.models[i], node->task.model_id) == 0) {
             model_idx = i;
             break;
         }
     }
+    pthread_mutex_unlock(&training_system.repository.lock);
     
     if (model_idx < 0) return;
+    if (training_system.settlement.count >= MAX_TRAINING_NODES) return;
     
-    double prev_accuracy = training_system.repository.best_accuracies[model_idx];
+    double prev_accuracy = pending_best_accuracy(model_idx);
     double improvement = (node->task.accuracy - prev_accuracy) * 100.0;
     
     if (improvement > 1.0) {  // At least 1% improvement
@@ -332,46 +1267,172 @@ void check_and_reward_improvement(training_node_t *node) {
         printf("[CDT]   Previous: %.2f%%, Current: %.2f%%, Improvement: %.2f%%\n",
                prev_accuracy * 100, node->task.accuracy * 100, improvement);
         
+        /* Re-measured on the held-out set before settlement; the node's own
+         * numbers don't count, so without a verifier backend nothing is rewarded */
+        if (!model_verifier_ready()) {
+            printf("[CDT]   No verifier backend, improvement not rewarded\n");
+            return;
+        }
+        
         /* Create AI verification for mining */
-        ai_verification_t verification;
-        strcpy(verification.model_id, node->task.model_id);
-        verification.baseline_accuracy = prev_accuracy;
-        verification.improved_accuracy = node->task.accuracy;
-        verification.improvement_percentage = improvement;
-        
-        verification.metrics.test_samples = node->task.samples_processed;
-        verification.metrics.validation_loss = node->task.loss;
-        verification.metrics.f1_score = node->task.accuracy * 0.95;  // Approximate
-        verification.metrics.precision = node->task.accuracy * 0.97;
-        verification.metrics.recall = node->task.accuracy * 0.93;
-        verification.metrics.verification_time = time(NULL);
-        
-        /* Simulate consensus from other nodes */
-        verification.consensus.verifying_nodes = training_system.active_nodes;
-        verification.consensus.confirmations = (training_system.active_nodes > 3) ? 
-                                               training_system.active_nodes / 2 : 3;
-        verification.consensus.consensus_score = 0.85 + ((double)rand() / RAND_MAX * 0.15);
-        
-        /* Submit for mining reward */
-        if (submit_ai_improvement(node->wallet, &verification)) {
-            /* Update repository */
-            training_system.repository.best_accuracies[model_idx] = node->task.accuracy;
-            
-            /* Update metrics */
-            training_system.metrics.total_improvements++;
-            training_system.metrics.cumulative_accuracy_gain += improvement;
-            
-            /* Update node mining stats */
-            node->mining_contribution += improvement;
+        uint32_t slot = training_system.settlement.count;
+        ai_verification_t *verification = &training_system.settlement.proofs[slot];
+        memset(verification, 0, sizeof(*verification));
+        
+        strcpy(verification->model_id, node->task.model_id);
+        verification->baseline_accuracy = prev_accuracy;
+        /* The claim, until the verifier replaces it; later nodes on the same
+         * model this tick have to beat it */
+        verification->improved_accuracy = node->task.accuracy;
+        
+        training_system.settlement.count++;
+        training_system.settlement.nodes[slot] = live;
+        training_system.settlement.generations[slot] = generation;
+        strcpy(training_system.settlement.node_ids[slot], node->node_id);
+        training_system.settlement.model_idx[slot] = model_idx;
+    }
+}
+
+/* Verify every improvement queued this tick in one pass over the held-out
+ * set's workers, and drop those the held-out set does not confirm */
+static void verify_pending_improvements(void) {
+    uint32_t count = training_system.settlement.count;
+    if (count == 0) return;
+    
+    const char *model_ids[MAX_TRAINING_NODES];
+    const char *node_ids[MAX_TRAINING_NODES];
+    uint8_t verified[MAX_TRAINING_NODES];
+    
+    for (uint32_t i = 0; i < count; i++) {
+        model_ids[i] = training_system.settlement.proofs[i].model_id;
+        node_ids[i] = training_system.settlement.node_ids[i];
+    }
+    
+    model_verifier_verify_batch(model_ids, node_ids, count,
+                                training_system.settlement.proofs, verified);
+    
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        ai_verification_t *verification = &training_system.settlement.proofs[i];
+        
+        if (!verified[i]) {
+            printf("[CDT] %s from %s not verified, improvement not rewarded\n",
+                   verification->model_id, training_system.settlement.node_ids[i]);
+            continue;
+        }
+        
+        verification->improvement_percentage =
+            (verification->improved_accuracy - verification->baseline_accuracy) * 100.0;
+        if (verification->improvement_percentage <= 1.0) {
+            printf("[CDT] Verified accuracy %.2f%% of %s does not confirm the improvement\n",
+                   verification->improved_accuracy * 100, verification->model_id);
+            continue;
+        }
+        /* The shard count is final here; queueing a proof short of it would only
+         * hold settlement for the full consensus wait */
+        if (verification->consensus.confirmations < QXC_MIN_CONFIRMATIONS) {
+            printf("[CDT] %u/%u held-out shards confirm %s, improvement not rewarded\n",
+                   verification->consensus.confirmations,
+                   verification->consensus.verifying_nodes, verification->model_id);
+            continue;
+        }
+        
+        if (kept != i) {
+            training_system.settlement.nodes[kept] = training_system.settlement.nodes[i];
+            training_system.settlement.generations[kept] = training_system.settlement.generations[i];
+            strcpy(training_system.settlement.node_ids[kept], training_system.settlement.node_ids[i]);
+            training_system.settlement.proofs[kept] = *verification;
+            training_system.settlement.model_idx[kept] = training_system.settlement.model_idx[i];
+        }
+        kept++;
+    }
+    
+    training_system.settlement.count = kept;
+}
+
+/* Settle all improvements queued during this sync tick */
+void settle_pending_rewards(void) {
+    uint32_t count = training_system.settlement.count;
+    if (count == 0) return;
+    
+    wallet_t *wallets[MAX_TRAINING_NODES];
+    uint8_t accepted[MAX_TRAINING_NODES];
+    
+    /* Drop entries whose node left during the tick; its slot may already
+     * hold another node, whose wallet must not collect the reward */
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        training_node_t *node = training_system.settlement.nodes[i];
+        
+        node_lock(node);
+        int current = node_current(node, training_system.settlement.generations[i]);
+        if (current) {
+            wallets[kept] = node->wallet;
+        }
+        node_unlock(node);
+        
+        if (!current) {
+            printf("[CDT] Node left before settlement, improvement for %s dropped\n",
+                   training_system.settlement.proofs[i].model_id);
+            continue;
+        }
+        if (kept != i) {
+            training_system.settlement.nodes[kept] = node;
+            training_system.settlement.generations[kept] = training_system.settlement.generations[i];
+            strcpy(training_system.settlement.node_ids[kept], training_system.settlement.node_ids[i]);
+            training_system.settlement.proofs[kept] = training_system.settlement.proofs[i];
+            training_system.settlement.model_idx[kept] = training_system.settlement.model_idx[i];
+        }
+        kept++;
+    }
+    
+    count = kept;
+    if (count == 0) {
+        training_system.settlement.count = 0;
+        return;
+    }
+    
+    /* Submit for mining reward: one block, one proof-of-work per tick */
+    submit_ai_improvements_batch(wallets, training_system.settlement.proofs,
+                                 accepted, count);
+    
+    for (uint32_t i = 0; i < count; i++) {
+        if (!accepted[i]) continue;
+        
+        training_node_t *node = training_system.settlement.nodes[i];
+        ai_verification_t *verification = &training_system.settlement.proofs[i];
+        int model_idx = training_system.settlement.model_idx[i];
+        
+        /* Update repository */
+        pthread_mutex_lock(&training_system.repository.lock);
+        if (verification->improved_accuracy >
+            training_system.repository.best_accuracies[model_idx]) {
+            training_system.repository.best_accuracies[model_idx] =
+                verification->improved_accuracy;
+        }
+        pthread_mutex_unlock(&training_system.repository.lock);
+        
+        /* Update metrics */
+        __atomic_fetch_add(&training_system.metrics.total_improvements, 1, __ATOMIC_RELAXED);
+        atomic_add_double(&training_system.metrics.cumulative_accuracy_gain,
+                          verification->improvement_percentage);
+        
+        /* Update node mining stats, unless it left while the block was mined */
+        node_lock(node);
+        if (node_current(node, training_system.settlement.generations[i])) {
+            node->mining_contribution += verification->improvement_percentage;
             node->blocks_contributed++;
-            
-            /* Get new balance */
-            double balance = get_wallet_balance(node->wallet->address);
-            training_system.metrics.total_qxc_mined = balance;
-            
-            printf("[CDT] Mining reward distributed! Node balance: %.4f QXC\n", balance);
         }
+        node_unlock(node);
+        
+        /* Get new balance */
+        double balance = get_wallet_balance(wallets[i]->address);
+        __atomic_store(&training_system.metrics.total_qxc_mined, &balance, __ATOMIC_RELAXED);
+        
+        printf("[CDT] Mining reward distributed! Node balance: %.4f QXC\n", balance);
     }
+    
+    training_system.settlement.count = 0;
 }
 
 /* Finalize training for a node */
@@ -398,91 +1459,142 @@ void finalize_training(training_node_t *node) {
 void print_training_metrics(void) {
     printf("\n");
     printf("================== CONTINUOUS DISTRIBUTED TRAINING ==================\n");
-    printf("Active Nodes:          %u\n", training_system.active_nodes);
-    printf("Models in Repository:  %u\n", training_system.repository.model_count);
-    printf("Total Epochs Trained:  %lu\n", training_system.metrics.total_epochs_trained);
-    printf("Total Improvements:    %lu\n", training_system.metrics.total_improvements);
-    printf("Cumulative Accuracy:   +%.2f%%\n", training_system.metrics.cumulative_accuracy_gain);
-    printf("Total QXC Mined:       %.4f QXC\n", training_system.metrics.total_qxc_mined);
+    double accuracy_gain, qxc_mined;
+    __atomic_load(&training_system.metrics.cumulative_accuracy_gain, &accuracy_gain,
+                  __ATOMIC_RELAXED);
+    __atomic_load(&training_system.metrics.total_qxc_mined, &qxc_mined, __ATOMIC_RELAXED);
+    
+    pthread_mutex_lock(&training_system.repository.lock);
+    uint32_t model_count = training_system.repository.model_count;
+    pthread_mutex_unlock(&training_system.repository.lock);
+    
+    printf("Active Nodes:          %u\n",
+           __atomic_load_n(&training_system.active_nodes, __ATOMIC_RELAXED));
+    printf("Models in Repository:  %u\n", model_count);
+    printf("Total Epochs Trained:  %lu\n",
+           __atomic_load_n(&training_system.metrics.total_epochs_trained, __ATOMIC_RELAXED));
+    printf("Total Improvements:    %lu\n",
+           __atomic_load_n(&training_system.metrics.total_improvements, __ATOMIC_RELAXED));
+    printf("Cumulative Accuracy:   +%.2f%%\n", accuracy_gain);
+    printf("Total QXC Mined:       %.4f QXC\n", qxc_mined);
+    printf("Queued Jobs:           %u\n", job_queue_depth());
+    
+    uint64_t logical_bytes, stored_bytes;
+    uint32_t stored_chunks;
+    model_store_stats(&logical_bytes, &stored_bytes, &stored_chunks);
+    printf("Model Store:           %lu MB in %u chunks (%lu MB logical)\n",
+           stored_bytes >> 20, stored_chunks, logical_bytes >> 20);
     
     /* Calculate total compute power */
     double total_tflops = 0.0;
-    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
-        if (training_system.nodes[i].active) {
-            total_tflops += training_system.nodes[i].resources.tflops;
-        }
+    uint32_t idx = node_list_read_lock();
+    const node_list_t *list = node_list_deref();
+    for (uint32_t i = 0; list && i < list->count; i++) {
+        total_tflops += list->nodes[i]->resources.tflops;
     }
+    node_list_read_unlock(idx);
     printf("Total Compute Power:   %.2f TFLOPS\n", total_tflops);
+    
+    coord_net_stats_t nstats;
+    coord_net_get_stats(&nstats);
+    printf("Network:               %s, %lu msgs, %lu batched replies, %.2f syscalls/msg\n",
+           coord_net_backend_name(nstats.backend), nstats.messages, nstats.replies_batched,
+           nstats.messages ? (double)nstats.syscalls / nstats.messages : 0.0);
+    
+    /* Coordinator queue depths and load shedding */
+    char admission_report[256];
+    if (admission_export(admission_report, sizeof(admission_report)) > 0) {
+        printf("Admission:             %s", admission_report);
+    }
+    
+    if (training_system.coordination.fedavg_enabled) {
+        fedavg_stats_t fstats;
+        fedavg_get_stats(&fstats);
+        printf("FedAvg Round:          %lu (%u/%u reported)\n",
+               fstats.current_round, fstats.current_reports, fstats.current_participants);
+        printf("FedAvg Rounds:         %lu aggregated, %lu abandoned\n",
+               fstats.rounds_completed, fstats.rounds_abandoned);
+    }
+    
+    /* Per-model sync intervals and why they were chosen */
+    char sync_report[4096];
+    if (sync_controller_export(sync_report, sizeof(sync_report)) > 0) {
+        printf("Model Sync Intervals:\n%s", sync_report);
+    }
+    
+    migration_stats_t mstats;
+    task_migration_get_stats(&mstats);
+    if (mstats.started > 0) {
+        printf("Task Migrations:       %lu done, %lu aborted, %.1f ms last downtime\n",
+               mstats.completed, mstats.aborted, mstats.last_downtime_ms);
+    }
     printf("====================================================================\n\n");
 }
 
 /* Add new training node to the system */
 int add_training_node(const char *node_id, const char *ip_address) {
-    pthread_mutex_lock(&training_system.nodes_lock);
+    training_node_t *node = claim_node_slot();
+    if (!node) return 0;
     
-    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
-        if (!training_system.nodes[i].active) {
-            training_node_t *node = &training_system.nodes[i];
-            
-            strcpy(node->node_id, node_id);
-            strcpy(node->ip_address, ip_address);
-            node->port = TRAINING_PORT + i;
-            node->active = 1;
-            
-            /* Set default resources */
-            node->resources.cpu_cores = 8;
-            node->resources.gpu_count = 1;
-            node->resources.memory_gb = 32;
-            node->resources.tflops = 10.0;
-            node->resources.current_utilization = 0.0;
-            
-            /* Create wallet */
-            node->wallet = create_wallet(node_id);
-            
-            /* Assign task */
-            assign_training_task(node);
-            
-            training_system.active_nodes++;
-            
-            pthread_mutex_unlock(&training_system.nodes_lock);
-            
-            printf("[CDT] Node %s added successfully\n", node_id);
-            return 1;
-        }
-    }
+    node_lock(node);
+    
+    strcpy(node->node_id, node_id);
+    strcpy(node->ip_address, ip_address);
+    node->port = TRAINING_PORT + (node - training_system.nodes);
+    
+    /* Set default resources */
+    node->resources.cpu_cores = 8;
+    node->resources.gpu_count = 1;
+    node->resources.memory_gb = 32;
+    node->resources.tflops = 10.0;
+    node->resources.current_utilization = 0.0;
+    
+    /* Create wallet */
+    node->wallet = create_wallet(node_id);
+    
+    /* Assign task */
+    assign_training_task(node);
+    
+    node_unlock(node);
     
-    pthread_mutex_unlock(&training_system.nodes_lock);
-    return 0;
+    publish_node(node);
+    
+    printf("[CDT] Node %s added successfully\n", node_id);
+    return 1;
 }
 
 /* Get training status for all nodes */
 void get_training_status(void) {
-    pthread_mutex_lock(&training_system.nodes_lock);
+    training_node_t *nodes[MAX_TRAINING_NODES];
+    uint32_t count = node_list_snapshot(nodes, NULL);
     
     printf("\n========== TRAINING NODE STATUS ==========\n");
-    for (uint32_t i = 0; i < MAX_TRAINING_NODES; i++) {
-        if (training_system.nodes[i].active) {
-            training_node_t *node = &training_system.nodes[i];
-            printf("Node: %s (%s:%d)\n", node->node_id, node->ip_address, node->port);
-            printf("  Model: %s\n", node->task.model_id);
-            printf("  Progress: %u/%u epochs\n", 
-                   node->task.current_epoch, node->task.total_epochs);
-            printf("  Accuracy: %.2f%%, Loss: %.4f\n",
-                   node->task.accuracy * 100, node->task.loss);
-            printf("  QXC Mined: %.4f, Blocks: %lu\n",
-                   get_wallet_balance(node->wallet->address), node->blocks_contributed);
-            printf("  Utilization: %.1f%%\n", node->resources.current_utilization * 100);
-            printf("\n");
-        }
+    for (uint32_t i = 0; i < count; i++) {
+        training_node_t view;
+        node_read(nodes[i], &view);
+        if (!view.active) continue;
+        
+        training_node_t *node = &view;
+        printf("Node: %s (%s:%d)\n", node->node_id, node->ip_address, node->port);
+        printf("  Model: %s\n", node->task.model_id);
+        printf("  Progress: %u/%u epochs\n", 
+               node->task.current_epoch, node->task.total_epochs);
+        printf("  Accuracy: %.2f%%, Loss: %.4f\n",
+               node->task.accuracy * 100, node->task.loss);
+        printf("  QXC Mined: %.4f, Blocks: %lu\n",
+               get_wallet_balance(node->wallet->address), node->blocks_contributed);
+        printf("  Utilization: %.1f%%\n", node->resources.current_utilization * 100);
+        printf("\n");
     }
     printf("==========================================\n");
-    
-    pthread_mutex_unlock(&training_system.nodes_lock);
 }
 
 /* Stop continuous training */
 void stop_continuous_training(void) {
+    pthread_mutex_lock(&training_system.coordination.wake_lock);
     training_system.coordination.running = 0;
+    pthread_cond_broadcast(&training_system.coordination.wake);
+    pthread_mutex_unlock(&training_system.coordination.wake_lock);
     
     /* Wait for threads to finish */
     pthread_join(training_system.coordination.coordinator_thread, NULL);
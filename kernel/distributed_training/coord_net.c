@@ -0,0 +1,954 @@
+#define _GNU_SOURCE
+#include "coord_net.h"
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+
+#define COORD_NET_WAIT_MS 1000     // How often the loop rechecks `running`
+#define COORD_NET_EPOLL_EVENTS 256
+#define COORD_NET_BUFFER_GROUP 0
+#define COORD_NET_TRACKED_FDS 65536  // Epoll handshake timeouts cover fds below this
+
+/* user_data: op in the top byte, reply slot in the next three, fd below */
+#define NET_OP_ACCEPT 1
+#define NET_OP_RECV 2
+#define NET_OP_SEND 3
+#define NET_OP_CLOSE 4
+#define NET_OP_TIMEOUT 5
+#define NET_NO_SLOT 0xFFFFFFu
+
+#define NET_USER_DATA(op, slot, fd) \
+    (((uint64_t)(op) << 56) | ((uint64_t)(slot) << 32) | (uint32_t)(fd))
+#define NET_UD_OP(ud) ((uint32_t)((ud) >> 56))
+#define NET_UD_SLOT(ud) ((uint32_t)((ud) >> 32) & 0xFFFFFFu)
+#define NET_UD_FD(ud) ((int)(uint32_t)(ud))
+
+typedef struct {
+    int fd;
+
+    /* Submission queue */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned local_tail;           // SQEs filled but not yet published
+    unsigned to_submit;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* Provided receive buffers */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    uint16_t buf_tail;
+
+    uint8_t multishot_accept;
+} net_ring_t;
+
+static struct {
+    coord_net_stats_t stats;
+    pthread_mutex_t lock;
+
+    /* Owned by the loop thread */
+    pthread_t loop_thread;
+    net_ring_t *ring;              // NULL when running on epoll
+    int epoll_fd;                  // -1 when running on io_uring
+    int current_fd;                // Connection being dispatched
+    uint8_t current_replied;       // Final reply made; no more writes, no detach
+    uint8_t current_close_queued;  // Ring reply carries the close with it
+    uint8_t current_detached;      // Handed to a streaming handler; not ours to close
+    struct __kernel_timespec handshake_timeout;
+    char *reply_slots;
+    uint32_t free_slots[COORD_NET_QUEUE_DEPTH];
+    uint32_t free_count;
+    coord_net_stats_t pass;        // Counters for this pass, published once
+} net = {
+    .epoll_fd = -1,
+    .current_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+const char* coord_net_backend_name(coord_net_backend_t backend) {
+    switch (backend) {
+        case COORD_NET_IO_URING: return "io_uring";
+        case COORD_NET_EPOLL:    return "epoll";
+        default:                 return "auto";
+    }
+}
+
+/* Fold this pass's counters into the shared stats */
+static void publish_pass(void) {
+    pthread_mutex_lock(&net.lock);
+    net.stats.connections += net.pass.connections;
+    net.stats.messages += net.pass.messages;
+    net.stats.replies_batched += net.pass.replies_batched;
+    net.stats.replies_direct += net.pass.replies_direct;
+    net.stats.syscalls += net.pass.syscalls;
+    pthread_mutex_unlock(&net.lock);
+
+    memset(&net.pass, 0, sizeof(net.pass));
+}
+
+void coord_net_get_stats(coord_net_stats_t *stats) {
+    pthread_mutex_lock(&net.lock);
+    *stats = net.stats;
+    pthread_mutex_unlock(&net.lock);
+}
+
+/* ---------------------------------------------------------------- io_uring */
+
+static int ring_enter(net_ring_t *r, unsigned submit, unsigned wait_nr, unsigned flags,
+                      void *arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, r->fd, submit, wait_nr, flags, arg, arg_size);
+}
+
+/* Publish queued SQEs; optionally wait for at least one completion */
+static int ring_submit(net_ring_t *r, int wait) {
+    __atomic_store_n(r->sq_tail, r->local_tail, __ATOMIC_RELEASE);
+
+    if (!wait && r->to_submit == 0) {
+        return 0;
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec = COORD_NET_WAIT_MS / 1000,
+        .tv_nsec = (COORD_NET_WAIT_MS % 1000) * 1000000L
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t)&ts
+    };
+
+    int ret = wait ?
+        ring_enter(r, r->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg)) :
+        ring_enter(r, r->to_submit, 0, 0, NULL, 0);
+    net.pass.syscalls++;
+
+    if (ret >= 0) {
+        r->to_submit -= (unsigned)ret > r->to_submit ? r->to_submit : (unsigned)ret;
+    } else if (errno != EINTR && errno != ETIME && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe* ring_get_sqe(net_ring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->local_tail - head >= r->sq_entries) {
+        /* SQ full: push what we have and try again */
+        ring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->local_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->local_tail++;
+    r->to_submit++;
+
+    return sqe;
+}
+
+static int ring_opcode_supported(int ring_fd, const uint8_t *ops, uint32_t count) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) return 0;
+
+    int ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        ok = ops[i] <= probe->last_op &&
+             (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+static void ring_destroy(net_ring_t *r) {
+    if (r->buffers) free(r->buffers);
+    if (r->buf_ring) munmap(r->buf_ring, r->buf_ring_size);
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0) close(r->fd);
+    free(r);
+}
+
+/* Give a receive buffer back to the kernel */
+static void ring_recycle_buffer(net_ring_t *r, uint16_t bid) {
+    struct io_uring_buf *buf = &r->buf_ring->bufs[r->buf_tail & (COORD_NET_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(r->buffers + (size_t)bid * COORD_NET_BUFFER_SIZE);
+    buf->len = COORD_NET_BUFFER_SIZE - 1;  // Room for the terminator
+    buf->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->buf_ring->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
+
+/* Set up the ring, or return NULL if this kernel can't do what we need */
+static net_ring_t* ring_create(void) {
+    static const uint8_t needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CLOSE,
+        IORING_OP_LINK_TIMEOUT
+    };
+
+    net_ring_t *r = calloc(1, sizeof(net_ring_t));
+    if (!r) return NULL;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+    r->fd = (int)syscall(__NR_io_uring_setup, COORD_NET_QUEUE_DEPTH, &params);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        r->fd = (int)syscall(__NR_io_uring_setup, COORD_NET_QUEUE_DEPTH, &params);
+    }
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    /* Timed waits and a single ring mmap are both required */
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !ring_opcode_supported(r->fd, needed, sizeof(needed))) {
+        ring_destroy(r);
+        return NULL;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (r->cq_ring_size > r->sq_ring_size) r->sq_ring_size = r->cq_ring_size;
+    r->cq_ring_size = r->sq_ring_size;
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        ring_destroy(r);
+        return NULL;
+    }
+    r->cq_ring = r->sq_ring;
+
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        ring_destroy(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_head = (unsigned*)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + params.sq_off.array);
+    r->sq_entries = params.sq_entries;
+    r->local_tail = *r->sq_tail;
+
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned*)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /* Provided buffer ring for receives */
+    r->buf_ring_size = COORD_NET_BUFFERS * sizeof(struct io_uring_buf);
+    r->buf_ring = mmap(NULL, r->buf_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buffers = malloc((size_t)COORD_NET_BUFFERS * COORD_NET_BUFFER_SIZE);
+    if (r->buf_ring == MAP_FAILED || !r->buffers) {
+        if (r->buf_ring == MAP_FAILED) r->buf_ring = NULL;
+        ring_destroy(r);
+        return NULL;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = COORD_NET_BUFFERS;
+    reg.bgid = COORD_NET_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        ring_destroy(r);
+        return NULL;
+    }
+
+    for (uint16_t bid = 0; bid < COORD_NET_BUFFERS; bid++) {
+        ring_recycle_buffer(r, bid);
+    }
+
+    r->multishot_accept = 1;
+    return r;
+}
+
+static int ring_arm_accept(net_ring_t *r, int listen_fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    if (!sqe) return 0;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (r->multishot_accept) {
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    }
+    sqe->user_data = NET_USER_DATA(NET_OP_ACCEPT, NET_NO_SLOT, listen_fd);
+    return 1;
+}
+
+/* Receive the first message, cancelled if it doesn't arrive in time */
+static int ring_arm_recv(net_ring_t *r, int fd) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->local_tail - head + 2 > r->sq_entries) {
+        ring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->local_tail - head + 2 > r->sq_entries) {
+            return 0;
+        }
+    }
+
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = COORD_NET_BUFFER_SIZE - 1;
+    sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->buf_group = COORD_NET_BUFFER_GROUP;
+    sqe->user_data = NET_USER_DATA(NET_OP_RECV, NET_NO_SLOT, fd);
+
+    sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&net.handshake_timeout;
+    sqe->len = 1;
+    sqe->user_data = NET_USER_DATA(NET_OP_TIMEOUT, NET_NO_SLOT, fd);
+    return 1;
+}
+
+static void ring_queue_close(net_ring_t *r, int fd) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    if (!sqe) {
+        close(fd);
+        net.pass.syscalls++;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = NET_USER_DATA(NET_OP_CLOSE, NET_NO_SLOT, fd);
+}
+
+/* Queue a reply and the close that follows it, hard-linked so the close
+ * runs even if the send comes up short */
+static int ring_queue_reply(net_ring_t *r, int fd, const void *data, size_t len) {
+    if (len > COORD_NET_BUFFER_SIZE || net.free_count == 0) {
+        return 0;
+    }
+
+    /* Both SQEs must fit or neither is queued */
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->local_tail - head + 2 > r->sq_entries) {
+        ring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->local_tail - head + 2 > r->sq_entries) {
+            return 0;
+        }
+    }
+
+    uint32_t slot = net.free_slots[--net.free_count];
+    char *buf = net.reply_slots + (size_t)slot * COORD_NET_BUFFER_SIZE;
+    memcpy(buf, data, len);
+
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_HARDLINK;
+    sqe->user_data = NET_USER_DATA(NET_OP_SEND, slot, fd);
+
+    ring_queue_close(r, fd);
+    return 1;
+}
+
+/* Receive completion: dispatch the message and queue the close */
+static void ring_handle_recv(net_ring_t *r, struct io_uring_cqe *cqe,
+                             coord_dispatch_fn dispatch) {
+    int fd = NET_UD_FD(cqe->user_data);
+
+    if (cqe->res == -ENOBUFS) {
+        /* All buffers in flight; they come back as soon as this pass ends */
+        if (!ring_arm_recv(r, fd)) {
+            ring_queue_close(r, fd);
+            admission_release(-1.0);
+        }
+        return;
+    }
+
+    if (cqe->res == -ECANCELED) {
+        /* Link timeout fired before the first message arrived */
+        ring_queue_close(r, fd);
+        admission_timeout();
+        return;
+    }
+
+    if (cqe->res <= 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+        ring_queue_close(r, fd);
+        admission_release(-1.0);
+        return;
+    }
+
+    uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    char *buffer = r->buffers + (size_t)bid * COORD_NET_BUFFER_SIZE;
+    buffer[cqe->res] = '\0';
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    net.pass.messages++;
+    net.current_fd = fd;
+    net.current_replied = 0;
+    net.current_close_queued = 0;
+    net.current_detached = 0;
+
+    dispatch(fd, buffer, cqe->res);
+
+    net.current_fd = -1;
+    ring_recycle_buffer(r, bid);
+
+    if (!net.current_close_queued && !net.current_detached) {
+        ring_queue_close(r, fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    admission_release((finished.tv_sec - started.tv_sec) * 1e3 +
+                      (finished.tv_nsec - started.tv_nsec) / 1e6);
+}
+
+/* Turn a connection away before reading it */
+static void shed_connection(int fd, uint32_t retry_after) {
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "RETRY_AFTER:%u", retry_after);
+
+    if (net.ring && ring_queue_reply(net.ring, fd, reply, len)) {
+        return;
+    }
+
+    send(fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+    net.pass.syscalls += 2;
+}
+
+static int run_io_uring(net_ring_t *r, int listen_fd, coord_dispatch_fn dispatch,
+                        volatile uint8_t *running) {
+    net.reply_slots = malloc((size_t)COORD_NET_QUEUE_DEPTH * COORD_NET_BUFFER_SIZE);
+    if (!net.reply_slots) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < COORD_NET_QUEUE_DEPTH; i++) {
+        net.free_slots[i] = i;
+    }
+    net.free_count = COORD_NET_QUEUE_DEPTH;
+    net.handshake_timeout.tv_sec = admission_get_config()->handshake_timeout;
+    net.handshake_timeout.tv_nsec = 0;
+    net.ring = r;
+
+    ring_arm_accept(r, listen_fd);
+
+    while (*running) {
+        if (ring_submit(r, 1) < 0) {
+            perror("[CDT] io_uring_enter failed");
+            break;
+        }
+
+        /* Reap everything that's ready; new SQEs go out with the next wait */
+        unsigned head = *r->cq_head;
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+            switch (NET_UD_OP(cqe->user_data)) {
+                case NET_OP_ACCEPT:
+                    if (cqe->res >= 0) {
+                        uint32_t retry_after;
+                        net.pass.connections++;
+                        if (!admission_accept(&retry_after)) {
+                            shed_connection(cqe->res, retry_after);
+                        } else if (!ring_arm_recv(r, cqe->res)) {
+                            close(cqe->res);
+                            admission_release(-1.0);
+                        }
+                    } else if (cqe->res == -EINVAL && r->multishot_accept) {
+                        /* Kernel predates multishot accept */
+                        r->multishot_accept = 0;
+                    }
+                    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                        ring_arm_accept(r, listen_fd);
+                    }
+                    break;
+
+                case NET_OP_RECV:
+                    ring_handle_recv(r, cqe, dispatch);
+                    break;
+
+                case NET_OP_SEND:
+                    net.free_slots[net.free_count++] = NET_UD_SLOT(cqe->user_data);
+                    break;
+
+                default:
+                    break;
+            }
+
+            head++;
+            /* Free CQ space as we go so long passes can't overflow it */
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        publish_pass();
+    }
+
+    net.ring = NULL;
+    free(net.reply_slots);
+    net.reply_slots = NULL;
+    return 1;
+}
+
+/* ------------------------------------------------------------------- epoll */
+
+static int run_epoll(int listen_fd, coord_dispatch_fn dispatch, volatile uint8_t *running) {
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        return 0;
+    }
+    net.epoll_fd = ep;
+
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+    epoll_ctl(ep, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct epoll_event events[COORD_NET_EPOLL_EVENTS];
+    char buffer[COORD_NET_BUFFER_SIZE];
+
+    /* Accept time per fd, for dropping connections that never send */
+    time_t *accepted_at = calloc(COORD_NET_TRACKED_FDS, sizeof(time_t));
+    uint32_t timeout = admission_get_config()->handshake_timeout;
+    int max_fd = -1;
+    time_t last_sweep = time(NULL);
+
+    if (!accepted_at) {
+        close(ep);
+        return 0;
+    }
+
+    while (*running) {
+        int n = epoll_wait(ep, events, COORD_NET_EPOLL_EVENTS, COORD_NET_WAIT_MS);
+        net.pass.syscalls++;
+        time_t now = time(NULL);
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listen_fd) {
+                /* Drain the backlog; client sockets stay blocking for handlers */
+                int client_fd;
+                while ((client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    uint32_t retry_after;
+                    net.pass.connections++;
+                    net.pass.syscalls++;
+
+                    if (!admission_accept(&retry_after)) {
+                        shed_connection(client_fd, retry_after);
+                        continue;
+                    }
+
+                    struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP,
+                                               .data.fd = client_fd };
+                    epoll_ctl(ep, EPOLL_CTL_ADD, client_fd, &cev);
+                    net.pass.syscalls++;
+
+                    if (client_fd < COORD_NET_TRACKED_FDS) {
+                        accepted_at[client_fd] = now;
+                        if (client_fd > max_fd) max_fd = client_fd;
+                    }
+                }
+                net.pass.syscalls++;
+                continue;
+            }
+
+            int bytes = recv(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+            net.pass.syscalls++;
+
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                continue;
+            }
+
+            double service_ms = -1.0;
+            if (bytes > 0) {
+                struct timespec started, finished;
+                clock_gettime(CLOCK_MONOTONIC, &started);
+
+                buffer[bytes] = '\0';
+                net.pass.messages++;
+                net.current_fd = fd;
+                net.current_replied = 0;
+                net.current_detached = 0;
+                dispatch(fd, buffer, bytes);
+                net.current_fd = -1;
+
+                clock_gettime(CLOCK_MONOTONIC, &finished);
+                service_ms = (finished.tv_sec - started.tv_sec) * 1e3 +
+                             (finished.tv_nsec - started.tv_nsec) / 1e6;
+            }
+
+            /* close() also drops the fd from the epoll set; a detached
+             * connection was already removed and belongs to its handler */
+            if (fd < COORD_NET_TRACKED_FDS) accepted_at[fd] = 0;
+            if (!net.current_detached) {
+                close(fd);
+                net.pass.syscalls++;
+            }
+            net.current_detached = 0;
+            admission_release(service_ms);
+        }
+
+        /* Drop connections that never sent their first message */
+        if (now != last_sweep) {
+            for (int fd = 0; fd <= max_fd; fd++) {
+                if (accepted_at[fd] && now - accepted_at[fd] >= (time_t)timeout) {
+                    accepted_at[fd] = 0;
+                    close(fd);
+                    net.pass.syscalls++;
+                    admission_timeout();
+                }
+            }
+            last_sweep = now;
+        }
+
+        publish_pass();
+    }
+
+    free(accepted_at);
+    net.epoll_fd = -1;
+    close(ep);
+    return 1;
+}
+
+/* ------------------------------------------------------------------ public */
+
+/* Queue the final reply on a connection being dispatched */
+int coord_net_reply(int fd, const void *data, size_t len) {
+    int on_loop = pthread_equal(pthread_self(), net.loop_thread) && fd == net.current_fd;
+
+    if (on_loop && net.ring && !net.current_replied && !net.current_detached &&
+        ring_queue_reply(net.ring, fd, data, len)) {
+        net.current_replied = 1;
+        net.current_close_queued = 1;
+        net.pass.replies_batched++;
+        return (int)len;
+    }
+
+    /* Epoll backend, other threads, or no ring space: plain blocking send */
+    int sent = send(fd, data, len, MSG_NOSIGNAL);
+    if (on_loop) {
+        net.current_replied = 1;
+        net.pass.replies_direct++;
+        net.pass.syscalls++;
+    }
+    return sent;
+}
+
+/* Take the connection being dispatched off the loop, so a streaming handler
+ * can run on its own thread. The caller owns the fd afterwards and must
+ * close it. Blocking I/O on it gives up after COORD_NET_STREAM_TIMEOUT. */
+int coord_net_detach(int fd) {
+    if (!pthread_equal(pthread_self(), net.loop_thread) || fd != net.current_fd ||
+        net.current_replied || net.current_detached) {
+        return 0;
+    }
+
+    struct timeval timeout = { .tv_sec = COORD_NET_STREAM_TIMEOUT };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+        return 0;
+    }
+    net.pass.syscalls += 2;
+
+    /* Stop epoll reporting the handler's traffic back to the loop */
+    if (net.epoll_fd >= 0) {
+        epoll_ctl(net.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        net.pass.syscalls++;
+    }
+
+    net.current_detached = 1;
+    return 1;
+}
+
+/* Blocking send of a whole buffer on a detached connection; 0 on error,
+ * timeout or a peer that went away */
+int coord_net_send(int fd, const void *data, size_t len) {
+    const uint8_t *src = data;
+
+    while (len > 0) {
+        ssize_t sent = send(fd, src, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return 0;
+        src += sent;
+        len -= sent;
+    }
+
+    return 1;
+}
+
+/* Run the coordinator event loop until *running is cleared */
+int coord_net_run(int listen_fd, coord_dispatch_fn dispatch, coord_net_backend_t backend,
+                  volatile uint8_t *running) {
+    net_ring_t *ring = NULL;
+
+    if (backend != COORD_NET_EPOLL) {
+        ring = ring_create();
+        if (!ring && backend == COORD_NET_IO_URING) {
+            printf("[CDT] io_uring unavailable (%s), falling back to epoll\n",
+                   strerror(errno));
+        }
+    }
+
+    pthread_mutex_lock(&net.lock);
+    net.stats.backend = ring ? COORD_NET_IO_URING : COORD_NET_EPOLL;
+    pthread_mutex_unlock(&net.lock);
+    net.loop_thread = pthread_self();
+
+    printf("[CDT] Coordinator network backend: %s\n",
+           coord_net_backend_name(ring ? COORD_NET_IO_URING : COORD_NET_EPOLL));
+
+    int ok;
+    if (ring) {
+        ok = run_io_uring(ring, listen_fd, dispatch, running);
+        ring_destroy(ring);
+    } else {
+        ok = run_epoll(listen_fd, dispatch, running);
+    }
+
+    return ok;
+}
+
+#ifdef COORD_NET_TEST
+/* Userspace test: cc -O2 -DCOORD_NET_TEST -DCOORD_NET_STREAM_TIMEOUT=1 coord_net.c admission.c -lpthread */
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../test_check.h"
+
+static struct {
+    volatile uint8_t running;
+    int detach_after_reply;        // coord_net_detach result once a reply was queued
+    int stream_timed_out;
+    int sink_send_failed;
+    pthread_mutex_t lock;
+} test = {
+    .detach_after_reply = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Detached stream whose peer never sends: the recv must time out */
+static void* stall_worker(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char byte;
+
+    ssize_t got = recv(fd, &byte, 1, 0);
+    pthread_mutex_lock(&test.lock);
+    test.stream_timed_out = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    pthread_mutex_unlock(&test.lock);
+
+    coord_net_reply(fd, "TIMEOUT", 7);
+    close(fd);
+    return NULL;
+}
+
+/* Detached stream whose peer went away: sends fail instead of raising SIGPIPE */
+static void* sink_worker(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    static char block[64 * 1024];
+    int ok = 1;
+
+    usleep(100 * 1000);
+    for (int i = 0; i < 64 && ok; i++) {
+        ok = coord_net_send(fd, block, sizeof(block));
+    }
+
+    pthread_mutex_lock(&test.lock);
+    test.sink_send_failed = !ok;
+    pthread_mutex_unlock(&test.lock);
+
+    close(fd);
+    return NULL;
+}
+
+static void test_dispatch(int fd, char *buffer, int bytes) {
+    pthread_t thread;
+    (void)bytes;
+
+    if (strncmp(buffer, "STALL", 5) == 0 || strncmp(buffer, "SINK", 4) == 0) {
+        if (!coord_net_detach(fd)) {
+            coord_net_reply(fd, "NODETACH", 8);
+            return;
+        }
+        pthread_create(&thread, NULL, buffer[1] == 'T' ? stall_worker : sink_worker,
+                       (void *)(intptr_t)fd);
+        pthread_detach(thread);
+    } else if (strncmp(buffer, "REPLIED", 7) == 0) {
+        coord_net_reply(fd, "DONE", 4);
+        test.detach_after_reply = coord_net_detach(fd);
+    } else {
+        coord_net_reply(fd, "PONG", 4);
+    }
+}
+
+static int connect_to(uint16_t port, const char *message) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+    };
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    send(fd, message, strlen(message), MSG_NOSIGNAL);
+    return fd;
+}
+
+static int read_reply(int fd, char *out, size_t out_size) {
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    ssize_t got = recv(fd, out, out_size - 1, 0);
+    out[got > 0 ? got : 0] = '\0';
+    return got > 0;
+}
+
+static double seconds_since(const struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+typedef struct {
+    int listen_fd;
+    coord_net_backend_t backend;
+} loop_args_t;
+
+static void* loop_thread_func(void *arg) {
+    loop_args_t *args = arg;
+    coord_net_run(args->listen_fd, test_dispatch, args->backend, &test.running);
+    return NULL;
+}
+
+/* A stalled streaming peer must hold up only its own detached handler */
+static void test_backend(coord_net_backend_t backend) {
+    const char *name = coord_net_backend_name(backend);
+    char reply[64];
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    listen(listen_fd, SOMAXCONN);
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    uint16_t port = ntohs(addr.sin_port);
+
+    memset(&test, 0, offsetof(typeof(test), lock));
+    test.detach_after_reply = -1;
+    test.running = 1;
+
+    loop_args_t args = { .listen_fd = listen_fd, .backend = backend };
+    pthread_t loop;
+    pthread_create(&loop, NULL, loop_thread_func, &args);
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    int stalled = connect_to(port, "STALL");
+    usleep(100 * 1000);
+
+    /* The loop still serves others while the stream waits */
+    int ping = connect_to(port, "PING");
+    CHECK(read_reply(ping, reply, sizeof(reply)) && strcmp(reply, "PONG") == 0,
+          "%s: ping answered '%s' behind a stalled stream", name, reply);
+    CHECK(seconds_since(&started) < 0.9, "%s: ping took %.2fs", name, seconds_since(&started));
+    close(ping);
+
+    int replied = connect_to(port, "REPLIED");
+    CHECK(read_reply(replied, reply, sizeof(reply)) && strcmp(reply, "DONE") == 0,
+          "%s: replied connection answered '%s'", name, reply);
+    usleep(100 * 1000);  // Dispatch tries the detach after the reply is out
+    CHECK(test.detach_after_reply == 0, "%s: detached after its reply was made", name);
+    close(replied);
+
+    /* The stalled stream gives up after the stream timeout */
+    CHECK(read_reply(stalled, reply, sizeof(reply)) && strcmp(reply, "TIMEOUT") == 0,
+          "%s: stalled stream answered '%s'", name, reply);
+    pthread_mutex_lock(&test.lock);
+    CHECK(test.stream_timed_out, "%s: stalled recv did not time out", name);
+    pthread_mutex_unlock(&test.lock);
+    close(stalled);
+
+    /* A peer that vanishes mid-stream fails the send without SIGPIPE */
+    int sink = connect_to(port, "SINK");
+    struct linger hard_close = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(sink, SOL_SOCKET, SO_LINGER, &hard_close, sizeof(hard_close));
+    usleep(20 * 1000);
+    close(sink);
+    sleep(1);
+    pthread_mutex_lock(&test.lock);
+    CHECK(test.sink_send_failed, "%s: send to a closed peer did not fail", name);
+    pthread_mutex_unlock(&test.lock);
+
+    test.running = 0;
+    pthread_join(loop, NULL);
+    close(listen_fd);
+}
+
+int main(void) {
+    admission_init(NULL);
+
+    test_backend(COORD_NET_EPOLL);
+    test_backend(COORD_NET_IO_URING);
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
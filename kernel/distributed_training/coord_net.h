@@ -0,0 +1,67 @@
+#ifndef QENEX_COORD_NET_H
+#define QENEX_COORD_NET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Coordinator network event loop.
+ *
+ * The coordinator protocol is one exchange per connection. The loop accepts
+ * connections, receives the first message and hands it to a dispatch
+ * callback. It then closes the connection once any queued reply has gone
+ * out.
+ *
+ * With io_uring, one multishot accept keeps producing connections. Receives
+ * draw buffers from a provided buffer ring. Replies and closes are queued
+ * as linked SQEs and submitted together with the next batch of receives,
+ * so one io_uring_enter covers every message completed in that pass. If
+ * io_uring or any of the features it needs is missing, the loop falls back
+ * to epoll.
+ *
+ * New connections go through admission control (admission.h). A connection
+ * that sends nothing within the handshake timeout is dropped.
+ *
+ * Dispatch runs on the loop thread, so it must not block. A handler that
+ * streams (FedAvg models and deltas, migration checkpoints) first calls
+ * coord_net_detach to take the connection over. The loop then forgets the
+ * fd, and the handler's thread does blocking I/O on it, with send and
+ * receive timeouts of COORD_NET_STREAM_TIMEOUT, and closes it when done.
+ * coord_net_reply must be the last write a handler makes on its connection.
+ */
+
+#define COORD_NET_BUFFER_SIZE 4096     // Matches the old per-connection recv buffer
+#define COORD_NET_BUFFERS 256          // Provided receive buffers, power of two
+#define COORD_NET_QUEUE_DEPTH 256
+#ifndef COORD_NET_STREAM_TIMEOUT
+#define COORD_NET_STREAM_TIMEOUT 30    // Seconds a detached stream may stall on send or recv
+#endif
+
+typedef enum {
+    COORD_NET_AUTO = 0,
+    COORD_NET_IO_URING,
+    COORD_NET_EPOLL
+} coord_net_backend_t;
+
+/* Called with the connection's first message, null-terminated */
+typedef void (*coord_dispatch_fn)(int fd, char *buffer, int bytes);
+
+typedef struct coord_net_stats {
+    coord_net_backend_t backend;
+    uint64_t connections;
+    uint64_t messages;
+    uint64_t replies_batched;      // Replies sent through the ring
+    uint64_t replies_direct;       // Replies sent with a blocking send
+    uint64_t syscalls;             // io_uring_enter or epoll_wait + per-fd calls
+} coord_net_stats_t;
+
+/* Function prototypes */
+int coord_net_run(int listen_fd, coord_dispatch_fn dispatch, coord_net_backend_t backend,
+                  volatile uint8_t *running);
+int coord_net_reply(int fd, const void *data, size_t len);
+int coord_net_detach(int fd);
+int coord_net_send(int fd, const void *data, size_t len);
+void coord_net_get_stats(coord_net_stats_t *stats);
+const char* coord_net_backend_name(coord_net_backend_t backend);
+
+#endif /* QENEX_COORD_NET_H */
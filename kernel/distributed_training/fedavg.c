@@ -0,0 +1,636 @@
+#include "fedavg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+static struct {
+    uint8_t initialized;
+    char model_id[65];
+    fedavg_config_t config;
+
+    /* Global model and the running weighted sum of this round's deltas */
+    float *global_model;
+    double *accumulator;
+    uint32_t param_count;
+
+    /* Current round */
+    struct {
+        uint64_t round_id;
+        uint8_t active;
+        time_t deadline;
+        char participants[FEDAVG_MAX_PARTICIPANTS][65];
+        uint8_t reported[FEDAVG_MAX_PARTICIPANTS];
+        uint32_t participant_count;
+        uint32_t reports;
+        double total_weight;
+    } round;
+
+    /* Deltas being received, each staged whole so a broken one never
+     * touches the sum; up to config.max_streams at once */
+    struct fedavg_stream {
+        float *staging;            // Allocated on first use, kept for later streams
+        int participant;           // Index into round.participants, -1 if idle
+        uint64_t token;            // Identifies the open stream to its handler
+        uint64_t round_id;
+        double weight;
+        uint32_t received;
+        time_t last_activity;
+    } streams[FEDAVG_MAX_STREAMS];
+    uint64_t next_token;
+
+    fedavg_stats_t stats;
+    pthread_mutex_t lock;
+} fedavg = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Fold one participant's delta into the weighted sum */
+static void fold_delta(double *restrict acc, const float *restrict delta,
+                       uint32_t count, double weight) {
+    for (uint32_t i = 0; i < count; i++) {
+        acc[i] += weight * delta[i];
+    }
+}
+
+/* Apply the weighted average of the round's deltas to the global model;
+ * returns the norm of the applied update relative to the updated model */
+static double apply_average(float *restrict model, const double *restrict acc,
+                            uint32_t count, double total_weight) {
+    double scale = 1.0 / total_weight;
+    double delta_sq = 0.0, model_sq = 0.0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        float delta = (float)(acc[i] * scale);
+        model[i] += delta;
+        delta_sq += (double)delta * delta;
+        model_sq += (double)model[i] * model[i];
+    }
+
+    if (model_sq == 0.0) {
+        return delta_sq > 0.0 ? 1.0 : 0.0;
+    }
+    return sqrt(delta_sq / model_sq);
+}
+
+/* Drop open streams whose senders went quiet; caller holds the lock */
+static void expire_streams(time_t now) {
+    for (uint32_t i = 0; i < fedavg.config.max_streams; i++) {
+        struct fedavg_stream *s = &fedavg.streams[i];
+
+        if (s->participant < 0 ||
+            now - s->last_activity <= (time_t)fedavg.config.stream_timeout) {
+            continue;
+        }
+
+        printf("[CDT] FedAvg delta from %s timed out after %u of %u params\n",
+               fedavg.round.participants[s->participant], s->received, fedavg.param_count);
+        s->participant = -1;
+        fedavg.stats.reports_rejected++;
+    }
+}
+
+/* The open stream a token names, or NULL once it ended or expired; caller holds the lock */
+static struct fedavg_stream *find_stream(uint64_t stream) {
+    for (uint32_t i = 0; i < fedavg.config.max_streams; i++) {
+        if (fedavg.streams[i].participant >= 0 && fedavg.streams[i].token == stream) {
+            return &fedavg.streams[i];
+        }
+    }
+    return NULL;
+}
+
+/* Release every stream's staging; caller holds the lock */
+static void free_streams(void) {
+    for (uint32_t i = 0; i < FEDAVG_MAX_STREAMS; i++) {
+        free(fedavg.streams[i].staging);
+        fedavg.streams[i].staging = NULL;
+        fedavg.streams[i].participant = -1;
+    }
+}
+
+static int find_participant(const char *node_id) {
+    for (uint32_t i = 0; i < fedavg.round.participant_count; i++) {
+        if (strcmp(fedavg.round.participants[i], node_id) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Initialize federated averaging for a model */
+int fedavg_init(const char *model_id, uint32_t param_count, const fedavg_config_t *config) {
+    if (param_count == 0 || config->local_epochs == 0 || config->min_reports == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&fedavg.lock);
+
+    free(fedavg.global_model);
+    free(fedavg.accumulator);
+    free_streams();
+
+    fedavg.global_model = calloc(param_count, sizeof(float));
+    fedavg.accumulator = calloc(param_count, sizeof(double));
+
+    if (!fedavg.global_model || !fedavg.accumulator) {
+        free(fedavg.global_model);
+        free(fedavg.accumulator);
+        fedavg.global_model = NULL;
+        fedavg.accumulator = NULL;
+        fedavg.initialized = 0;
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    strncpy(fedavg.model_id, model_id, sizeof(fedavg.model_id) - 1);
+    fedavg.config = *config;
+    if (fedavg.config.stream_timeout == 0) {
+        fedavg.config.stream_timeout = FEDAVG_STREAM_TIMEOUT;
+    }
+    if (fedavg.config.max_streams == 0 || fedavg.config.max_streams > FEDAVG_MAX_STREAMS) {
+        fedavg.config.max_streams = FEDAVG_MAX_STREAMS;
+    }
+    fedavg.param_count = param_count;
+    fedavg.round.active = 0;
+    memset(&fedavg.stats, 0, sizeof(fedavg.stats));
+    fedavg.initialized = 1;
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    printf("[CDT] FedAvg enabled for %s: %u params, %.0f%% sampled, E=%u, %u concurrent uploads\n",
+           model_id, param_count, config->sample_fraction * 100, config->local_epochs,
+           fedavg.config.max_streams);
+
+    return 1;
+}
+
+const fedavg_config_t* fedavg_get_config(void) {
+    return fedavg.initialized ? &fedavg.config : NULL;
+}
+
+uint32_t fedavg_param_count(void) {
+    return fedavg.param_count;
+}
+
+const char* fedavg_model_id(void) {
+    return fedavg.model_id;
+}
+
+/* Start a round with the sampled participants */
+uint64_t fedavg_begin_round(char participants[][65], uint32_t count) {
+    if (count > FEDAVG_MAX_PARTICIPANTS) {
+        count = FEDAVG_MAX_PARTICIPANTS;
+    }
+
+    pthread_mutex_lock(&fedavg.lock);
+
+    if (!fedavg.initialized || fedavg.round.active || count == 0) {
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    fedavg.round.round_id++;
+    fedavg.round.active = 1;
+    fedavg.round.deadline = time(NULL) + fedavg.config.round_timeout;
+    fedavg.round.participant_count = count;
+    fedavg.round.reports = 0;
+    fedavg.round.total_weight = 0.0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        strncpy(fedavg.round.participants[i], participants[i], 64);
+        fedavg.round.participants[i][64] = '\0';
+        fedavg.round.reported[i] = 0;
+    }
+
+    memset(fedavg.accumulator, 0, (size_t)fedavg.param_count * sizeof(double));
+
+    uint64_t round_id = fedavg.round.round_id;
+    fedavg.stats.current_round = round_id;
+    fedavg.stats.current_participants = count;
+    fedavg.stats.current_reports = 0;
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    printf("[CDT] FedAvg round %lu started with %u participants\n", round_id, count);
+
+    return round_id;
+}
+
+int fedavg_round_active(void) {
+    pthread_mutex_lock(&fedavg.lock);
+    int active = fedavg.round.active;
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return active;
+}
+
+/* Round a node should train for, or 0 if it isn't a pending participant */
+uint64_t fedavg_participant_round(const char *node_id) {
+    uint64_t round_id = 0;
+
+    pthread_mutex_lock(&fedavg.lock);
+
+    if (fedavg.round.active) {
+        int idx = find_participant(node_id);
+        if (idx >= 0 && !fedavg.round.reported[idx]) {
+            round_id = fedavg.round.round_id;
+        }
+    }
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return round_id;
+}
+
+/* Copy a slice of the global model for download */
+uint32_t fedavg_copy_global(float *out, uint32_t offset, uint32_t count) {
+    pthread_mutex_lock(&fedavg.lock);
+
+    if (offset >= fedavg.param_count) {
+        count = 0;
+    } else if (count > fedavg.param_count - offset) {
+        count = fedavg.param_count - offset;
+    }
+    memcpy(out, fedavg.global_model + offset, (size_t)count * sizeof(float));
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return count;
+}
+
+/* Begin receiving a participant's delta; on success *stream names it */
+fedavg_stream_status_t fedavg_stream_begin(uint64_t round_id, const char *node_id,
+                                           uint64_t samples, uint64_t *stream) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&fedavg.lock);
+
+    int idx = fedavg.round.active ? find_participant(node_id) : -1;
+
+    if (round_id != fedavg.round.round_id || idx < 0 ||
+        fedavg.round.reported[idx] || samples == 0) {
+        fedavg.stats.reports_rejected++;
+        pthread_mutex_unlock(&fedavg.lock);
+        return FEDAVG_STREAM_REJECTED;
+    }
+
+    /* A stalled sender holds its slot only until its stream times out, and a
+     * participant that starts over gives up the stream it had */
+    expire_streams(now);
+    struct fedavg_stream *slot = NULL;
+    for (uint32_t i = 0; i < fedavg.config.max_streams; i++) {
+        struct fedavg_stream *s = &fedavg.streams[i];
+
+        if (s->participant == idx) {
+            s->participant = -1;
+            fedavg.stats.reports_rejected++;
+        }
+        if (s->participant < 0 && (!slot || (s->staging && !slot->staging))) {
+            slot = s;
+        }
+    }
+
+    if (slot && !slot->staging) {
+        slot->staging = malloc((size_t)fedavg.param_count * sizeof(float));
+    }
+    if (!slot || !slot->staging) {
+        pthread_mutex_unlock(&fedavg.lock);
+        return FEDAVG_STREAM_BUSY;
+    }
+
+    slot->participant = idx;
+    slot->token = ++fedavg.next_token;
+    slot->round_id = round_id;
+    slot->weight = (double)samples;
+    slot->received = 0;
+    slot->last_activity = now;
+    *stream = slot->token;
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return FEDAVG_STREAM_OPEN;
+}
+
+/* Receive the next contiguous slice of the delta. A slice with a NaN or
+ * infinite value would poison the whole round's sum, so it drops the stream. */
+int fedavg_stream_chunk(uint64_t stream, uint32_t offset, const float *values, uint32_t count) {
+    pthread_mutex_lock(&fedavg.lock);
+
+    struct fedavg_stream *s = find_stream(stream);
+    if (!s || offset != s->received || count > fedavg.param_count - offset) {
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!isfinite(values[i])) {
+            printf("[CDT] FedAvg delta from %s rejected: non-finite value at param %u\n",
+                   fedavg.round.participants[s->participant], offset + i);
+            s->participant = -1;
+            fedavg.stats.reports_rejected++;
+            pthread_mutex_unlock(&fedavg.lock);
+            return 0;
+        }
+    }
+
+    memcpy(s->staging + offset, values, (size_t)count * sizeof(float));
+    s->received += count;
+    s->last_activity = time(NULL);
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return 1;
+}
+
+/* Finish a delta and fold it into the round */
+int fedavg_stream_end(uint64_t stream) {
+    pthread_mutex_lock(&fedavg.lock);
+
+    /* Timed out and its slot possibly reused by another participant */
+    struct fedavg_stream *s = find_stream(stream);
+    if (!s) {
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    int idx = s->participant;
+    s->participant = -1;
+
+    /* Round may have closed while the delta was in flight */
+    if (s->received != fedavg.param_count ||
+        !fedavg.round.active || s->round_id != fedavg.round.round_id) {
+        fedavg.stats.reports_rejected++;
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    fold_delta(fedavg.accumulator, s->staging, fedavg.param_count, s->weight);
+
+    fedavg.round.reported[idx] = 1;
+    fedavg.round.reports++;
+    fedavg.round.total_weight += s->weight;
+    fedavg.stats.reports_accepted++;
+    fedavg.stats.current_reports = fedavg.round.reports;
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    return 1;
+}
+
+/* Drop a delta whose stream broke off */
+void fedavg_stream_abort(uint64_t stream) {
+    pthread_mutex_lock(&fedavg.lock);
+    struct fedavg_stream *s = find_stream(stream);
+    if (s) {
+        s->participant = -1;
+        fedavg.stats.reports_rejected++;
+    }
+    pthread_mutex_unlock(&fedavg.lock);
+}
+
+/* Close the round if everyone reported or the deadline passed */
+int fedavg_maybe_close_round(time_t now) {
+    pthread_mutex_lock(&fedavg.lock);
+
+    expire_streams(now);
+
+    if (!fedavg.round.active ||
+        (fedavg.round.reports < fedavg.round.participant_count &&
+         now < fedavg.round.deadline)) {
+        pthread_mutex_unlock(&fedavg.lock);
+        return 0;
+    }
+
+    uint64_t round_id = fedavg.round.round_id;
+    uint32_t reports = fedavg.round.reports;
+    uint32_t participants = fedavg.round.participant_count;
+    int applied = 0;
+
+    if (reports >= fedavg.config.min_reports && fedavg.round.total_weight > 0.0) {
+        fedavg.stats.last_update_norm =
+            apply_average(fedavg.global_model, fedavg.accumulator,
+                          fedavg.param_count, fedavg.round.total_weight);
+        fedavg.stats.rounds_completed++;
+        applied = 1;
+    } else {
+        fedavg.stats.rounds_abandoned++;
+    }
+
+    fedavg.round.active = 0;
+
+    pthread_mutex_unlock(&fedavg.lock);
+
+    printf("[CDT] FedAvg round %lu %s: %u/%u participants reported\n",
+           round_id, applied ? "aggregated" : "abandoned", reports, participants);
+
+    return applied ? 1 : -1;
+}
+
+void fedavg_get_stats(fedavg_stats_t *stats) {
+    pthread_mutex_lock(&fedavg.lock);
+    *stats = fedavg.stats;
+    pthread_mutex_unlock(&fedavg.lock);
+}
+
+#ifdef FEDAVG_TEST
+/* Userspace test: cc -O2 -DFEDAVG_TEST fedavg.c -lm -lpthread */
+#include <unistd.h>
+
+#include "../test_check.h"
+
+#define TEST_PARAMS 8
+
+static uint64_t start_round(const char *a, const char *b, const char *c) {
+    char participants[3][65] = {{0}};
+    uint32_t count = 0;
+
+    if (a) strcpy(participants[count++], a);
+    if (b) strcpy(participants[count++], b);
+    if (c) strcpy(participants[count++], c);
+    return fedavg_begin_round(participants, count);
+}
+
+/* Stream a constant delta in two slices */
+static int send_delta(uint64_t round_id, const char *node_id, uint64_t samples, float value) {
+    float delta[TEST_PARAMS];
+    uint64_t stream;
+
+    for (int i = 0; i < TEST_PARAMS; i++) delta[i] = value;
+    if (fedavg_stream_begin(round_id, node_id, samples, &stream) != FEDAVG_STREAM_OPEN) {
+        return 0;
+    }
+    if (!fedavg_stream_chunk(stream, 0, delta, TEST_PARAMS / 2) ||
+        !fedavg_stream_chunk(stream, TEST_PARAMS / 2, delta + TEST_PARAMS / 2, TEST_PARAMS / 2)) {
+        fedavg_stream_abort(stream);
+        return 0;
+    }
+    return fedavg_stream_end(stream);
+}
+
+/* Deltas are weighted by samples; a missing participant closes at the deadline */
+static void test_round_aggregation(void) {
+    float model[TEST_PARAMS];
+    float delta[TEST_PARAMS] = {0};
+    uint64_t stream;
+
+    uint64_t round_id = start_round("a", "b", "c");
+    CHECK(round_id != 0, "round did not start");
+    CHECK(fedavg_participant_round("a") == round_id, "participant not in round");
+    CHECK(fedavg_participant_round("z") == 0, "stranger in round");
+
+    CHECK(fedavg_stream_begin(round_id, "z", 10, &stream) == FEDAVG_STREAM_REJECTED,
+          "stranger opened a stream");
+    CHECK(fedavg_stream_begin(round_id + 1, "a", 10, &stream) == FEDAVG_STREAM_REJECTED,
+          "wrong round opened a stream");
+
+    /* Slices must arrive in order */
+    CHECK(fedavg_stream_begin(round_id, "a", 100, &stream) == FEDAVG_STREAM_OPEN, "a not opened");
+    CHECK(!fedavg_stream_chunk(stream, 4, delta, 4), "out of order slice accepted");
+    CHECK(!fedavg_stream_end(stream), "short delta folded");
+
+    CHECK(send_delta(round_id, "a", 100, 1.0f), "a not folded");
+    CHECK(send_delta(round_id, "b", 300, 3.0f), "b not folded");
+    CHECK(!send_delta(round_id, "a", 100, 1.0f), "a folded twice");
+
+    time_t now = time(NULL);
+    CHECK(fedavg_maybe_close_round(now) == 0, "round closed before the deadline");
+    CHECK(fedavg_maybe_close_round(now + 61) == 1, "round not aggregated at the deadline");
+
+    fedavg_copy_global(model, 0, TEST_PARAMS);
+    for (int i = 0; i < TEST_PARAMS; i++) {
+        CHECK(model[i] == 2.5f, "param %d is %f", i, model[i]);
+    }
+}
+
+/* Participants upload side by side, each delta staged on its own */
+static void test_concurrent_streams(void) {
+    float model[TEST_PARAMS], before[TEST_PARAMS];
+    float ones[TEST_PARAMS], threes[TEST_PARAMS];
+    uint64_t a, b, c;
+
+    for (int i = 0; i < TEST_PARAMS; i++) {
+        ones[i] = 1.0f;
+        threes[i] = 3.0f;
+    }
+    fedavg_copy_global(before, 0, TEST_PARAMS);
+    uint64_t round_id = start_round("a", "b", "c");
+
+    CHECK(fedavg_stream_begin(round_id, "a", 100, &a) == FEDAVG_STREAM_OPEN, "a not opened");
+    CHECK(fedavg_stream_begin(round_id, "b", 300, &b) == FEDAVG_STREAM_OPEN,
+          "second upload waited for the first");
+    CHECK(fedavg_stream_begin(round_id, "c", 10, &c) == FEDAVG_STREAM_BUSY,
+          "third upload got a slot beyond max_streams");
+
+    /* Interleaved slices land in their own staging */
+    CHECK(fedavg_stream_chunk(a, 0, ones, TEST_PARAMS / 2), "a slice refused");
+    CHECK(fedavg_stream_chunk(b, 0, threes, TEST_PARAMS / 2), "b slice refused");
+    CHECK(fedavg_stream_chunk(a, TEST_PARAMS / 2, ones, TEST_PARAMS / 2), "a slice refused");
+    CHECK(fedavg_stream_chunk(b, TEST_PARAMS / 2, threes, TEST_PARAMS / 2), "b slice refused");
+    CHECK(fedavg_stream_end(b), "b not folded");
+    CHECK(fedavg_stream_end(a), "a not folded");
+
+    /* A participant starting over frees the slot it had */
+    CHECK(fedavg_stream_begin(round_id, "c", 10, &c) == FEDAVG_STREAM_OPEN, "c not opened");
+    CHECK(fedavg_stream_chunk(c, 0, ones, 2), "c slice refused");
+    uint64_t restarted;
+    CHECK(fedavg_stream_begin(round_id, "c", 10, &restarted) == FEDAVG_STREAM_OPEN, "c not reopened");
+    CHECK(!fedavg_stream_chunk(c, 2, ones, 2), "replaced stream accepted a slice");
+    fedavg_stream_abort(restarted);
+
+    CHECK(fedavg_maybe_close_round(time(NULL) + 61) == 1, "round not aggregated");
+    fedavg_copy_global(model, 0, TEST_PARAMS);
+    for (int i = 0; i < TEST_PARAMS; i++) {
+        CHECK(model[i] == before[i] + 2.5f, "param %d is %f", i, model[i]);
+    }
+}
+
+/* A participant that stalls mid-delta loses its slot after stream_timeout */
+static void test_stalled_participant(void) {
+    float delta[TEST_PARAMS] = {0};
+    uint64_t stalled, busy, other;
+
+    uint64_t round_id = start_round("a", "b", "c");
+
+    CHECK(fedavg_stream_begin(round_id, "a", 10, &stalled) == FEDAVG_STREAM_OPEN, "a not opened");
+    CHECK(fedavg_stream_chunk(stalled, 0, delta, 2), "first slice refused");
+    CHECK(fedavg_stream_begin(round_id, "b", 10, &busy) == FEDAVG_STREAM_OPEN, "b not opened");
+    CHECK(fedavg_stream_begin(round_id, "c", 10, &other) == FEDAVG_STREAM_BUSY,
+          "third stream not told to wait");
+
+    sleep(2);
+
+    CHECK(fedavg_stream_begin(round_id, "c", 10, &other) == FEDAVG_STREAM_OPEN,
+          "stalled streams kept their slots");
+    CHECK(!fedavg_stream_chunk(stalled, 2, delta, 2), "stale token accepted a slice");
+    CHECK(!fedavg_stream_end(stalled), "stale token ended the stream");
+    fedavg_stream_abort(stalled);
+    fedavg_stream_abort(busy);
+    CHECK(fedavg_stream_chunk(other, 0, delta, TEST_PARAMS), "stale abort dropped the new stream");
+    CHECK(fedavg_stream_end(other), "c not folded");
+    CHECK(send_delta(round_id, "b", 10, 1.0f), "b not folded after its stream expired");
+
+    /* The stalled node can still report, and an idle slot also expires on the tick */
+    CHECK(fedavg_stream_begin(round_id, "a", 10, &stalled) == FEDAVG_STREAM_OPEN, "a not reopened");
+    sleep(2);
+    CHECK(fedavg_maybe_close_round(time(NULL)) == 0, "round closed early");
+    CHECK(!fedavg_stream_end(stalled), "expired stream folded");
+    CHECK(send_delta(round_id, "a", 10, 1.0f), "a not folded after retry");
+    CHECK(fedavg_maybe_close_round(time(NULL)) == 1, "round not closed when complete");
+}
+
+/* A NaN or infinite value drops the delta instead of poisoning the sum */
+static void test_non_finite_delta(void) {
+    float model[TEST_PARAMS];
+    float delta[TEST_PARAMS] = {0};
+    uint64_t stream;
+    fedavg_stats_t stats;
+
+    fedavg_copy_global(model, 0, TEST_PARAMS);
+    float before = model[0];
+    fedavg_get_stats(&stats);
+    uint64_t rejected = stats.reports_rejected;
+
+    uint64_t round_id = start_round("a", NULL, NULL);
+
+    delta[3] = NAN;
+    CHECK(fedavg_stream_begin(round_id, "a", 10, &stream) == FEDAVG_STREAM_OPEN, "a not opened");
+    CHECK(!fedavg_stream_chunk(stream, 0, delta, TEST_PARAMS), "NaN accepted");
+    CHECK(!fedavg_stream_end(stream), "NaN delta folded");
+
+    delta[3] = INFINITY;
+    CHECK(fedavg_stream_begin(round_id, "a", 10, &stream) == FEDAVG_STREAM_OPEN, "slot not freed");
+    CHECK(!fedavg_stream_chunk(stream, 0, delta, TEST_PARAMS), "infinity accepted");
+
+    fedavg_get_stats(&stats);
+    CHECK(stats.reports_rejected == rejected + 2, "rejections counted %lu",
+          stats.reports_rejected - rejected);
+
+    CHECK(send_delta(round_id, "a", 10, 0.5f), "finite delta refused");
+    CHECK(fedavg_maybe_close_round(time(NULL)) == 1, "round not aggregated");
+    fedavg_copy_global(model, 0, TEST_PARAMS);
+    CHECK(model[0] == before + 0.5f && isfinite(model[3]), "model is %f", model[3]);
+}
+
+int main(void) {
+    fedavg_config_t config = {
+        .sample_fraction = 1.0,
+        .min_participants = 1,
+        .min_reports = 1,
+        .local_epochs = 1,
+        .round_timeout = 60,
+        .stream_timeout = 1,
+        .max_streams = 2
+    };
+    fedavg_init("test", TEST_PARAMS, &config);
+
+    test_round_aggregation();
+    test_concurrent_streams();
+    test_stalled_participant();
+    test_non_finite_delta();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
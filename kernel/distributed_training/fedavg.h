@@ -0,0 +1,74 @@
+#ifndef QENEX_FEDAVG_H
+#define QENEX_FEDAVG_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Federated averaging for intermittently connected nodes.
+ *
+ * Each round samples a subset of nodes, which train E local epochs from the
+ * current global model and report a parameter delta. Each delta is staged
+ * as it streams in and folded into a running weighted sum once complete
+ * (weight = samples processed), so a delta that breaks off never touches
+ * the sum and memory stays at max_streams + 2 model-sized buffers no
+ * matter how big the cohort is. Rounds close when every participant has
+ * reported or the deadline passes; late or missing nodes simply don't
+ * contribute.
+ *
+ * Up to max_streams deltas upload at once, each from its own participant.
+ * A stream is identified by a token, and a stream idle for longer than
+ * stream_timeout gives up its slot to the next participant; chunk, end and
+ * abort calls on its stale token then fail.
+ */
+
+#define FEDAVG_MAX_PARTICIPANTS 256
+#define FEDAVG_STREAM_TIMEOUT 30       // Default idle seconds before a delta stream is dropped
+#define FEDAVG_MAX_STREAMS 8           // Deltas uploading at once, and the default
+
+typedef struct fedavg_config {
+    double sample_fraction;        // Fraction of active nodes sampled per round
+    uint32_t min_participants;     // Nodes sampled even on small clusters
+    uint32_t min_reports;          // Reports needed for a round to count
+    uint32_t local_epochs;         // E: epochs each participant runs locally
+    uint32_t round_timeout;        // Seconds before a round closes regardless
+    uint32_t stream_timeout;       // Idle seconds before a delta stream loses its slot (0 = default)
+    uint32_t max_streams;          // Concurrent delta uploads (0 = FEDAVG_MAX_STREAMS)
+} fedavg_config_t;
+
+/* Outcome of fedavg_stream_begin */
+typedef enum {
+    FEDAVG_STREAM_REJECTED,        // Not a pending participant of this round
+    FEDAVG_STREAM_OPEN,            // Stream slot taken; send chunks with the token
+    FEDAVG_STREAM_BUSY             // Every stream slot is taken; retry later
+} fedavg_stream_status_t;
+
+typedef struct fedavg_stats {
+    uint64_t rounds_completed;
+    uint64_t rounds_abandoned;
+    uint64_t reports_accepted;
+    uint64_t reports_rejected;     // Late, unknown or malformed deltas
+    uint64_t current_round;
+    uint32_t current_participants;
+    uint32_t current_reports;
+    double last_update_norm;       // |delta| / |model| of the last aggregated round
+} fedavg_stats_t;
+
+/* Function prototypes */
+int fedavg_init(const char *model_id, uint32_t param_count, const fedavg_config_t *config);
+const fedavg_config_t* fedavg_get_config(void);
+uint32_t fedavg_param_count(void);
+const char* fedavg_model_id(void);
+uint64_t fedavg_begin_round(char participants[][65], uint32_t count);
+int fedavg_round_active(void);
+uint64_t fedavg_participant_round(const char *node_id);
+uint32_t fedavg_copy_global(float *out, uint32_t offset, uint32_t count);
+fedavg_stream_status_t fedavg_stream_begin(uint64_t round_id, const char *node_id,
+                                           uint64_t samples, uint64_t *stream);
+int fedavg_stream_chunk(uint64_t stream, uint32_t offset, const float *values, uint32_t count);
+int fedavg_stream_end(uint64_t stream);
+void fedavg_stream_abort(uint64_t stream);
+int fedavg_maybe_close_round(time_t now);
+void fedavg_get_stats(fedavg_stats_t *stats);
+
+#endif /* QENEX_FEDAVG_H */
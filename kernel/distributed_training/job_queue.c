@@ -0,0 +1,432 @@
+#include "job_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Each tenant owns a binary heap ordered by (priority, deadline, submission
+ * order). Pulling work looks at the heads of all tenant heaps: the highest
+ * priority wins, an urgent deadline wins within a priority level, and
+ * otherwise the tenant with the least weighted usage goes first.
+ */
+
+typedef struct {
+    double weight;
+    double usage;                  // Epochs charged to this tenant
+    training_job_t *heap[MAX_TRAINING_JOBS];
+    uint32_t heap_size;
+} tenant_queue_t;
+
+static struct {
+    training_job_t jobs[MAX_TRAINING_JOBS];
+    tenant_queue_t tenants[MAX_TRAINING_TENANTS];
+    uint64_t next_job_id;
+    uint32_t queued;
+    pthread_mutex_t lock;
+} job_queue = {
+    .next_job_id = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Heap ordering: returns non-zero if a should run before b */
+static int job_before(const training_job_t *a, const training_job_t *b) {
+    if (a->priority != b->priority) {
+        return a->priority > b->priority;
+    }
+
+    /* Jobs with a deadline go before jobs without one */
+    if (a->deadline != b->deadline) {
+        if (a->deadline == 0) return 0;
+        if (b->deadline == 0) return 1;
+        return a->deadline < b->deadline;
+    }
+
+    return a->job_id < b->job_id;
+}
+
+static void heap_sift_up(tenant_queue_t *tq, uint32_t i) {
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!job_before(tq->heap[i], tq->heap[parent])) break;
+
+        training_job_t *tmp = tq->heap[i];
+        tq->heap[i] = tq->heap[parent];
+        tq->heap[parent] = tmp;
+        i = parent;
+    }
+}
+
+static void heap_sift_down(tenant_queue_t *tq, uint32_t i) {
+    while (1) {
+        uint32_t left = 2 * i + 1;
+        uint32_t right = left + 1;
+        uint32_t best = i;
+
+        if (left < tq->heap_size && job_before(tq->heap[left], tq->heap[best])) {
+            best = left;
+        }
+        if (right < tq->heap_size && job_before(tq->heap[right], tq->heap[best])) {
+            best = right;
+        }
+        if (best == i) break;
+
+        training_job_t *tmp = tq->heap[i];
+        tq->heap[i] = tq->heap[best];
+        tq->heap[best] = tmp;
+        i = best;
+    }
+}
+
+static void heap_push(tenant_queue_t *tq, training_job_t *job) {
+    tq->heap[tq->heap_size] = job;
+    heap_sift_up(tq, tq->heap_size);
+    tq->heap_size++;
+}
+
+static void heap_remove(tenant_queue_t *tq, uint32_t i) {
+    tq->heap_size--;
+    if (i == tq->heap_size) return;
+
+    tq->heap[i] = tq->heap[tq->heap_size];
+    heap_sift_down(tq, i);
+    heap_sift_up(tq, i);
+}
+
+static double tenant_vtime(const tenant_queue_t *tq) {
+    return tq->usage / tq->weight;
+}
+
+/* Find the highest-ranked eligible job; returns its tenant or -1 */
+static int select_tenant(uint32_t gpu_count, uint32_t *heap_idx, time_t now) {
+    int best_tenant = -1;
+    uint32_t best_idx = 0;
+
+    for (uint32_t t = 0; t < MAX_TRAINING_TENANTS; t++) {
+        tenant_queue_t *tq = &job_queue.tenants[t];
+        if (tq->heap_size == 0) continue;
+
+        /* Head of this tenant's heap, skipping past jobs this node can't run */
+        uint32_t idx = 0;
+        if (tq->heap[0]->min_gpus > gpu_count) {
+            int found = 0;
+            for (uint32_t i = 1; i < tq->heap_size; i++) {
+                if (tq->heap[i]->min_gpus <= gpu_count &&
+                    (!found || job_before(tq->heap[i], tq->heap[idx]))) {
+                    idx = i;
+                    found = 1;
+                }
+            }
+            if (!found) continue;
+        }
+
+        if (best_tenant < 0) {
+            best_tenant = t;
+            best_idx = idx;
+            continue;
+        }
+
+        training_job_t *cand = job_queue.tenants[t].heap[idx];
+        training_job_t *best = job_queue.tenants[best_tenant].heap[best_idx];
+
+        if (cand->priority != best->priority) {
+            if (cand->priority > best->priority) {
+                best_tenant = t;
+                best_idx = idx;
+            }
+            continue;
+        }
+
+        /* Same priority: urgent deadlines first, then fair share */
+        int cand_urgent = cand->deadline && cand->deadline - now <= JOB_URGENT_WINDOW;
+        int best_urgent = best->deadline && best->deadline - now <= JOB_URGENT_WINDOW;
+
+        if (cand_urgent != best_urgent) {
+            if (cand_urgent) {
+                best_tenant = t;
+                best_idx = idx;
+            }
+        } else if (cand_urgent) {
+            if (cand->deadline < best->deadline) {
+                best_tenant = t;
+                best_idx = idx;
+            }
+        } else if (tenant_vtime(tq) < tenant_vtime(&job_queue.tenants[best_tenant])) {
+            best_tenant = t;
+            best_idx = idx;
+        }
+    }
+
+    *heap_idx = best_idx;
+    return best_tenant;
+}
+
+/* Initialize job queue */
+void job_queue_init(void) {
+    pthread_mutex_lock(&job_queue.lock);
+
+    memset(job_queue.jobs, 0, sizeof(job_queue.jobs));
+    for (uint32_t t = 0; t < MAX_TRAINING_TENANTS; t++) {
+        job_queue.tenants[t].weight = 1.0;
+        job_queue.tenants[t].usage = 0.0;
+        job_queue.tenants[t].heap_size = 0;
+    }
+    job_queue.queued = 0;
+
+    pthread_mutex_unlock(&job_queue.lock);
+
+    printf("[CDT] Training job queue ready (%u jobs, %u tenants)\n",
+           MAX_TRAINING_JOBS, MAX_TRAINING_TENANTS);
+}
+
+/* Set fair-share weight for a tenant */
+int job_queue_set_tenant_weight(uint32_t tenant, double weight) {
+    if (tenant >= MAX_TRAINING_TENANTS || weight <= 0.0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&job_queue.lock);
+    job_queue.tenants[tenant].weight = weight;
+    pthread_mutex_unlock(&job_queue.lock);
+
+    return 1;
+}
+
+/* Submit a new training job */
+training_job_t* job_queue_submit(const char *model_id, uint32_t tenant,
+                                 job_priority_t priority, time_t deadline,
+                                 uint32_t total_epochs, uint32_t min_gpus) {
+    if (tenant >= MAX_TRAINING_TENANTS) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&job_queue.lock);
+
+    training_job_t *job = NULL;
+    for (uint32_t i = 0; i < MAX_TRAINING_JOBS; i++) {
+        if (job_queue.jobs[i].state == JOB_STATE_FREE ||
+            job_queue.jobs[i].state == JOB_STATE_DONE) {
+            job = &job_queue.jobs[i];
+            break;
+        }
+    }
+
+    if (!job) {
+        pthread_mutex_unlock(&job_queue.lock);
+        printf("[CDT] Job queue full, rejecting job for model %s\n", model_id);
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->job_id = job_queue.next_job_id++;
+    strncpy(job->model_id, model_id, sizeof(job->model_id) - 1);
+    job->tenant = tenant;
+    job->base_priority = priority;
+    job->priority = priority;
+    job->deadline = deadline;
+    job->enqueue_time = time(NULL);
+    job->min_gpus = min_gpus;
+    job->state = JOB_STATE_QUEUED;
+
+    job->progress.total_epochs = total_epochs;
+    job->progress.loss = 10.0;  // Initial high loss
+
+    heap_push(&job_queue.tenants[tenant], job);
+    job_queue.queued++;
+
+    pthread_mutex_unlock(&job_queue.lock);
+
+    return job;
+}
+
+/* Pull the next job a node with gpu_count GPUs can run */
+training_job_t* job_queue_pull(uint32_t gpu_count) {
+    pthread_mutex_lock(&job_queue.lock);
+
+    uint32_t idx;
+    int tenant = select_tenant(gpu_count, &idx, time(NULL));
+    if (tenant < 0) {
+        pthread_mutex_unlock(&job_queue.lock);
+        return NULL;
+    }
+
+    tenant_queue_t *tq = &job_queue.tenants[tenant];
+    training_job_t *job = tq->heap[idx];
+    heap_remove(tq, idx);
+    job_queue.queued--;
+
+    job->state = JOB_STATE_RUNNING;
+    if (job->progress.start_time == 0) {
+        job->progress.start_time = time(NULL);
+    }
+
+    pthread_mutex_unlock(&job_queue.lock);
+
+    return job;
+}
+
+/* Check whether a running job should yield at its next epoch boundary.
+ * Aging only orders the queue: preemption compares base priorities, so a
+ * background job that waited long never preempts the work it waited on. */
+int job_queue_should_preempt(const training_job_t *running, uint32_t gpu_count) {
+    int preempt = 0;
+
+    pthread_mutex_lock(&job_queue.lock);
+
+    for (uint32_t t = 0; t < MAX_TRAINING_TENANTS && !preempt; t++) {
+        tenant_queue_t *tq = &job_queue.tenants[t];
+        for (uint32_t i = 0; i < tq->heap_size; i++) {
+            if (tq->heap[i]->base_priority > running->base_priority &&
+                tq->heap[i]->min_gpus <= gpu_count) {
+                preempt = 1;
+                break;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&job_queue.lock);
+
+    return preempt;
+}
+
+/* Return a preempted job to the queue, keeping its progress */
+void job_queue_requeue(training_job_t *job) {
+    pthread_mutex_lock(&job_queue.lock);
+
+    job->state = JOB_STATE_QUEUED;
+    job->priority = job->base_priority;
+    job->enqueue_time = time(NULL);
+    job->preemptions++;
+
+    heap_push(&job_queue.tenants[job->tenant], job);
+    job_queue.queued++;
+
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/* Mark a job as finished and release its slot */
+void job_queue_complete(training_job_t *job) {
+    pthread_mutex_lock(&job_queue.lock);
+    job->state = JOB_STATE_DONE;
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/* Charge training work to a tenant's fair share */
+void job_queue_charge(uint32_t tenant, double epochs) {
+    if (tenant >= MAX_TRAINING_TENANTS) return;
+
+    pthread_mutex_lock(&job_queue.lock);
+    job_queue.tenants[tenant].usage += epochs;
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/* Promote long-waiting jobs so queueing delay stays bounded */
+void job_queue_age(time_t now) {
+    pthread_mutex_lock(&job_queue.lock);
+
+    for (uint32_t t = 0; t < MAX_TRAINING_TENANTS; t++) {
+        tenant_queue_t *tq = &job_queue.tenants[t];
+        int changed = 0;
+
+        for (uint32_t i = 0; i < tq->heap_size; i++) {
+            training_job_t *job = tq->heap[i];
+            if (job->priority >= JOB_PRIORITY_HIGH) continue;
+
+            uint32_t steps = (now - job->enqueue_time) / JOB_AGING_INTERVAL;
+            job_priority_t aged = job->base_priority + steps;
+            if (aged > JOB_PRIORITY_HIGH) aged = JOB_PRIORITY_HIGH;
+
+            if (aged > job->priority) {
+                job->priority = aged;
+                changed = 1;
+            }
+        }
+
+        /* Rebuild heap if any priority moved */
+        if (changed) {
+            for (int i = (int)tq->heap_size / 2 - 1; i >= 0; i--) {
+                heap_sift_down(tq, i);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&job_queue.lock);
+}
+
+/* Number of jobs waiting to run */
+uint32_t job_queue_depth(void) {
+    pthread_mutex_lock(&job_queue.lock);
+    uint32_t depth = job_queue.queued;
+    pthread_mutex_unlock(&job_queue.lock);
+
+    return depth;
+}
+
+#ifdef JOB_QUEUE_TEST
+/* Userspace test: cc -O2 -DJOB_QUEUE_TEST job_queue.c -lpthread */
+#include "../test_check.h"
+
+/* Higher base priority preempts; GPU requirements are respected */
+static void test_preempt_by_class(void) {
+    job_queue_init();
+
+    training_job_t *background = job_queue_submit("filler", 0, JOB_PRIORITY_BACKGROUND, 0, 10, 0);
+    CHECK(job_queue_pull(1) == background, "background job not pulled");
+    CHECK(!job_queue_should_preempt(background, 1), "preempted with nothing queued");
+
+    training_job_t *big = job_queue_submit("big", 1, JOB_PRIORITY_NORMAL, 0, 10, 4);
+    CHECK(!job_queue_should_preempt(background, 1), "preempted for a job the node can't run");
+    CHECK(job_queue_should_preempt(background, 4), "normal job did not preempt background");
+
+    training_job_t *normal = job_queue_submit("normal", 1, JOB_PRIORITY_NORMAL, 0, 10, 0);
+    CHECK(job_queue_should_preempt(background, 1), "normal job did not preempt background");
+
+    job_queue_requeue(background);
+    CHECK(job_queue_pull(1) == normal, "normal job not pulled after preemption");
+
+    training_job_t *retrain = job_queue_submit("retrain", 2, JOB_PRIORITY_RETRAIN, 0, 10, 0);
+    CHECK(job_queue_should_preempt(normal, 1), "retraining did not preempt normal work");
+    CHECK(job_queue_pull(4) == retrain, "retraining not pulled first");
+    CHECK(job_queue_pull(4) == big, "normal job not pulled before background");
+    CHECK(job_queue_pull(4) == background, "background job lost");
+}
+
+/* An aged background job goes first in the queue but never preempts normal work */
+static void test_aging_does_not_preempt(void) {
+    job_queue_init();
+
+    training_job_t *background = job_queue_submit("filler", 0, JOB_PRIORITY_BACKGROUND, 0, 10, 0);
+    job_queue_pull(1);
+    training_job_t *normal = job_queue_submit("normal", 1, JOB_PRIORITY_NORMAL, 0, 10, 0);
+
+    /* The background job is preempted and waits well past two aging steps */
+    for (int round = 0; round < 4; round++) {
+        CHECK(job_queue_should_preempt(background, 1), "round %d: background not preempted", round);
+        job_queue_requeue(background);
+        CHECK(job_queue_pull(1) == normal, "round %d: normal job not pulled", round);
+
+        job_queue_age(time(NULL) + 3 * JOB_AGING_INTERVAL);
+        CHECK(background->priority == JOB_PRIORITY_HIGH, "round %d: background aged to %d",
+              round, background->priority);
+        CHECK(!job_queue_should_preempt(normal, 1), "round %d: aged background preempted normal work",
+              round);
+
+        /* Aging still orders the queue: it runs ahead of fresh normal work */
+        training_job_t *fresh = job_queue_submit("fresh", 2, JOB_PRIORITY_NORMAL, 0, 10, 0);
+        CHECK(job_queue_pull(1) == background, "round %d: aged background not first in queue", round);
+        CHECK(job_queue_pull(1) == fresh, "round %d: fresh normal job lost", round);
+        job_queue_complete(fresh);
+
+        /* Normal work returns and the cycle repeats */
+        job_queue_requeue(normal);
+    }
+}
+
+int main(void) {
+    test_preempt_by_class();
+    test_aging_does_not_preempt();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
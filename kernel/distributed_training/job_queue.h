@@ -0,0 +1,66 @@
+#ifndef QENEX_JOB_QUEUE_H
+#define QENEX_JOB_QUEUE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Deadline-aware priority queue for distributed training jobs */
+
+#define MAX_TRAINING_JOBS 1024
+#define MAX_TRAINING_TENANTS 32
+#define JOB_AGING_INTERVAL 300     // Seconds queued before a job is promoted
+#define JOB_URGENT_WINDOW 600      // Deadlines this close override fair share
+
+typedef enum {
+    JOB_PRIORITY_BACKGROUND = 0,   // Filler work when nothing else is queued
+    JOB_PRIORITY_NORMAL = 1,
+    JOB_PRIORITY_HIGH = 2,         // Highest level reachable through aging
+    JOB_PRIORITY_RETRAIN = 3       // Urgent retraining, preempts everything else
+} job_priority_t;
+
+typedef enum {
+    JOB_STATE_FREE = 0,
+    JOB_STATE_QUEUED,
+    JOB_STATE_RUNNING,
+    JOB_STATE_DONE
+} job_state_t;
+
+/* Training job; progress is saved here at epoch boundaries */
+typedef struct training_job {
+    uint64_t job_id;
+    char model_id[65];
+    uint32_t tenant;
+    job_priority_t base_priority;
+    job_priority_t priority;       // Effective priority after aging
+    time_t deadline;               // 0 = no deadline
+    time_t enqueue_time;
+    uint32_t min_gpus;
+    job_state_t state;
+    uint32_t preemptions;
+
+    /* Resumable training state */
+    struct {
+        uint32_t current_epoch;
+        uint32_t total_epochs;
+        double loss;
+        double accuracy;
+        time_t start_time;
+        uint64_t samples_processed;
+    } progress;
+} training_job_t;
+
+/* Function prototypes */
+void job_queue_init(void);
+int job_queue_set_tenant_weight(uint32_t tenant, double weight);
+training_job_t* job_queue_submit(const char *model_id, uint32_t tenant,
+                                 job_priority_t priority, time_t deadline,
+                                 uint32_t total_epochs, uint32_t min_gpus);
+training_job_t* job_queue_pull(uint32_t gpu_count);
+int job_queue_should_preempt(const training_job_t *running, uint32_t gpu_count);
+void job_queue_requeue(training_job_t *job);
+void job_queue_complete(training_job_t *job);
+void job_queue_charge(uint32_t tenant, double epochs);
+void job_queue_age(time_t now);
+uint32_t job_queue_depth(void);
+
+#endif /* QENEX_JOB_QUEUE_H */
@@ -0,0 +1,624 @@
+#include "model_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+/*
+ * Chunk boundaries come from a gear rolling hash with normalized chunking:
+ * a stricter mask before the average size and a looser one after it keeps
+ * chunk sizes close to MODEL_CHUNK_AVG_SIZE. Masks sit in the high bits so
+ * every boundary decision depends on the last 64 bytes of input.
+ */
+#define CHUNK_MASK_STRICT ((((uint64_t)1 << 15) - 1) << 49)
+#define CHUNK_MASK_LOOSE  ((((uint64_t)1 << 11) - 1) << 53)
+
+typedef struct chunk_entry {
+    uint8_t digest[MODEL_DIGEST_SIZE];
+    uint32_t size;
+    uint32_t refcount;
+    uint8_t *data;
+    struct chunk_entry *next;
+} chunk_entry_t;
+
+static struct {
+    chunk_entry_t *buckets[MODEL_STORE_BUCKETS];
+    uint64_t gear[256];
+    uint64_t logical_bytes;    // Bytes referenced by adopted manifests
+    uint64_t stored_bytes;     // Bytes actually held in unique chunks
+    uint32_t chunk_count;
+    uint32_t transfers;        // Open peer transfers; GC waits for them
+    uint8_t gc_pending;
+    uint8_t initialized;
+    pthread_mutex_t lock;
+} model_store = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint32_t digest_bucket(const uint8_t *digest) {
+    uint32_t h;
+    memcpy(&h, digest, sizeof(h));
+    return h & (MODEL_STORE_BUCKETS - 1);
+}
+
+static chunk_entry_t* find_chunk(const uint8_t *digest) {
+    chunk_entry_t *entry = model_store.buckets[digest_bucket(digest)];
+
+    while (entry) {
+        if (memcmp(entry->digest, digest, MODEL_DIGEST_SIZE) == 0) {
+            return entry;
+        }
+        entry = entry->next;
+    }
+
+    return NULL;
+}
+
+/* Insert chunk if new; returns the stored entry */
+static chunk_entry_t* insert_chunk(const uint8_t *digest, const uint8_t *data, uint32_t size) {
+    chunk_entry_t *entry = find_chunk(digest);
+    if (entry) {
+        return entry;
+    }
+
+    entry = calloc(1, sizeof(chunk_entry_t));
+    if (!entry) {
+        return NULL;
+    }
+    entry->data = malloc(size);
+    if (!entry->data) {
+        free(entry);
+        return NULL;
+    }
+
+    memcpy(entry->digest, digest, MODEL_DIGEST_SIZE);
+    memcpy(entry->data, data, size);
+    entry->size = size;
+
+    uint32_t bucket = digest_bucket(digest);
+    entry->next = model_store.buckets[bucket];
+    model_store.buckets[bucket] = entry;
+
+    model_store.stored_bytes += size;
+    model_store.chunk_count++;
+
+    return entry;
+}
+
+/* Length of the next content-defined chunk */
+static uint32_t find_chunk_boundary(const uint8_t *data, uint64_t len) {
+    if (len <= MODEL_CHUNK_MIN_SIZE) {
+        return len;
+    }
+    if (len > MODEL_CHUNK_MAX_SIZE) {
+        len = MODEL_CHUNK_MAX_SIZE;
+    }
+
+    uint64_t fp = 0;
+    uint64_t normal = len < MODEL_CHUNK_AVG_SIZE ? len : MODEL_CHUNK_AVG_SIZE;
+    uint64_t i = MODEL_CHUNK_MIN_SIZE;
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + model_store.gear[data[i]];
+        if (!(fp & CHUNK_MASK_STRICT)) return i + 1;
+    }
+    for (; i < len; i++) {
+        fp = (fp << 1) + model_store.gear[data[i]];
+        if (!(fp & CHUNK_MASK_LOOSE)) return i + 1;
+    }
+
+    return len;
+}
+
+static int chunk_digest(const uint8_t *data, uint32_t size, uint8_t digest[MODEL_DIGEST_SIZE]) {
+    return EVP_Digest(data, size, digest, NULL, EVP_sha256(), NULL);
+}
+
+static int compute_manifest_hash(model_manifest_t *manifest) {
+    unsigned char hash[MODEL_DIGEST_SIZE];
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    int ok = ctx &&
+             EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+             EVP_DigestUpdate(ctx, manifest->model_id, strlen(manifest->model_id)) &&
+             EVP_DigestUpdate(ctx, &manifest->version, sizeof(manifest->version)) &&
+             EVP_DigestUpdate(ctx, manifest->chunks,
+                              (size_t)manifest->chunk_count * MODEL_DIGEST_SIZE) &&
+             EVP_DigestFinal_ex(ctx, hash, NULL);
+    EVP_MD_CTX_free(ctx);
+    if (!ok) {
+        return 0;
+    }
+
+    for (int i = 0; i < MODEL_DIGEST_SIZE; i++) {
+        sprintf(&manifest->manifest_hash[i*2], "%02x", hash[i]);
+    }
+    manifest->manifest_hash[64] = '\0';
+    return 1;
+}
+
+/* Initialize model blob store */
+void model_store_init(void) {
+    pthread_mutex_lock(&model_store.lock);
+
+    if (!model_store.initialized) {
+        /* Deterministic gear table so every node cuts identical chunks */
+        uint64_t seed = 0x51454E584D4F444CULL;  // "QENXMODL"
+        for (int i = 0; i < 256; i++) {
+            seed += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            model_store.gear[i] = z ^ (z >> 31);
+        }
+        model_store.initialized = 1;
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    printf("[CDT] Model blob store ready (chunks %u-%u KB)\n",
+           MODEL_CHUNK_MIN_SIZE / 1024, MODEL_CHUNK_MAX_SIZE / 1024);
+}
+
+/* Store a model version, returning its manifest */
+model_manifest_t* model_store_put(const char *model_id, uint32_t version,
+                                  const uint8_t *data, uint64_t size) {
+    /* Upper bound on chunk count comes from the minimum chunk size */
+    uint32_t max_chunks = size / MODEL_CHUNK_MIN_SIZE + 1;
+
+    model_manifest_t *manifest = calloc(1, sizeof(model_manifest_t));
+    if (!manifest) {
+        return NULL;
+    }
+    manifest->chunks = malloc((size_t)max_chunks * MODEL_DIGEST_SIZE);
+    manifest->chunk_sizes = malloc((size_t)max_chunks * sizeof(uint32_t));
+    if (!manifest->chunks || !manifest->chunk_sizes) {
+        free(manifest->chunks);
+        free(manifest->chunk_sizes);
+        free(manifest);
+        return NULL;
+    }
+
+    strncpy(manifest->model_id, model_id, sizeof(manifest->model_id) - 1);
+    manifest->version = version;
+    manifest->total_size = size;
+
+    /* Chunking and hashing happen outside the store lock */
+    uint64_t offset = 0;
+    int hashed = 1;
+    while (offset < size && hashed) {
+        uint32_t len = find_chunk_boundary(data + offset, size - offset);
+        hashed = chunk_digest(data + offset, len, manifest->chunks[manifest->chunk_count]);
+        manifest->chunk_sizes[manifest->chunk_count] = len;
+        manifest->chunk_count++;
+        offset += len;
+    }
+    if (!hashed || !compute_manifest_hash(manifest)) {
+        free(manifest->chunks);
+        free(manifest->chunk_sizes);
+        free(manifest);
+        return NULL;
+    }
+
+    uint64_t stored_before;
+
+    pthread_mutex_lock(&model_store.lock);
+
+    stored_before = model_store.stored_bytes;
+    offset = 0;
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        chunk_entry_t *entry = insert_chunk(manifest->chunks[i], data + offset,
+                                            manifest->chunk_sizes[i]);
+        if (!entry) {
+            /* Roll back references taken so far */
+            for (uint32_t j = 0; j < i; j++) {
+                find_chunk(manifest->chunks[j])->refcount--;
+            }
+            pthread_mutex_unlock(&model_store.lock);
+            free(manifest->chunks);
+            free(manifest->chunk_sizes);
+            free(manifest);
+            return NULL;
+        }
+        entry->refcount++;
+        offset += manifest->chunk_sizes[i];
+    }
+    model_store.logical_bytes += size;
+    uint64_t new_bytes = model_store.stored_bytes - stored_before;
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    printf("[CDT] Stored model %s v%u: %u chunks, %lu of %lu bytes new\n",
+           model_id, version, manifest->chunk_count, new_bytes, size);
+
+    return manifest;
+}
+
+/* Reassemble a model version into out */
+int model_store_get(const model_manifest_t *manifest, uint8_t *out, uint64_t out_size) {
+    if (out_size < manifest->total_size) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&model_store.lock);
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        chunk_entry_t *entry = find_chunk(manifest->chunks[i]);
+        if (!entry || offset + entry->size > out_size) {
+            pthread_mutex_unlock(&model_store.lock);
+            return 0;
+        }
+        memcpy(out + offset, entry->data, entry->size);
+        offset += entry->size;
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    return offset == manifest->total_size;
+}
+
+/* List chunk indices of a remote manifest that must be fetched.
+ * An allocation failure lists nothing; the later adopt then fails. */
+uint32_t model_store_missing(const model_manifest_t *manifest,
+                             uint32_t *missing, uint32_t max_missing) {
+    uint32_t count = 0;
+
+    /* Same chunk may appear many times in one manifest; fetch it once.
+     * Open-addressed set of listed chunk indices (stored +1, 0 = empty). */
+    uint32_t slots = 16;
+    while (slots < 2 * manifest->chunk_count) slots <<= 1;
+    uint32_t *seen = calloc(slots, sizeof(uint32_t));
+    if (!seen) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&model_store.lock);
+
+    for (uint32_t i = 0; i < manifest->chunk_count && count < max_missing; i++) {
+        if (find_chunk(manifest->chunks[i])) {
+            continue;
+        }
+
+        uint32_t h;
+        memcpy(&h, manifest->chunks[i] + 4, sizeof(h));
+        for (h &= slots - 1; seen[h]; h = (h + 1) & (slots - 1)) {
+            if (memcmp(manifest->chunks[seen[h] - 1], manifest->chunks[i],
+                       MODEL_DIGEST_SIZE) == 0) {
+                break;
+            }
+        }
+        if (!seen[h]) {
+            seen[h] = i + 1;
+            missing[count++] = i;
+        }
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    free(seen);
+    return count;
+}
+
+/* Accept a chunk received from a peer; verified against its digest */
+int model_store_put_chunk(const uint8_t digest[MODEL_DIGEST_SIZE],
+                          const uint8_t *data, uint32_t size) {
+    unsigned char check[MODEL_DIGEST_SIZE];
+
+    if (size > MODEL_CHUNK_MAX_SIZE) {
+        return 0;
+    }
+
+    if (!chunk_digest(data, size, check) || memcmp(check, digest, MODEL_DIGEST_SIZE) != 0) {
+        printf("[CDT] Rejected model chunk with mismatched digest\n");
+        return 0;
+    }
+
+    pthread_mutex_lock(&model_store.lock);
+    chunk_entry_t *entry = insert_chunk(digest, data, size);
+    pthread_mutex_unlock(&model_store.lock);
+
+    return entry != NULL;
+}
+
+/* Copy a chunk out to serve to a peer; returns its size or 0 */
+uint32_t model_store_read_chunk(const uint8_t digest[MODEL_DIGEST_SIZE],
+                                uint8_t *out, uint32_t out_size) {
+    uint32_t size = 0;
+
+    pthread_mutex_lock(&model_store.lock);
+
+    chunk_entry_t *entry = find_chunk(digest);
+    if (entry && entry->size <= out_size) {
+        memcpy(out, entry->data, entry->size);
+        size = entry->size;
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    return size;
+}
+
+/* Take references on all chunks of a manifest received from a peer */
+int model_store_adopt(const model_manifest_t *manifest) {
+    pthread_mutex_lock(&model_store.lock);
+
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        if (!find_chunk(manifest->chunks[i])) {
+            pthread_mutex_unlock(&model_store.lock);
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        find_chunk(manifest->chunks[i])->refcount++;
+    }
+    model_store.logical_bytes += manifest->total_size;
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    return 1;
+}
+
+/* Drop a manifest and its chunk references */
+void model_store_release(model_manifest_t *manifest) {
+    if (!manifest) return;
+
+    pthread_mutex_lock(&model_store.lock);
+
+    uint64_t released = 0;
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        chunk_entry_t *entry = find_chunk(manifest->chunks[i]);
+        if (entry && entry->refcount > 0) {
+            entry->refcount--;
+            released += entry->size;
+        }
+    }
+    if (released <= model_store.logical_bytes) {
+        model_store.logical_bytes -= released;
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    /* Unreferenced chunks are freed by the next model_store_gc() */
+    free(manifest->chunks);
+    free(manifest->chunk_sizes);
+    free(manifest);
+}
+
+/* Free unreferenced chunks; caller holds the store lock */
+static uint32_t sweep_chunks(void) {
+    uint32_t freed = 0;
+
+    for (uint32_t b = 0; b < MODEL_STORE_BUCKETS; b++) {
+        chunk_entry_t **link = &model_store.buckets[b];
+
+        while (*link) {
+            chunk_entry_t *entry = *link;
+            if (entry->refcount == 0) {
+                *link = entry->next;
+                model_store.stored_bytes -= entry->size;
+                model_store.chunk_count--;
+                free(entry->data);
+                free(entry);
+                freed++;
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+    model_store.gc_pending = 0;
+
+    return freed;
+}
+
+/* Free chunks no manifest references; returns number freed.
+ * While a peer transfer is open its received chunks are not yet adopted,
+ * so the sweep is deferred to the end of the last open transfer. */
+uint32_t model_store_gc(void) {
+    uint32_t freed = 0;
+
+    pthread_mutex_lock(&model_store.lock);
+
+    if (model_store.transfers > 0) {
+        model_store.gc_pending = 1;
+    } else {
+        freed = sweep_chunks();
+    }
+
+    pthread_mutex_unlock(&model_store.lock);
+
+    return freed;
+}
+
+/* Bracket a peer transfer: chunks found by model_store_missing() or
+ * received by model_store_put_chunk() stay until model_store_adopt() */
+void model_store_transfer_begin(void) {
+    pthread_mutex_lock(&model_store.lock);
+    model_store.transfers++;
+    pthread_mutex_unlock(&model_store.lock);
+}
+
+void model_store_transfer_end(void) {
+    pthread_mutex_lock(&model_store.lock);
+    if (model_store.transfers > 0 && --model_store.transfers == 0 && model_store.gc_pending) {
+        sweep_chunks();
+    }
+    pthread_mutex_unlock(&model_store.lock);
+}
+
+/* Storage statistics: logical bytes vs bytes actually stored */
+void model_store_stats(uint64_t *logical_bytes, uint64_t *stored_bytes, uint32_t *chunks) {
+    pthread_mutex_lock(&model_store.lock);
+    *logical_bytes = model_store.logical_bytes;
+    *stored_bytes = model_store.stored_bytes;
+    *chunks = model_store.chunk_count;
+    pthread_mutex_unlock(&model_store.lock);
+}
+
+#ifdef MODEL_STORE_TEST
+/* Userspace test: cc -O2 -DMODEL_STORE_TEST model_store.c -lcrypto -lpthread */
+#include "../test_check.h"
+
+#define TEST_MODEL_SIZE (512 * 1024)
+
+static void fill_random(uint8_t *data, uint64_t size, uint64_t seed) {
+    for (uint64_t i = 0; i < size; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        data[i] = seed >> 56;
+    }
+}
+
+static model_manifest_t* manifest_of(const model_manifest_t *src, const uint32_t *order,
+                                     uint32_t count) {
+    model_manifest_t *m = calloc(1, sizeof(model_manifest_t));
+    m->chunks = malloc((size_t)count * MODEL_DIGEST_SIZE);
+    m->chunk_sizes = malloc((size_t)count * sizeof(uint32_t));
+    strcpy(m->model_id, src->model_id);
+    m->chunk_count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(m->chunks[i], src->chunks[order[i]], MODEL_DIGEST_SIZE);
+        m->chunk_sizes[i] = src->chunk_sizes[order[i]];
+        m->total_size += m->chunk_sizes[i];
+    }
+    return m;
+}
+
+static void free_test_manifest(model_manifest_t *m) {
+    free(m->chunks);
+    free(m->chunk_sizes);
+    free(m);
+}
+
+/* Round trip, and a small edit only adds the chunks around it */
+static void test_put_get(void) {
+    uint8_t *data = malloc(TEST_MODEL_SIZE);
+    uint8_t *out = malloc(TEST_MODEL_SIZE);
+    uint64_t logical, stored;
+    uint32_t chunks;
+
+    fill_random(data, TEST_MODEL_SIZE, 1);
+    model_manifest_t *v1 = model_store_put("resnet", 1, data, TEST_MODEL_SIZE);
+    CHECK(v1 && v1->chunk_count > 8, "v1 chunked into %u", v1 ? v1->chunk_count : 0);
+    CHECK(strlen(v1->manifest_hash) == 64, "manifest hash missing");
+    CHECK(model_store_get(v1, out, TEST_MODEL_SIZE) && memcmp(out, data, TEST_MODEL_SIZE) == 0,
+          "v1 round trip");
+
+    model_store_stats(&logical, &stored, &chunks);
+    uint64_t stored_v1 = stored;
+
+    data[TEST_MODEL_SIZE / 2] ^= 0xff;
+    model_manifest_t *v2 = model_store_put("resnet", 2, data, TEST_MODEL_SIZE);
+    CHECK(model_store_get(v2, out, TEST_MODEL_SIZE) && memcmp(out, data, TEST_MODEL_SIZE) == 0,
+          "v2 round trip");
+    CHECK(strcmp(v1->manifest_hash, v2->manifest_hash) != 0, "versions share a manifest hash");
+
+    model_store_stats(&logical, &stored, &chunks);
+    CHECK(logical == 2 * TEST_MODEL_SIZE, "logical bytes %lu", logical);
+    CHECK(stored - stored_v1 <= 2 * MODEL_CHUNK_MAX_SIZE, "edit stored %lu new bytes",
+          stored - stored_v1);
+
+    model_store_release(v1);
+    model_store_release(v2);
+    CHECK(model_store_gc() == chunks, "gc left referenced chunks");
+    model_store_stats(&logical, &stored, &chunks);
+    CHECK(logical == 0 && stored == 0 && chunks == 0, "store not empty after gc");
+
+    free(data);
+    free(out);
+}
+
+/* Duplicate chunks are listed once, in manifest order */
+static void test_missing(void) {
+    uint8_t *data = malloc(TEST_MODEL_SIZE);
+    fill_random(data, TEST_MODEL_SIZE, 2);
+    model_manifest_t *src = model_store_put("bert", 1, data, TEST_MODEL_SIZE);
+
+    uint32_t order[] = { 0, 1, 0, 2, 1, 2, 3 };
+    model_manifest_t *remote = manifest_of(src, order, 7);
+    uint32_t missing[7];
+
+    CHECK(model_store_missing(remote, missing, 7) == 0, "held chunks listed as missing");
+
+    model_store_release(src);
+    model_store_gc();
+
+    uint32_t need = model_store_missing(remote, missing, 7);
+    CHECK(need == 4 && missing[0] == 0 && missing[1] == 1 && missing[2] == 3 && missing[3] == 6,
+          "missing listed %u chunks", need);
+    CHECK(model_store_missing(remote, missing, 2) == 2, "max_missing not honoured");
+
+    /* One chunk repeated across a large manifest */
+    uint32_t big_count = 200000;
+    uint32_t *zeros = calloc(big_count, sizeof(uint32_t));
+    model_manifest_t *big = manifest_of(remote, zeros, big_count);
+    uint32_t *big_missing = malloc(big_count * sizeof(uint32_t));
+    CHECK(model_store_missing(big, big_missing, big_count) == 1, "repeated chunk listed twice");
+
+    free(zeros);
+    free(big_missing);
+    free_test_manifest(big);
+    free_test_manifest(remote);
+    free(data);
+}
+
+/* A GC during a peer transfer must not free chunks not yet adopted */
+static void test_gc_during_transfer(void) {
+    uint8_t *data = malloc(TEST_MODEL_SIZE);
+    uint8_t *chunk = malloc(MODEL_CHUNK_MAX_SIZE);
+    uint8_t digest[MODEL_DIGEST_SIZE];
+    fill_random(data, TEST_MODEL_SIZE, 3);
+
+    /* A sender's chunks, still held locally but no longer referenced */
+    model_manifest_t *src = model_store_put("gpt", 1, data, TEST_MODEL_SIZE);
+    uint32_t all[64];
+    uint32_t count = src->chunk_count < 64 ? src->chunk_count : 64;
+    for (uint32_t i = 0; i < count; i++) all[i] = i;
+    model_manifest_t *remote = manifest_of(src, all, count);
+    model_store_release(src);
+
+    /* missing() counts on them, so a GC before adoption must wait */
+    uint32_t missing[64];
+    model_store_transfer_begin();
+    CHECK(model_store_missing(remote, missing, count) == 0, "unreferenced chunks listed as missing");
+    CHECK(model_store_gc() == 0, "gc freed chunks during a transfer");
+    CHECK(model_store_adopt(remote), "adopt failed after a deferred gc");
+    model_store_transfer_end();
+    CHECK(model_store_read_chunk(remote->chunks[0], chunk, MODEL_CHUNK_MAX_SIZE) ==
+          remote->chunk_sizes[0], "adopted chunk lost");
+
+    /* A chunk received but never adopted goes once the last transfer ends */
+    memcpy(digest, remote->chunks[0], MODEL_DIGEST_SIZE);
+    uint32_t size = model_store_read_chunk(digest, chunk, MODEL_CHUNK_MAX_SIZE);
+    model_store_release(remote);
+    model_store_gc();
+    CHECK(model_store_read_chunk(digest, chunk, MODEL_CHUNK_MAX_SIZE) == 0, "released chunk kept");
+
+    model_store_transfer_begin();
+    model_store_transfer_begin();
+    CHECK(model_store_put_chunk(digest, chunk, size), "received chunk rejected");
+    CHECK(!model_store_put_chunk(digest, chunk, size - 1), "truncated chunk accepted");
+    model_store_gc();
+    model_store_transfer_end();
+    CHECK(model_store_read_chunk(digest, chunk, MODEL_CHUNK_MAX_SIZE) == size,
+          "chunk freed with a transfer still open");
+    model_store_transfer_end();
+    CHECK(model_store_read_chunk(digest, chunk, MODEL_CHUNK_MAX_SIZE) == 0,
+          "deferred gc did not run");
+
+    free(data);
+    free(chunk);
+}
+
+int main(void) {
+    model_store_init();
+
+    test_put_get();
+    test_missing();
+    test_gc_during_transfer();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,49 @@
+#ifndef QENEX_MODEL_STORE_H
+#define QENEX_MODEL_STORE_H
+
+#include <stdint.h>
+
+/*
+ * Content-addressed model blob store.
+ *
+ * Model bytes are split into content-defined chunks and stored once per
+ * SHA-256 digest. A model version is a manifest of chunk digests, so a new
+ * version only adds (and only needs to transfer) the chunks that changed.
+ * The manifest hash is what goes into model_hash / ai_model_ref on chain.
+ */
+
+#define MODEL_CHUNK_MIN_SIZE (2 * 1024)
+#define MODEL_CHUNK_AVG_SIZE (8 * 1024)
+#define MODEL_CHUNK_MAX_SIZE (64 * 1024)
+#define MODEL_STORE_BUCKETS 65536
+#define MODEL_DIGEST_SIZE 32
+
+typedef struct model_manifest {
+    char model_id[65];
+    uint32_t version;
+    uint64_t total_size;
+    uint32_t chunk_count;
+    uint8_t (*chunks)[MODEL_DIGEST_SIZE];
+    uint32_t *chunk_sizes;
+    char manifest_hash[65];
+} model_manifest_t;
+
+/* Function prototypes */
+void model_store_init(void);
+model_manifest_t* model_store_put(const char *model_id, uint32_t version,
+                                  const uint8_t *data, uint64_t size);
+int model_store_get(const model_manifest_t *manifest, uint8_t *out, uint64_t out_size);
+uint32_t model_store_missing(const model_manifest_t *manifest,
+                             uint32_t *missing, uint32_t max_missing);
+int model_store_put_chunk(const uint8_t digest[MODEL_DIGEST_SIZE],
+                          const uint8_t *data, uint32_t size);
+uint32_t model_store_read_chunk(const uint8_t digest[MODEL_DIGEST_SIZE],
+                                uint8_t *out, uint32_t out_size);
+int model_store_adopt(const model_manifest_t *manifest);
+void model_store_release(model_manifest_t *manifest);
+uint32_t model_store_gc(void);
+void model_store_transfer_begin(void);
+void model_store_transfer_end(void);
+void model_store_stats(uint64_t *logical_bytes, uint64_t *stored_bytes, uint32_t *chunks);
+
+#endif /* QENEX_MODEL_STORE_H */
@@ -0,0 +1,591 @@
+#include "model_verifier.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define VERIFIER_DEFAULT_SHARDS 4
+#define VERIFIER_DEFAULT_BATCH 256
+#define VERIFIER_MIN_SHARDS 3      // verify_ai_improvement needs 3 confirmations
+#define VERIFIER_CONFIRM_MARGIN 0.01  // Its 1% minimum improvement, per shard
+
+/* Verifications in flight together; the batches of every model are
+ * striped across one set of workers */
+typedef struct {
+    const void **models;           // NULL entries are skipped
+    uint32_t model_count;
+    model_infer_fn infer;
+    void *ctx;
+    const eval_dataset_t *eval;
+    uint32_t workers;
+    uint32_t batch_size;
+    uint32_t batch_count;          // Per model
+
+    /* One prediction per held-out sample, model after model */
+    uint32_t *predictions;
+} verify_job_t;
+
+typedef struct {
+    verify_job_t *job;
+    uint32_t worker;
+} verify_worker_t;
+
+static struct {
+    uint8_t initialized;
+    verifier_backend_t backend;
+    eval_dataset_t eval;
+    verifier_config_t config;
+    pthread_mutex_t lock;
+} verifier = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+/* Run every batch assigned to this worker */
+static void* verify_worker_thread(void *arg) {
+    verify_worker_t *w = arg;
+    verify_job_t *job = w->job;
+    const eval_dataset_t *eval = job->eval;
+    uint32_t total = job->batch_count * job->model_count;
+
+    for (uint32_t b = w->worker; b < total; b += job->workers) {
+        uint32_t m = b / job->batch_count;
+        uint32_t start = (b % job->batch_count) * job->batch_size;
+        uint32_t count = eval->sample_count - start;
+        if (count > job->batch_size) count = job->batch_size;
+        if (!job->models[m]) continue;
+
+        job->infer(job->models[m], eval->features + (size_t)start * eval->feature_dim,
+                   count, eval->feature_dim,
+                   job->predictions + (size_t)m * eval->sample_count + start, job->ctx);
+    }
+
+    return NULL;
+}
+
+/* Macro-averaged precision, recall and F1 over classes present in the set */
+static void confusion_metrics(const uint64_t *confusion, uint32_t classes,
+                              const uint64_t *support, ai_verification_t *result) {
+    double precision_sum = 0.0, recall_sum = 0.0, f1_sum = 0.0;
+    uint32_t precision_classes = 0, recall_classes = 0;
+
+    for (uint32_t c = 0; c < classes; c++) {
+        uint64_t tp = confusion[(size_t)c * classes + c];
+        uint64_t predicted = 0;
+        for (uint32_t t = 0; t < classes; t++) {
+            predicted += confusion[(size_t)t * classes + c];
+        }
+
+        double precision = predicted ? (double)tp / predicted : 0.0;
+        double recall = support[c] ? (double)tp / support[c] : 0.0;
+
+        if (predicted) {
+            precision_sum += precision;
+            precision_classes++;
+        }
+        if (support[c]) {
+            recall_sum += recall;
+            f1_sum += (precision + recall) > 0.0 ?
+                      2.0 * precision * recall / (precision + recall) : 0.0;
+            recall_classes++;
+        }
+    }
+
+    result->metrics.precision = precision_classes ? precision_sum / precision_classes : 0.0;
+    result->metrics.recall = recall_classes ? recall_sum / recall_classes : 0.0;
+    result->metrics.f1_score = recall_classes ? f1_sum / recall_classes : 0.0;
+}
+
+/* Fill metrics from the predictions, and one confirmation per shard that
+ * shows the improvement over result->baseline_accuracy on its own */
+static int merge_results(const verify_job_t *job, uint32_t m, ai_verification_t *result,
+                         uint32_t shards) {
+    const eval_dataset_t *eval = job->eval;
+    const uint32_t *predictions = job->predictions + (size_t)m * eval->sample_count;
+    uint32_t classes = eval->num_classes;
+
+    uint64_t *confusion = calloc((size_t)classes * classes, sizeof(uint64_t));
+    uint64_t *support = calloc(classes, sizeof(uint64_t));
+    uint64_t *shard_correct = calloc(shards, sizeof(uint64_t));
+    uint64_t *shard_seen = calloc(shards, sizeof(uint64_t));
+    if (!confusion || !support || !shard_correct || !shard_seen) {
+        free(confusion);
+        free(support);
+        free(shard_correct);
+        free(shard_seen);
+        return 0;
+    }
+
+    uint64_t correct = 0;
+
+    for (uint32_t i = 0; i < eval->sample_count; i++) {
+        uint32_t label = eval->labels[i];
+        uint32_t pred = predictions[i];
+        uint32_t shard = i % shards;
+
+        shard_seen[shard]++;
+
+        if (label >= classes) continue;
+        support[label]++;
+
+        /* Out-of-range predictions only count against recall */
+        if (pred < classes) {
+            confusion[(size_t)label * classes + pred]++;
+            if (pred == label) {
+                correct++;
+                shard_correct[shard]++;
+            }
+        }
+    }
+
+    uint32_t confirmations = 0;
+    for (uint32_t s = 0; s < shards; s++) {
+        if (shard_seen[s] &&
+            (double)shard_correct[s] / shard_seen[s] >=
+            result->baseline_accuracy + VERIFIER_CONFIRM_MARGIN) {
+            confirmations++;
+        }
+    }
+
+    confusion_metrics(confusion, classes, support, result);
+
+    double accuracy = (double)correct / eval->sample_count;
+    result->improved_accuracy = accuracy;
+    result->metrics.test_samples = eval->sample_count;
+    result->metrics.validation_loss = 1.0 - accuracy;  // No logits, so error rate
+    result->consensus.verifying_nodes = shards;
+    result->consensus.confirmations = confirmations;
+    result->consensus.consensus_score = (double)confirmations / shards;
+    /* Stamped last: a set time tells the consensus wait the count is final */
+    __atomic_store_n(&result->metrics.verification_time, time(NULL), __ATOMIC_RELEASE);
+
+    free(confusion);
+    free(support);
+    free(shard_correct);
+    free(shard_seen);
+    return 1;
+}
+
+/* Evaluate models on a held-out set across one set of parallel verifier
+ * workers; verified[i] says whether results[i] was filled. Each
+ * results[i].baseline_accuracy must hold the accuracy to beat. */
+uint32_t verify_models(const void **models, uint32_t count, model_infer_fn infer, void *ctx,
+                       const eval_dataset_t *eval, const verifier_config_t *config,
+                       ai_verification_t *results, uint8_t *verified) {
+    memset(verified, 0, count);
+    if (!count || !infer || !eval->sample_count || !eval->num_classes ||
+        eval->num_classes > MAX_VERIFIER_CLASSES || !config->batch_size) {
+        return 0;
+    }
+
+    verify_job_t job = {
+        .models = models,
+        .model_count = count,
+        .infer = infer,
+        .ctx = ctx,
+        .eval = eval,
+        .workers = config->workers,
+        .batch_size = config->batch_size,
+        .batch_count = (eval->sample_count + config->batch_size - 1) / config->batch_size
+    };
+
+    if (job.workers == 0 || job.workers > MAX_VERIFIER_WORKERS) {
+        job.workers = MAX_VERIFIER_WORKERS;
+    }
+    if (job.workers > job.batch_count * count) {
+        job.workers = job.batch_count * count;
+    }
+
+    /* Every shard needs samples of its own */
+    uint32_t shards = config->shards ? config->shards : VERIFIER_DEFAULT_SHARDS;
+    if (shards < VERIFIER_MIN_SHARDS) shards = VERIFIER_MIN_SHARDS;
+    if (shards > eval->sample_count) {
+        return 0;
+    }
+
+    job.predictions = malloc((size_t)count * eval->sample_count * sizeof(uint32_t));
+    if (!job.predictions) {
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[MAX_VERIFIER_WORKERS];
+    verify_worker_t workers[MAX_VERIFIER_WORKERS];
+    uint32_t started = 0;
+
+    for (uint32_t w = 0; w < job.workers; w++) {
+        workers[w].job = &job;
+        workers[w].worker = w;
+        if (pthread_create(&threads[w], NULL, verify_worker_thread, &workers[w]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    /* Cover any worker that failed to start on this thread */
+    for (uint32_t w = started; w < job.workers; w++) {
+        verify_worker_thread(&workers[w]);
+    }
+    for (uint32_t w = 0; w < started; w++) {
+        pthread_join(threads[w], NULL);
+    }
+
+    uint32_t done = 0;
+    for (uint32_t m = 0; m < count; m++) {
+        if (models[m] && merge_results(&job, m, &results[m], shards)) {
+            verified[m] = 1;
+            done++;
+        }
+    }
+    free(job.predictions);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("[CDT] Verified %u model(s) on %u samples by %u workers in %.2fs\n",
+           done, eval->sample_count, job.workers, elapsed);
+    for (uint32_t m = 0; m < count; m++) {
+        if (verified[m]) {
+            printf("[CDT]   %s: acc %.2f%%, F1 %.3f, %u/%u shards confirm\n",
+                   results[m].model_id, results[m].improved_accuracy * 100,
+                   results[m].metrics.f1_score, results[m].consensus.confirmations,
+                   results[m].consensus.verifying_nodes);
+        }
+    }
+
+    return done;
+}
+
+/* Evaluate a model on a held-out set across parallel verifier workers.
+ * result->baseline_accuracy must hold the accuracy to beat. */
+int verify_model(const void *model, model_infer_fn infer, void *ctx,
+                 const eval_dataset_t *eval, const verifier_config_t *config,
+                 ai_verification_t *result) {
+    uint8_t verified;
+
+    return verify_models(&model, 1, infer, ctx, eval, config, result, &verified) == 1;
+}
+
+/* Register the inference backend and held-out set used for submissions */
+int model_verifier_init(const verifier_backend_t *backend, const eval_dataset_t *eval,
+                        const verifier_config_t *config) {
+    if (!backend->load || !backend->infer || !eval->sample_count ||
+        !eval->num_classes || eval->num_classes > MAX_VERIFIER_CLASSES) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&verifier.lock);
+
+    verifier.backend = *backend;
+    verifier.eval = *eval;
+
+    if (config) {
+        verifier.config = *config;
+    } else {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        verifier.config.workers = cpus > 0 ? (uint32_t)cpus : 1;
+        verifier.config.shards = VERIFIER_DEFAULT_SHARDS;
+        verifier.config.batch_size = VERIFIER_DEFAULT_BATCH;
+    }
+
+    if (verifier.config.workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        verifier.config.workers = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (verifier.config.shards < VERIFIER_MIN_SHARDS) {
+        verifier.config.shards = VERIFIER_MIN_SHARDS;
+    }
+    if (verifier.config.batch_size == 0) {
+        verifier.config.batch_size = VERIFIER_DEFAULT_BATCH;
+    }
+
+    verifier.initialized = 1;
+
+    pthread_mutex_unlock(&verifier.lock);
+
+    printf("[CDT] Model verifier ready: %u held-out samples in %u shards, %u workers\n",
+           eval->sample_count, verifier.config.shards, verifier.config.workers);
+
+    return 1;
+}
+
+int model_verifier_ready(void) {
+    return verifier.initialized;
+}
+
+/* Load submitted models through the backend and verify them together;
+ * verified[i] says whether results[i] was filled. Returns how many were. */
+uint32_t model_verifier_verify_batch(const char **model_ids, const char **node_ids,
+                                     uint32_t count, ai_verification_t *results,
+                                     uint8_t *verified) {
+    memset(verified, 0, count);
+    pthread_mutex_lock(&verifier.lock);
+
+    if (!verifier.initialized || count == 0) {
+        pthread_mutex_unlock(&verifier.lock);
+        return 0;
+    }
+
+    verifier_backend_t backend = verifier.backend;
+    eval_dataset_t eval = verifier.eval;
+    verifier_config_t config = verifier.config;
+
+    pthread_mutex_unlock(&verifier.lock);
+
+    const void **models = calloc(count, sizeof(*models));
+    if (!models) {
+        return 0;
+    }
+
+    uint32_t loaded = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        models[i] = backend.load(model_ids[i], node_ids[i], backend.ctx);
+        if (!models[i]) {
+            printf("[CDT] Verifier could not load %s from node %s\n", model_ids[i], node_ids[i]);
+            continue;
+        }
+        loaded++;
+    }
+
+    uint32_t done = loaded ?
+        verify_models(models, count, backend.infer, backend.ctx, &eval, &config,
+                      results, verified) : 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (models[i] && backend.release) {
+            backend.release(models[i], backend.ctx);
+        }
+        /* Wake anyone waiting on this proof's confirmations */
+        if (verified[i]) {
+            qxc_verification_complete(&results[i]);
+        }
+    }
+    free(models);
+
+    return done;
+}
+
+/* Load a submitted model through the backend and verify it */
+int model_verifier_verify(const char *model_id, const char *node_id,
+                          ai_verification_t *result) {
+    uint8_t verified;
+
+    return model_verifier_verify_batch(&model_id, &node_id, 1, result, &verified) == 1;
+}
+
+#ifdef MODEL_VERIFIER_TEST
+/* Userspace test: cc -O2 -DMODEL_VERIFIER_TEST model_verifier.c -lpthread */
+#include "../test_check.h"
+
+#define TEST_SAMPLES 1000
+#define TEST_CLASSES 4
+
+/* Stands in for qenex_coin's consensus wakeup */
+static uint32_t completions;
+static const ai_verification_t *completed;
+
+void qxc_verification_complete(ai_verification_t *v) {
+    completions++;
+    completed = v;
+}
+
+/* Sample i: features {i, label}. A test model misses samples by index. */
+typedef struct {
+    uint32_t miss_every;           // Wrong on every n-th sample
+    int perfect_shard;             // Never wrong on samples i % 4 == this, -1 for none
+} test_model_t;
+
+static uint32_t inferred[TEST_SAMPLES];
+
+static void test_infer(const void *model, const float *inputs, uint32_t batch,
+                       uint32_t feature_dim, uint32_t *predictions, void *ctx) {
+    const test_model_t *m = model;
+    (void)ctx;
+
+    for (uint32_t r = 0; r < batch; r++) {
+        uint32_t i = (uint32_t)inputs[(size_t)r * feature_dim];
+        uint32_t label = (uint32_t)inputs[(size_t)r * feature_dim + 1];
+        int wrong = i % m->miss_every == 0 && (int)(i % 4) != m->perfect_shard;
+
+        __atomic_fetch_add(&inferred[i], 1, __ATOMIC_RELAXED);
+        predictions[r] = wrong ? (label + 1) % TEST_CLASSES : label;
+    }
+}
+
+static float features[TEST_SAMPLES * 2];
+static uint32_t labels[TEST_SAMPLES];
+
+static const eval_dataset_t eval = {
+    .features = features,
+    .labels = labels,
+    .sample_count = TEST_SAMPLES,
+    .feature_dim = 2,
+    .num_classes = TEST_CLASSES
+};
+
+static int run(const test_model_t *model, const verifier_config_t *config, double baseline,
+               ai_verification_t *result) {
+    memset(result, 0, sizeof(*result));
+    memset(inferred, 0, sizeof(inferred));
+    result->baseline_accuracy = baseline;
+    return verify_model(model, test_infer, NULL, &eval, config, result);
+}
+
+/* Each sample is inferred once, however many workers run */
+static void test_single_inference(void) {
+    test_model_t model = { .miss_every = 9, .perfect_shard = -1 };
+    ai_verification_t result;
+    uint32_t worker_counts[] = { 1, 3, 7, 0 };
+
+    for (uint32_t k = 0; k < 4; k++) {
+        verifier_config_t config = { .workers = worker_counts[k], .shards = 4, .batch_size = 64 };
+        CHECK(run(&model, &config, 0.8, &result), "%u workers: verification failed",
+              worker_counts[k]);
+
+        uint32_t wrong = 0;
+        for (uint32_t i = 0; i < TEST_SAMPLES; i++) {
+            if (inferred[i] != 1) wrong++;
+        }
+        CHECK(wrong == 0, "%u workers: %u samples not inferred exactly once",
+              worker_counts[k], wrong);
+        CHECK(result.improved_accuracy > 0.88 && result.improved_accuracy < 0.89,
+              "%u workers: accuracy %f", worker_counts[k], result.improved_accuracy);
+    }
+}
+
+/* An improvement seen on every shard is confirmed by every shard */
+static void test_consistent_improvement(void) {
+    test_model_t model = { .miss_every = 9, .perfect_shard = -1 };
+    verifier_config_t config = { .workers = 3, .shards = 4, .batch_size = 64 };
+    ai_verification_t result;
+
+    run(&model, &config, 0.8, &result);
+    CHECK(result.consensus.verifying_nodes == 4 && result.consensus.confirmations == 4 &&
+          result.consensus.consensus_score == 1.0,
+          "%u/%u shards confirmed", result.consensus.confirmations,
+          result.consensus.verifying_nodes);
+
+    /* Not enough of a gain anywhere: nothing confirms */
+    run(&model, &config, 0.885, &result);
+    CHECK(result.consensus.confirmations == 0 && result.consensus.consensus_score == 0.0,
+          "%u shards confirmed a sub-1%% gain", result.consensus.confirmations);
+}
+
+/* A gain that comes from one slice of the held-out set isn't confirmed */
+static void test_one_lucky_shard(void) {
+    test_model_t model = { .miss_every = 5, .perfect_shard = 0 };
+    verifier_config_t config = { .workers = 3, .shards = 4, .batch_size = 64 };
+    ai_verification_t result;
+
+    run(&model, &config, 0.8, &result);
+    CHECK(result.improved_accuracy >= 0.84, "overall accuracy %f", result.improved_accuracy);
+    CHECK(result.consensus.confirmations == 1 && result.consensus.consensus_score == 0.25,
+          "%u/%u shards confirmed", result.consensus.confirmations,
+          result.consensus.verifying_nodes);
+}
+
+/* Fewer shards than verify_ai_improvement's 3 confirmations are never used */
+static void test_shard_floor(void) {
+    test_model_t model = { .miss_every = 7, .perfect_shard = -1 };
+    verifier_config_t config = { .workers = 2, .shards = 1, .batch_size = 64 };
+    ai_verification_t result;
+
+    run(&model, &config, 0.8, &result);
+    CHECK(result.consensus.verifying_nodes == VERIFIER_MIN_SHARDS &&
+          result.consensus.confirmations == VERIFIER_MIN_SHARDS,
+          "%u/%u shards confirmed", result.consensus.confirmations,
+          result.consensus.verifying_nodes);
+
+    config.shards = TEST_SAMPLES + 1;
+    CHECK(!run(&model, &config, 0.8, &result), "more shards than samples accepted");
+}
+
+static test_model_t backend_model = { .miss_every = 9, .perfect_shard = -1 };
+static test_model_t weaker_model = { .miss_every = 5, .perfect_shard = -1 };
+
+static const void* test_load(const char *model_id, const char *node_id, void *ctx) {
+    (void)node_id;
+    (void)ctx;
+    if (strcmp(model_id, "weaker") == 0) return &weaker_model;
+    return strcmp(model_id, "known") == 0 ? &backend_model : NULL;
+}
+
+/* A finished verification wakes the consensus wait; nothing else does */
+static void test_signals_completion(void) {
+    verifier_backend_t backend = { .load = test_load, .infer = test_infer };
+    verifier_config_t config = { .workers = 2, .shards = 4, .batch_size = 64 };
+    ai_verification_t result;
+
+    memset(&result, 0, sizeof(result));
+    CHECK(!model_verifier_verify("known", "node", &result), "verified before init");
+    CHECK(completions == 0, "signalled without a verifier");
+
+    CHECK(model_verifier_init(&backend, &eval, &config), "init failed");
+
+    CHECK(!model_verifier_verify("unknown", "node", &result), "verified a model that didn't load");
+    CHECK(completions == 0, "signalled for a model that didn't load");
+
+    result.baseline_accuracy = 0.8;
+    CHECK(model_verifier_verify("known", "node", &result), "verification failed");
+    CHECK(completions == 1 && completed == &result, "%u completions, wrong proof %d",
+          completions, completed != &result);
+    CHECK(result.consensus.confirmations == 4, "%u shards confirmed",
+          result.consensus.confirmations);
+}
+
+/* Models submitted together each get their own result from one pass of the workers */
+static void test_batch(void) {
+    const char *models[3] = { "known", "unknown", "weaker" };
+    const char *nodes[3] = { "a", "b", "c" };
+    ai_verification_t results[3];
+    uint8_t verified[3];
+
+    memset(results, 0, sizeof(results));
+    memset(inferred, 0, sizeof(inferred));
+    for (uint32_t i = 0; i < 3; i++) {
+        results[i].baseline_accuracy = 0.8;
+    }
+    completions = 0;
+
+    CHECK(model_verifier_verify_batch(models, nodes, 3, results, verified) == 2,
+          "batch verified %u %u %u", verified[0], verified[1], verified[2]);
+    CHECK(verified[0] && !verified[1] && verified[2], "verified %u %u %u",
+          verified[0], verified[1], verified[2]);
+    CHECK(completions == 2, "%u completions for 2 verified models", completions);
+
+    uint32_t wrong = 0;
+    for (uint32_t i = 0; i < TEST_SAMPLES; i++) {
+        if (inferred[i] != 2) wrong++;
+    }
+    CHECK(wrong == 0, "%u samples not inferred once per loaded model", wrong);
+
+    CHECK(results[0].improved_accuracy > 0.88 && results[0].improved_accuracy < 0.89 &&
+          results[0].consensus.confirmations == 4, "known: acc %f, %u shards",
+          results[0].improved_accuracy, results[0].consensus.confirmations);
+    CHECK(results[2].improved_accuracy > 0.79 && results[2].improved_accuracy < 0.81 &&
+          results[2].consensus.confirmations == 0, "weaker: acc %f, %u shards",
+          results[2].improved_accuracy, results[2].consensus.confirmations);
+    CHECK(results[1].metrics.verification_time == 0, "unloaded model stamped as verified");
+}
+
+int main(void) {
+    for (uint32_t i = 0; i < TEST_SAMPLES; i++) {
+        labels[i] = (i / 7) % TEST_CLASSES;
+        features[i * 2] = (float)i;
+        features[i * 2 + 1] = (float)labels[i];
+    }
+
+    test_single_inference();
+    test_consistent_improvement();
+    test_one_lucky_shard();
+    test_shard_floor();
+    test_signals_completion();
+    test_batch();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,73 @@
+#ifndef QENEX_MODEL_VERIFIER_H
+#define QENEX_MODEL_VERIFIER_H
+
+#include <stdint.h>
+#include "../cryptocurrency/qenex_coin.h"
+
+/*
+ * Parallel model verification.
+ *
+ * A submitted model is evaluated on a held-out set cut into batches, which
+ * are spread across verifier workers; each sample is inferred once. The
+ * predictions give one confusion matrix, and from it precision, recall
+ * and F1.
+ *
+ * Confirmations come from `shards` disjoint slices of the held-out set.
+ * Each slice is independent evidence. A shard confirms the improvement
+ * when the model's accuracy on it beats result->baseline_accuracy by the
+ * 1% that verify_ai_improvement requires. consensus_score is the fraction
+ * of shards that confirm.
+ *
+ * Models submitted together are verified together: the batches of all
+ * of them are striped across the same workers, so a tick's proofs are
+ * evaluated in parallel without a thread pool per proof.
+ *
+ * The verifier does not know how to run a model. The backend supplies a
+ * loader for submitted models and a batched inference function.
+ */
+
+#define MAX_VERIFIER_WORKERS 64
+#define MAX_VERIFIER_CLASSES 256
+
+/* Batched inference: write one predicted class per input row */
+typedef void (*model_infer_fn)(const void *model, const float *inputs, uint32_t batch,
+                               uint32_t feature_dim, uint32_t *predictions, void *ctx);
+
+typedef struct verifier_backend {
+    const void* (*load)(const char *model_id, const char *node_id, void *ctx);
+    void (*release)(const void *model, void *ctx);
+    model_infer_fn infer;
+    void *ctx;
+} verifier_backend_t;
+
+typedef struct eval_dataset {
+    const float *features;         // sample_count x feature_dim, row-major
+    const uint32_t *labels;
+    uint32_t sample_count;
+    uint32_t feature_dim;
+    uint32_t num_classes;
+} eval_dataset_t;
+
+typedef struct verifier_config {
+    uint32_t workers;              // Verifier workers; 0 = one per online CPU
+    uint32_t shards;               // Disjoint held-out slices, one confirmation each
+    uint32_t batch_size;           // Samples per inference call
+} verifier_config_t;
+
+/* Function prototypes */
+int model_verifier_init(const verifier_backend_t *backend, const eval_dataset_t *eval,
+                        const verifier_config_t *config);
+int model_verifier_ready(void);
+int model_verifier_verify(const char *model_id, const char *node_id,
+                          ai_verification_t *result);
+uint32_t model_verifier_verify_batch(const char **model_ids, const char **node_ids,
+                                     uint32_t count, ai_verification_t *results,
+                                     uint8_t *verified);
+uint32_t verify_models(const void **models, uint32_t count, model_infer_fn infer, void *ctx,
+                       const eval_dataset_t *eval, const verifier_config_t *config,
+                       ai_verification_t *results, uint8_t *verified);
+int verify_model(const void *model, model_infer_fn infer, void *ctx,
+                 const eval_dataset_t *eval, const verifier_config_t *config,
+                 ai_verification_t *result);
+
+#endif /* QENEX_MODEL_VERIFIER_H */
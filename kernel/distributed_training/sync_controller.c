@@ -0,0 +1,427 @@
+#include "sync_controller.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define SYNC_INITIAL_INTERVAL 60   // Matches the old fixed MODEL_SYNC_INTERVAL
+#define SYNC_EWMA_ALPHA 0.5
+
+typedef struct {
+    uint8_t used;
+    sync_decision_t decision;
+
+    /* Observations gathered since the last interval update */
+    double loss_sum;
+    double norm_sum;
+    uint32_t samples;
+    uint32_t norm_samples;
+    uint8_t has_loss;              // Some node has reported loss on this model
+    uint8_t has_norm;              // An applied update has been measured
+
+    double last_loss;
+    time_t last_update;
+} sync_model_t;
+
+static struct {
+    sync_config_t config;
+    sync_model_t models[MAX_SYNC_MODELS];
+    pthread_mutex_t lock;
+} sync_ctl = {
+    .config = {
+        .min_interval = 10,
+        .max_interval = 600,
+        .fast_slope = 1e-3,
+        .flat_slope = 1e-5,
+        .min_update_norm = 1e-3,
+        .max_bandwidth_share = 0.2
+    },
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static sync_model_t* find_model(const char *model_id, int create) {
+    sync_model_t *free_slot = NULL;
+
+    for (uint32_t i = 0; i < MAX_SYNC_MODELS; i++) {
+        sync_model_t *m = &sync_ctl.models[i];
+        if (m->used && strcmp(m->decision.model_id, model_id) == 0) {
+            return m;
+        }
+        if (!m->used && !free_slot) {
+            free_slot = m;
+        }
+    }
+
+    if (!create || !free_slot) {
+        return NULL;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    strncpy(free_slot->decision.model_id, model_id, 64);
+
+    uint32_t interval = SYNC_INITIAL_INTERVAL;
+    if (interval < sync_ctl.config.min_interval) interval = sync_ctl.config.min_interval;
+    if (interval > sync_ctl.config.max_interval) interval = sync_ctl.config.max_interval;
+    free_slot->decision.interval = interval;
+
+    return free_slot;
+}
+
+static const char* reason_name(uint32_t bit) {
+    switch (bit) {
+        case SYNC_REASON_FAST_LOSS:   return "fast-loss";
+        case SYNC_REASON_FLAT_LOSS:   return "flat-loss";
+        case SYNC_REASON_SMALL_DELTA: return "small-delta";
+        case SYNC_REASON_BANDWIDTH:   return "bandwidth";
+        case SYNC_REASON_MIN_BOUND:   return "min-bound";
+        case SYNC_REASON_MAX_BOUND:   return "max-bound";
+    }
+    return "none";
+}
+
+/* Recompute one model's interval from its latest observations */
+static void update_interval(sync_model_t *m, time_t now) {
+    sync_config_t *cfg = &sync_ctl.config;
+    sync_decision_t *d = &m->decision;
+
+    double dt = m->last_update ? (double)(now - m->last_update) : 0.0;
+
+    /* Relative loss decrease per second, smoothed. Models synced only by
+     * FedAvg rounds report update norms but no loss. */
+    if (m->samples > 0) {
+        double loss = m->loss_sum / m->samples;
+        if (m->last_loss > 0.0 && dt > 0.0) {
+            double slope = (m->last_loss - loss) / m->last_loss / dt;
+            d->loss_slope = SYNC_EWMA_ALPHA * slope + (1.0 - SYNC_EWMA_ALPHA) * d->loss_slope;
+        }
+        m->last_loss = loss;
+        m->has_loss = 1;
+    }
+    if (m->norm_samples > 0) {
+        double norm = m->norm_sum / m->norm_samples;
+        d->update_norm = m->has_norm ?
+            SYNC_EWMA_ALPHA * norm + (1.0 - SYNC_EWMA_ALPHA) * d->update_norm : norm;
+        m->has_norm = 1;
+    }
+
+    uint32_t reasons = SYNC_REASON_NONE;
+    double interval = d->interval;
+
+    if (!m->has_loss) {
+        /* No loss curve to judge */
+    } else if (d->loss_slope >= cfg->fast_slope) {
+        interval *= 0.5;
+        reasons |= SYNC_REASON_FAST_LOSS;
+    } else if (d->loss_slope <= cfg->flat_slope) {
+        interval *= 2.0;
+        reasons |= SYNC_REASON_FLAT_LOSS;
+    }
+
+    /* Only models whose updates are measured can be judged too small */
+    if (m->has_norm && d->update_norm < cfg->min_update_norm &&
+        !(reasons & SYNC_REASON_FAST_LOSS)) {
+        interval *= 1.5;
+        reasons |= SYNC_REASON_SMALL_DELTA;
+    }
+
+    /* Never spend more than the bandwidth share on this model's syncs */
+    if (d->throughput_bps > 0.0 && d->model_bytes > 0 && cfg->max_bandwidth_share > 0.0) {
+        double floor = (d->model_bytes / d->throughput_bps) / cfg->max_bandwidth_share;
+        if (interval < floor) {
+            interval = floor;
+            reasons |= SYNC_REASON_BANDWIDTH;
+        }
+    }
+
+    if (interval <= cfg->min_interval) {
+        interval = cfg->min_interval;
+        reasons |= SYNC_REASON_MIN_BOUND;
+    }
+    if (interval >= cfg->max_interval) {
+        interval = cfg->max_interval;
+        reasons |= SYNC_REASON_MAX_BOUND;
+    }
+
+    d->interval = (uint32_t)interval;
+    d->reasons = reasons;
+    d->next_sync = now + d->interval;
+    d->syncs++;
+
+    m->last_update = now;
+    m->loss_sum = 0.0;
+    m->norm_sum = 0.0;
+    m->samples = 0;
+    m->norm_samples = 0;
+}
+
+/* Initialize controller with interval bounds and thresholds */
+void sync_controller_init(const sync_config_t *config) {
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    if (config) {
+        sync_ctl.config = *config;
+    }
+    if (sync_ctl.config.max_interval < sync_ctl.config.min_interval) {
+        sync_ctl.config.max_interval = sync_ctl.config.min_interval;
+    }
+    memset(sync_ctl.models, 0, sizeof(sync_ctl.models));
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+
+    printf("[CDT] Adaptive model sync: %u-%u s per model\n",
+           sync_ctl.config.min_interval, sync_ctl.config.max_interval);
+}
+
+/* Size of one sync transfer for a model */
+void sync_controller_set_model_size(const char *model_id, uint64_t bytes) {
+    pthread_mutex_lock(&sync_ctl.lock);
+    sync_model_t *m = find_model(model_id, 1);
+    if (m) m->decision.model_bytes = bytes;
+    pthread_mutex_unlock(&sync_ctl.lock);
+}
+
+/* Check whether a model should be synced at this tick */
+int sync_controller_due(const char *model_id, time_t now) {
+    pthread_mutex_lock(&sync_ctl.lock);
+    sync_model_t *m = find_model(model_id, 1);
+    int due = !m || now >= m->decision.next_sync;
+    pthread_mutex_unlock(&sync_ctl.lock);
+
+    return due;
+}
+
+/* Record one node's progress on a model; interval is updated once per sync */
+void sync_controller_observe(const char *model_id, double loss) {
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    sync_model_t *m = find_model(model_id, 1);
+    if (m) {
+        m->loss_sum += loss;
+        m->samples++;
+    }
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+}
+
+/* Record the norm of an update applied to a model, relative to the model */
+void sync_controller_observe_update(const char *model_id, double update_norm) {
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    sync_model_t *m = find_model(model_id, 1);
+    if (m) {
+        m->norm_sum += update_norm;
+        m->norm_samples++;
+    }
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+}
+
+/* Measured transfer for a model, used as the link throughput estimate */
+void sync_controller_record_transfer(const char *model_id, uint64_t bytes, double seconds) {
+    if (seconds <= 0.0 || bytes == 0) return;
+
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    sync_model_t *m = find_model(model_id, 1);
+    if (m) {
+        double bps = bytes / seconds;
+        m->decision.throughput_bps = m->decision.throughput_bps > 0.0 ?
+            SYNC_EWMA_ALPHA * bps + (1.0 - SYNC_EWMA_ALPHA) * m->decision.throughput_bps : bps;
+    }
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+}
+
+/* Apply observations gathered this tick; returns earliest next sync time */
+time_t sync_controller_commit(time_t now) {
+    time_t next = now + sync_ctl.config.max_interval;
+
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    for (uint32_t i = 0; i < MAX_SYNC_MODELS; i++) {
+        sync_model_t *m = &sync_ctl.models[i];
+        if (!m->used) continue;
+
+        if (m->samples > 0 || m->norm_samples > 0) {
+            update_interval(m, now);
+        }
+        if (m->decision.next_sync < next) {
+            next = m->decision.next_sync;
+        }
+    }
+
+    if (next < now + sync_ctl.config.min_interval) {
+        next = now + sync_ctl.config.min_interval;
+    }
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+
+    return next;
+}
+
+/* Current decision for a model */
+int sync_controller_get(const char *model_id, sync_decision_t *decision) {
+    pthread_mutex_lock(&sync_ctl.lock);
+    sync_model_t *m = find_model(model_id, 0);
+    if (m) *decision = m->decision;
+    pthread_mutex_unlock(&sync_ctl.lock);
+
+    return m != NULL;
+}
+
+/* Text export of every model's chosen interval and the reasons behind it */
+size_t sync_controller_export(char *out, size_t out_size) {
+    size_t used = 0;
+
+    if (out_size == 0) return 0;
+    out[0] = '\0';
+
+    pthread_mutex_lock(&sync_ctl.lock);
+
+    for (uint32_t i = 0; i < MAX_SYNC_MODELS && used < out_size; i++) {
+        sync_model_t *m = &sync_ctl.models[i];
+        if (!m->used) continue;
+
+        sync_decision_t *d = &m->decision;
+        int n = snprintf(out + used, out_size - used, "%s interval=%us slope=%.2e",
+                         d->model_id, d->interval, d->loss_slope);
+        if (n < 0) break;
+        used += n;
+
+        /* Norm and throughput are measured only on FedAvg transfers; models
+         * synced by loss alone never had them, so they are left out */
+        if (m->has_norm && used < out_size) {
+            n = snprintf(out + used, out_size - used, " norm=%.2e", d->update_norm);
+            if (n > 0) used += n;
+        }
+        if (d->throughput_bps > 0.0 && used < out_size) {
+            n = snprintf(out + used, out_size - used, " bw=%.0fB/s", d->throughput_bps);
+            if (n > 0) used += n;
+        }
+        if (used < out_size) {
+            n = snprintf(out + used, out_size - used, " reasons=");
+            if (n < 0) break;
+            used += n;
+        }
+
+        int first = 1;
+        for (uint32_t bit = 1; bit <= SYNC_REASON_MAX_BOUND && used < out_size; bit <<= 1) {
+            if (!(d->reasons & bit)) continue;
+            n = snprintf(out + used, out_size - used, "%s%s", first ? "" : ",", reason_name(bit));
+            if (n < 0) break;
+            used += n;
+            first = 0;
+        }
+        if (used < out_size) {
+            n = snprintf(out + used, out_size - used, "%s\n", first ? "none" : "");
+            if (n > 0) used += n;
+        }
+    }
+
+    pthread_mutex_unlock(&sync_ctl.lock);
+
+    return used < out_size ? used : out_size - 1;
+}
+
+#ifdef SYNC_CONTROLLER_TEST
+/* Userspace test: cc -O2 -DSYNC_CONTROLLER_TEST sync_controller.c -lpthread */
+#include "../test_check.h"
+
+/* A model synced only through FedAvg: norms and throughput set its interval */
+static void test_fedavg_entry(void) {
+    sync_decision_t d;
+    time_t now = 1000000;
+
+    sync_controller_set_model_size("fedavg", 4 * 1024 * 1024);
+    CHECK(sync_controller_due("fedavg", now), "new model not due");
+
+    /* Small updates back off; with no loss reported it isn't judged flat */
+    sync_controller_observe_update("fedavg", 1e-5);
+    sync_controller_commit(now);
+    sync_controller_get("fedavg", &d);
+    CHECK(d.interval == 90 && d.reasons == SYNC_REASON_SMALL_DELTA,
+          "small update gave %us reasons %x", d.interval, d.reasons);
+    CHECK(!sync_controller_due("fedavg", now + 89) && sync_controller_due("fedavg", now + 90),
+          "due time not from the interval");
+
+    /* Large updates hold the interval */
+    now += 90;
+    sync_controller_observe_update("fedavg", 1.0);
+    sync_controller_commit(now);
+    sync_controller_get("fedavg", &d);
+    CHECK(d.interval == 90 && d.reasons == SYNC_REASON_NONE,
+          "large update gave %us reasons %x", d.interval, d.reasons);
+
+    /* A slow link holds the interval above the bandwidth floor */
+    now += 90;
+    sync_controller_record_transfer("fedavg", 4 * 1024 * 1024, 40.0);
+    sync_controller_observe_update("fedavg", 1.0);
+    sync_controller_commit(now);
+    sync_controller_get("fedavg", &d);
+    CHECK(d.interval == 200 && d.reasons == SYNC_REASON_BANDWIDTH,
+          "slow link gave %us reasons %x", d.interval, d.reasons);
+
+    /* No new observation: the interval is left alone */
+    sync_controller_commit(now + 200);
+    sync_controller_get("fedavg", &d);
+    CHECK(d.syncs == 3, "interval updated without observations");
+}
+
+/* Loss-driven models: fast loss syncs sooner, a flat curve backs off */
+static void test_loss_entry(void) {
+    sync_decision_t d;
+    time_t now = 2000000;
+
+    sync_controller_observe("bert", 2.0);
+    sync_controller_commit(now);
+    sync_controller_get("bert", &d);
+    uint32_t first = d.interval;
+
+    now += first;
+    sync_controller_observe("bert", 1.0);
+    sync_controller_observe("bert", 1.0);
+    sync_controller_commit(now);
+    sync_controller_get("bert", &d);
+    CHECK(d.interval == first / 2 && (d.reasons & SYNC_REASON_FAST_LOSS),
+          "falling loss gave %us reasons %x", d.interval, d.reasons);
+
+    /* The smoothed slope decays until the curve counts as flat */
+    for (int i = 0; i < 20 && !(d.reasons & SYNC_REASON_FLAT_LOSS); i++) {
+        now += d.interval;
+        sync_controller_observe("bert", 1.0);
+        sync_controller_commit(now);
+        sync_controller_get("bert", &d);
+    }
+    CHECK(d.reasons & SYNC_REASON_FLAT_LOSS, "flat loss gave reasons %x", d.reasons);
+    CHECK(!(d.reasons & SYNC_REASON_SMALL_DELTA), "unmeasured updates judged small");
+}
+
+/* Loss-only models export no norm or throughput; FedAvg models do */
+static void test_export(void) {
+    char out[1024];
+    sync_controller_export(out, sizeof(out));
+
+    char *bert = strstr(out, "bert ");
+    char *fedavg = strstr(out, "fedavg ");
+    CHECK(bert && fedavg, "export missing a model: %s", out);
+    if (!bert || !fedavg) return;
+
+    *strchr(bert, '\n') = '\0';
+    *strchr(fedavg, '\n') = '\0';
+    CHECK(!strstr(bert, "norm=") && !strstr(bert, "bw=") && strstr(bert, "reasons="),
+          "loss-only export: %s", bert);
+    CHECK(strstr(fedavg, "norm=") && strstr(fedavg, "bw=") && strstr(fedavg, "reasons="),
+          "fedavg export: %s", fedavg);
+}
+
+int main(void) {
+    sync_controller_init(NULL);
+
+    test_fedavg_entry();
+    test_loss_entry();
+    test_export();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
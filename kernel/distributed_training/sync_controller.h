@@ -0,0 +1,66 @@
+#ifndef QENEX_SYNC_CONTROLLER_H
+#define QENEX_SYNC_CONTROLLER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Per-model sync interval controller.
+ *
+ * Replaces the fixed MODEL_SYNC_INTERVAL: each model's interval shrinks
+ * while the loss is still falling quickly and grows once updates become
+ * small, and never drops below what the measured link throughput can
+ * carry within the configured bandwidth share.
+ *
+ * Loss comes from every training node. Update norms and link throughput
+ * are measured only on FedAvg rounds, the one path that moves model bytes,
+ * so the small-delta and bandwidth rules apply to the FedAvg model alone.
+ */
+
+#define MAX_SYNC_MODELS 100
+
+/* Why the last interval was chosen */
+typedef enum {
+    SYNC_REASON_NONE        = 0,
+    SYNC_REASON_FAST_LOSS   = 1 << 0,  // Loss falling quickly, sync sooner
+    SYNC_REASON_FLAT_LOSS   = 1 << 1,  // Loss curve flat, back off
+    SYNC_REASON_SMALL_DELTA = 1 << 2,  // Update norm too small to be worth sending
+    SYNC_REASON_BANDWIDTH   = 1 << 3,  // Held back by link throughput
+    SYNC_REASON_MIN_BOUND   = 1 << 4,
+    SYNC_REASON_MAX_BOUND   = 1 << 5
+} sync_reason_t;
+
+typedef struct sync_config {
+    uint32_t min_interval;         // Seconds
+    uint32_t max_interval;         // Seconds
+    double fast_slope;             // Relative loss drop per second considered fast
+    double flat_slope;             // Relative loss drop per second considered flat
+    double min_update_norm;        // Relative update norm worth syncing
+    double max_bandwidth_share;    // Fraction of link time sync may use
+} sync_config_t;
+
+typedef struct sync_decision {
+    char model_id[65];
+    uint32_t interval;
+    uint32_t reasons;              // sync_reason_t bits
+    time_t next_sync;
+    double loss_slope;
+    double update_norm;
+    double throughput_bps;         // Measured bytes per second
+    uint64_t model_bytes;
+    uint64_t syncs;
+} sync_decision_t;
+
+/* Function prototypes */
+void sync_controller_init(const sync_config_t *config);
+void sync_controller_set_model_size(const char *model_id, uint64_t bytes);
+int sync_controller_due(const char *model_id, time_t now);
+void sync_controller_observe(const char *model_id, double loss);
+void sync_controller_observe_update(const char *model_id, double update_norm);
+void sync_controller_record_transfer(const char *model_id, uint64_t bytes, double seconds);
+time_t sync_controller_commit(time_t now);
+int sync_controller_get(const char *model_id, sync_decision_t *decision);
+size_t sync_controller_export(char *out, size_t out_size);
+
+#endif /* QENEX_SYNC_CONTROLLER_H */
@@ -0,0 +1,749 @@
+#include "task_migration.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define MIGRATION_MAX_CHUNKS (1 << 20)
+
+typedef struct {
+    uint8_t digest[MODEL_DIGEST_SIZE];
+    uint32_t size;
+} __attribute__((packed)) chunk_ref_t;
+
+/* Buffered reader so bytes already received with the header aren't lost */
+typedef struct {
+    int fd;
+    const char *pending;
+    uint32_t pending_len;
+} conn_reader_t;
+
+static struct {
+    task_migration_t migrations[MAX_TASK_MIGRATIONS];
+    uint32_t next_id;
+    migration_stats_t stats;
+    pthread_mutex_t lock;
+} migration_table = {
+    .next_id = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static int read_exact(conn_reader_t *r, void *out, uint32_t len) {
+    uint8_t *dst = out;
+
+    if (r->pending_len > 0) {
+        uint32_t n = len < r->pending_len ? len : r->pending_len;
+        memcpy(dst, r->pending, n);
+        r->pending += n;
+        r->pending_len -= n;
+        dst += n;
+        len -= n;
+    }
+
+    while (len > 0) {
+        int got = recv(r->fd, dst, len, 0);
+        if (got <= 0) return 0;
+        dst += got;
+        len -= got;
+    }
+
+    return 1;
+}
+
+static int send_all(int fd, const void *data, uint32_t len) {
+    const uint8_t *src = data;
+
+    while (len > 0) {
+        int sent = send(fd, src, len, MSG_NOSIGNAL);
+        if (sent <= 0) return 0;
+        src += sent;
+        len -= sent;
+    }
+
+    return 1;
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static task_migration_t* find_migration(uint32_t migration_id) {
+    for (uint32_t i = 0; i < MAX_TASK_MIGRATIONS; i++) {
+        task_migration_t *m = &migration_table.migrations[i];
+        if (m->migration_id == migration_id &&
+            m->state != MIGRATION_IDLE && m->state != MIGRATION_DONE &&
+            m->state != MIGRATION_ABORTED) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+static void release_migration(task_migration_t *m, migration_state_t final_state) {
+    model_store_release(m->checkpoint);
+    m->checkpoint = NULL;
+    m->state = final_state;
+
+    if (final_state == MIGRATION_ABORTED) {
+        migration_table.stats.aborted++;
+    }
+}
+
+/* Free a manifest that never took chunk references */
+static void free_manifest(model_manifest_t *manifest) {
+    if (!manifest) return;
+    free(manifest->chunks);
+    free(manifest->chunk_sizes);
+    free(manifest);
+}
+
+static model_manifest_t* alloc_manifest(const char *model_id, uint32_t chunk_count) {
+    model_manifest_t *manifest = calloc(1, sizeof(model_manifest_t));
+    if (!manifest) return NULL;
+
+    manifest->chunks = malloc((size_t)chunk_count * MODEL_DIGEST_SIZE + 1);
+    manifest->chunk_sizes = malloc((size_t)chunk_count * sizeof(uint32_t) + 1);
+
+    if (!manifest->chunks || !manifest->chunk_sizes) {
+        free(manifest->chunks);
+        free(manifest->chunk_sizes);
+        free(manifest);
+        return NULL;
+    }
+
+    strncpy(manifest->model_id, model_id, sizeof(manifest->model_id) - 1);
+    manifest->chunk_count = chunk_count;
+    return manifest;
+}
+
+/* Start migrating a node's task; returns migration id or 0 */
+uint32_t task_migration_begin(const char *source_id, const char *dest_id, const char *model_id) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    task_migration_t *slot = NULL;
+    for (uint32_t i = 0; i < MAX_TASK_MIGRATIONS; i++) {
+        task_migration_t *m = &migration_table.migrations[i];
+        /* An abandoned migration holds its slot until its source hears to resume */
+        int live = m->state == MIGRATION_PRECOPY || m->state == MIGRATION_FREEZE ||
+                   m->state == MIGRATION_CUTOVER || now <= m->resume_deadline;
+
+        /* A node takes part in at most one migration at a time */
+        if (live && (strcmp(m->source_id, source_id) == 0 || strcmp(m->dest_id, source_id) == 0 ||
+                     strcmp(m->source_id, dest_id) == 0 || strcmp(m->dest_id, dest_id) == 0)) {
+            pthread_mutex_unlock(&migration_table.lock);
+            return 0;
+        }
+        if (!live && !slot) {
+            slot = m;
+        }
+    }
+
+    if (!slot) {
+        pthread_mutex_unlock(&migration_table.lock);
+        return 0;
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->migration_id = migration_table.next_id++;
+    slot->state = MIGRATION_PRECOPY;
+    strncpy(slot->source_id, source_id, 64);
+    strncpy(slot->dest_id, dest_id, 64);
+    strncpy(slot->model_id, model_id, 64);
+    slot->start_time = now;
+    migration_table.stats.started++;
+
+    uint32_t id = slot->migration_id;
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    printf("[CDT] Migration %u started: %s -> %s (%s)\n", id, source_id, dest_id, model_id);
+
+    return id;
+}
+
+/* Which side of a live migration a node is on */
+migration_role_t task_migration_role(const char *node_id, uint32_t *migration_id) {
+    migration_role_t role = MIGRATION_ROLE_NONE;
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    for (uint32_t i = 0; i < MAX_TASK_MIGRATIONS && role == MIGRATION_ROLE_NONE; i++) {
+        task_migration_t *m = &migration_table.migrations[i];
+        if (m->state != MIGRATION_PRECOPY && m->state != MIGRATION_FREEZE &&
+            m->state != MIGRATION_CUTOVER) {
+            continue;
+        }
+
+        if (strcmp(m->source_id, node_id) == 0 && m->state != MIGRATION_CUTOVER) {
+            role = MIGRATION_ROLE_SOURCE;
+            *migration_id = m->migration_id;
+        } else if (strcmp(m->dest_id, node_id) == 0) {
+            role = MIGRATION_ROLE_DEST;
+            *migration_id = m->migration_id;
+        }
+    }
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    return role;
+}
+
+int task_migration_node_busy(const char *node_id) {
+    uint32_t id;
+    return task_migration_role(node_id, &id) != MIGRATION_ROLE_NONE;
+}
+
+/* Receive one checkpoint round from the source */
+migration_state_t task_migration_handle_checkpoint(int fd, char *buffer, int bytes,
+                                                   uint32_t *migration_id) {
+    uint32_t id, final, epoch, chunk_count;
+    uint64_t samples;
+    double loss, accuracy;
+    char model_id[65];
+
+    char *body = memchr(buffer, '\n', bytes);
+    if (!body ||
+        sscanf(buffer, "MIGRATE_CKPT:%u:%u:%u:%lu:%lf:%lf:%u",
+               &id, &final, &epoch, &samples, &loss, &accuracy, &chunk_count) != 7 ||
+        chunk_count == 0 || chunk_count > MIGRATION_MAX_CHUNKS) {
+        return MIGRATION_ABORTED;
+    }
+    body++;
+
+    conn_reader_t reader = {
+        .fd = fd,
+        .pending = body,
+        .pending_len = bytes - (body - buffer)
+    };
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    task_migration_t *m = find_migration(id);
+    if (!m || m->state == MIGRATION_CUTOVER) {
+        pthread_mutex_unlock(&migration_table.lock);
+        send_all(fd, "MIGRATE_ABORT", 13);
+        return MIGRATION_ABORTED;
+    }
+    memcpy(model_id, m->model_id, sizeof(model_id));
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    *migration_id = id;
+
+    /* Transfer unlocked; the table is only touched again to install the result */
+    model_manifest_t *manifest = alloc_manifest(model_id, chunk_count);
+    uint32_t *missing = malloc((size_t)chunk_count * sizeof(uint32_t));
+    uint8_t *chunk = malloc(MODEL_CHUNK_MAX_SIZE);
+    int ok = manifest && missing && chunk;
+
+    /* Chunk list of this checkpoint */
+    for (uint32_t i = 0; i < chunk_count && ok; i++) {
+        chunk_ref_t ref;
+        ok = read_exact(&reader, &ref, sizeof(ref)) && ref.size <= MODEL_CHUNK_MAX_SIZE;
+        if (ok) {
+            memcpy(manifest->chunks[i], ref.digest, MODEL_DIGEST_SIZE);
+            manifest->chunk_sizes[i] = ref.size;
+            manifest->total_size += ref.size;
+        }
+    }
+
+    /* Ask only for chunks the store doesn't already hold; from here until
+     * adoption, GC must not free what model_store_missing() counted on */
+    model_store_transfer_begin();
+    uint32_t need = ok ? model_store_missing(manifest, missing, chunk_count) : 0;
+    if (ok) {
+        char header[64];
+        int len = snprintf(header, sizeof(header), "MIGRATE_NEED:%u\n", need);
+        ok = send_all(fd, header, len) &&
+             send_all(fd, missing, need * sizeof(uint32_t));
+    }
+
+    uint64_t delta_bytes = 0;
+    for (uint32_t i = 0; i < need && ok; i++) {
+        uint32_t size = manifest->chunk_sizes[missing[i]];
+        ok = read_exact(&reader, chunk, size) &&
+             model_store_put_chunk(manifest->chunks[missing[i]], chunk, size);
+        delta_bytes += size;
+    }
+    free(missing);
+    free(chunk);
+
+    /* Adopted chunks survive a model_store_gc() while the lock is retaken */
+    int adopted = ok && model_store_adopt(manifest);
+    model_store_transfer_end();
+    if (!adopted) {
+        free_manifest(manifest);
+    }
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    /* Expired or aborted while the checkpoint was in flight */
+    m = find_migration(id);
+    if (!m || m->state == MIGRATION_CUTOVER) {
+        pthread_mutex_unlock(&migration_table.lock);
+        if (adopted) model_store_release(manifest);
+        send_all(fd, "MIGRATE_ABORT", 13);
+        return MIGRATION_ABORTED;
+    }
+
+    if (!adopted) {
+        release_migration(m, MIGRATION_ABORTED);
+        pthread_mutex_unlock(&migration_table.lock);
+        printf("[CDT] Migration %u aborted: checkpoint transfer failed\n", id);
+        return MIGRATION_ABORTED;
+    }
+
+    /* New checkpoint replaces the previous round's references */
+    model_store_release(m->checkpoint);
+    m->checkpoint = manifest;
+    m->progress.current_epoch = epoch;
+    m->progress.samples_processed = samples;
+    m->progress.loss = loss;
+    m->progress.accuracy = accuracy;
+    m->rounds++;
+    m->last_round_bytes = delta_bytes;
+    m->total_bytes += delta_bytes;
+    migration_table.stats.bytes_transferred += delta_bytes;
+
+    const char *reply;
+    if (final) {
+        m->state = MIGRATION_CUTOVER;
+        m->cutover_deadline = time(NULL) + MIGRATION_CUTOVER_TIMEOUT;
+        clock_gettime(CLOCK_MONOTONIC, &m->cutover_time);
+        reply = "MIGRATE_DONE";
+    } else if (m->state == MIGRATION_FREEZE ||
+               (m->rounds > 1 && delta_bytes <= MIGRATION_FREEZE_BYTES) ||
+               m->rounds >= MIGRATION_MAX_ROUNDS) {
+        /* Remaining delta is small: stop training and send the last one */
+        if (m->state != MIGRATION_FREEZE) {
+            m->state = MIGRATION_FREEZE;
+            clock_gettime(CLOCK_MONOTONIC, &m->freeze_time);
+        }
+        reply = "MIGRATE_FREEZE";
+    } else {
+        reply = "MIGRATE_CONTINUE";
+    }
+
+    migration_state_t state = m->state;
+    uint32_t rounds = m->rounds;
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    send_all(fd, reply, strlen(reply));
+
+    printf("[CDT] Migration %u round %u: %lu bytes delta, %s\n",
+           id, rounds, delta_bytes, reply);
+
+    return state;
+}
+
+/* Copy a manifest and pin its chunks, so it can be served without the table lock */
+static model_manifest_t* pin_manifest(const model_manifest_t *manifest) {
+    model_manifest_t *copy = alloc_manifest(manifest->model_id, manifest->chunk_count);
+    if (!copy) return NULL;
+
+    memcpy(copy->chunks, manifest->chunks, (size_t)manifest->chunk_count * MODEL_DIGEST_SIZE);
+    memcpy(copy->chunk_sizes, manifest->chunk_sizes,
+           (size_t)manifest->chunk_count * sizeof(uint32_t));
+    copy->total_size = manifest->total_size;
+
+    if (!model_store_adopt(copy)) {
+        free_manifest(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+/* Destination pulls the latest checkpoint. Returns 1 once the final one has
+ * been sent in full, with a snapshot of the finished move in *completed. */
+int task_migration_handle_fetch(int fd, char *buffer, int bytes, task_migration_t *completed) {
+    uint32_t id;
+    char node_id[65];
+
+    char *body = memchr(buffer, '\n', bytes);
+    if (!body || sscanf(buffer, "MIGRATE_FETCH:%u:%64[^:\n]", &id, node_id) != 2) {
+        return 0;
+    }
+    body++;
+
+    conn_reader_t reader = {
+        .fd = fd,
+        .pending = body,
+        .pending_len = bytes - (body - buffer)
+    };
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    task_migration_t *m = find_migration(id);
+    model_manifest_t *manifest = NULL;
+    if (m && strcmp(m->dest_id, node_id) == 0 && m->checkpoint) {
+        manifest = pin_manifest(m->checkpoint);
+    }
+    if (!manifest) {
+        pthread_mutex_unlock(&migration_table.lock);
+        send_all(fd, "MIGRATE_WAIT", 12);
+        return 0;
+    }
+
+    int final = m->state == MIGRATION_CUTOVER;
+    char header[192];
+    int len = snprintf(header, sizeof(header), "MIGRATE_STATE:%d:%u:%lu:%f:%f:%u\n",
+                       final, m->progress.current_epoch, m->progress.samples_processed,
+                       m->progress.loss, m->progress.accuracy, manifest->chunk_count);
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    int ok = send_all(fd, header, len);
+
+    for (uint32_t i = 0; i < manifest->chunk_count && ok; i++) {
+        chunk_ref_t ref;
+        memcpy(ref.digest, manifest->chunks[i], MODEL_DIGEST_SIZE);
+        ref.size = manifest->chunk_sizes[i];
+        ok = send_all(fd, &ref, sizeof(ref));
+    }
+
+    /* Destination answers with the chunk indices it still lacks */
+    char line[16] = {0};
+    uint32_t need = 0;
+    for (uint32_t i = 0; i < sizeof(line) - 1 && ok; i++) {
+        ok = read_exact(&reader, &line[i], 1);
+        if (line[i] == '\n') break;
+    }
+    if (ok && (sscanf(line, "%u", &need) != 1 || need > manifest->chunk_count)) {
+        ok = 0;
+    }
+
+    uint8_t *chunk = malloc(MODEL_CHUNK_MAX_SIZE);
+    uint64_t sent_bytes = 0;
+    ok = ok && chunk;
+    for (uint32_t i = 0; i < need && ok; i++) {
+        uint32_t idx;
+        ok = read_exact(&reader, &idx, sizeof(idx)) && idx < manifest->chunk_count;
+        if (!ok) break;
+
+        uint32_t size = model_store_read_chunk(manifest->chunks[idx], chunk, MODEL_CHUNK_MAX_SIZE);
+        ok = size > 0 && send_all(fd, chunk, size);
+        sent_bytes += size;
+    }
+    free(chunk);
+    model_store_release(manifest);
+
+    struct timespec done;
+    clock_gettime(CLOCK_MONOTONIC, &done);
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    migration_table.stats.bytes_transferred += sent_bytes;
+
+    /* Still cut over: the migration may have expired during the transfer */
+    m = ok && final ? find_migration(id) : NULL;
+    if (m && m->state == MIGRATION_CUTOVER) {
+        /* Downtime runs from the freeze order to the destination holding the state */
+        double downtime = elapsed_ms(m->freeze_time.tv_sec ? &m->freeze_time : &m->cutover_time,
+                                     &done);
+
+        migration_table.stats.completed++;
+        migration_table.stats.last_downtime_ms = downtime;
+        if (downtime > migration_table.stats.max_downtime_ms) {
+            migration_table.stats.max_downtime_ms = downtime;
+        }
+
+        printf("[CDT] Migration %u complete: %u rounds, %lu bytes, %.1f ms downtime\n",
+               id, m->rounds, m->total_bytes, downtime);
+
+        *completed = *m;
+        completed->checkpoint = NULL;
+        release_migration(m, MIGRATION_DONE);
+        completed->state = MIGRATION_DONE;
+        pthread_mutex_unlock(&migration_table.lock);
+        model_store_gc();
+        return 1;
+    }
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    return 0;
+}
+
+/* Snapshot of a migration, e.g. to apply its cutover */
+int task_migration_get(uint32_t migration_id, task_migration_t *out) {
+    pthread_mutex_lock(&migration_table.lock);
+
+    task_migration_t *m = find_migration(migration_id);
+    if (m) {
+        *out = *m;
+        out->checkpoint = NULL;  // Owned by the migration table
+    }
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    return m != NULL;
+}
+
+/* Resume order for a source whose migration was abandoned while it was
+ * frozen; returns the migration id, once, or 0 */
+uint32_t task_migration_take_resume(const char *node_id) {
+    uint32_t id = 0;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    for (uint32_t i = 0; i < MAX_TASK_MIGRATIONS && !id; i++) {
+        task_migration_t *m = &migration_table.migrations[i];
+        if (m->state == MIGRATION_ABORTED && now <= m->resume_deadline &&
+            strcmp(m->source_id, node_id) == 0) {
+            id = m->migration_id;
+            m->resume_deadline = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    return id;
+}
+
+/* Abandon migrations that stalled before cutover; the source keeps its
+ * task, and if it was already frozen it is told to resume on its next
+ * poll. Cut-over migrations keep their checkpoint until fetched or until
+ * the cutover deadline passes. */
+void task_migration_expire(time_t now) {
+    uint32_t expired = 0;
+
+    pthread_mutex_lock(&migration_table.lock);
+
+    for (uint32_t i = 0; i < MAX_TASK_MIGRATIONS; i++) {
+        task_migration_t *m = &migration_table.migrations[i];
+        if ((m->state == MIGRATION_PRECOPY || m->state == MIGRATION_FREEZE) &&
+            now - m->start_time > MIGRATION_TIMEOUT) {
+            printf("[CDT] Migration %u timed out after %u rounds\n",
+                   m->migration_id, m->rounds);
+            if (m->state == MIGRATION_FREEZE) {
+                m->resume_deadline = now + MIGRATION_CUTOVER_TIMEOUT;
+            }
+            release_migration(m, MIGRATION_ABORTED);
+            expired++;
+        } else if (m->state == MIGRATION_CUTOVER && now > m->cutover_deadline) {
+            printf("[CDT] Migration %u expired: %s never fetched the final checkpoint, %s resumes\n",
+                   m->migration_id, m->dest_id, m->source_id);
+            m->resume_deadline = now + MIGRATION_CUTOVER_TIMEOUT;
+            release_migration(m, MIGRATION_ABORTED);
+            expired++;
+        }
+    }
+
+    pthread_mutex_unlock(&migration_table.lock);
+
+    if (expired) {
+        model_store_gc();
+    }
+}
+
+void task_migration_get_stats(migration_stats_t *stats) {
+    pthread_mutex_lock(&migration_table.lock);
+    *stats = migration_table.stats;
+    pthread_mutex_unlock(&migration_table.lock);
+}
+
+#ifdef TASK_MIGRATION_TEST
+/* Userspace test: cc -O2 -DTASK_MIGRATION_TEST task_migration.c model_store.c -lcrypto -lpthread */
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../test_check.h"
+
+#define TEST_MODEL_SIZE (24 * 1024)
+
+/* Source checkpoint: chunk list and bytes, no longer held by the store */
+static struct {
+    uint8_t data[TEST_MODEL_SIZE];
+    chunk_ref_t refs[64];
+    uint32_t chunk_count;
+} source;
+
+static void make_checkpoint(void) {
+    uint64_t seed = 7;
+    for (uint32_t i = 0; i < TEST_MODEL_SIZE; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        source.data[i] = seed >> 56;
+    }
+
+    model_manifest_t *manifest = model_store_put("m", 1, source.data, TEST_MODEL_SIZE);
+    source.chunk_count = manifest->chunk_count;
+    for (uint32_t i = 0; i < manifest->chunk_count; i++) {
+        memcpy(source.refs[i].digest, manifest->chunks[i], MODEL_DIGEST_SIZE);
+        source.refs[i].size = manifest->chunk_sizes[i];
+    }
+    model_store_release(manifest);
+    model_store_gc();
+}
+
+/* Everything the coordinator has written to the peer end so far */
+static uint32_t drain(int fd, uint8_t *out, uint32_t out_size) {
+    uint32_t used = 0;
+    int got;
+    while (used < out_size && (got = recv(fd, out + used, out_size - used, MSG_DONTWAIT)) > 0) {
+        used += got;
+    }
+    return used;
+}
+
+/* One checkpoint round; the peer's chunk bytes are queued before the handler runs */
+static migration_state_t send_checkpoint(uint32_t id, int final, uint32_t epoch, char *reply) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+    char buffer[4096];
+    int len = snprintf(buffer, sizeof(buffer), "MIGRATE_CKPT:%u:%d:%u:%u:%f:%f:%u\n",
+                       id, final, epoch, epoch * 100, 1.0 / (epoch + 1), 0.5, source.chunk_count);
+    memcpy(buffer + len, source.refs, source.chunk_count * sizeof(chunk_ref_t));
+    len += source.chunk_count * sizeof(chunk_ref_t);
+
+    /* A fresh store lacks every chunk, a warm one none: send what it will ask for */
+    model_manifest_t probe = {
+        .chunk_count = source.chunk_count,
+        .chunks = malloc(source.chunk_count * MODEL_DIGEST_SIZE)
+    };
+    uint32_t missing[64];
+    for (uint32_t i = 0; i < source.chunk_count; i++) {
+        memcpy(probe.chunks[i], source.refs[i].digest, MODEL_DIGEST_SIZE);
+    }
+    uint32_t need = model_store_missing(&probe, missing, 64);
+    free(probe.chunks);
+
+    uint64_t offset[64] = {0};
+    for (uint32_t i = 1; i < source.chunk_count; i++) {
+        offset[i] = offset[i - 1] + source.refs[i - 1].size;
+    }
+    for (uint32_t i = 0; i < need; i++) {
+        send_all(sv[1], source.data + offset[missing[i]], source.refs[missing[i]].size);
+    }
+
+    uint32_t migration_id = 0;
+    migration_state_t state = task_migration_handle_checkpoint(sv[0], buffer, len, &migration_id);
+
+    /* MIGRATE_NEED:<n>\n, n indices, then the verdict */
+    uint8_t out[4096];
+    uint32_t got = drain(sv[1], out, sizeof(out) - 1);
+    uint32_t listed = 0;
+    char *verdict = memchr(out, '\n', got);
+    out[got] = '\0';
+    if (sscanf((char *)out, "MIGRATE_NEED:%u", &listed) == 1 && listed == need && verdict &&
+        verdict + 1 + listed * sizeof(uint32_t) <= (char *)out + got) {
+        strcpy(reply, verdict + 1 + listed * sizeof(uint32_t));
+    } else {
+        strcpy(reply, "");
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    return state;
+}
+
+/* Destination fetch. need_count indices are requested; only `sent` of them
+ * arrive before the destination stops writing. */
+static int fetch(uint32_t id, uint32_t need_count, uint32_t sent, task_migration_t *completed,
+                 uint8_t *received, uint32_t *received_len) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    int size = 1 << 20;
+    setsockopt(sv[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    char buffer[128];
+    int len = snprintf(buffer, sizeof(buffer), "MIGRATE_FETCH:%u:dst\n", id);
+
+    char line[16];
+    int n = snprintf(line, sizeof(line), "%u\n", need_count);
+    send_all(sv[1], line, n);
+    for (uint32_t i = 0; i < sent; i++) {
+        send_all(sv[1], &i, sizeof(i));
+    }
+    shutdown(sv[1], SHUT_WR);
+
+    int done = task_migration_handle_fetch(sv[0], buffer, len, completed);
+    *received_len = drain(sv[1], received, 256 * 1024);
+
+    close(sv[0]);
+    close(sv[1]);
+    return done;
+}
+
+static void test_cutover_on_fetch(void) {
+    static uint8_t received[256 * 1024];
+    uint32_t received_len;
+    char reply[64];
+    task_migration_t completed, view;
+    migration_stats_t stats;
+
+    uint32_t id = task_migration_begin("src", "dst", "m");
+    CHECK(id != 0, "migration not started");
+
+    CHECK(send_checkpoint(id, 0, 1, reply) == MIGRATION_PRECOPY, "first round not pre-copy");
+    CHECK(strcmp(reply, "MIGRATE_CONTINUE") == 0, "first round answered %s", reply);
+
+    /* Pre-copy fetches never complete the move */
+    memset(&completed, 0, sizeof(completed));
+    CHECK(!fetch(id, source.chunk_count, source.chunk_count, &completed, received, &received_len),
+          "pre-copy fetch completed the migration");
+    CHECK(completed.migration_id == 0, "pre-copy fetch filled the snapshot");
+
+    /* The final checkpoint alone doesn't cut over */
+    CHECK(send_checkpoint(id, 1, 2, reply) == MIGRATION_CUTOVER, "final round not cut over");
+    CHECK(strcmp(reply, "MIGRATE_DONE") == 0, "final round answered %s", reply);
+    CHECK(task_migration_get(id, &view) && view.state == MIGRATION_CUTOVER,
+          "migration finished before the fetch");
+
+    /* Destination drops mid-fetch: the task stays with the source */
+    CHECK(!fetch(id, source.chunk_count, 1, &completed, received, &received_len),
+          "partial fetch completed the migration");
+    CHECK(task_migration_get(id, &view) && view.state == MIGRATION_CUTOVER,
+          "partial fetch ended the migration");
+    uint32_t role_id;
+    CHECK(task_migration_role("dst", &role_id) == MIGRATION_ROLE_DEST && role_id == id,
+          "destination no longer expected to fetch");
+
+    /* And if it never comes back, the migration is abandoned */
+    task_migration_expire(time(NULL) + MIGRATION_CUTOVER_TIMEOUT + 1);
+    CHECK(!task_migration_get(id, &view), "expired migration still open");
+    task_migration_get_stats(&stats);
+    CHECK(stats.aborted == 1 && stats.completed == 0, "stats %lu aborted %lu completed",
+          stats.aborted, stats.completed);
+
+    /* The frozen source is told to resume, once, and is not a source meanwhile */
+    CHECK(task_migration_role("src", &role_id) == MIGRATION_ROLE_NONE, "source still migrating");
+    CHECK(task_migration_begin("src", "other", "m") == 0, "source moved again before resuming");
+    CHECK(task_migration_take_resume("dst") == 0, "destination told to resume");
+    CHECK(task_migration_take_resume("src") == id, "frozen source not told to resume");
+    CHECK(task_migration_take_resume("src") == 0, "resume delivered twice");
+
+    /* A complete fetch of the final checkpoint is what cuts over */
+    id = task_migration_begin("src", "dst", "m");
+    CHECK(send_checkpoint(id, 1, 3, reply) == MIGRATION_CUTOVER, "second migration not cut over");
+    CHECK(fetch(id, source.chunk_count, source.chunk_count, &completed, received, &received_len),
+          "full fetch did not complete the migration");
+    CHECK(completed.migration_id == id && completed.state == MIGRATION_DONE &&
+          strcmp(completed.source_id, "src") == 0 && strcmp(completed.dest_id, "dst") == 0 &&
+          completed.progress.current_epoch == 3 && completed.progress.samples_processed == 300,
+          "snapshot is migration %u state %d epoch %u", completed.migration_id, completed.state,
+          completed.progress.current_epoch);
+    CHECK(received_len >= TEST_MODEL_SIZE &&
+          memcmp(received + received_len - TEST_MODEL_SIZE, source.data, TEST_MODEL_SIZE) == 0,
+          "destination received %u bytes", received_len);
+    CHECK(!task_migration_get(id, &view), "completed migration still open");
+    task_migration_get_stats(&stats);
+    CHECK(stats.completed == 1, "completed %lu", stats.completed);
+}
+
+int main(void) {
+    model_store_init();
+    make_checkpoint();
+
+    test_cutover_on_fetch();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,107 @@
+#ifndef QENEX_TASK_MIGRATION_H
+#define QENEX_TASK_MIGRATION_H
+
+#include <stdint.h>
+#include <time.h>
+#include "model_store.h"
+
+/*
+ * Live migration of in-progress training tasks.
+ *
+ * The source node keeps training while it uploads checkpoints of its model
+ * and optimizer state. Checkpoints go through the model blob store, so
+ * each pre-copy round only carries the chunks that changed since the last
+ * one. Once a round's delta is small enough, the source is told to freeze
+ * and send a final checkpoint. The task is cut over to the destination
+ * only once it has fetched that final checkpoint, having already
+ * prefetched all but the last delta; until then, and if the migration is
+ * aborted, the task stays with the source. A source that was frozen when
+ * its migration expired is told to resume when it next polls.
+ *
+ * Wire protocol (one exchange per connection):
+ *   node:   MIGRATE_POLL:<node_id>
+ *   coord:  MIGRATE_SOURCE:<id> | MIGRATE_DEST:<id> | MIGRATE_RESUME:<id> | MIGRATE_NONE
+ *
+ *   source: MIGRATE_CKPT:<id>:<final>:<epoch>:<samples>:<loss>:<acc>:<chunks>\n
+ *           followed by <chunks> x {digest[32], uint32 size}
+ *   coord:  MIGRATE_NEED:<n>\n followed by n x uint32 chunk index
+ *   source: raw bytes of each needed chunk, in index order
+ *   coord:  MIGRATE_CONTINUE | MIGRATE_FREEZE | MIGRATE_DONE | MIGRATE_ABORT
+ *
+ *   dest:   MIGRATE_FETCH:<id>:<node_id>\n
+ *   coord:  MIGRATE_STATE:<final>:<epoch>:<samples>:<loss>:<acc>:<chunks>\n
+ *           followed by <chunks> x {digest[32], uint32 size}
+ *   dest:   <n>\n followed by n x uint32 chunk index it lacks
+ *   coord:  raw bytes of each requested chunk
+ */
+
+#define MAX_TASK_MIGRATIONS 32
+#define MIGRATION_FREEZE_BYTES (4 * 1024 * 1024)  // Final delta small enough to freeze
+#define MIGRATION_MAX_ROUNDS 8                    // Freeze regardless after this many
+#define MIGRATION_TIMEOUT 600                     // Seconds before a migration is abandoned
+#define MIGRATION_CUTOVER_TIMEOUT 120             // Seconds the destination has to fetch the final state
+
+typedef enum {
+    MIGRATION_IDLE = 0,
+    MIGRATION_PRECOPY,             // Source training, checkpoints streaming
+    MIGRATION_FREEZE,              // Source told to stop and send final delta
+    MIGRATION_CUTOVER,             // Final checkpoint in store, awaiting switch
+    MIGRATION_DONE,
+    MIGRATION_ABORTED
+} migration_state_t;
+
+typedef enum {
+    MIGRATION_ROLE_NONE = 0,
+    MIGRATION_ROLE_SOURCE,
+    MIGRATION_ROLE_DEST
+} migration_role_t;
+
+typedef struct task_migration {
+    uint32_t migration_id;
+    migration_state_t state;
+    char source_id[65];
+    char dest_id[65];
+    char model_id[65];
+    uint32_t rounds;
+
+    /* Latest checkpoint received from the source */
+    model_manifest_t *checkpoint;
+    struct {
+        uint32_t current_epoch;
+        uint64_t samples_processed;
+        double loss;
+        double accuracy;
+    } progress;
+
+    /* Transfer accounting */
+    uint64_t last_round_bytes;
+    uint64_t total_bytes;
+    time_t start_time;
+    time_t cutover_deadline;
+    struct timespec freeze_time;
+    struct timespec cutover_time;
+    time_t resume_deadline;        // Aborted with the source frozen: it is told to resume until then
+} task_migration_t;
+
+typedef struct migration_stats {
+    uint64_t started;
+    uint64_t completed;
+    uint64_t aborted;
+    uint64_t bytes_transferred;
+    double last_downtime_ms;
+    double max_downtime_ms;
+} migration_stats_t;
+
+/* Function prototypes */
+uint32_t task_migration_begin(const char *source_id, const char *dest_id, const char *model_id);
+migration_role_t task_migration_role(const char *node_id, uint32_t *migration_id);
+int task_migration_node_busy(const char *node_id);
+migration_state_t task_migration_handle_checkpoint(int fd, char *buffer, int bytes,
+                                                   uint32_t *migration_id);
+int task_migration_handle_fetch(int fd, char *buffer, int bytes, task_migration_t *completed);
+int task_migration_get(uint32_t migration_id, task_migration_t *out);
+uint32_t task_migration_take_resume(const char *node_id);
+void task_migration_expire(time_t now);
+void task_migration_get_stats(migration_stats_t *stats);
+
+#endif /* QENEX_TASK_MIGRATION_H */
@@ -0,0 +1,1067 @@
+/*
+ * QENEX Hypervisor - Asynchronous Block Engine
+ *
+ * io_uring submission and completion for virtual disks. See blk_engine.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "blk_engine.h"
+
+#define BLK_UD_KICK (~0ULL)
+
+typedef struct blk_op {
+    uint8_t opcode;             // IORING_OP_READV, WRITEV or FSYNC
+    uint64_t host_offset;
+    uint64_t length;
+    uint32_t iov_count;
+    struct iovec iov[BLK_MERGE_MAX_IOVS];
+    blk_request_t* owner[BLK_MERGE_MAX_IOVS];
+    uint64_t cache_seq;         // Block cache generation when a read was built
+    struct blk_op* next_free;
+} blk_op_t;
+
+typedef struct {
+    int fd;
+
+    // Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sq_entries;
+    unsigned local_tail;        // SQEs filled but not yet published
+    unsigned to_submit;
+    struct io_uring_sqe* sqes;
+
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* rings;
+    size_t rings_size;
+    size_t sqes_size;
+} blk_ring_t;
+
+struct blk_engine {
+    disk_image_t* image;
+    int image_fd;
+
+    // Shared block cache under the image, if any
+    block_cache_t* cache;
+    int cache_file;
+    uint32_t cache_vm;
+    bool write_back;
+
+    blk_ring_t* ring;           // NULL: synchronous fallback
+    bool fixed_file;
+    bool fixed_buffers;
+    uint8_t* guest_mem;
+    uint64_t fixed_size;        // Bytes of guest RAM registered
+
+    int kick_fd;
+    bool kick_armed;
+
+    blk_complete_fn complete;
+    void* ctx;
+
+    // Requests staged since the last kick
+    blk_request_t* staged;
+    blk_request_t** staged_tail;
+
+    blk_op_t ops[BLK_ENGINE_QUEUE_DEPTH];
+    blk_op_t* free_ops;
+    blk_op_t* current;          // Still accepting merges
+    uint32_t inflight;
+
+    blk_engine_stats_t stats;
+};
+
+/* ==================== IO_URING RING ==================== */
+
+static int ring_enter(blk_ring_t* r, unsigned submit, unsigned wait_nr, unsigned flags,
+                      void* arg, size_t arg_size) {
+    return (int)syscall(__NR_io_uring_enter, r->fd, submit, wait_nr, flags, arg, arg_size);
+}
+
+// Publish queued SQEs; optionally wait for a completion
+static int ring_submit(blk_ring_t* r, bool wait) {
+    __atomic_store_n(r->sq_tail, r->local_tail, __ATOMIC_RELEASE);
+
+    if (!wait && r->to_submit == 0) {
+        return 0;
+    }
+
+    struct __kernel_timespec ts = {
+        .tv_sec = BLK_ENGINE_WAIT_MS / 1000,
+        .tv_nsec = (BLK_ENGINE_WAIT_MS % 1000) * 1000000L
+    };
+    struct io_uring_getevents_arg arg = {
+        .ts = (uint64_t)(uintptr_t)&ts
+    };
+
+    int ret = wait ?
+        ring_enter(r, r->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                   &arg, sizeof(arg)) :
+        ring_enter(r, r->to_submit, 0, 0, NULL, 0);
+
+    if (ret >= 0) {
+        r->to_submit -= (unsigned)ret > r->to_submit ? r->to_submit : (unsigned)ret;
+    } else if (errno != EINTR && errno != ETIME && errno != EBUSY) {
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe* ring_get_sqe(blk_ring_t* r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->local_tail - head >= r->sq_entries) {
+        ring_submit(r, false);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->local_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned idx = r->local_tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->local_tail++;
+    r->to_submit++;
+
+    return sqe;
+}
+
+static void ring_destroy(blk_ring_t* r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->rings) {
+        munmap(r->rings, r->rings_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r);
+}
+
+static bool ring_opcodes_supported(int ring_fd) {
+    static const uint8_t needed[] = {
+        IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_READ_FIXED,
+        IORING_OP_WRITE_FIXED, IORING_OP_FSYNC, IORING_OP_POLL_ADD
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (!probe) {
+        return false;
+    }
+
+    bool ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed); i++) {
+        ok = needed[i] <= probe->last_op &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+static blk_ring_t* ring_create(void) {
+    blk_ring_t* r = calloc(1, sizeof(blk_ring_t));
+    if (!r) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER;
+
+    r->fd = (int)syscall(__NR_io_uring_setup, BLK_ENGINE_QUEUE_DEPTH, &params);
+    if (r->fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        r->fd = (int)syscall(__NR_io_uring_setup, BLK_ENGINE_QUEUE_DEPTH, &params);
+    }
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    if (!(params.features & IORING_FEAT_EXT_ARG) ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !ring_opcodes_supported(r->fd)) {
+        ring_destroy(r);
+        return NULL;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+
+    r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->rings == MAP_FAILED) {
+        r->rings = NULL;
+        ring_destroy(r);
+        return NULL;
+    }
+
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        ring_destroy(r);
+        return NULL;
+    }
+
+    char* base = r->rings;
+    r->sq_head = (unsigned*)(base + params.sq_off.head);
+    r->sq_tail = (unsigned*)(base + params.sq_off.tail);
+    r->sq_mask = (unsigned*)(base + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(base + params.sq_off.array);
+    r->sq_entries = params.sq_entries;
+    r->local_tail = *r->sq_tail;
+
+    r->cq_head = (unsigned*)(base + params.cq_off.head);
+    r->cq_tail = (unsigned*)(base + params.cq_off.tail);
+    r->cq_mask = (unsigned*)(base + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    return r;
+}
+
+// Pin guest RAM once so fixed reads and writes skip per-I/O page lookups; only
+// valid while every page keeps the frame it has now
+static void register_guest_memory(blk_engine_t* e, uint64_t guest_size) {
+    struct iovec chunks[BLK_MAX_FIXED];
+    uint32_t count = 0;
+
+    for (uint64_t off = 0; off < guest_size && count < BLK_MAX_FIXED; off += BLK_FIXED_CHUNK) {
+        uint64_t len = guest_size - off;
+        chunks[count].iov_base = e->guest_mem + off;
+        chunks[count].iov_len = len < BLK_FIXED_CHUNK ? len : BLK_FIXED_CHUNK;
+        count++;
+    }
+
+    // Fails under a low RLIMIT_MEMLOCK; vectored I/O still works then
+    if (count && syscall(__NR_io_uring_register, e->ring->fd, IORING_REGISTER_BUFFERS,
+                         chunks, count) == 0) {
+        e->fixed_buffers = true;
+        e->fixed_size = count < BLK_MAX_FIXED ? guest_size : (uint64_t)count * BLK_FIXED_CHUNK;
+    }
+}
+
+/* ==================== OPERATIONS ==================== */
+
+static void request_put(blk_engine_t* e, blk_request_t* req) {
+    if (--req->pending == 0) {
+        if (req->status < 0) {
+            e->stats.errors++;
+        }
+        e->complete(e->ctx, req);
+    }
+}
+
+// Run an operation synchronously from byte `done`; returns bytes or -errno
+static int64_t op_run_sync(blk_engine_t* e, blk_op_t* op, uint64_t done) {
+    if (op->opcode == IORING_OP_FSYNC) {
+        return fdatasync(e->image_fd) < 0 ? -errno : 0;
+    }
+
+    uint64_t skipped = 0;
+    for (uint32_t i = 0; i < op->iov_count; i++) {
+        uint8_t* base = op->iov[i].iov_base;
+        uint64_t len = op->iov[i].iov_len;
+
+        if (skipped + len <= done) {
+            skipped += len;
+            continue;
+        }
+
+        uint64_t from = done > skipped ? done - skipped : 0;
+        while (from < len) {
+            ssize_t n = op->opcode == IORING_OP_READV ?
+                pread(e->image_fd, base + from, len - from, op->host_offset + skipped + from) :
+                pwrite(e->image_fd, base + from, len - from, op->host_offset + skipped + from);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return n < 0 ? -errno : -EIO;
+            }
+            from += n;
+        }
+        skipped += len;
+    }
+
+    return op->length;
+}
+
+// Keep the block cache coherent with what just moved to or from the file
+static bool op_sync_cache(blk_engine_t* e, blk_op_t* op) {
+    uint64_t host = op->host_offset;
+    bool valid = true;
+
+    for (uint32_t i = 0; i < op->iov_count; i++) {
+        if (op->opcode == IORING_OP_READV) {
+            valid &= block_cache_fill(e->cache, e->cache_file, op->cache_seq, host,
+                                      op->iov[i].iov_base, op->iov[i].iov_len);
+        } else {
+            block_cache_update(e->cache, e->cache_file, host,
+                               op->iov[i].iov_base, op->iov[i].iov_len);
+        }
+        host += op->iov[i].iov_len;
+    }
+    return valid;
+}
+
+static void op_complete(blk_engine_t* e, blk_op_t* op, int64_t res) {
+    // Short transfers are rare; finish them inline
+    if (res >= 0 && op->opcode != IORING_OP_FSYNC && (uint64_t)res < op->length) {
+        res = op_run_sync(e, op, res);
+    }
+
+    // A read that raced a write-back may predate data that has left the cache
+    while (res >= 0 && e->cache && op->opcode != IORING_OP_FSYNC && !op_sync_cache(e, op)) {
+        op->cache_seq = block_cache_fill_seq(e->cache, e->cache_file);
+        res = op_run_sync(e, op, 0);
+    }
+
+    if (op->opcode == IORING_OP_FSYNC) {
+        if (res < 0) {
+            op->owner[0]->status = (int)res;
+        }
+        request_put(e, op->owner[0]);
+    } else {
+        for (uint32_t i = 0; i < op->iov_count; i++) {
+            // Each request's extents sit together in the operation
+            if (i + 1 < op->iov_count && op->owner[i + 1] == op->owner[i]) {
+                continue;
+            }
+            if (res < 0) {
+                op->owner[i]->status = (int)res;
+            }
+            request_put(e, op->owner[i]);
+        }
+    }
+
+    op->next_free = e->free_ops;
+    e->free_ops = op;
+    e->inflight--;
+}
+
+static void op_issue(blk_engine_t* e, blk_op_t* op) {
+    struct io_uring_sqe* sqe = e->ring ? ring_get_sqe(e->ring) : NULL;
+
+    e->inflight++;
+    e->stats.ops++;
+
+    if (!sqe) {
+        e->stats.inline_ops++;
+        op_complete(e, op, op_run_sync(e, op, 0));
+        return;
+    }
+
+    sqe->fd = e->fixed_file ? 0 : e->image_fd;
+    sqe->flags = e->fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->off = op->host_offset;
+    sqe->user_data = (uint64_t)(op - e->ops);
+
+    if (op->opcode == IORING_OP_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        return;
+    }
+
+    uint8_t* buf = op->iov[0].iov_base;
+    uint64_t rel = (uint64_t)(buf - e->guest_mem);
+    bool fixed = e->fixed_buffers && op->iov_count == 1 &&
+                 buf >= e->guest_mem && rel + op->length <= e->fixed_size &&
+                 rel / BLK_FIXED_CHUNK == (rel + op->length - 1) / BLK_FIXED_CHUNK;
+
+    if (fixed) {
+        sqe->opcode = op->opcode == IORING_OP_READV ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+        sqe->addr = (uint64_t)(uintptr_t)buf;
+        sqe->len = op->length;
+        sqe->buf_index = rel / BLK_FIXED_CHUNK;
+        e->stats.fixed_ops++;
+    } else {
+        sqe->opcode = op->opcode;
+        sqe->addr = (uint64_t)(uintptr_t)op->iov;
+        sqe->len = op->iov_count;
+    }
+}
+
+static void reap_completions(blk_engine_t* e, bool* kicked);
+
+static blk_op_t* op_alloc(blk_engine_t* e, uint8_t opcode, uint64_t host_offset) {
+    // Out of operations: push what is queued and wait for some to finish
+    while (!e->free_ops) {
+        if (!e->ring || ring_submit(e->ring, true) < 0) {
+            return NULL;
+        }
+        reap_completions(e, NULL);
+    }
+
+    blk_op_t* op = e->free_ops;
+    e->free_ops = op->next_free;
+
+    op->opcode = opcode;
+    op->host_offset = host_offset;
+    op->length = 0;
+    op->iov_count = 0;
+    if (e->cache && opcode == IORING_OP_READV) {
+        op->cache_seq = block_cache_fill_seq(e->cache, e->cache_file);
+    }
+    return op;
+}
+
+// Add one host-contiguous extent, merging into the open operation if it follows on
+static bool add_extent(blk_engine_t* e, blk_request_t* req, uint8_t opcode,
+                       uint64_t host_offset, uint8_t* buf, uint64_t len) {
+    blk_op_t* op = e->current;
+
+    if (op && (op->opcode != opcode ||
+               op->host_offset + op->length != host_offset ||
+               op->iov_count == BLK_MERGE_MAX_IOVS)) {
+        e->current = NULL;
+        op_issue(e, op);
+        op = NULL;
+    }
+
+    if (!op) {
+        op = op_alloc(e, opcode, host_offset);
+        if (!op) {
+            return false;
+        }
+        e->current = op;
+    }
+
+    uint32_t last = op->iov_count - 1;
+    if (op->iov_count && op->owner[last] == req &&
+        (uint8_t*)op->iov[last].iov_base + op->iov[last].iov_len == buf) {
+        op->iov[last].iov_len += len;  // Guest buffer continues too
+    } else {
+        if (op->iov_count == 0 || op->owner[last] != req) {
+            req->pending++;
+            if (op->iov_count) {
+                e->stats.merged++;
+            }
+        }
+        op->iov[op->iov_count].iov_base = buf;
+        op->iov[op->iov_count].iov_len = len;
+        op->owner[op->iov_count] = req;
+        op->iov_count++;
+    }
+
+    op->length += len;
+    return true;
+}
+
+static void process_rw(blk_engine_t* e, blk_request_t* req) {
+    bool write = req->type == BLK_REQ_WRITE;
+    uint8_t opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    uint64_t total = 0;
+    uint64_t pos = req->offset;
+
+    for (uint32_t i = 0; i < req->iov_count; i++) {
+        total += req->iov[i].iov_len;
+    }
+    if (req->offset > disk_image_size(e->image) ||
+        total > disk_image_size(e->image) - req->offset) {
+        req->status = -EINVAL;
+        return;
+    }
+
+    for (uint32_t i = 0; i < req->iov_count; i++) {
+        uint8_t* buf = req->iov[i].iov_base;
+        uint64_t left = req->iov[i].iov_len;
+
+        while (left > 0) {
+            uint64_t host, chunk;
+            disk_map_type_t type = disk_image_map(e->image, pos, left, write, &host, &chunk);
+
+            if (type == DISK_MAP_DATA && e->cache && !write &&
+                block_cache_lookup(e->cache, e->cache_file, e->cache_vm, host, buf, chunk)) {
+                e->stats.cache_hits++;
+            } else if (type == DISK_MAP_DATA && e->write_back && write) {
+                // Absorbed by the cache; the cache writes it back later
+                if (block_cache_write(e->cache, e->cache_file, e->cache_vm,
+                                      host, buf, chunk) < 0) {
+                    req->status = -EIO;
+                    return;
+                }
+                e->stats.cache_writes++;
+            } else if (type == DISK_MAP_DATA) {
+                if (!add_extent(e, req, opcode, host, buf, chunk)) {
+                    req->status = -EIO;
+                    return;
+                }
+            } else if (write) {
+                req->status = -EIO;  // Allocation failed
+                return;
+            } else if (type == DISK_MAP_ZERO) {
+                memset(buf, 0, chunk);
+                e->stats.inline_ops++;
+            } else {
+                // Template data; shared clusters are cached below the image
+                if (disk_image_read(e->image, pos, buf, chunk) < 0) {
+                    req->status = -EIO;
+                    return;
+                }
+                e->stats.inline_ops++;
+            }
+
+            pos += chunk;
+            buf += chunk;
+            left -= chunk;
+        }
+    }
+}
+
+static void process_request(blk_engine_t* e, blk_request_t* req) {
+    req->status = 0;
+    req->pending = 1;  // Held until every extent is queued
+    e->stats.requests++;
+
+    switch (req->type) {
+        case BLK_REQ_READ:
+        case BLK_REQ_WRITE:
+            process_rw(e, req);
+            break;
+
+        case BLK_REQ_FLUSH: {
+            if (e->write_back) {
+                // Dirty cached blocks first, then the file
+                if (disk_image_flush(e->image) < 0) {
+                    req->status = -EIO;
+                }
+                e->stats.inline_ops++;
+                break;
+            }
+
+            // Covers writes that completed before the flush was sent
+            if (e->current) {
+                op_issue(e, e->current);
+                e->current = NULL;
+            }
+            blk_op_t* op = op_alloc(e, IORING_OP_FSYNC, 0);
+            if (!op) {
+                req->status = -EIO;
+                break;
+            }
+            op->owner[0] = req;
+            req->pending++;
+            op_issue(e, op);
+            break;
+        }
+
+        case BLK_REQ_DISCARD:
+            if (disk_image_discard(e->image, req->offset, req->length) < 0) {
+                req->status = -EIO;
+            }
+            e->stats.inline_ops++;
+            break;
+    }
+
+    request_put(e, req);
+}
+
+/* ==================== ENGINE ==================== */
+
+blk_engine_t* blk_engine_create(disk_image_t* image, void* guest_mem, uint64_t guest_size,
+                                uint32_t flags, int kick_fd, blk_complete_fn complete, void* ctx) {
+    blk_engine_t* e = calloc(1, sizeof(blk_engine_t));
+    if (!e) {
+        return NULL;
+    }
+
+    e->image = image;
+    e->image_fd = disk_image_fd(image);
+    e->cache = disk_image_cache(image, &e->cache_file, &e->cache_vm);
+    e->write_back = e->cache && block_cache_mode(e->cache) == BLOCK_CACHE_WRITEBACK;
+    e->guest_mem = guest_mem;
+    e->kick_fd = kick_fd;
+    e->complete = complete;
+    e->ctx = ctx;
+    e->staged_tail = &e->staged;
+
+    for (int i = BLK_ENGINE_QUEUE_DEPTH - 1; i >= 0; i--) {
+        e->ops[i].next_free = e->free_ops;
+        e->free_ops = &e->ops[i];
+    }
+
+    e->ring = ring_create();
+    if (e->ring) {
+        e->fixed_file = syscall(__NR_io_uring_register, e->ring->fd,
+                                IORING_REGISTER_FILES, &e->image_fd, 1) == 0;
+        if (guest_mem && (flags & BLK_ENGINE_PIN_GUEST)) {
+            register_guest_memory(e, guest_size);
+        }
+    }
+
+    return e;
+}
+
+void blk_engine_destroy(blk_engine_t* engine) {
+    if (!engine) {
+        return;
+    }
+
+    blk_engine_kick(engine);
+    while (engine->inflight > 0) {
+        blk_engine_poll(engine, true, NULL);
+    }
+
+    if (engine->ring) {
+        ring_destroy(engine->ring);
+    }
+    free(engine);
+}
+
+bool blk_engine_async(const blk_engine_t* engine) {
+    return engine->ring != NULL;
+}
+
+// Stage a request; nothing is issued until the next kick
+void blk_engine_queue(blk_engine_t* engine, blk_request_t* req) {
+    req->next = NULL;
+    *engine->staged_tail = req;
+    engine->staged_tail = &req->next;
+}
+
+// Issue everything staged with a single submission
+int blk_engine_kick(blk_engine_t* engine) {
+    uint32_t count = 0;
+
+    // Completions reaped along the way may stage more requests
+    while (engine->staged) {
+        blk_request_t* req = engine->staged;
+        engine->staged = req->next;
+        if (!engine->staged) {
+            engine->staged_tail = &engine->staged;
+        }
+        process_request(engine, req);
+        count++;
+    }
+
+    if (engine->current) {
+        op_issue(engine, engine->current);
+        engine->current = NULL;
+    }
+
+    if (engine->ring && engine->ring->to_submit > 0) {
+        engine->stats.submits++;
+        if (ring_submit(engine->ring, false) < 0) {
+            return -1;
+        }
+    }
+
+    return count;
+}
+
+static void arm_kick(blk_engine_t* e) {
+    struct io_uring_sqe* sqe = ring_get_sqe(e->ring);
+    if (!sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->kick_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = BLK_UD_KICK;
+    e->kick_armed = true;
+}
+
+static void drain_kick(blk_engine_t* e) {
+    uint64_t count;
+    while (read(e->kick_fd, &count, sizeof(count)) == sizeof(count)) {
+        // eventfd counter; the kick itself is all we need
+    }
+}
+
+static void reap_completions(blk_engine_t* e, bool* kicked) {
+    blk_ring_t* r = e->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int32_t res = cqe->res;
+        uint32_t flags = cqe->flags;
+
+        // Free the slot first; completion callbacks may queue more SQEs
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+        if (ud == BLK_UD_KICK) {
+            if (!(flags & IORING_CQE_F_MORE)) {
+                e->kick_armed = false;
+            }
+            if (kicked) {
+                *kicked = true;
+            }
+        } else {
+            op_complete(e, &e->ops[ud], res);
+        }
+
+        tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+/*
+ * Reap completions, waiting up to BLK_ENGINE_WAIT_MS if asked. *kicked is
+ * set when the guest kicked the queue; the eventfd is already drained.
+ */
+int blk_engine_poll(blk_engine_t* engine, bool wait, bool* kicked) {
+    uint64_t before = engine->stats.ops - engine->inflight;
+    bool kick = false;
+
+    if (engine->ring) {
+        if (engine->kick_fd >= 0 && !engine->kick_armed) {
+            arm_kick(engine);
+        }
+
+        bool ready = *engine->ring->cq_head !=
+                     __atomic_load_n(engine->ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (ring_submit(engine->ring, wait && !ready) < 0) {
+            return -1;
+        }
+        reap_completions(engine, &kick);
+    } else if (wait && engine->kick_fd >= 0) {
+        // Synchronous requests are done by now; only kicks can arrive
+        struct pollfd pfd = {.fd = engine->kick_fd, .events = POLLIN};
+        kick = poll(&pfd, 1, BLK_ENGINE_WAIT_MS) > 0;
+    }
+
+    if (kick && engine->kick_fd >= 0) {
+        drain_kick(engine);
+    }
+    if (kicked) {
+        *kicked = kick;
+    }
+
+    return (int)(engine->stats.ops - engine->inflight - before);
+}
+
+uint32_t blk_engine_inflight(const blk_engine_t* engine) {
+    return engine->inflight;
+}
+
+void blk_engine_get_stats(const blk_engine_t* engine, blk_engine_stats_t* stats) {
+    *stats = engine->stats;
+}
+
+#ifdef BLK_ENGINE_TEST
+/* Self-test on temporary files: cc -O2 -DBLK_ENGINE_TEST blk_engine.c disk_image.c block_cache.c -lpthread */
+#include <stdio.h>
+
+#define TEST_SIZE (64ULL << 20)
+#define TEST_GUEST (1ULL << 20)
+
+#include "../test_check.h"
+
+static uint32_t completions;
+static int last_status;
+
+static void test_complete(void* ctx, blk_request_t* req) {
+    (void)ctx;
+    completions++;
+    last_status = req->status;
+}
+
+static void fill(uint8_t* buf, uint64_t length, uint8_t seed) {
+    for (uint64_t i = 0; i < length; i++) {
+        buf[i] = (uint8_t)(i * 131 + seed) | 1;
+    }
+}
+
+// A 64MB image whose first 256KB is allocated and holds fill(seed 7)
+static disk_image_t* test_image(char* path) {
+    uint8_t data[256 << 10];
+
+    strcpy(path, "/tmp/qxbe-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    close(fd);
+
+    disk_image_t* image = disk_image_create(path, TEST_SIZE, NULL);
+    fill(data, sizeof(data), 7);
+    if (image && disk_image_write(image, 0, data, sizeof(data)) != (int64_t)sizeof(data)) {
+        disk_image_close(image);
+        image = NULL;
+    }
+    if (!image) {
+        unlink(path);
+    }
+    return image;
+}
+
+static void read_request(blk_request_t* req, uint64_t offset, void* buf, uint64_t length) {
+    memset(req, 0, sizeof(*req));
+    req->type = BLK_REQ_READ;
+    req->offset = offset;
+    req->iov_count = 1;
+    req->iov[0].iov_base = buf;
+    req->iov[0].iov_len = length;
+}
+
+static void run_until(blk_engine_t* e, uint32_t expected) {
+    blk_engine_kick(e);
+    for (int i = 0; i < 100 && (completions < expected || e->inflight > 0); i++) {
+        blk_engine_poll(e, true, NULL);
+    }
+}
+
+// Requests that continue each other in the image share one host operation
+static void test_merge(disk_image_t* image) {
+    uint8_t expect[8192];
+    uint8_t a[4096], b[4096];
+    blk_request_t ra, rb;
+
+    fill(expect, sizeof(expect), 7);
+    completions = 0;
+
+    blk_engine_t* e = blk_engine_create(image, NULL, 0, 0, -1, test_complete, NULL);
+    CHECK(e, "create");
+    if (!e) {
+        return;
+    }
+    if (!blk_engine_async(e)) {
+        printf("no io_uring here; merges are checked on the synchronous path\n");
+    }
+
+    read_request(&ra, 0, a, sizeof(a));
+    read_request(&rb, 4096, b, sizeof(b));
+    blk_engine_queue(e, &ra);
+    blk_engine_queue(e, &rb);
+    run_until(e, 2);
+
+    blk_engine_stats_t stats;
+    blk_engine_get_stats(e, &stats);
+    CHECK(completions == 2 && ra.status == 0 && rb.status == 0, "%u completions, status %d %d",
+          completions, ra.status, rb.status);
+    CHECK(memcmp(a, expect, 4096) == 0 && memcmp(b, expect + 4096, 4096) == 0, "merged read data");
+    CHECK(stats.ops == 1 && stats.merged == 1, "%llu ops, %llu merged for two adjacent reads",
+          (unsigned long long)stats.ops, (unsigned long long)stats.merged);
+
+    blk_engine_destroy(e);
+}
+
+// Pinned guest RAM takes fixed I/O for single buffers, vectored for the rest;
+// unpinned RAM is never registered
+static void test_fixed_split(disk_image_t* image) {
+    uint8_t* guest = aligned_alloc(4096, TEST_GUEST);
+    uint8_t expect[8192];
+    blk_request_t req;
+    blk_engine_stats_t stats;
+
+    fill(expect, sizeof(expect), 7);
+    completions = 0;
+
+    blk_engine_t* e = blk_engine_create(image, guest, TEST_GUEST, 0, -1, test_complete, NULL);
+    CHECK(e && !e->fixed_buffers, "unpinned guest RAM was registered");
+    if (e) {
+        read_request(&req, 0, guest, 8192);
+        blk_engine_queue(e, &req);
+        run_until(e, 1);
+        blk_engine_get_stats(e, &stats);
+        CHECK(req.status == 0 && stats.fixed_ops == 0 && memcmp(guest, expect, 8192) == 0,
+              "unpinned read: status %d, %llu fixed ops", req.status,
+              (unsigned long long)stats.fixed_ops);
+        blk_engine_destroy(e);
+    }
+
+    e = blk_engine_create(image, guest, TEST_GUEST, BLK_ENGINE_PIN_GUEST, -1, test_complete, NULL);
+    CHECK(e, "create pinned");
+    if (!e) {
+        free(guest);
+        return;
+    }
+    if (!e->fixed_buffers) {
+        printf("guest RAM could not be registered (io_uring or RLIMIT_MEMLOCK); fixed I/O skipped\n");
+        blk_engine_destroy(e);
+        free(guest);
+        return;
+    }
+
+    memset(guest, 0, TEST_GUEST);
+    completions = 0;
+    read_request(&req, 0, guest + 65536, 8192);
+    blk_engine_queue(e, &req);
+    run_until(e, 1);
+    blk_engine_get_stats(e, &stats);
+    CHECK(req.status == 0 && stats.fixed_ops == 1 && memcmp(guest + 65536, expect, 8192) == 0,
+          "single buffer: status %d, %llu fixed ops", req.status,
+          (unsigned long long)stats.fixed_ops);
+
+    // Two guest buffers that don't continue each other: one vectored operation
+    completions = 0;
+    read_request(&req, 0, guest, 4096);
+    req.iov[1].iov_base = guest + 3 * 4096;
+    req.iov[1].iov_len = 4096;
+    req.iov_count = 2;
+    blk_engine_queue(e, &req);
+    run_until(e, 1);
+    blk_engine_get_stats(e, &stats);
+    CHECK(req.status == 0 && stats.fixed_ops == 1 &&
+          memcmp(guest, expect, 4096) == 0 && memcmp(guest + 3 * 4096, expect + 4096, 4096) == 0,
+          "scattered buffers: status %d, %llu fixed ops", req.status,
+          (unsigned long long)stats.fixed_ops);
+
+    blk_engine_destroy(e);
+    free(guest);
+}
+
+// Without a ring every request completes inside the kick
+static void test_sync_fallback(disk_image_t* image) {
+    uint8_t data[4096], back[4096];
+    blk_request_t req;
+
+    blk_engine_t* e = blk_engine_create(image, NULL, 0, 0, -1, test_complete, NULL);
+    CHECK(e, "create");
+    if (!e) {
+        return;
+    }
+    if (e->ring) {
+        ring_destroy(e->ring);
+        e->ring = NULL;
+        e->fixed_file = false;
+    }
+
+    fill(data, sizeof(data), 42);
+    memset(&req, 0, sizeof(req));
+    req.type = BLK_REQ_WRITE;
+    req.offset = 128 << 10;
+    req.iov_count = 1;
+    req.iov[0].iov_base = data;
+    req.iov[0].iov_len = sizeof(data);
+    completions = 0;
+    blk_engine_queue(e, &req);
+    CHECK(blk_engine_kick(e) == 1 && completions == 1 && req.status == 0 && e->inflight == 0,
+          "sync write: %u completions, status %d", completions, req.status);
+
+    read_request(&req, 128 << 10, back, sizeof(back));
+    blk_engine_queue(e, &req);
+    blk_engine_kick(e);
+    CHECK(completions == 2 && req.status == 0 && memcmp(back, data, sizeof(data)) == 0,
+          "sync read back: status %d", req.status);
+
+    // Unallocated clusters read as zeros without touching the file
+    memset(back, 0xff, sizeof(back));
+    read_request(&req, TEST_SIZE / 2, back, sizeof(back));
+    blk_engine_queue(e, &req);
+    blk_engine_kick(e);
+    CHECK(completions == 3 && req.status == 0 && back[0] == 0 && back[4095] == 0,
+          "zero cluster: status %d", req.status);
+
+    read_request(&req, TEST_SIZE - 2048, back, sizeof(back));
+    blk_engine_queue(e, &req);
+    blk_engine_kick(e);
+    CHECK(completions == 4 && last_status == -EINVAL, "read past the end: status %d", last_status);
+
+    blk_engine_stats_t stats;
+    blk_engine_get_stats(e, &stats);
+    CHECK(stats.inline_ops >= 2 && stats.submits == 0, "%llu inline ops, %llu submits",
+          (unsigned long long)stats.inline_ops, (unsigned long long)stats.submits);
+
+    blk_engine_destroy(e);
+}
+
+// A read that completes after the file changed under a write-back cache is read again
+static void test_stale_fill(void) {
+    uint8_t fresh[4096], stale[4096];
+    uint64_t host, chunk;
+    blk_request_t req;
+    char path[32];
+
+    disk_image_t* image = test_image(path);
+    block_cache_t* cache = block_cache_create(1 << 20, BLOCK_CACHE_WRITEBACK);
+    CHECK(image && cache && disk_image_set_cache(image, cache, 1) == 0, "image with a cache");
+    blk_engine_t* e = image && cache ?
+        blk_engine_create(image, NULL, 0, 0, -1, test_complete, NULL) : NULL;
+    CHECK(e && e->write_back, "engine over a write-back cache");
+    if (!e) {
+        if (image) {
+            disk_image_close(image);
+            unlink(path);
+        }
+        block_cache_destroy(cache);
+        return;
+    }
+
+    CHECK(disk_image_map(image, 192 << 10, sizeof(fresh), false, &host, &chunk) == DISK_MAP_DATA,
+          "map");
+    read_request(&req, 192 << 10, stale, sizeof(stale));
+    req.pending = 1;
+    completions = 0;
+
+    // Built before the file changes, as a read in flight would be
+    blk_op_t* op = op_alloc(e, IORING_OP_READV, host);
+    fill(stale, sizeof(stale), 7);
+    op->iov[0].iov_base = stale;
+    op->iov[0].iov_len = sizeof(stale);
+    op->owner[0] = &req;
+    op->iov_count = 1;
+    op->length = sizeof(stale);
+
+    fill(fresh, sizeof(fresh), 99);
+    CHECK(pwrite(e->image_fd, fresh, sizeof(fresh), host) == (ssize_t)sizeof(fresh), "pwrite");
+    block_cache_invalidate(cache, e->cache_file, host, sizeof(fresh));
+
+    e->inflight++;
+    op_complete(e, op, sizeof(stale));
+    CHECK(completions == 1 && req.status == 0, "%u completions, status %d", completions, req.status);
+    CHECK(memcmp(stale, fresh, sizeof(fresh)) == 0, "stale read was not redone");
+
+    // The redone read filled the cache with the current data
+    uint8_t cached[4096];
+    CHECK(block_cache_lookup(cache, e->cache_file, 1, host, cached, sizeof(cached)) &&
+          memcmp(cached, fresh, sizeof(fresh)) == 0, "cache holds stale data");
+
+    blk_engine_destroy(e);
+    disk_image_close(image);
+    unlink(path);
+    block_cache_destroy(cache);
+}
+
+int main(void) {
+    char path[32];
+    disk_image_t* image = test_image(path);
+    CHECK(image, "create test image");
+    if (!image) {
+        return 1;
+    }
+
+    test_merge(image);
+    test_fixed_split(image);
+    test_sync_fallback(image);
+
+    disk_image_close(image);
+    unlink(path);
+
+    test_stale_fill();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
+#endif
@@ -0,0 +1,1047 @@
+/*
+ * QENEX Hypervisor - Shared Block Cache
+ *
+ * ARC-managed block cache with readahead and write-back. See block_cache.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "block_cache.h"
+
+#define BS BLOCK_CACHE_BLOCK_SIZE
+#define GROUP_MASK ((1ULL << BLOCK_CACHE_SHARD_GROUP_BITS) - 1)
+
+enum {
+    LIST_NONE,
+    LIST_T1,                // Resident, seen once
+    LIST_T2,                // Resident, seen more than once
+    LIST_B1,                // Ghost of a T1 eviction
+    LIST_B2                 // Ghost of a T2 eviction
+};
+
+typedef struct cache_node {
+    int file;
+    uint64_t index;
+    uint8_t list;
+    bool dirty;
+    bool prefetched;        // Brought in by readahead and not yet read
+    uint64_t dirty_since;
+
+    struct cache_node* prev;        // ARC list, MRU at the head
+    struct cache_node* next;
+    struct cache_node* dirty_prev;  // Oldest dirty block at the head
+    struct cache_node* dirty_next;
+    struct cache_node* hash_next;
+    uint8_t* data;                  // NULL on ghost lists
+} cache_node_t;
+
+typedef struct {
+    cache_node_t* head;
+    cache_node_t* tail;
+    uint64_t size;
+} node_list_t;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    uint32_t refs;
+    uint64_t seq;           // Bumped when the file changes under the cache
+} cache_file_t;
+
+typedef struct {
+    bool used;
+    int file;
+    uint32_t vm_id;
+    uint64_t next_offset;
+    uint32_t window;        // Blocks; 0 until the stream looks sequential
+    uint64_t ra_end;        // Prefetched up to here
+} read_stream_t;
+
+typedef struct {
+    int file;
+    uint64_t offset;
+    uint32_t blocks;
+    uint64_t seq;
+} readahead_t;
+
+/*
+ * One independent ARC over a slice of the key space. Runs of
+ * 2^BLOCK_CACHE_SHARD_GROUP_BITS blocks stay in one shard, so a typical
+ * request takes one shard lock and unrelated requests rarely share one.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    block_cache_t* cache;
+
+    uint64_t capacity;
+    uint64_t p;                     // ARC target size for T1
+
+    node_list_t t1, t2, b1, b2;
+    cache_node_t* free_nodes;
+    uint8_t** free_data;
+    uint64_t free_data_count;
+
+    cache_node_t** buckets;
+    uint64_t bucket_mask;
+
+    cache_node_t* dirty_head;
+    cache_node_t* dirty_tail;
+    uint64_t dirty;
+
+    uint64_t evictions;
+    uint64_t readahead_blocks;
+    uint64_t written_back;
+    block_cache_vm_stats_t vm_stats[BLOCK_CACHE_MAX_VMS];
+} __attribute__((aligned(64))) cache_shard_t;
+
+struct block_cache {
+    block_cache_mode_t mode;
+    uint64_t capacity;
+
+    cache_shard_t shards[BLOCK_CACHE_SHARDS];
+    cache_node_t* nodes;            // 2 x capacity: residents plus ghosts
+    uint8_t* data;
+    uint8_t** free_data;
+
+    // Attach and detach only; the data path reads fd and seq without it
+    pthread_mutex_t files_lock;
+    cache_file_t files[BLOCK_CACHE_MAX_FILES];
+
+    // Stream detection and the readahead queue; never waited on by readers
+    pthread_mutex_t ra_lock;
+    read_stream_t streams[BLOCK_CACHE_STREAMS];
+    readahead_t readahead[BLOCK_CACHE_READAHEAD_QUEUE];
+    uint32_t ra_head;
+    uint32_t ra_count;
+
+    pthread_cond_t wake;
+    pthread_t worker;
+    bool running;
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int pread_full(int fd, void* buf, uint64_t length, uint64_t offset) {
+    uint8_t* p = buf;
+
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            memset(p, 0, length);  // Past the end of the file reads as zeros
+            return 0;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buf, uint64_t length, uint64_t offset) {
+    const uint8_t* p = buf;
+
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static uint64_t file_seq(block_cache_t* cache, int file) {
+    return __atomic_load_n(&cache->files[file].seq, __ATOMIC_ACQUIRE);
+}
+
+static void file_seq_bump(block_cache_t* cache, int file) {
+    __atomic_fetch_add(&cache->files[file].seq, 1, __ATOMIC_ACQ_REL);
+}
+
+static block_cache_vm_stats_t* vm_stats(cache_shard_t* s, uint32_t vm_id) {
+    return &s->vm_stats[vm_id < BLOCK_CACHE_MAX_VMS ? vm_id : BLOCK_CACHE_MAX_VMS - 1];
+}
+
+static cache_shard_t* shard_of(block_cache_t* cache, int file, uint64_t index) {
+    uint64_t h = ((index >> BLOCK_CACHE_SHARD_GROUP_BITS) ^ ((uint64_t)file << 40)) *
+                 0x9E3779B97F4A7C15ULL;
+    return &cache->shards[(h >> 32) % BLOCK_CACHE_SHARDS];
+}
+
+// Part of block `index` that [offset, offset+length) covers
+static void block_span(uint64_t index, uint64_t offset, uint64_t length,
+                       uint64_t* from, uint64_t* to) {
+    uint64_t block_start = index * BS;
+    *from = offset > block_start ? offset - block_start : 0;
+    *to = offset + length < block_start + BS ? offset + length - block_start : BS;
+}
+
+/* ==================== HASH AND LISTS ==================== */
+
+static uint64_t hash_key(const cache_shard_t* s, int file, uint64_t index) {
+    uint64_t h = (index ^ ((uint64_t)file << 48)) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 17) & s->bucket_mask;
+}
+
+static cache_node_t* hash_find(cache_shard_t* s, int file, uint64_t index) {
+    cache_node_t* node = s->buckets[hash_key(s, file, index)];
+
+    while (node && (node->file != file || node->index != index)) {
+        node = node->hash_next;
+    }
+    return node;
+}
+
+static void hash_insert(cache_shard_t* s, cache_node_t* node) {
+    cache_node_t** bucket = &s->buckets[hash_key(s, node->file, node->index)];
+    node->hash_next = *bucket;
+    *bucket = node;
+}
+
+static void hash_remove(cache_shard_t* s, cache_node_t* node) {
+    cache_node_t** link = &s->buckets[hash_key(s, node->file, node->index)];
+
+    while (*link != node) {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+}
+
+static node_list_t* list_of(cache_shard_t* s, uint8_t list) {
+    switch (list) {
+        case LIST_T1: return &s->t1;
+        case LIST_T2: return &s->t2;
+        case LIST_B1: return &s->b1;
+        case LIST_B2: return &s->b2;
+        default: return NULL;
+    }
+}
+
+static void list_unlink(cache_shard_t* s, cache_node_t* node) {
+    node_list_t* list = list_of(s, node->list);
+
+    if (node->prev) node->prev->next = node->next;
+    else list->head = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else list->tail = node->prev;
+
+    list->size--;
+    node->prev = node->next = NULL;
+    node->list = LIST_NONE;
+}
+
+static void list_push_mru(cache_shard_t* s, cache_node_t* node, uint8_t list_id) {
+    node_list_t* list = list_of(s, list_id);
+
+    node->list = list_id;
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head) list->head->prev = node;
+    else list->tail = node;
+    list->head = node;
+    list->size++;
+}
+
+static void dirty_unlink(cache_shard_t* s, cache_node_t* node) {
+    if (node->dirty_prev) node->dirty_prev->dirty_next = node->dirty_next;
+    else s->dirty_head = node->dirty_next;
+    if (node->dirty_next) node->dirty_next->dirty_prev = node->dirty_prev;
+    else s->dirty_tail = node->dirty_prev;
+
+    node->dirty_prev = node->dirty_next = NULL;
+    node->dirty = false;
+    s->dirty--;
+}
+
+static void mark_dirty(cache_shard_t* s, cache_node_t* node) {
+    if (node->dirty) {
+        return;
+    }
+
+    node->dirty = true;
+    node->dirty_since = now_ms();
+    node->dirty_next = NULL;
+    node->dirty_prev = s->dirty_tail;
+    if (s->dirty_tail) s->dirty_tail->dirty_next = node;
+    else s->dirty_head = node;
+    s->dirty_tail = node;
+    s->dirty++;
+}
+
+// Write a dirty block back with the shard lock held; it stays dirty on failure
+static int write_back_locked(cache_shard_t* s, cache_node_t* node) {
+    cache_file_t* file = &s->cache->files[node->file];
+
+    if (pwrite_full(file->fd, node->data, BS, node->index * BS) < 0) {
+        return -1;
+    }
+    s->written_back++;
+    dirty_unlink(s, node);
+    file_seq_bump(s->cache, node->file);
+    return 0;
+}
+
+// Eviction can't keep a block it failed to write; the file keeps the old copy
+static void write_back_or_drop(cache_shard_t* s, cache_node_t* node) {
+    if (write_back_locked(s, node) < 0) {
+        dirty_unlink(s, node);
+    }
+}
+
+/* ==================== ARC ==================== */
+
+// Move one resident block to its ghost list and free its buffer
+static void replace(cache_shard_t* s, bool ghost_in_b2) {
+    cache_node_t* victim;
+    uint8_t ghost;
+
+    if (s->t1.size > 0 &&
+        (s->t1.size > s->p || (ghost_in_b2 && s->t1.size == s->p) || s->t2.size == 0)) {
+        victim = s->t1.tail;
+        ghost = LIST_B1;
+    } else {
+        victim = s->t2.tail;
+        ghost = LIST_B2;
+    }
+
+    if (victim->dirty) {
+        write_back_or_drop(s, victim);
+    }
+
+    list_unlink(s, victim);
+    list_push_mru(s, victim, ghost);
+    s->free_data[s->free_data_count++] = victim->data;
+    victim->data = NULL;
+    victim->prefetched = false;
+    s->evictions++;
+}
+
+// Forget a block entirely, ghost or resident
+static void drop_node(cache_shard_t* s, cache_node_t* node) {
+    if (node->data) {
+        if (node->dirty) {
+            write_back_or_drop(s, node);
+        }
+        s->free_data[s->free_data_count++] = node->data;
+        node->data = NULL;
+    }
+
+    list_unlink(s, node);
+    hash_remove(s, node);
+    node->hash_next = s->free_nodes;
+    s->free_nodes = node;
+}
+
+static uint8_t* take_buffer(cache_shard_t* s, bool ghost_in_b2) {
+    if (s->free_data_count == 0) {
+        replace(s, ghost_in_b2);
+    }
+    return s->free_data[--s->free_data_count];
+}
+
+/*
+ * Make (file, index) resident and return it; the caller fills the data.
+ * This is ARC's miss path, including the ghost-hit adaptation of p.
+ */
+static cache_node_t* admit(cache_shard_t* s, int file, uint64_t index) {
+    cache_node_t* node = hash_find(s, file, index);
+    uint64_t c = s->capacity;
+
+    if (node && node->list == LIST_B1) {
+        // Recency is paying off: grow T1's share
+        uint64_t delta = s->b2.size > s->b1.size ? s->b2.size / s->b1.size : 1;
+        s->p = s->p + delta < c ? s->p + delta : c;
+        list_unlink(s, node);
+        node->data = take_buffer(s, false);
+        list_push_mru(s, node, LIST_T2);
+        return node;
+    }
+
+    if (node && node->list == LIST_B2) {
+        // Frequency is paying off: shrink T1's share
+        uint64_t delta = s->b1.size > s->b2.size ? s->b1.size / s->b2.size : 1;
+        s->p = s->p > delta ? s->p - delta : 0;
+        list_unlink(s, node);
+        node->data = take_buffer(s, true);
+        list_push_mru(s, node, LIST_T2);
+        return node;
+    }
+
+    // Brand new key: keep the directory within ARC's bounds first
+    if (s->t1.size + s->b1.size >= c) {
+        if (s->t1.size < c) {
+            drop_node(s, s->b1.tail);
+        } else {
+            drop_node(s, s->t1.tail);
+        }
+    } else {
+        uint64_t total = s->t1.size + s->t2.size + s->b1.size + s->b2.size;
+        if (total >= 2 * c && s->b2.size > 0) {
+            drop_node(s, s->b2.tail);
+        }
+    }
+
+    node = s->free_nodes;
+    s->free_nodes = node->hash_next;
+    memset(node, 0, sizeof(*node));
+    node->file = file;
+    node->index = index;
+    node->data = take_buffer(s, false);
+    hash_insert(s, node);
+    list_push_mru(s, node, LIST_T1);
+    return node;
+}
+
+static cache_node_t* find_resident(cache_shard_t* s, int file, uint64_t index) {
+    cache_node_t* node = hash_find(s, file, index);
+    return node && node->data ? node : NULL;
+}
+
+static void touch(cache_shard_t* s, cache_node_t* node, block_cache_vm_stats_t* stats) {
+    if (node->prefetched) {
+        node->prefetched = false;
+        stats->readahead_hits++;
+    }
+    list_unlink(s, node);
+    list_push_mru(s, node, LIST_T2);
+}
+
+// Insert prefetched data for whole blocks that aren't cached yet
+static void fill_prefetched(block_cache_t* cache, int file, uint64_t seq,
+                            uint64_t offset, const uint8_t* buf, uint64_t length) {
+    uint64_t index = (offset + BS - 1) / BS;
+    uint64_t end = (offset + length) / BS;
+
+    while (index < end) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_end = (index | GROUP_MASK) + 1;
+
+        pthread_mutex_lock(&s->lock);
+        for (; index < end && index < group_end; index++) {
+            if (file_seq(cache, file) != seq) {
+                pthread_mutex_unlock(&s->lock);
+                return;
+            }
+            if (find_resident(s, file, index)) {
+                continue;  // The cache copy is at least as new
+            }
+            cache_node_t* node = admit(s, file, index);
+            memcpy(node->data, buf + (index * BS - offset), BS);
+            node->prefetched = true;
+            s->readahead_blocks++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* ==================== READAHEAD ==================== */
+
+// Watch for sequential streams; skipped rather than waited for under contention
+static void note_access(block_cache_t* cache, int file, uint32_t vm_id,
+                        uint64_t offset, uint64_t length) {
+    if (pthread_mutex_trylock(&cache->ra_lock) != 0) {
+        return;
+    }
+
+    read_stream_t* s = &cache->streams[((uint32_t)file * 31 + vm_id) % BLOCK_CACHE_STREAMS];
+
+    if (!s->used || s->file != file || s->vm_id != vm_id || offset != s->next_offset) {
+        s->used = true;
+        s->file = file;
+        s->vm_id = vm_id;
+        s->window = 0;
+        s->ra_end = 0;
+        s->next_offset = offset + length;
+        pthread_mutex_unlock(&cache->ra_lock);
+        return;
+    }
+
+    s->window = s->window ? s->window * 2 : BLOCK_CACHE_READAHEAD_MIN;
+    if (s->window > BLOCK_CACHE_READAHEAD_MAX) {
+        s->window = BLOCK_CACHE_READAHEAD_MAX;
+    }
+    s->next_offset = offset + length;
+
+    // Keep a window's worth prefetched ahead of the reader
+    uint64_t want = (s->next_offset + (uint64_t)s->window * BS + BS - 1) / BS * BS;
+    if (want > s->ra_end && cache->ra_count < BLOCK_CACHE_READAHEAD_QUEUE) {
+        uint64_t start = s->ra_end > s->next_offset ? s->ra_end : s->next_offset / BS * BS;
+        readahead_t* ra = &cache->readahead[(cache->ra_head + cache->ra_count) %
+                                            BLOCK_CACHE_READAHEAD_QUEUE];
+        ra->file = file;
+        ra->offset = start;
+        ra->blocks = (want - start) / BS;
+        ra->seq = file_seq(cache, file);
+        cache->ra_count++;
+        s->ra_end = want;
+        pthread_cond_signal(&cache->wake);
+    }
+
+    pthread_mutex_unlock(&cache->ra_lock);
+}
+
+/* ==================== WORKER ==================== */
+
+/*
+ * Write back one shard's expired blocks, or its oldest while it is over the
+ * mark. Each write happens under the lock, like eviction's, so an older copy
+ * of a block can never land after a newer one; the lock is dropped between
+ * blocks so guests aren't held off for the whole batch.
+ */
+static void write_back_shard(cache_shard_t* s, uint64_t now) {
+    pthread_mutex_lock(&s->lock);
+
+    while (s->dirty_head &&
+           (s->dirty * 100 > s->capacity * BLOCK_CACHE_DIRTY_HIGH ||
+            now - s->dirty_head->dirty_since >= BLOCK_CACHE_DIRTY_EXPIRE_MS)) {
+        if (write_back_locked(s, s->dirty_head) < 0) {
+            break;  // Still dirty; try again next round
+        }
+
+        pthread_mutex_unlock(&s->lock);
+        pthread_mutex_lock(&s->lock);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+static void* cache_worker(void* arg) {
+    block_cache_t* cache = arg;
+    uint8_t* buffer = malloc((size_t)BLOCK_CACHE_READAHEAD_MAX * BS);
+
+    pthread_mutex_lock(&cache->ra_lock);
+
+    while (cache->running && buffer) {
+        // Readahead first; a reader is likely waiting on it
+        if (cache->ra_count > 0) {
+            readahead_t ra = cache->readahead[cache->ra_head];
+            cache->ra_head = (cache->ra_head + 1) % BLOCK_CACHE_READAHEAD_QUEUE;
+            cache->ra_count--;
+            pthread_mutex_unlock(&cache->ra_lock);
+
+            uint64_t length = (uint64_t)(ra.blocks < BLOCK_CACHE_READAHEAD_MAX ?
+                                         ra.blocks : BLOCK_CACHE_READAHEAD_MAX) * BS;
+            if (file_seq(cache, ra.file) == ra.seq &&
+                pread_full(cache->files[ra.file].fd, buffer, length, ra.offset) == 0) {
+                fill_prefetched(cache, ra.file, ra.seq, ra.offset, buffer, length);
+            }
+
+            pthread_mutex_lock(&cache->ra_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&cache->ra_lock);
+        uint64_t now = now_ms();
+        for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+            write_back_shard(&cache->shards[i], now);
+        }
+        pthread_mutex_lock(&cache->ra_lock);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += BLOCK_CACHE_FLUSH_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (cache->running && cache->ra_count == 0) {
+            pthread_cond_timedwait(&cache->wake, &cache->ra_lock, &deadline);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->ra_lock);
+    free(buffer);
+    return NULL;
+}
+
+/* ==================== SETUP ==================== */
+
+block_cache_t* block_cache_create(uint64_t capacity_bytes, block_cache_mode_t mode) {
+    uint64_t per_shard = capacity_bytes / BS / BLOCK_CACHE_SHARDS;
+    if (per_shard < 16) {
+        return NULL;
+    }
+
+    block_cache_t* cache = aligned_alloc(64, (sizeof(block_cache_t) + 63) & ~63UL);
+    if (!cache) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(*cache));
+
+    uint64_t buckets = 1;
+    while (buckets < 2 * per_shard) {
+        buckets <<= 1;
+    }
+
+    cache->mode = mode;
+    cache->capacity = per_shard * BLOCK_CACHE_SHARDS;
+    cache->nodes = calloc(2 * cache->capacity, sizeof(cache_node_t));
+    cache->data = aligned_alloc(BS, cache->capacity * BS);
+    cache->free_data = calloc(cache->capacity, sizeof(uint8_t*));
+
+    if (!cache->nodes || !cache->data || !cache->free_data) {
+        block_cache_destroy(cache);
+        return NULL;
+    }
+
+    // Each shard owns a fixed slice of the nodes and buffers
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* s = &cache->shards[i];
+        cache_node_t* nodes = cache->nodes + 2 * per_shard * i;
+        uint8_t* data = cache->data + per_shard * BS * i;
+
+        s->cache = cache;
+        s->capacity = per_shard;
+        s->bucket_mask = buckets - 1;
+        s->buckets = calloc(buckets, sizeof(cache_node_t*));
+        s->free_data = cache->free_data + per_shard * i;
+        if (!s->buckets) {
+            block_cache_destroy(cache);
+            return NULL;
+        }
+
+        for (uint64_t n = 0; n < 2 * per_shard; n++) {
+            nodes[n].hash_next = s->free_nodes;
+            s->free_nodes = &nodes[n];
+        }
+        for (uint64_t n = 0; n < per_shard; n++) {
+            s->free_data[s->free_data_count++] = data + n * BS;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+    }
+    for (int i = 0; i < BLOCK_CACHE_MAX_FILES; i++) {
+        cache->files[i].fd = -1;
+    }
+
+    pthread_mutex_init(&cache->files_lock, NULL);
+    pthread_mutex_init(&cache->ra_lock, NULL);
+    pthread_cond_init(&cache->wake, NULL);
+    cache->running = true;
+    if (pthread_create(&cache->worker, NULL, cache_worker, cache) != 0) {
+        cache->running = false;
+        block_cache_destroy(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void block_cache_destroy(block_cache_t* cache) {
+    if (!cache) {
+        return;
+    }
+
+    if (cache->running) {
+        pthread_mutex_lock(&cache->ra_lock);
+        cache->running = false;
+        pthread_cond_signal(&cache->wake);
+        pthread_mutex_unlock(&cache->ra_lock);
+        pthread_join(cache->worker, NULL);
+
+        block_cache_flush(cache, -1);
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_MAX_FILES; i++) {
+        if (cache->files[i].fd >= 0) {
+            close(cache->files[i].fd);
+        }
+    }
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        free(cache->shards[i].buckets);
+    }
+    free(cache->nodes);
+    free(cache->data);
+    free(cache->free_data);
+    free(cache);
+}
+
+block_cache_mode_t block_cache_mode(const block_cache_t* cache) {
+    return cache->mode;
+}
+
+// Register an open file; the same inode always gets the same handle
+int block_cache_attach(block_cache_t* cache, int fd) {
+    struct stat st;
+    int slot = -1;
+
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache->files_lock);
+
+    for (int i = 0; i < BLOCK_CACHE_MAX_FILES; i++) {
+        cache_file_t* file = &cache->files[i];
+        if (file->refs > 0 && file->dev == st.st_dev && file->ino == st.st_ino) {
+            file->refs++;
+            pthread_mutex_unlock(&cache->files_lock);
+            return i;
+        }
+        if (file->refs == 0 && slot < 0) {
+            slot = i;
+        }
+    }
+
+    if (slot >= 0) {
+        cache_file_t* file = &cache->files[slot];
+        // Our own descriptor, so write-back outlives the caller's
+        file->fd = dup(fd);
+        if (file->fd < 0) {
+            slot = -1;
+        } else {
+            file->dev = st.st_dev;
+            file->ino = st.st_ino;
+            file->refs = 1;
+            file_seq_bump(cache, slot);
+        }
+    }
+
+    pthread_mutex_unlock(&cache->files_lock);
+    return slot;
+}
+
+void block_cache_detach(block_cache_t* cache, int file) {
+    block_cache_flush(cache, file);
+
+    pthread_mutex_lock(&cache->files_lock);
+
+    cache_file_t* f = &cache->files[file];
+    if (--f->refs == 0) {
+        file_seq_bump(cache, file);  // Cancels queued readahead
+        for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+            cache_shard_t* s = &cache->shards[i];
+            cache_node_t* nodes = cache->nodes + 2 * s->capacity * i;
+
+            pthread_mutex_lock(&s->lock);
+            for (uint64_t n = 0; n < 2 * s->capacity; n++) {
+                if (nodes[n].list != LIST_NONE && nodes[n].file == file) {
+                    drop_node(s, &nodes[n]);
+                }
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        close(f->fd);
+        f->fd = -1;
+    }
+
+    pthread_mutex_unlock(&cache->files_lock);
+}
+
+/* ==================== DATA PATH ==================== */
+
+/*
+ * Copy the range out if every block is cached; counts a hit or a miss.
+ * Shards are checked one at a time, so on a miss buf may be partly written.
+ */
+bool block_cache_lookup(block_cache_t* cache, int file, uint32_t vm_id,
+                        uint64_t offset, void* buf, uint64_t length) {
+    uint64_t index = offset / BS;
+    uint64_t last = (offset + length - 1) / BS;
+    uint8_t* out = buf;
+
+    if (length == 0) {
+        return true;
+    }
+
+    note_access(cache, file, vm_id, offset, length);
+
+    while (index <= last) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_last = index | GROUP_MASK;
+        uint64_t end = group_last < last ? group_last : last;
+
+        pthread_mutex_lock(&s->lock);
+        block_cache_vm_stats_t* stats = vm_stats(s, vm_id);
+
+        for (uint64_t i = index; i <= end; i++) {
+            if (!find_resident(s, file, i)) {
+                stats->misses += last - index + 1;
+                pthread_mutex_unlock(&s->lock);
+                return false;
+            }
+        }
+
+        for (; index <= end; index++) {
+            cache_node_t* node = find_resident(s, file, index);
+            uint64_t from, to;
+            block_span(index, offset, length, &from, &to);
+            memcpy(out + (index * BS + from - offset), node->data + from, to - from);
+            touch(s, node, stats);
+            stats->hits++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    return true;
+}
+
+// Snapshot taken before reading a file directly; pass it to block_cache_fill
+uint64_t block_cache_fill_seq(block_cache_t* cache, int file) {
+    return file_seq(cache, file);
+}
+
+/*
+ * Reconcile data just read from the file with the cache. Cached blocks win,
+ * since in write-back mode they may be newer than the file, and are copied
+ * over buf. Whole blocks the cache lacks are kept, unless the file changed
+ * since seq was taken.
+ *
+ * Returns false if buf can't be trusted: a block was written back and may
+ * have left the cache after the file was read. Read again with a new seq.
+ */
+bool block_cache_fill(block_cache_t* cache, int file, uint64_t seq,
+                      uint64_t offset, void* buf, uint64_t length) {
+    uint8_t* data = buf;
+    uint64_t index = offset / BS;
+
+    while (index * BS < offset + length) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_end = (index | GROUP_MASK) + 1;
+
+        pthread_mutex_lock(&s->lock);
+        for (; index < group_end && index * BS < offset + length; index++) {
+            cache_node_t* node = find_resident(s, file, index);
+            uint64_t from, to;
+            block_span(index, offset, length, &from, &to);
+
+            if (node) {
+                memcpy(data + (index * BS + from - offset), node->data + from, to - from);
+            } else if (to - from == BS && file_seq(cache, file) == seq) {
+                // Checked per block: admitting one can write back another in range
+                node = admit(s, file, index);
+                memcpy(node->data, data + (index * BS - offset), BS);
+            }
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    // Write-through never has data only in the cache
+    return cache->mode == BLOCK_CACHE_WRITETHROUGH || file_seq(cache, file) == seq;
+}
+
+// The file was written directly; bring any cached copies up to date
+void block_cache_update(block_cache_t* cache, int file, uint64_t offset,
+                        const void* buf, uint64_t length) {
+    const uint8_t* in = buf;
+    uint64_t index = offset / BS;
+
+    file_seq_bump(cache, file);
+
+    while (index * BS < offset + length) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_end = (index | GROUP_MASK) + 1;
+
+        pthread_mutex_lock(&s->lock);
+        for (; index < group_end && index * BS < offset + length; index++) {
+            cache_node_t* node = find_resident(s, file, index);
+            if (!node) {
+                continue;
+            }
+            uint64_t from, to;
+            block_span(index, offset, length, &from, &to);
+            memcpy(node->data + from, in + (index * BS + from - offset), to - from);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+int64_t block_cache_read(block_cache_t* cache, int file, uint32_t vm_id,
+                         uint64_t offset, void* buf, uint64_t length) {
+    if (block_cache_lookup(cache, file, vm_id, offset, buf, length)) {
+        return length;
+    }
+
+    // Read whole blocks so the cache can keep them
+    uint64_t start = offset / BS * BS;
+    uint64_t end = (offset + length + BS - 1) / BS * BS;
+    uint8_t* tmp = malloc(end - start);
+    if (!tmp) {
+        return -1;
+    }
+
+    uint64_t seq;
+    do {
+        seq = block_cache_fill_seq(cache, file);
+        if (pread_full(cache->files[file].fd, tmp, end - start, start) < 0) {
+            free(tmp);
+            return -1;
+        }
+    } while (!block_cache_fill(cache, file, seq, start, tmp, end - start));
+    memcpy(buf, tmp + (offset - start), length);
+    free(tmp);
+    return length;
+}
+
+int64_t block_cache_write(block_cache_t* cache, int file, uint32_t vm_id,
+                          uint64_t offset, const void* buf, uint64_t length) {
+    const uint8_t* in = buf;
+    uint64_t index = offset / BS;
+    uint8_t old[BS];
+
+    if (cache->mode == BLOCK_CACHE_WRITETHROUGH) {
+        if (pwrite_full(cache->files[file].fd, buf, length, offset) < 0) {
+            return -1;
+        }
+        block_cache_update(cache, file, offset, buf, length);
+        return length;
+    }
+
+    // Written blocks stay resident until written back, so no seq bump here
+
+    while (index * BS < offset + length) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_end = (index | GROUP_MASK) + 1;
+
+        pthread_mutex_lock(&s->lock);
+        for (; index < group_end && index * BS < offset + length; index++) {
+            cache_node_t* node = find_resident(s, file, index);
+            uint64_t from, to;
+            block_span(index, offset, length, &from, &to);
+
+            if (!node && to - from < BS) {
+                // Partial block we don't hold: fetch the rest of it first
+                pthread_mutex_unlock(&s->lock);
+                int err = pread_full(cache->files[file].fd, old, BS, index * BS);
+                pthread_mutex_lock(&s->lock);
+                if (err) {
+                    pthread_mutex_unlock(&s->lock);
+                    return -1;
+                }
+
+                node = find_resident(s, file, index);
+                if (!node) {
+                    node = admit(s, file, index);
+                    memcpy(node->data, old, BS);
+                }
+            } else if (!node) {
+                node = admit(s, file, index);
+            }
+
+            memcpy(node->data + from, in + (index * BS + from - offset), to - from);
+            mark_dirty(s, node);
+            vm_stats(s, vm_id)->writes_absorbed++;
+        }
+
+        bool over = s->dirty * 100 > s->capacity * BLOCK_CACHE_DIRTY_HIGH;
+        pthread_mutex_unlock(&s->lock);
+
+        if (over) {
+            pthread_cond_signal(&cache->wake);
+        }
+    }
+
+    return length;
+}
+
+// Write back a file's dirty blocks and make them durable; file < 0 for all
+int block_cache_flush(block_cache_t* cache, int file) {
+    int err = 0;
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* s = &cache->shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        cache_node_t* node = s->dirty_head;
+        while (node) {
+            cache_node_t* next = node->dirty_next;
+            if ((file < 0 || node->file == file) && write_back_locked(s, node) < 0) {
+                err = -1;
+            }
+            node = next;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    for (int i = 0; i < BLOCK_CACHE_MAX_FILES; i++) {
+        if ((file < 0 || i == file) && cache->files[i].fd >= 0 &&
+            fdatasync(cache->files[i].fd) < 0) {
+            err = -1;
+        }
+    }
+
+    return err;
+}
+
+// Forget cached blocks for a discarded range; dirty data there is dropped
+void block_cache_invalidate(block_cache_t* cache, int file, uint64_t offset, uint64_t length) {
+    uint64_t index = offset / BS;
+
+    file_seq_bump(cache, file);
+
+    while (index * BS < offset + length) {
+        cache_shard_t* s = shard_of(cache, file, index);
+        uint64_t group_end = (index | GROUP_MASK) + 1;
+
+        pthread_mutex_lock(&s->lock);
+        for (; index < group_end && index * BS < offset + length; index++) {
+            cache_node_t* node = hash_find(s, file, index);
+            if (!node) {
+                continue;
+            }
+            if (node->dirty) {
+                dirty_unlink(s, node);
+            }
+            drop_node(s, node);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void block_cache_get_stats(block_cache_t* cache, block_cache_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->capacity = cache->capacity;
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* s = &cache->shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        stats->t1 += s->t1.size;
+        stats->t2 += s->t2.size;
+        stats->b1 += s->b1.size;
+        stats->b2 += s->b2.size;
+        stats->target_t1 += s->p;
+        stats->dirty += s->dirty;
+        stats->evictions += s->evictions;
+        stats->readahead_blocks += s->readahead_blocks;
+        stats->written_back += s->written_back;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void block_cache_get_vm_stats(block_cache_t* cache, uint32_t vm_id, block_cache_vm_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+
+    for (int i = 0; i < BLOCK_CACHE_SHARDS; i++) {
+        cache_shard_t* s = &cache->shards[i];
+
+        pthread_mutex_lock(&s->lock);
+        block_cache_vm_stats_t* v = vm_stats(s, vm_id);
+        stats->hits += v->hits;
+        stats->misses += v->misses;
+        stats->readahead_hits += v->readahead_hits;
+        stats->writes_absorbed += v->writes_absorbed;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
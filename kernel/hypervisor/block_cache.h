@@ -0,0 +1,95 @@
+/*
+ * QENEX Hypervisor - Shared Block Cache
+ *
+ * One size-bounded cache of 4KB blocks under every virtual disk. Files are
+ * identified by device and inode, so guests cloned from the same template
+ * share the template's cached blocks no matter who read them first.
+ *
+ * Eviction is ARC. Blocks seen once live on T1 and blocks seen again move
+ * to T2. Ghost lists (B1/B2) remember recently evicted keys and steer the
+ * T1/T2 split: a boot storm that streams through once cannot push out the
+ * library blocks every guest keeps coming back to.
+ *
+ * The key space is split over BLOCK_CACHE_SHARDS shards, each a complete
+ * ARC with its own lock, so disk queues running on different CPUs don't
+ * serialize on the cache. Runs of 64KB stay in one shard, and most
+ * requests take a single shard lock.
+ *
+ * Each (file, VM) stream is watched for sequential access. Once a stream
+ * reads sequentially, a background worker prefetches a window ahead of it.
+ * The window doubles up to BLOCK_CACHE_READAHEAD_MAX while the pattern
+ * holds.
+ *
+ * In write-back mode, writes complete once they are in the cache. The same
+ * worker writes dirty blocks back after BLOCK_CACHE_DIRTY_EXPIRE_MS, or
+ * sooner once too much of the cache is dirty. Guest flushes go through
+ * block_cache_flush(). In write-through mode, writes go to the file and
+ * cached copies are updated in place.
+ */
+
+#ifndef QENEX_BLOCK_CACHE_H
+#define QENEX_BLOCK_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BLOCK_CACHE_BLOCK_SIZE 4096
+#define BLOCK_CACHE_MAX_FILES 256
+#define BLOCK_CACHE_SHARDS 16               // Independent ARCs, each with its own lock
+#define BLOCK_CACHE_SHARD_GROUP_BITS 4      // 16 consecutive blocks share a shard
+#define BLOCK_CACHE_MAX_VMS 64              // Matches MAX_VMS
+#define BLOCK_CACHE_STREAMS 128             // Tracked (file, VM) read streams
+#define BLOCK_CACHE_READAHEAD_MIN 8         // Blocks; first window is 32KB
+#define BLOCK_CACHE_READAHEAD_MAX 256       // Blocks; windows stop growing at 1MB
+#define BLOCK_CACHE_READAHEAD_QUEUE 64
+#define BLOCK_CACHE_DIRTY_EXPIRE_MS 5000
+#define BLOCK_CACHE_FLUSH_INTERVAL_MS 500
+#define BLOCK_CACHE_DIRTY_HIGH 20           // Percent dirty that forces write-back
+
+typedef enum {
+    BLOCK_CACHE_WRITETHROUGH,
+    BLOCK_CACHE_WRITEBACK
+} block_cache_mode_t;
+
+typedef struct {
+    uint64_t hits;                  // Blocks served from memory
+    uint64_t misses;
+    uint64_t readahead_hits;        // Hits on blocks the worker prefetched
+    uint64_t writes_absorbed;       // Blocks written into the cache (write-back)
+} block_cache_vm_stats_t;
+
+typedef struct {
+    uint64_t capacity;              // Blocks
+    uint64_t t1, t2, b1, b2;
+    uint64_t target_t1;             // ARC's p
+    uint64_t dirty;
+    uint64_t evictions;
+    uint64_t readahead_blocks;
+    uint64_t written_back;
+} block_cache_stats_t;
+
+typedef struct block_cache block_cache_t;
+
+/* Function prototypes */
+block_cache_t* block_cache_create(uint64_t capacity_bytes, block_cache_mode_t mode);
+void block_cache_destroy(block_cache_t* cache);
+block_cache_mode_t block_cache_mode(const block_cache_t* cache);
+int block_cache_attach(block_cache_t* cache, int fd);
+void block_cache_detach(block_cache_t* cache, int file);
+bool block_cache_lookup(block_cache_t* cache, int file, uint32_t vm_id,
+                        uint64_t offset, void* buf, uint64_t length);
+uint64_t block_cache_fill_seq(block_cache_t* cache, int file);
+bool block_cache_fill(block_cache_t* cache, int file, uint64_t seq,
+                      uint64_t offset, void* buf, uint64_t length);
+void block_cache_update(block_cache_t* cache, int file, uint64_t offset,
+                        const void* buf, uint64_t length);
+int64_t block_cache_read(block_cache_t* cache, int file, uint32_t vm_id,
+                         uint64_t offset, void* buf, uint64_t length);
+int64_t block_cache_write(block_cache_t* cache, int file, uint32_t vm_id,
+                          uint64_t offset, const void* buf, uint64_t length);
+int block_cache_flush(block_cache_t* cache, int file);
+void block_cache_invalidate(block_cache_t* cache, int file, uint64_t offset, uint64_t length);
+void block_cache_get_stats(block_cache_t* cache, block_cache_stats_t* stats);
+void block_cache_get_vm_stats(block_cache_t* cache, uint32_t vm_id, block_cache_vm_stats_t* stats);
+
+#endif /* QENEX_BLOCK_CACHE_H */
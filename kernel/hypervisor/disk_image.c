@@ -0,0 +1,1190 @@
+/*
+ * QENEX Hypervisor - Sparse Disk Images
+ *
+ * Two-level mapped copy-on-write images. See disk_image.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include "disk_image.h"
+
+typedef struct {
+    uint64_t offset;        // L2 table's position in the file; 0 if the slot is free
+    uint64_t* table;
+    uint64_t last_used;
+} l2_cache_slot_t;
+
+struct disk_image {
+    int fd;
+    bool read_only;
+    disk_image_header_t header;
+
+    uint32_t cluster_size;
+    uint32_t l2_bits;
+    uint64_t* l1;
+    uint64_t file_end;
+
+    // Unwritten clusters read from here; a raw base has no header
+    disk_image_t* base;
+    int base_raw_fd;
+    uint64_t base_size;
+
+    l2_cache_slot_t l2_cache[DISK_IMAGE_L2_CACHE];
+    uint64_t* l2_spare;     // Next table to load into; swapped in whole
+    uint64_t tick;
+
+    // Odd while L1, the L2 cache or an L2 entry is changing
+    uint32_t map_seq;
+
+    // Data clusters and raw base reads go through the shared block cache
+    block_cache_t* cache;
+    int cache_file;
+    int base_cache_file;
+    uint32_t cache_vm;
+
+    disk_image_stats_t stats;
+    pthread_mutex_t lock;
+};
+
+static disk_image_t* open_image(const char* path, bool read_only, int depth);
+
+/* ==================== FILE HELPERS ==================== */
+
+static int pread_full(int fd, void* buf, uint64_t length, uint64_t offset) {
+    uint8_t* p = buf;
+
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            memset(p, 0, length);  // Past the end of the file reads as zeros
+            return 0;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static int pwrite_full(int fd, const void* buf, uint64_t length, uint64_t offset) {
+    const uint8_t* p = buf;
+
+    while (length > 0) {
+        ssize_t n = pwrite(fd, p, length, offset);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+    return 0;
+}
+
+static bool is_zero(const void* buf, uint64_t length) {
+    const uint64_t* words = buf;
+
+    for (uint64_t i = 0; i < length / sizeof(uint64_t); i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Guest data in the image file, through the block cache when one is set
+static int data_read(disk_image_t* image, void* buf, uint64_t length, uint64_t host) {
+    if (image->cache) {
+        return block_cache_read(image->cache, image->cache_file, image->cache_vm,
+                                host, buf, length) < 0 ? -1 : 0;
+    }
+    return pread_full(image->fd, buf, length, host);
+}
+
+static int data_write(disk_image_t* image, const void* buf, uint64_t length, uint64_t host) {
+    if (image->cache) {
+        return block_cache_write(image->cache, image->cache_file, image->cache_vm,
+                                 host, buf, length) < 0 ? -1 : 0;
+    }
+    return pwrite_full(image->fd, buf, length, host);
+}
+
+/* ==================== BASE IMAGE ==================== */
+
+static int read_base(disk_image_t* image, uint64_t offset, void* buf, uint64_t length) {
+    if (image->base) {
+        return disk_image_read(image->base, offset, buf, length) < 0 ? -1 : 0;
+    }
+
+    // Raw bases may be smaller than the overlay
+    uint64_t avail = offset < image->base_size ? image->base_size - offset : 0;
+    if (avail > length) {
+        avail = length;
+    }
+    if (avail && image->cache) {
+        if (block_cache_read(image->cache, image->base_cache_file, image->cache_vm,
+                             offset, buf, avail) < 0) {
+            return -1;
+        }
+    } else if (avail && pread_full(image->base_raw_fd, buf, avail, offset) < 0) {
+        return -1;
+    }
+    memset((uint8_t*)buf + avail, 0, length - avail);
+    return 0;
+}
+
+static int open_base(disk_image_t* image, int depth) {
+    const char* path = image->header.base_path;
+
+    if (path[0] == '\0') {
+        return 0;
+    }
+    if (depth >= DISK_IMAGE_MAX_DEPTH) {
+        return -1;
+    }
+
+    // Bases are never written through an overlay
+    image->base = open_image(path, true, depth + 1);
+    if (image->base) {
+        return 0;
+    }
+
+    image->base_raw_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (image->base_raw_fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(image->base_raw_fd, &st) < 0) {
+        return -1;
+    }
+    image->base_size = st.st_size;
+    return 0;
+}
+
+/* ==================== L2 TABLE CACHE ==================== */
+
+/*
+ * Mapping an allocated cluster is the hot path for every queue of a disk,
+ * so it doesn't take image->lock. Writers hold the lock and bracket each
+ * change to L1, to an L2 cache slot or to an L2 entry with map_seq; readers
+ * retry if map_seq moved. No I/O happens inside a bracket: L2 tables are
+ * read into a spare buffer first and then swapped in.
+ */
+static void map_write_begin(disk_image_t* image) {
+    __atomic_store_n(&image->map_seq, image->map_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void map_write_end(disk_image_t* image) {
+    __atomic_store_n(&image->map_seq, image->map_seq + 1, __ATOMIC_RELEASE);
+}
+
+// L2 entry for a cluster without the lock; false if its table isn't cached
+static bool map_lockless(disk_image_t* image, uint64_t l1_index, uint64_t l2_index,
+                         uint64_t* entry) {
+    uint32_t seq;
+    bool found;
+
+    do {
+        while ((seq = __atomic_load_n(&image->map_seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+
+        uint64_t l2_offset = image->l1[l1_index];
+        found = !l2_offset;  // No table: the whole range is unallocated
+        *entry = 0;
+        for (int i = 0; l2_offset && i < DISK_IMAGE_L2_CACHE; i++) {
+            l2_cache_slot_t* slot = &image->l2_cache[i];
+            if (slot->offset == l2_offset) {
+                // Keep hot tables off the LRU end; stores only after a miss moved tick
+                uint64_t tick = __atomic_load_n(&image->tick, __ATOMIC_RELAXED);
+                if (slot->last_used != tick) {
+                    __atomic_store_n(&slot->last_used, tick, __ATOMIC_RELAXED);
+                }
+                *entry = slot->table[l2_index];
+                found = true;
+                break;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&image->map_seq, __ATOMIC_RELAXED) != seq);
+
+    return found;
+}
+
+static uint64_t* l2_lookup(disk_image_t* image, uint64_t l2_offset) {
+    l2_cache_slot_t* victim = &image->l2_cache[0];
+
+    image->tick++;
+    for (int i = 0; i < DISK_IMAGE_L2_CACHE; i++) {
+        l2_cache_slot_t* slot = &image->l2_cache[i];
+
+        if (slot->offset == l2_offset) {
+            slot->last_used = image->tick;
+            image->stats.l2_hits++;
+            return slot->table;
+        }
+        if (slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+
+    // Entries are written through, so eviction just drops the table
+    image->stats.l2_misses++;
+    if (!image->l2_spare) {
+        image->l2_spare = malloc(image->cluster_size);
+        if (!image->l2_spare) {
+            return NULL;
+        }
+    }
+    if (pread_full(image->fd, image->l2_spare, image->cluster_size, l2_offset) < 0) {
+        return NULL;
+    }
+
+    map_write_begin(image);
+    uint64_t* old = victim->table;
+    victim->table = image->l2_spare;
+    victim->offset = l2_offset;
+    map_write_end(image);
+
+    image->l2_spare = old;
+    victim->last_used = image->tick;
+    return victim->table;
+}
+
+static uint64_t allocate_cluster(disk_image_t* image) {
+    uint64_t offset = image->file_end;
+
+    // Extending the file leaves the new cluster reading as zeros
+    if (ftruncate(image->fd, offset + image->cluster_size) < 0) {
+        return 0;
+    }
+    image->file_end += image->cluster_size;
+    return offset;
+}
+
+// New, empty L2 table for an L1 slot; called with the lock held
+static uint64_t allocate_l2(disk_image_t* image, uint64_t l1_index) {
+    uint64_t l2_offset = allocate_cluster(image);
+
+    if (!l2_offset ||
+        pwrite_full(image->fd, &l2_offset, sizeof(l2_offset),
+                    image->header.l1_offset + l1_index * sizeof(uint64_t)) < 0) {
+        return 0;
+    }
+    map_write_begin(image);
+    image->l1[l1_index] = l2_offset;
+    map_write_end(image);
+    return l2_offset;
+}
+
+/* ==================== CREATE / OPEN ==================== */
+
+disk_image_t* disk_image_create(const char* path, uint64_t virtual_size, const char* base_path) {
+    disk_image_header_t header = {0};
+    uint32_t cluster_size = 1U << DISK_IMAGE_CLUSTER_BITS;
+    uint64_t l2_span = (uint64_t)cluster_size * (cluster_size / sizeof(uint64_t));
+
+    if (base_path && strlen(base_path) >= DISK_IMAGE_PATH_MAX) {
+        return NULL;
+    }
+
+    header.magic = DISK_IMAGE_MAGIC;
+    header.version = DISK_IMAGE_VERSION;
+    header.cluster_bits = DISK_IMAGE_CLUSTER_BITS;
+    header.virtual_size = virtual_size;
+    header.l1_entries = (virtual_size + l2_span - 1) / l2_span;
+    header.l1_offset = cluster_size;
+    if (base_path) {
+        strcpy(header.base_path, base_path);
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Header cluster plus an empty L1 table; everything else comes later
+    uint64_t l1_bytes = (uint64_t)header.l1_entries * sizeof(uint64_t);
+    uint64_t l1_clusters = (l1_bytes + cluster_size - 1) / cluster_size;
+    if (pwrite_full(fd, &header, sizeof(header), 0) < 0 ||
+        ftruncate(fd, (1 + l1_clusters) * cluster_size) < 0 ||
+        fdatasync(fd) < 0) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    close(fd);
+
+    disk_image_t* image = disk_image_open(path, false);
+    if (!image) {
+        unlink(path);
+    }
+    return image;
+}
+
+static disk_image_t* open_image(const char* path, bool read_only, int depth) {
+    disk_image_t* image = calloc(1, sizeof(*image));
+    if (!image) {
+        return NULL;
+    }
+
+    image->base_raw_fd = -1;
+    image->cache_file = -1;
+    image->base_cache_file = -1;
+    pthread_mutex_init(&image->lock, NULL);
+    image->read_only = read_only;
+    image->fd = open(path, (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+    if (image->fd < 0) {
+        goto fail;
+    }
+
+    if (pread_full(image->fd, &image->header, sizeof(image->header), 0) < 0 ||
+        image->header.magic != DISK_IMAGE_MAGIC ||
+        image->header.version != DISK_IMAGE_VERSION ||
+        image->header.cluster_bits < 12 || image->header.cluster_bits > 21) {
+        goto fail;
+    }
+    image->header.base_path[DISK_IMAGE_PATH_MAX - 1] = '\0';
+
+    image->cluster_size = 1U << image->header.cluster_bits;
+    image->l2_bits = image->header.cluster_bits - 3;
+
+    uint64_t l1_bytes = (uint64_t)image->header.l1_entries * sizeof(uint64_t);
+    image->l1 = calloc(1, l1_bytes ? l1_bytes : 1);
+    if (!image->l1 || pread_full(image->fd, image->l1, l1_bytes, image->header.l1_offset) < 0) {
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(image->fd, &st) < 0) {
+        goto fail;
+    }
+    image->file_end = ((uint64_t)st.st_size + image->cluster_size - 1) &
+                      ~((uint64_t)image->cluster_size - 1);
+
+    if (open_base(image, depth) < 0) {
+        goto fail;
+    }
+
+    return image;
+
+fail:
+    disk_image_close(image);
+    return NULL;
+}
+
+disk_image_t* disk_image_open(const char* path, bool read_only) {
+    return open_image(path, read_only, 0);
+}
+
+void disk_image_close(disk_image_t* image) {
+    if (!image) {
+        return;
+    }
+
+    // Dirty cached blocks must reach the file before it closes
+    if (image->cache) {
+        block_cache_detach(image->cache, image->cache_file);
+        if (image->base_cache_file >= 0) {
+            block_cache_detach(image->cache, image->base_cache_file);
+        }
+    }
+    if (image->fd >= 0) {
+        close(image->fd);
+    }
+    if (image->base) {
+        disk_image_close(image->base);
+    }
+    if (image->base_raw_fd >= 0) {
+        close(image->base_raw_fd);
+    }
+    for (int i = 0; i < DISK_IMAGE_L2_CACHE; i++) {
+        free(image->l2_cache[i].table);
+    }
+    free(image->l2_spare);
+    free(image->l1);
+    pthread_mutex_destroy(&image->lock);
+    free(image);
+}
+
+uint64_t disk_image_size(const disk_image_t* image) {
+    return image->header.virtual_size;
+}
+
+int disk_image_fd(const disk_image_t* image) {
+    return image->fd;
+}
+
+/*
+ * Serve this image, and every image under it, through a shared block
+ * cache. Set once, before the first I/O; vm_id only labels statistics.
+ */
+int disk_image_set_cache(disk_image_t* image, block_cache_t* cache, uint32_t vm_id) {
+    if (image->cache) {
+        return -1;
+    }
+
+    int file = block_cache_attach(cache, image->fd);
+    if (file < 0) {
+        return -1;
+    }
+
+    if (image->base && disk_image_set_cache(image->base, cache, vm_id) < 0) {
+        block_cache_detach(cache, file);
+        return -1;
+    }
+    if (image->base_raw_fd >= 0) {
+        image->base_cache_file = block_cache_attach(cache, image->base_raw_fd);
+        if (image->base_cache_file < 0) {
+            block_cache_detach(cache, file);
+            return -1;
+        }
+    }
+
+    image->cache_file = file;
+    image->cache_vm = vm_id;
+    image->cache = cache;
+    return 0;
+}
+
+// The cache data clusters go through, with this image's handle in it
+block_cache_t* disk_image_cache(const disk_image_t* image, int* file, uint32_t* vm_id) {
+    *file = image->cache_file;
+    *vm_id = image->cache_vm;
+    return image->cache;
+}
+
+/* ==================== MAPPING ==================== */
+
+/*
+ * Map the start of [offset, offset+length) to where its data lives.
+ * *mapped is how much of the range the answer covers; it never crosses a
+ * cluster. A write allocates the cluster, copying it up from the base if
+ * the write will not cover it.
+ */
+disk_map_type_t disk_image_map(disk_image_t* image, uint64_t offset, uint64_t length,
+                               bool write, uint64_t* host_offset, uint64_t* mapped) {
+    uint64_t cluster_mask = image->cluster_size - 1;
+    uint64_t in_cluster = offset & cluster_mask;
+    uint64_t cluster_start = offset - in_cluster;
+    uint64_t l2_index = (offset >> image->header.cluster_bits) & ((1ULL << image->l2_bits) - 1);
+    uint64_t l1_index = offset >> (image->header.cluster_bits + image->l2_bits);
+
+    *mapped = image->cluster_size - in_cluster;
+    if (*mapped > length) {
+        *mapped = length;
+    }
+    *host_offset = 0;
+
+    if (l1_index >= image->header.l1_entries || (write && image->read_only)) {
+        return DISK_MAP_ZERO;
+    }
+
+    // Allocated clusters, and reads of unallocated ones, need no lock
+    uint64_t entry;
+    if (map_lockless(image, l1_index, l2_index, &entry) &&
+        ((entry & DISK_IMAGE_OFFSET_MASK) || !write)) {
+        if (entry & DISK_IMAGE_OFFSET_MASK) {
+            *host_offset = (entry & DISK_IMAGE_OFFSET_MASK) + in_cluster;
+            return DISK_MAP_DATA;
+        }
+        return !(entry & DISK_IMAGE_ZERO_FLAG) && image->header.base_path[0] ?
+               DISK_MAP_BASE : DISK_MAP_ZERO;
+    }
+
+    pthread_mutex_lock(&image->lock);
+
+    uint64_t l2_offset = image->l1[l1_index];
+    if (!l2_offset) {
+        if (!write) {
+            pthread_mutex_unlock(&image->lock);
+            return image->header.base_path[0] ? DISK_MAP_BASE : DISK_MAP_ZERO;
+        }
+
+        l2_offset = allocate_l2(image, l1_index);
+        if (!l2_offset) {
+            pthread_mutex_unlock(&image->lock);
+            return DISK_MAP_ZERO;
+        }
+    }
+
+    uint64_t* l2 = l2_lookup(image, l2_offset);
+    if (!l2) {
+        pthread_mutex_unlock(&image->lock);
+        return DISK_MAP_ZERO;
+    }
+
+    entry = l2[l2_index];
+    if (entry & DISK_IMAGE_OFFSET_MASK) {
+        *host_offset = (entry & DISK_IMAGE_OFFSET_MASK) + in_cluster;
+        pthread_mutex_unlock(&image->lock);
+        return DISK_MAP_DATA;
+    }
+
+    bool from_base = !(entry & DISK_IMAGE_ZERO_FLAG) && image->header.base_path[0];
+    if (!write) {
+        pthread_mutex_unlock(&image->lock);
+        return from_base ? DISK_MAP_BASE : DISK_MAP_ZERO;
+    }
+
+    // First write: allocate, copy up the rest of the cluster, then publish
+    uint64_t data = allocate_cluster(image);
+    if (!data) {
+        pthread_mutex_unlock(&image->lock);
+        return DISK_MAP_ZERO;
+    }
+
+    if (from_base && *mapped < image->cluster_size) {
+        void* buf = malloc(image->cluster_size);
+        int err = !buf ||
+                  read_base(image, cluster_start, buf, image->cluster_size) < 0 ||
+                  data_write(image, buf, image->cluster_size, data) < 0;
+        free(buf);
+        if (err) {
+            pthread_mutex_unlock(&image->lock);
+            return DISK_MAP_ZERO;
+        }
+        image->stats.cow_copies++;
+    }
+
+    if (pwrite_full(image->fd, &data, sizeof(data),
+                    l2_offset + l2_index * sizeof(uint64_t)) < 0) {
+        pthread_mutex_unlock(&image->lock);
+        return DISK_MAP_ZERO;
+    }
+    map_write_begin(image);
+    l2[l2_index] = data;
+    map_write_end(image);
+    image->stats.clusters_allocated++;
+
+    *host_offset = data + in_cluster;
+    pthread_mutex_unlock(&image->lock);
+    return DISK_MAP_DATA;
+}
+
+/* ==================== GUEST I/O ==================== */
+
+int64_t disk_image_read(disk_image_t* image, uint64_t offset, void* buf, uint64_t length) {
+    uint8_t* p = buf;
+
+    if (offset >= image->header.virtual_size) {
+        return 0;
+    }
+    if (length > image->header.virtual_size - offset) {
+        length = image->header.virtual_size - offset;
+    }
+
+    uint64_t done = 0;
+    while (done < length) {
+        uint64_t host, chunk;
+        disk_map_type_t type = disk_image_map(image, offset + done, length - done,
+                                              false, &host, &chunk);
+        int err = 0;
+
+        if (type == DISK_MAP_DATA) {
+            err = data_read(image, p + done, chunk, host);
+        } else if (type == DISK_MAP_BASE) {
+            err = read_base(image, offset + done, p + done, chunk);
+        } else {
+            memset(p + done, 0, chunk);
+        }
+        if (err < 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+
+    return done;
+}
+
+int64_t disk_image_write(disk_image_t* image, uint64_t offset, const void* buf, uint64_t length) {
+    const uint8_t* p = buf;
+
+    if (image->read_only || offset >= image->header.virtual_size) {
+        return -1;
+    }
+    if (length > image->header.virtual_size - offset) {
+        length = image->header.virtual_size - offset;
+    }
+
+    uint64_t done = 0;
+    while (done < length) {
+        uint64_t host, chunk;
+        if (disk_image_map(image, offset + done, length - done, true,
+                           &host, &chunk) != DISK_MAP_DATA ||
+            data_write(image, p + done, chunk, host) < 0) {
+            return -1;
+        }
+        done += chunk;
+    }
+
+    return done;
+}
+
+// Drop whole clusters in the range; partial clusters are left alone
+int disk_image_discard(disk_image_t* image, uint64_t offset, uint64_t length) {
+    uint64_t cluster_mask = image->cluster_size - 1;
+    uint64_t start = (offset + cluster_mask) & ~cluster_mask;
+    uint64_t end = (offset + length) & ~cluster_mask;
+    int ret = 0;
+
+    if (image->read_only) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&image->lock);
+
+    for (uint64_t pos = start; pos < end && pos < image->header.virtual_size;
+         pos += image->cluster_size) {
+        uint64_t l1_index = pos >> (image->header.cluster_bits + image->l2_bits);
+        uint64_t l2_index = (pos >> image->header.cluster_bits) & ((1ULL << image->l2_bits) - 1);
+
+        if (!image->l1[l1_index]) {
+            if (!image->header.base_path[0]) {
+                continue;  // Never written, nothing under it
+            }
+            if (!allocate_l2(image, l1_index)) {
+                ret = -1;
+                break;
+            }
+        }
+
+        uint64_t* l2 = l2_lookup(image, image->l1[l1_index]);
+        if (!l2) {
+            continue;
+        }
+
+        uint64_t old = l2[l2_index];
+        uint64_t entry = image->header.base_path[0] ? DISK_IMAGE_ZERO_FLAG : 0;
+        if (old == entry) {
+            continue;
+        }
+
+        if (pwrite_full(image->fd, &entry, sizeof(entry),
+                        image->l1[l1_index] + l2_index * sizeof(uint64_t)) < 0) {
+            ret = -1;
+            break;
+        }
+        map_write_begin(image);
+        l2[l2_index] = entry;
+        map_write_end(image);
+
+        // Give the space back now; compaction reclaims the offset later
+        if (old & DISK_IMAGE_OFFSET_MASK) {
+            if (image->cache) {
+                block_cache_invalidate(image->cache, image->cache_file,
+                                       old & DISK_IMAGE_OFFSET_MASK, image->cluster_size);
+            }
+            fallocate(image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      old & DISK_IMAGE_OFFSET_MASK, image->cluster_size);
+        }
+        image->stats.discards++;
+    }
+
+    pthread_mutex_unlock(&image->lock);
+    return ret;
+}
+
+int disk_image_flush(disk_image_t* image) {
+    if (image->read_only) {
+        return 0;
+    }
+    if (image->cache) {
+        return block_cache_flush(image->cache, image->cache_file);
+    }
+    return fdatasync(image->fd);
+}
+
+void disk_image_get_stats(disk_image_t* image, disk_image_stats_t* stats) {
+    pthread_mutex_lock(&image->lock);
+    *stats = image->stats;
+    stats->file_end = image->file_end;
+    pthread_mutex_unlock(&image->lock);
+}
+
+/* ==================== COMPACTION ==================== */
+
+/*
+ * Rewrite an image that no VM has open, keeping only clusters with data.
+ * With flatten, base contents are copied in and the base link is dropped.
+ * Returns the bytes saved, or -1 on error (the original is left intact).
+ */
+int64_t disk_image_compact(const char* path, bool flatten) {
+    char temp_path[DISK_IMAGE_PATH_MAX + 16];
+    snprintf(temp_path, sizeof(temp_path), "%s.compact", path);
+
+    disk_image_t* src = disk_image_open(path, true);
+    if (!src) {
+        return -1;
+    }
+
+    bool keep_base = !flatten && src->header.base_path[0];
+    disk_image_t* dst = disk_image_create(temp_path, src->header.virtual_size,
+                                          keep_base ? src->header.base_path : NULL);
+    void* buf = malloc(src->cluster_size);
+    if (!dst || !buf) {
+        goto fail;
+    }
+
+    uint64_t l2_span = (uint64_t)src->cluster_size << src->l2_bits;
+    for (uint64_t pos = 0; pos < src->header.virtual_size; pos += src->cluster_size) {
+        uint64_t l1_index = pos / l2_span;
+
+        // Unmapped L2 ranges only matter when flattening a base in
+        if (!src->l1[l1_index] && !(flatten && src->header.base_path[0])) {
+            pos = (l1_index + 1) * l2_span - src->cluster_size;
+            continue;
+        }
+
+        uint64_t host, chunk;
+        disk_map_type_t type = disk_image_map(src, pos, src->cluster_size, false,
+                                              &host, &chunk);
+
+        if (type == DISK_MAP_ZERO) {
+            // An explicit zero must keep hiding the base
+            if (keep_base && disk_image_discard(dst, pos, src->cluster_size) < 0) {
+                goto fail;
+            }
+            continue;
+        }
+        if (type == DISK_MAP_BASE && !flatten) {
+            continue;
+        }
+
+        int64_t got = disk_image_read(src, pos, buf, chunk);
+        if (got < 0) {
+            goto fail;
+        }
+        chunk = got;
+        if (is_zero(buf, (chunk + 7) & ~7ULL)) {
+            if (keep_base && disk_image_discard(dst, pos, src->cluster_size) < 0) {
+                goto fail;
+            }
+            continue;
+        }
+        if (disk_image_write(dst, pos, buf, chunk) < 0) {
+            goto fail;
+        }
+    }
+
+    if (disk_image_flush(dst) < 0) {
+        goto fail;
+    }
+
+    int64_t saved = (int64_t)src->file_end - (int64_t)dst->file_end;
+    disk_image_close(src);
+    disk_image_close(dst);
+    free(buf);
+
+    if (rename(temp_path, path) < 0) {
+        unlink(temp_path);
+        return -1;
+    }
+    return saved;
+
+fail:
+    disk_image_close(src);
+    disk_image_close(dst);
+    free(buf);
+    unlink(temp_path);
+    return -1;
+}
+
+#ifdef DISK_IMAGE_TOOL
+/* Standalone compaction tool: cc -DDISK_IMAGE_TOOL disk_image.c block_cache.c -lpthread */
+int main(int argc, char** argv) {
+    bool flatten = argc == 3 && strcmp(argv[1], "--flatten") == 0;
+
+    if (argc != 2 && !flatten) {
+        fprintf(stderr, "usage: %s [--flatten] <image>\n", argv[0]);
+        return 2;
+    }
+
+    int64_t saved = disk_image_compact(argv[argc - 1], flatten);
+    if (saved < 0) {
+        fprintf(stderr, "compaction failed: %s\n", argv[argc - 1]);
+        return 1;
+    }
+
+    printf("%s: %lld KB reclaimed\n", argv[argc - 1], (long long)(saved / 1024));
+    return 0;
+}
+#endif
+
+#ifdef DISK_IMAGE_TEST
+/* Self-test on temporary files: cc -O2 -DDISK_IMAGE_TEST disk_image.c block_cache.c -lpthread */
+#define CLUSTER (1ULL << DISK_IMAGE_CLUSTER_BITS)
+#define TEST_SIZE (1ULL << 30)
+
+#include "../test_check.h"
+
+static void temp_path(char* path) {
+    strcpy(path, "/tmp/qxdi-XXXXXX");
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void fill(uint8_t* buf, uint64_t length, uint8_t seed) {
+    for (uint64_t i = 0; i < length; i++) {
+        buf[i] = (uint8_t)(i * 131 + seed) | 1;
+    }
+}
+
+static uint64_t allocated_bytes(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_blocks * 512 : 0;
+}
+
+static disk_image_t* open_with(const char* path, block_cache_t* cache) {
+    disk_image_t* image = disk_image_open(path, false);
+    if (image && cache && disk_image_set_cache(image, cache, 1) < 0) {
+        disk_image_close(image);
+        return NULL;
+    }
+    return image;
+}
+
+static bool read_equals(disk_image_t* image, uint64_t offset, const uint8_t* expect, uint64_t length) {
+    uint8_t* buf = malloc(length);
+    bool same = buf && disk_image_read(image, offset, buf, length) == (int64_t)length &&
+                memcmp(buf, expect, length) == 0;
+    free(buf);
+    return same;
+}
+
+static bool reads_zero(disk_image_t* image, uint64_t offset, uint64_t length) {
+    uint8_t* zero = calloc(1, length);
+    bool same = zero && read_equals(image, offset, zero, length);
+    free(zero);
+    return same;
+}
+
+// Clusters appear on first write only; everything else reads as zeros
+static void test_allocate(block_cache_t* cache) {
+    char path[32];
+    uint8_t data[8192];
+    disk_image_stats_t stats;
+    uint64_t host, mapped;
+
+    temp_path(path);
+    disk_image_t* image = disk_image_create(path, TEST_SIZE, NULL);
+    CHECK(image, "create %s", path);
+    if (!image) {
+        return;
+    }
+    struct stat st;
+    CHECK(stat(path, &st) == 0 && (uint64_t)st.st_size <= 2 * CLUSTER,
+          "new 1GB image is %lld bytes", (long long)st.st_size);
+    disk_image_close(image);
+
+    image = open_with(path, cache);
+    CHECK(image, "reopen");
+    if (!image) {
+        unlink(path);
+        return;
+    }
+    CHECK(reads_zero(image, 0, 1 << 20), "unwritten image reads as zeros");
+    CHECK(disk_image_map(image, 5 * CLUSTER, 512, false, &host, &mapped) == DISK_MAP_ZERO,
+          "unwritten cluster maps to zeros");
+
+    fill(data, sizeof(data), 1);
+    CHECK(disk_image_write(image, 3 * CLUSTER + 100, data, 4096) == 4096, "write in one cluster");
+    CHECK(disk_image_write(image, 10 * CLUSTER - 50, data, 100) == 100, "write across two clusters");
+    CHECK(disk_image_write(image, TEST_SIZE, data, 512) < 0, "write past the end");
+    disk_image_get_stats(image, &stats);
+    CHECK(stats.clusters_allocated == 3, "%llu clusters allocated, expected 3",
+          (unsigned long long)stats.clusters_allocated);
+
+    CHECK(read_equals(image, 3 * CLUSTER + 100, data, 4096), "data in one cluster");
+    CHECK(read_equals(image, 10 * CLUSTER - 50, data, 100), "data across two clusters");
+    CHECK(reads_zero(image, 3 * CLUSTER, 100), "rest of the first cluster before the write");
+    CHECK(reads_zero(image, 3 * CLUSTER + 4196, CLUSTER - 4196), "rest of the first cluster after it");
+    CHECK(disk_image_map(image, 3 * CLUSTER, CLUSTER, false, &host, &mapped) == DISK_MAP_DATA &&
+          mapped == CLUSTER, "written cluster maps to data");
+
+    // Still there after a flush and a reopen
+    CHECK(disk_image_flush(image) == 0, "flush");
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image && read_equals(image, 3 * CLUSTER + 100, data, 4096), "data after reopen");
+    disk_image_close(image);
+    unlink(path);
+}
+
+// Overlays read through to their base and copy it up on partial writes
+static void test_cow(block_cache_t* cache) {
+    char base_path[32], path[32], raw_path[32];
+    uint8_t* base_data = malloc(2 * CLUSTER);
+    uint8_t* expect = malloc(CLUSTER);
+    uint8_t patch[512];
+    disk_image_stats_t stats;
+    uint64_t host, mapped;
+
+    temp_path(base_path);
+    temp_path(path);
+    temp_path(raw_path);
+    fill(base_data, 2 * CLUSTER, 7);
+    fill(patch, sizeof(patch), 99);
+
+    disk_image_t* base = disk_image_create(base_path, TEST_SIZE, NULL);
+    CHECK(base && disk_image_write(base, 0, base_data, 2 * CLUSTER) == (int64_t)(2 * CLUSTER),
+          "write base");
+    disk_image_close(base);
+
+    disk_image_t* image = disk_image_create(path, TEST_SIZE, base_path);
+    CHECK(image, "create overlay");
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image, "open overlay");
+    if (!image) {
+        goto out;
+    }
+
+    CHECK(disk_image_map(image, CLUSTER, CLUSTER, false, &host, &mapped) == DISK_MAP_BASE,
+          "unwritten overlay cluster maps to the base");
+    CHECK(read_equals(image, 0, base_data, 2 * CLUSTER), "overlay reads the base");
+    CHECK(reads_zero(image, 2 * CLUSTER, CLUSTER), "beyond the base's data reads zeros");
+
+    // Partial write: the rest of the cluster comes up from the base
+    CHECK(disk_image_write(image, CLUSTER / 2, patch, sizeof(patch)) == sizeof(patch), "partial write");
+    memcpy(expect, base_data, CLUSTER);
+    memcpy(expect + CLUSTER / 2, patch, sizeof(patch));
+    CHECK(read_equals(image, 0, expect, CLUSTER), "partial write merged with the base");
+
+    // Whole-cluster write: nothing to copy
+    fill(expect, CLUSTER, 42);
+    CHECK(disk_image_write(image, CLUSTER, expect, CLUSTER) == (int64_t)CLUSTER, "full cluster write");
+    CHECK(read_equals(image, CLUSTER, expect, CLUSTER), "full cluster write reads back");
+
+    disk_image_get_stats(image, &stats);
+    CHECK(stats.cow_copies == 1, "%llu COW copies, expected 1", (unsigned long long)stats.cow_copies);
+    CHECK(stats.clusters_allocated == 2, "%llu clusters allocated, expected 2",
+          (unsigned long long)stats.clusters_allocated);
+    disk_image_close(image);
+
+    base = disk_image_open(base_path, true);
+    CHECK(base && read_equals(base, 0, base_data, 2 * CLUSTER), "base untouched by the overlay");
+    disk_image_close(base);
+
+    // A raw base shorter than the overlay reads as zeros past its end
+    int fd = open(raw_path, O_WRONLY | O_TRUNC);
+    CHECK(fd >= 0 && pwrite_full(fd, base_data, CLUSTER + CLUSTER / 2, 0) == 0, "write raw base");
+    if (fd >= 0) {
+        close(fd);
+    }
+    image = disk_image_create(path, TEST_SIZE, raw_path);
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image, "open overlay of a raw base");
+    if (image) {
+        CHECK(read_equals(image, 0, base_data, CLUSTER + CLUSTER / 2), "raw base reads through");
+        CHECK(reads_zero(image, CLUSTER + CLUSTER / 2, CLUSTER / 2), "past the raw base's end");
+        CHECK(disk_image_write(image, CLUSTER + 100, patch, sizeof(patch)) == sizeof(patch),
+              "partial write over a raw base");
+        memcpy(expect, base_data + CLUSTER, CLUSTER / 2);
+        memset(expect + CLUSTER / 2, 0, CLUSTER / 2);
+        memcpy(expect + 100, patch, sizeof(patch));
+        CHECK(read_equals(image, CLUSTER, expect, CLUSTER), "raw base copied up");
+        disk_image_close(image);
+    }
+
+out:
+    unlink(path);
+    unlink(base_path);
+    unlink(raw_path);
+    free(base_data);
+    free(expect);
+}
+
+// Discarded clusters read as zeros, hide the base and give their space back
+static void test_discard(block_cache_t* cache) {
+    char base_path[32], path[32];
+    uint8_t* data = malloc(4 * CLUSTER);
+    disk_image_stats_t stats;
+    uint64_t host, mapped;
+
+    temp_path(base_path);
+    temp_path(path);
+    fill(data, 4 * CLUSTER, 3);
+
+    // No base: the cluster is simply gone
+    disk_image_t* image = disk_image_create(path, TEST_SIZE, NULL);
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image && disk_image_write(image, 0, data, 4 * CLUSTER) == (int64_t)(4 * CLUSTER),
+          "write four clusters");
+    if (!image) {
+        goto out;
+    }
+    CHECK(disk_image_flush(image) == 0, "flush");
+    uint64_t before = allocated_bytes(path);
+
+    CHECK(disk_image_discard(image, CLUSTER, 2 * CLUSTER) == 0, "discard two clusters");
+    CHECK(disk_image_discard(image, 3 * CLUSTER + 100, 1000) == 0, "discard inside a cluster");
+    CHECK(reads_zero(image, CLUSTER, 2 * CLUSTER), "discarded clusters read as zeros");
+    CHECK(read_equals(image, 0, data, CLUSTER), "cluster before the discard kept");
+    CHECK(read_equals(image, 3 * CLUSTER, data + 3 * CLUSTER, CLUSTER), "partial discard ignored");
+    // Splitting the extent may cost the file system a block of its own
+    uint64_t after = allocated_bytes(path);
+    CHECK(after + 2 * CLUSTER - 4096 <= before, "discard punched %lld of %llu bytes",
+          (long long)(before - after), (unsigned long long)(2 * CLUSTER));
+    disk_image_get_stats(image, &stats);
+    CHECK(stats.discards == 2, "%llu discards, expected 2", (unsigned long long)stats.discards);
+
+    // Rewriting a discarded cluster allocates it again
+    CHECK(disk_image_write(image, CLUSTER, data, 512) == 512, "write after discard");
+    CHECK(read_equals(image, CLUSTER, data, 512) && reads_zero(image, CLUSTER + 512, CLUSTER - 512),
+          "rewritten cluster starts from zeros");
+
+    // A table update that cannot reach the file fails the discard
+    int ro = open(path, O_RDONLY);
+    int rw = dup(image->fd);
+    CHECK(ro >= 0 && rw >= 0 && dup2(ro, image->fd) == image->fd, "swap in a read-only fd");
+    CHECK(disk_image_discard(image, 0, CLUSTER) < 0, "failed discard reported");
+    dup2(rw, image->fd);
+    close(ro);
+    close(rw);
+    CHECK(read_equals(image, 0, data, CLUSTER), "failed discard keeps the cluster");
+    disk_image_close(image);
+
+    // With a base: unwritten and written clusters both stop reading through
+    image = disk_image_create(base_path, TEST_SIZE, NULL);
+    CHECK(image && disk_image_write(image, 0, data, 2 * CLUSTER) == (int64_t)(2 * CLUSTER), "write base");
+    disk_image_close(image);
+    image = disk_image_create(path, TEST_SIZE, base_path);
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image, "open overlay");
+    if (!image) {
+        goto out;
+    }
+    CHECK(disk_image_write(image, 0, data + CLUSTER, 512) == 512, "overlay write");
+    CHECK(disk_image_discard(image, 0, 2 * CLUSTER) == 0, "discard over a base");
+    CHECK(reads_zero(image, 0, 2 * CLUSTER), "discard hides the base");
+    CHECK(disk_image_map(image, CLUSTER, CLUSTER, false, &host, &mapped) == DISK_MAP_ZERO,
+          "discarded cluster maps to zeros");
+    disk_image_close(image);
+
+    image = disk_image_open(path, true);
+    CHECK(image && reads_zero(image, 0, 2 * CLUSTER), "zero flags persist");
+    disk_image_close(image);
+
+out:
+    unlink(path);
+    unlink(base_path);
+    free(data);
+}
+
+// Compaction keeps what reads back and drops the rest; flattening drops the base
+static void test_compact(block_cache_t* cache) {
+    char base_path[32], path[32];
+    uint64_t span = 8 * CLUSTER;
+    uint8_t* data = malloc(2 * CLUSTER);
+    uint8_t* zero = calloc(1, CLUSTER);
+    uint8_t* before = malloc(span);
+    disk_image_stats_t stats;
+
+    temp_path(base_path);
+    temp_path(path);
+    fill(data, 2 * CLUSTER, 11);
+
+    disk_image_t* image = disk_image_create(base_path, TEST_SIZE, NULL);
+    CHECK(image && disk_image_write(image, 0, data, 2 * CLUSTER) == (int64_t)(2 * CLUSTER), "write base");
+    disk_image_close(image);
+
+    // Cluster 0 copied up, 1 discarded, 2 written with zeros, 3 and 5 with data, 4 discarded
+    image = disk_image_create(path, TEST_SIZE, base_path);
+    disk_image_close(image);
+    image = open_with(path, cache);
+    CHECK(image, "open overlay");
+    if (!image) {
+        goto out;
+    }
+    CHECK(disk_image_write(image, 100, data + CLUSTER, 1000) == 1000, "copy-up write");
+    CHECK(disk_image_discard(image, CLUSTER, CLUSTER) == 0, "discard a base cluster");
+    CHECK(disk_image_write(image, 2 * CLUSTER, zero, CLUSTER) == (int64_t)CLUSTER, "zero write");
+    CHECK(disk_image_write(image, 3 * CLUSTER, data, 2 * CLUSTER) == (int64_t)(2 * CLUSTER), "data write");
+    CHECK(disk_image_write(image, 5 * CLUSTER, data, CLUSTER) == (int64_t)CLUSTER, "data write");
+    CHECK(disk_image_discard(image, 4 * CLUSTER, CLUSTER) == 0, "discard a data cluster");
+    CHECK(disk_image_read(image, 0, before, span) == (int64_t)span, "read before compaction");
+    disk_image_get_stats(image, &stats);
+    uint64_t file_end = stats.file_end;
+    disk_image_close(image);
+
+    // Clusters 2 (zeros) and 4 (discarded) are dropped: 3 of 5 data clusters remain
+    int64_t saved = disk_image_compact(path, false);
+    CHECK(saved >= (int64_t)(2 * CLUSTER), "compaction saved %lld bytes of %llu",
+          (long long)saved, (unsigned long long)file_end);
+
+    image = open_with(path, cache);
+    CHECK(image && read_equals(image, 0, before, span), "contents kept by compaction");
+    if (image) {
+        uint64_t host, mapped;
+        CHECK(disk_image_map(image, CLUSTER, CLUSTER, false, &host, &mapped) == DISK_MAP_ZERO,
+              "discarded cluster still hides the base");
+        CHECK(disk_image_map(image, 2 * CLUSTER, CLUSTER, false, &host, &mapped) == DISK_MAP_ZERO,
+              "zero cluster no longer allocated");
+        disk_image_close(image);
+    }
+
+    // Flatten: the base goes away and the contents stay
+    CHECK(disk_image_compact(path, true) >= 0, "flatten");
+    unlink(base_path);
+    image = open_with(path, cache);
+    CHECK(image && read_equals(image, 0, before, span), "contents kept by flattening");
+    CHECK(image && image->header.base_path[0] == '\0', "flattened image has no base");
+    disk_image_close(image);
+
+out:
+    unlink(path);
+    unlink(base_path);
+    free(data);
+    free(zero);
+    free(before);
+}
+
+int main(void) {
+    const char* names[] = { "direct", "write-through cache", "write-back cache" };
+    block_cache_t* caches[] = {
+        NULL,
+        block_cache_create(8 << 20, BLOCK_CACHE_WRITETHROUGH),
+        block_cache_create(8 << 20, BLOCK_CACHE_WRITEBACK),
+    };
+
+    for (int i = 0; i < 3; i++) {
+        int before = failures;
+        if (i > 0 && !caches[i]) {
+            CHECK(false, "block_cache_create");
+            continue;
+        }
+
+        test_allocate(caches[i]);
+        test_cow(caches[i]);
+        test_discard(caches[i]);
+        test_compact(caches[i]);
+        printf("%-20s %s\n", names[i], failures == before ? "ok" : "FAILED");
+    }
+
+    for (int i = 1; i < 3; i++) {
+        block_cache_destroy(caches[i]);
+    }
+    return failures ? 1 : 0;
+}
+#endif
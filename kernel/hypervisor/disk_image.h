@@ -0,0 +1,87 @@
+/*
+ * QENEX Hypervisor - Sparse Disk Images
+ *
+ * Copy-on-write image format for virtual disk backing files. The guest
+ * address space is mapped in two levels, as in qcow2:
+ *
+ *   guest offset -> L1 entry -> L2 table -> data cluster in the image file
+ *
+ * Creating an image writes only the header and the L1 table, so the file
+ * starts at a few hundred KB whatever the virtual size. Clusters are
+ * appended the first time a guest writes to them. A cluster that was never
+ * written reads from the base image if there is one, and reads as zeros
+ * otherwise. A partial first write copies the rest of the cluster up from
+ * the base before the new data lands.
+ *
+ * Discarded clusters are punched out of the file immediately, but their
+ * file offsets are only reclaimed by compaction. Compaction rewrites the
+ * image with live clusters only and drops any that are all zeros.
+ * Flattening also folds the base image in.
+ *
+ * With a block cache attached, data clusters and raw bases are read and
+ * written through it. L1/L2 metadata is always written straight to the file.
+ */
+
+#ifndef QENEX_DISK_IMAGE_H
+#define QENEX_DISK_IMAGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "block_cache.h"
+
+#define DISK_IMAGE_MAGIC 0x49445851         // "QXDI"
+#define DISK_IMAGE_VERSION 1
+#define DISK_IMAGE_CLUSTER_BITS 16          // 64KB clusters
+#define DISK_IMAGE_PATH_MAX 256
+#define DISK_IMAGE_L2_CACHE 32              // Cached L2 tables; 32 x 512MB of guest disk
+#define DISK_IMAGE_MAX_DEPTH 8              // Base image chain length
+
+// L2 entry flag: cluster reads as zeros even though a base image exists
+#define DISK_IMAGE_ZERO_FLAG 1ULL
+#define DISK_IMAGE_OFFSET_MASK (~0xFFFULL)
+
+typedef enum {
+    DISK_MAP_DATA,          // Allocated in this image at host_offset
+    DISK_MAP_ZERO,          // Reads as zeros
+    DISK_MAP_BASE           // Falls through to the base image
+} disk_map_type_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t cluster_bits;
+    uint32_t l1_entries;
+    uint64_t virtual_size;
+    uint64_t l1_offset;
+    char base_path[DISK_IMAGE_PATH_MAX];
+} __attribute__((packed)) disk_image_header_t;
+
+typedef struct {
+    uint64_t clusters_allocated;
+    uint64_t cow_copies;            // Partial first writes filled from the base
+    uint64_t l2_hits;               // Locked lookups; lock-free mappings aren't counted
+    uint64_t l2_misses;
+    uint64_t discards;
+    uint64_t file_end;              // Next cluster to allocate
+} disk_image_stats_t;
+
+typedef struct disk_image disk_image_t;
+
+/* Function prototypes */
+disk_image_t* disk_image_create(const char* path, uint64_t virtual_size, const char* base_path);
+disk_image_t* disk_image_open(const char* path, bool read_only);
+void disk_image_close(disk_image_t* image);
+uint64_t disk_image_size(const disk_image_t* image);
+int disk_image_fd(const disk_image_t* image);
+int disk_image_set_cache(disk_image_t* image, block_cache_t* cache, uint32_t vm_id);
+block_cache_t* disk_image_cache(const disk_image_t* image, int* file, uint32_t* vm_id);
+disk_map_type_t disk_image_map(disk_image_t* image, uint64_t offset, uint64_t length,
+                               bool write, uint64_t* host_offset, uint64_t* mapped);
+int64_t disk_image_read(disk_image_t* image, uint64_t offset, void* buf, uint64_t length);
+int64_t disk_image_write(disk_image_t* image, uint64_t offset, const void* buf, uint64_t length);
+int disk_image_discard(disk_image_t* image, uint64_t offset, uint64_t length);
+int disk_image_flush(disk_image_t* image);
+void disk_image_get_stats(disk_image_t* image, disk_image_stats_t* stats);
+int64_t disk_image_compact(const char* path, bool flatten);
+
+#endif /* QENEX_DISK_IMAGE_H */
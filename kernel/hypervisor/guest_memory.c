@@ -0,0 +1,816 @@
+/*
+ * QENEX Hypervisor - Guest Physical Memory
+ *
+ * Guest RAM on huge pages where possible, and EPT/NPT tables with leaves
+ * to match. See guest_memory.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "guest_memory.h"
+
+#define PAGE_SHIFT GUEST_MEMORY_PAGE_SHIFT
+#define UNIT_SHIFT GUEST_MEMORY_2M_SHIFT
+#define GIGA_SHIFT GUEST_MEMORY_1G_SHIFT
+#define ENTRIES 512
+#define ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+// Entry bits. Both formats put the large-page bit at 7.
+#define EPT_READ (1ULL << 0)
+#define EPT_WRITE (1ULL << 1)
+#define EPT_EXEC (1ULL << 2)
+#define EPT_MEMTYPE_WB (6ULL << 3)
+#define EPT_IGNORE_PAT (1ULL << 6)
+#define NPT_PRESENT (1ULL << 0)
+#define NPT_WRITE (1ULL << 1)
+#define NPT_USER (1ULL << 2)
+#define LARGE_PAGE (1ULL << 7)
+
+struct guest_memory {
+    guest_memory_ops_t ops;
+    guest_memory_format_t format;
+    uint32_t flags;
+    pthread_mutex_t lock;
+
+    uint8_t* base;
+    uint64_t size;
+    uint64_t* root;
+
+    // Backing, per 2MB unit of guest memory
+    uint64_t units;
+    uint8_t* unit_shift;        // Page size backing the unit; 0 while untouched
+    uint64_t* unit_phys;        // Start of the huge page backing it
+    uint16_t* unit_released;    // 4KB pages of it released
+    uint64_t* released;         // Per 4KB page: its backing was released
+
+    guest_memory_stats_t stats;
+};
+
+static inline uint32_t level_shift(int level) {
+    return PAGE_SHIFT + 9 * (level - 1);
+}
+
+static inline uint32_t entry_index(uint64_t gpa, int level) {
+    return (gpa >> level_shift(level)) & (ENTRIES - 1);
+}
+
+static inline bool entry_present(guest_memory_t* gm, uint64_t entry) {
+    return gm->format == GUEST_MEMORY_EPT ? (entry & (EPT_READ | EPT_WRITE | EPT_EXEC)) != 0
+                                          : (entry & NPT_PRESENT) != 0;
+}
+
+static inline bool entry_is_leaf(uint64_t entry, int level) {
+    return level == 1 || (entry & LARGE_PAGE);
+}
+
+static inline uint64_t write_bit(guest_memory_t* gm) {
+    return gm->format == GUEST_MEMORY_EPT ? EPT_WRITE : NPT_WRITE;
+}
+
+static uint64_t leaf_entry(guest_memory_t* gm, uint64_t phys, int level, bool writable) {
+    uint64_t entry = phys | (level > 1 ? LARGE_PAGE : 0);
+
+    if (gm->format == GUEST_MEMORY_EPT) {
+        entry |= EPT_READ | EPT_EXEC | EPT_MEMTYPE_WB | EPT_IGNORE_PAT;
+    } else {
+        entry |= NPT_PRESENT | NPT_USER;
+    }
+    return writable ? entry | write_bit(gm) : entry;
+}
+
+static uint64_t table_entry(guest_memory_t* gm, uint64_t* table) {
+    uint64_t phys = gm->ops.virt_to_phys(gm->ops.ctx, table);
+
+    return gm->format == GUEST_MEMORY_EPT ? phys | EPT_READ | EPT_WRITE | EPT_EXEC
+                                          : phys | NPT_PRESENT | NPT_WRITE | NPT_USER;
+}
+
+static uint64_t* entry_table(guest_memory_t* gm, uint64_t entry) {
+    return gm->ops.phys_to_virt(gm->ops.ctx, entry & ADDR_MASK);
+}
+
+static uint64_t* alloc_table(guest_memory_t* gm) {
+    uint64_t* table = gm->ops.alloc_table(gm->ops.ctx);
+
+    if (table) {
+        gm->stats.tables++;
+    }
+    return table;
+}
+
+// Replace a large leaf with a table of leaves one level down, same mapping
+static int split_leaf(guest_memory_t* gm, uint64_t* entry, int level) {
+    uint64_t* table = alloc_table(gm);
+    uint64_t phys = *entry & ADDR_MASK;
+    uint64_t flags = *entry & ~ADDR_MASK;
+
+    if (!table) {
+        return -1;
+    }
+    if (level - 1 == 1) {
+        flags &= ~LARGE_PAGE;
+    }
+    for (uint32_t i = 0; i < ENTRIES; i++) {
+        table[i] = (phys + ((uint64_t)i << level_shift(level - 1))) | flags;
+    }
+
+    // One store: a walk sees either the old leaf or the table
+    __atomic_store_n(entry, table_entry(gm, table), __ATOMIC_RELEASE);
+    gm->stats.splits++;
+    return 0;
+}
+
+// Entry mapping gpa at level, creating tables and splitting larger leaves above it
+static uint64_t* walk_create(guest_memory_t* gm, uint64_t gpa, int level) {
+    uint64_t* table = gm->root;
+
+    for (int l = 4; l > level; l--) {
+        uint64_t* entry = &table[entry_index(gpa, l)];
+
+        if (!entry_present(gm, *entry)) {
+            uint64_t* next = alloc_table(gm);
+
+            if (!next) {
+                return NULL;
+            }
+            __atomic_store_n(entry, table_entry(gm, next), __ATOMIC_RELEASE);
+        } else if (entry_is_leaf(*entry, l) && split_leaf(gm, entry, l) < 0) {
+            return NULL;
+        }
+        table = entry_table(gm, *entry);
+    }
+    return &table[entry_index(gpa, level)];
+}
+
+// Leaf mapping gpa, and its level; NULL if unmapped
+static uint64_t* walk(guest_memory_t* gm, uint64_t gpa, int* level) {
+    uint64_t* table = gm->root;
+
+    for (int l = 4; l >= 1; l--) {
+        uint64_t* entry = &table[entry_index(gpa, l)];
+
+        if (!entry_present(gm, *entry)) {
+            return NULL;
+        }
+        if (entry_is_leaf(*entry, l)) {
+            *level = l;
+            return entry;
+        }
+        table = entry_table(gm, *entry);
+    }
+    return NULL;
+}
+
+static void free_tables(guest_memory_t* gm, uint64_t* table, int level) {
+    for (uint32_t i = 0; level > 1 && i < ENTRIES; i++) {
+        if (entry_present(gm, table[i]) && !entry_is_leaf(table[i], level)) {
+            free_tables(gm, entry_table(gm, table[i]), level - 1);
+        }
+    }
+    gm->ops.free_table(gm->ops.ctx, table);
+}
+
+static int map_locked(guest_memory_t* gm, uint64_t gpa, uint64_t phys, int level, bool writable) {
+    uint64_t* entry = walk_create(gm, gpa, level);
+
+    if (!entry) {
+        return -1;
+    }
+
+    // Never drop a table holding smaller mappings
+    if (entry_present(gm, *entry) && !entry_is_leaf(*entry, level)) {
+        return -1;
+    }
+    __atomic_store_n(entry, leaf_entry(gm, phys, level, writable), __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Back and map [gpa, gpa + size) with pages of 1 << shift
+static int populate_range(guest_memory_t* gm, uint64_t gpa, uint64_t size, uint32_t shift) {
+    int level = (shift - PAGE_SHIFT) / 9 + 1;
+
+    if (gm->ops.populate(gm->ops.ctx, gm->base + gpa, size, shift) < 0) {
+        return -1;
+    }
+
+    for (uint64_t offset = 0; offset < size; offset += 1ULL << shift) {
+        uint64_t phys = gm->ops.virt_to_phys(gm->ops.ctx, gm->base + gpa + offset);
+
+        if (map_locked(gm, gpa + offset, phys, level, true) < 0) {
+            return -1;
+        }
+    }
+
+    for (uint64_t unit = gpa >> UNIT_SHIFT; unit < (gpa + size + (1ULL << UNIT_SHIFT) - 1) >> UNIT_SHIFT; unit++) {
+        gm->unit_shift[unit] = shift;
+        if (shift > PAGE_SHIFT) {
+            uint64_t page_start = (unit << UNIT_SHIFT) & ~((1ULL << shift) - 1);
+
+            gm->unit_phys[unit] = gm->ops.virt_to_phys(gm->ops.ctx, gm->base + page_start);
+        }
+    }
+
+    if (shift == GIGA_SHIFT) {
+        gm->stats.bytes_1g += size;
+    } else if (shift == UNIT_SHIFT) {
+        gm->stats.bytes_2m += size;
+    } else {
+        gm->stats.bytes_4k += size;
+    }
+    return 0;
+}
+
+// Nothing populated in units [first, first + count)
+static bool units_untouched(guest_memory_t* gm, uint64_t first, uint64_t count) {
+    for (uint64_t unit = first; unit < first + count; unit++) {
+        if (gm->unit_shift[unit]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Back the page at gpa with the largest page that fits around it, up to 1 << max_shift
+static int fault_locked(guest_memory_t* gm, uint64_t gpa, uint32_t max_shift) {
+    uint64_t giga = gpa & ~((1ULL << GIGA_SHIFT) - 1);
+    uint64_t unit = gpa >> UNIT_SHIFT;
+    int level;
+
+    if (walk(gm, gpa, &level)) {
+        return 0;
+    }
+
+    if (max_shift >= GIGA_SHIFT && (gm->flags & GUEST_MEMORY_PAGES_1G) && giga + (1ULL << GIGA_SHIFT) <= gm->size &&
+        units_untouched(gm, giga >> UNIT_SHIFT, ENTRIES) &&
+        populate_range(gm, giga, 1ULL << GIGA_SHIFT, GIGA_SHIFT) == 0) {
+        return 1;
+    }
+    if (max_shift >= UNIT_SHIFT && (gm->flags & GUEST_MEMORY_PAGES_2M) && ((unit + 1) << UNIT_SHIFT) <= gm->size &&
+        !gm->unit_shift[unit] && populate_range(gm, unit << UNIT_SHIFT, 1ULL << UNIT_SHIFT, UNIT_SHIFT) == 0) {
+        return 1;
+    }
+    return populate_range(gm, gpa & ~((1ULL << PAGE_SHIFT) - 1), 1ULL << PAGE_SHIFT, PAGE_SHIFT) == 0 ? 1 : -1;
+}
+
+guest_memory_t* guest_memory_create(uint64_t size, guest_memory_format_t format,
+                                    uint32_t flags, const guest_memory_ops_t* ops) {
+    if (!size || (size & ((1ULL << PAGE_SHIFT) - 1))) {
+        return NULL;
+    }
+
+    guest_memory_t* gm = calloc(1, sizeof(guest_memory_t));
+    if (!gm) {
+        return NULL;
+    }
+    gm->ops = *ops;
+    gm->format = format;
+    gm->flags = flags;
+    gm->size = size;
+    gm->units = (size + (1ULL << UNIT_SHIFT) - 1) >> UNIT_SHIFT;
+    pthread_mutex_init(&gm->lock, NULL);
+
+    gm->unit_shift = calloc(gm->units, sizeof(uint8_t));
+    gm->unit_phys = calloc(gm->units, sizeof(uint64_t));
+    gm->unit_released = calloc(gm->units, sizeof(uint16_t));
+    gm->released = calloc((size >> PAGE_SHIFT) / 64 + 1, sizeof(uint64_t));
+    gm->root = alloc_table(gm);
+    gm->base = gm->root ? ops->reserve(ops->ctx, size) : NULL;
+    if (!gm->unit_shift || !gm->unit_phys || !gm->unit_released || !gm->released || !gm->base) {
+        guest_memory_destroy(gm);
+        return NULL;
+    }
+    if (flags & GUEST_MEMORY_LAZY) {
+        return gm;
+    }
+
+    uint32_t page_sizes = flags;
+    uint64_t gpa = 0;
+    while (gpa < size) {
+        uint64_t left = size - gpa;
+
+        if ((page_sizes & GUEST_MEMORY_PAGES_1G) && !(gpa & ((1ULL << GIGA_SHIFT) - 1)) &&
+            left >= (1ULL << GIGA_SHIFT)) {
+            if (populate_range(gm, gpa, 1ULL << GIGA_SHIFT, GIGA_SHIFT) == 0) {
+                gpa += 1ULL << GIGA_SHIFT;
+                continue;
+            }
+            page_sizes &= ~GUEST_MEMORY_PAGES_1G;
+        }
+
+        if ((page_sizes & GUEST_MEMORY_PAGES_2M) && left >= (1ULL << UNIT_SHIFT)) {
+            if (populate_range(gm, gpa, 1ULL << UNIT_SHIFT, UNIT_SHIFT) == 0) {
+                gpa += 1ULL << UNIT_SHIFT;
+                continue;
+            }
+            page_sizes &= ~GUEST_MEMORY_PAGES_2M;
+        }
+
+        // 4KB pages, a 2MB unit per call
+        uint64_t chunk = left < (1ULL << UNIT_SHIFT) ? left : 1ULL << UNIT_SHIFT;
+        if (populate_range(gm, gpa, chunk, PAGE_SHIFT) < 0) {
+            guest_memory_destroy(gm);
+            return NULL;
+        }
+        gpa += chunk;
+    }
+    return gm;
+}
+
+void guest_memory_destroy(guest_memory_t* gm) {
+    if (!gm) {
+        return;
+    }
+    if (gm->root) {
+        free_tables(gm, gm->root, 4);
+    }
+    if (gm->base) {
+        gm->ops.unreserve(gm->ops.ctx, gm->base, gm->size);
+    }
+    pthread_mutex_destroy(&gm->lock);
+    free(gm->unit_shift);
+    free(gm->unit_phys);
+    free(gm->unit_released);
+    free(gm->released);
+    free(gm);
+}
+
+void* guest_memory_base(guest_memory_t* gm) {
+    return gm->base;
+}
+
+uint64_t* guest_memory_table(guest_memory_t* gm) {
+    return gm->root;
+}
+
+int guest_memory_map(guest_memory_t* gm, uint64_t gpa, uint64_t phys, uint64_t size, bool writable) {
+    int level = size == (1ULL << GIGA_SHIFT) ? 3 : size == (1ULL << UNIT_SHIFT) ? 2 : 1;
+
+    if (size != (1ULL << level_shift(level)) || ((gpa | phys) & (size - 1)) || gpa >= gm->size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gm->lock);
+    int result = map_locked(gm, gpa, phys, level, writable);
+    if (result == 0 && level == 1 && !gm->unit_shift[gpa >> UNIT_SHIFT]) {
+        // A 2MB page can no longer go here
+        gm->unit_shift[gpa >> UNIT_SHIFT] = PAGE_SHIFT;
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return result;
+}
+
+/*
+ * First touch of an unmapped page. Returns 1 once it is backed, 0 if it
+ * already was, -1 if out of memory or outside the guest. Faults are
+ * serialized per guest; at worst one waits for a 2MB page to be zeroed.
+ */
+int guest_memory_fault(guest_memory_t* gm, uint64_t gpa) {
+    if (gpa >= gm->size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gm->lock);
+    int result = fault_locked(gm, gpa, UNIT_SHIFT);
+    if (result > 0) {
+        gm->stats.faults++;
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return result;
+}
+
+// Populate [gpa, gpa + size) now, for memory the guest is certain to touch early
+int guest_memory_prefault(guest_memory_t* gm, uint64_t gpa, uint64_t size) {
+    if (gpa >= gm->size || size > gm->size - gpa) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gm->lock);
+    for (uint64_t end = gpa + size; gpa < end;) {
+        int level;
+
+        if (fault_locked(gm, gpa, GIGA_SHIFT) < 0) {
+            pthread_mutex_unlock(&gm->lock);
+            return -1;
+        }
+        walk(gm, gpa, &level);
+        gpa = (gpa | ((1ULL << level_shift(level)) - 1)) + 1;
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return 0;
+}
+
+int guest_memory_protect(guest_memory_t* gm, uint64_t gpa, bool writable) {
+    int level;
+    int result = -1;
+
+    pthread_mutex_lock(&gm->lock);
+    uint64_t* entry = walk(gm, gpa, &level);
+    if (entry && level > 1) {
+        // Only this 4KB page changes
+        entry = walk_create(gm, gpa, 1);
+    }
+    if (entry) {
+        uint64_t value = writable ? *entry | write_bit(gm) : *entry & ~write_bit(gm);
+
+        __atomic_store_n(entry, value, __ATOMIC_RELEASE);
+        result = 0;
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return result;
+}
+
+uint64_t guest_memory_lookup(guest_memory_t* gm, uint64_t gpa, uint64_t* leaf_size) {
+    int level;
+    uint64_t phys = 0;
+
+    pthread_mutex_lock(&gm->lock);
+    uint64_t* entry = walk(gm, gpa, &level);
+    if (entry) {
+        uint64_t mask = (1ULL << level_shift(level)) - 1;
+
+        phys = (*entry & ADDR_MASK & ~mask) | (gpa & mask);
+        if (leaf_size) {
+            *leaf_size = mask + 1;
+        }
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return phys;
+}
+
+/*
+ * The 4KB page at gpa no longer maps its original backing; phys is what it
+ * mapped until now, 0 if nothing. Returns the bytes freed, which for a huge
+ * page is 0 until the last of its 4KB pages goes, or -1 if the page's
+ * backing was already released, in which case phys is the caller's own
+ * frame.
+ */
+int64_t guest_memory_release(guest_memory_t* gm, uint64_t gpa, uint64_t phys) {
+    uint64_t page = gpa >> PAGE_SHIFT;
+    uint64_t unit = gpa >> UNIT_SHIFT;
+    int64_t freed = 0;
+
+    if (gpa >= gm->size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gm->lock);
+    if (gm->released[page / 64] & (1ULL << (page % 64))) {
+        pthread_mutex_unlock(&gm->lock);
+        return -1;
+    }
+    gm->released[page / 64] |= 1ULL << (page % 64);
+
+    if (!phys) {
+        // Never populated: nothing to free, and the page stays 4KB from now on
+        if (!gm->unit_shift[unit]) {
+            gm->unit_shift[unit] = PAGE_SHIFT;
+        }
+    } else if (gm->unit_shift[unit] == PAGE_SHIFT) {
+        gm->ops.release(gm->ops.ctx, phys & ~((1ULL << PAGE_SHIFT) - 1), 1ULL << PAGE_SHIFT);
+        freed = 1ULL << PAGE_SHIFT;
+    } else if (++gm->unit_released[unit] == ENTRIES) {
+        if (gm->unit_shift[unit] == UNIT_SHIFT) {
+            gm->ops.release(gm->ops.ctx, gm->unit_phys[unit], 1ULL << UNIT_SHIFT);
+            freed = 1ULL << UNIT_SHIFT;
+        } else {
+            uint64_t first = unit & ~(uint64_t)(ENTRIES - 1);
+            uint64_t u = first;
+
+            while (u < first + ENTRIES && gm->unit_released[u] == ENTRIES) {
+                u++;
+            }
+            if (u == first + ENTRIES) {
+                gm->ops.release(gm->ops.ctx, gm->unit_phys[unit], 1ULL << GIGA_SHIFT);
+                freed = 1ULL << GIGA_SHIFT;
+            }
+        }
+    }
+    gm->stats.released += freed;
+    pthread_mutex_unlock(&gm->lock);
+    return freed;
+}
+
+/*
+ * The guest gave back the whole 2MB unit at gpa. If a 2MB page of its own
+ * backs it, the leaf is cleared with nothing split and the unit is
+ * untouched again: its next touch faults in a fresh zeroed 2MB page.
+ * Returns the bytes unmapped, with *phys the page that backed them, which
+ * the caller frees once no TLB or host mapping reaches it; 0 if nothing
+ * was populated there; -1 if the unit cannot go whole (4KB pages, part of
+ * a 1GB page, or partly remapped or released), and then it goes a 4KB
+ * page at a time through guest_memory_release().
+ */
+int64_t guest_memory_unmap_unit(guest_memory_t* gm, uint64_t gpa, uint64_t* phys) {
+    uint64_t unit = gpa >> UNIT_SHIFT;
+    int64_t result = -1;
+    int level;
+
+    if ((gpa & ((1ULL << UNIT_SHIFT) - 1)) || gpa + (1ULL << UNIT_SHIFT) > gm->size) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&gm->lock);
+    uint64_t* entry = walk(gm, gpa, &level);
+    if (!gm->unit_shift[unit]) {
+        result = 0;
+    } else if (gm->unit_shift[unit] == UNIT_SHIFT && !gm->unit_released[unit] && entry && level == 2) {
+        *phys = *entry & ADDR_MASK;
+        __atomic_store_n(entry, 0, __ATOMIC_RELEASE);
+        gm->unit_shift[unit] = 0;
+        gm->stats.released += 1ULL << UNIT_SHIFT;
+        result = 1LL << UNIT_SHIFT;
+    }
+    pthread_mutex_unlock(&gm->lock);
+    return result;
+}
+
+void guest_memory_get_stats(guest_memory_t* gm, guest_memory_stats_t* stats) {
+    pthread_mutex_lock(&gm->lock);
+    *stats = gm->stats;
+    pthread_mutex_unlock(&gm->lock);
+}
+
+#ifdef GUEST_MEMORY_TEST
+/* Userspace test: cc -O2 -DGUEST_MEMORY_TEST guest_memory.c -lpthread */
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <linux/mman.h>
+
+// Host addresses stand in for physical ones
+static bool pretend_huge;       // Accept huge page sizes without hugetlbfs
+
+static void* test_reserve(void* ctx, uint64_t size) {
+    (void)ctx;
+    uint64_t giga = 1ULL << GIGA_SHIFT;
+    uint8_t* area = mmap(NULL, size + giga, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (area == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t* base = (uint8_t*)(((uint64_t)area + giga - 1) & ~(giga - 1));
+    if (base > area) {
+        munmap(area, base - area);
+    }
+    munmap(base + size, area + giga - base);
+    return base;
+}
+
+static void test_unreserve(void* ctx, void* base, uint64_t size) {
+    (void)ctx;
+    munmap(base, size);
+}
+
+static int test_populate(void* ctx, void* addr, uint64_t size, uint32_t page_shift) {
+    (void)ctx;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE;
+
+    if (page_shift > PAGE_SHIFT && !pretend_huge) {
+        // Reserved and faulted in now, so a short pool fails here and not in the guest
+        flags = (flags & ~MAP_NORESERVE) | MAP_HUGETLB | MAP_POPULATE | (page_shift << MAP_HUGE_SHIFT);
+    }
+    return mmap(addr, size, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED ? -1 : 0;
+}
+
+static uint64_t released_bytes;
+
+static void test_release(void* ctx, uint64_t phys, uint64_t size) {
+    (void)ctx;
+    released_bytes += size;
+    madvise((void*)phys, size, MADV_DONTNEED);
+}
+
+static void* test_alloc_table(void* ctx) {
+    (void)ctx;
+    void* table = aligned_alloc(4096, 4096);
+
+    if (table) {
+        memset(table, 0, 4096);
+    }
+    return table;
+}
+
+static void test_free_table(void* ctx, void* table) {
+    (void)ctx;
+    free(table);
+}
+
+static uint64_t test_virt_to_phys(void* ctx, const void* addr) {
+    (void)ctx;
+    return (uint64_t)addr;
+}
+
+static void* test_phys_to_virt(void* ctx, uint64_t phys) {
+    (void)ctx;
+    return (void*)phys;
+}
+
+static const guest_memory_ops_t test_ops = {
+    .reserve = test_reserve,
+    .unreserve = test_unreserve,
+    .populate = test_populate,
+    .release = test_release,
+    .alloc_table = test_alloc_table,
+    .free_table = test_free_table,
+    .virt_to_phys = test_virt_to_phys,
+    .phys_to_virt = test_phys_to_virt,
+};
+
+#include "../test_check.h"
+
+// Every page translates to the host window, except those listed in moved
+static void check_identity(guest_memory_t* gm, uint64_t size, uint64_t moved_gpa, uint64_t moved_phys) {
+    uint8_t* base = guest_memory_base(gm);
+
+    for (uint64_t gpa = 0; gpa < size; gpa += 1ULL << PAGE_SHIFT) {
+        uint64_t expect = gpa == moved_gpa ? moved_phys : (uint64_t)(base + gpa);
+        uint64_t phys = guest_memory_lookup(gm, gpa, NULL);
+
+        if (phys != expect) {
+            CHECK(false, "gpa 0x%llx -> 0x%llx, expected 0x%llx", (unsigned long long)gpa,
+                  (unsigned long long)phys, (unsigned long long)expect);
+            return;
+        }
+    }
+}
+
+static void report(const char* name, guest_memory_t* gm, double ms) {
+    guest_memory_stats_t stats;
+
+    guest_memory_get_stats(gm, &stats);
+    printf("%-10s 1G %5llu MB  2M %5llu MB  4K %5llu MB  tables %6llu  splits %llu  built in %.1f ms\n", name,
+           (unsigned long long)(stats.bytes_1g >> 20), (unsigned long long)(stats.bytes_2m >> 20),
+           (unsigned long long)(stats.bytes_4k >> 20), (unsigned long long)stats.tables,
+           (unsigned long long)stats.splits, ms);
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(void) {
+    // 2GB + 6MB + 12KB: 1GB, 2MB and 4KB leaves all appear
+    uint64_t size = (2ULL << 30) + (6ULL << 20) + (12ULL << 10);
+
+    // Real huge pages, if the host has any; otherwise 4KB throughout
+    double start = now_ms();
+    guest_memory_t* gm = guest_memory_create(size, GUEST_MEMORY_EPT, GUEST_MEMORY_PAGES_ALL, &test_ops);
+    CHECK(gm, "create with hugetlbfs");
+    if (gm) {
+        report("hugetlbfs", gm, now_ms() - start);
+        check_identity(gm, size, UINT64_MAX, 0);
+        guest_memory_destroy(gm);
+    }
+
+    start = now_ms();
+    gm = guest_memory_create(size, GUEST_MEMORY_NPT, 0, &test_ops);
+    CHECK(gm, "create with 4KB pages");
+    if (gm) {
+        report("4KB only", gm, now_ms() - start);
+        check_identity(gm, size, UINT64_MAX, 0);
+        guest_memory_destroy(gm);
+    }
+
+    // Pretend huge pages are there, to check the large leaves
+    pretend_huge = true;
+    start = now_ms();
+    gm = guest_memory_create(size, GUEST_MEMORY_EPT, GUEST_MEMORY_PAGES_ALL, &test_ops);
+    CHECK(gm, "create with huge pages");
+    if (!gm) {
+        return 1;
+    }
+    report("huge", gm, now_ms() - start);
+    check_identity(gm, size, UINT64_MAX, 0);
+
+    uint8_t* base = guest_memory_base(gm);
+    uint64_t leaf;
+    guest_memory_lookup(gm, 0x12345000, &leaf);
+    CHECK(leaf == 1ULL << GIGA_SHIFT, "1GB leaf at 0x12345000, got %llu", (unsigned long long)leaf);
+    guest_memory_lookup(gm, (2ULL << 30) + (4ULL << 20), &leaf);
+    CHECK(leaf == 1ULL << UNIT_SHIFT, "2MB leaf after 2GB, got %llu", (unsigned long long)leaf);
+    guest_memory_lookup(gm, size - 4096, &leaf);
+    CHECK(leaf == 1ULL << PAGE_SHIFT, "4KB leaf at the end, got %llu", (unsigned long long)leaf);
+
+    // Remap one 4KB page inside the first 1GB leaf: it splits down to a PTE
+    uint64_t moved = 0x12345000;
+    uint64_t frame = (uint64_t)test_alloc_table(NULL);
+    CHECK(guest_memory_map(gm, moved, frame, 4096, false) == 0, "remap");
+    guest_memory_lookup(gm, moved, &leaf);
+    CHECK(leaf == 4096, "remapped page has a 4KB leaf");
+    guest_memory_lookup(gm, moved + (4ULL << 20), &leaf);
+    CHECK(leaf == 1ULL << UNIT_SHIFT, "the rest of the 1GB leaf stays 2MB, got %llu", (unsigned long long)leaf);
+    check_identity(gm, size, moved, frame);
+
+    // Protection is per 4KB page too
+    CHECK(guest_memory_protect(gm, 0x40001000, false) == 0, "protect");
+    int level;
+    uint64_t* entry = walk(gm, 0x40001000, &level);
+    CHECK(entry && level == 1 && !(*entry & EPT_WRITE), "protected page is read-only");
+    entry = walk(gm, 0x40002000, &level);
+    CHECK(entry && (*entry & EPT_WRITE), "neighbour stays writable");
+    CHECK(guest_memory_protect(gm, 0x40001000, true) == 0, "unprotect");
+    entry = walk(gm, 0x40001000, &level);
+    CHECK(entry && (*entry & EPT_WRITE), "unprotected page is writable");
+    check_identity(gm, size, moved, frame);
+
+    // A 2MB page is released once all its 4KB pages are
+    uint64_t unit_gpa = (2ULL << 30) + (2ULL << 20);
+    int64_t freed = 0;
+    for (uint64_t gpa = unit_gpa; gpa < unit_gpa + (2ULL << 20); gpa += 4096) {
+        freed += guest_memory_release(gm, gpa, (uint64_t)(base + gpa));
+    }
+    CHECK(freed == 2LL << 20, "2MB page released once, got %lld", (long long)freed);
+    CHECK(guest_memory_release(gm, unit_gpa, 0) == -1, "second release of a page");
+
+    // A 4KB page straight away
+    CHECK(guest_memory_release(gm, size - 4096, (uint64_t)(base + size - 4096)) == 4096, "4KB release");
+
+    // A 1GB page only when all of it is gone
+    freed = 0;
+    for (uint64_t gpa = 1ULL << GIGA_SHIFT; gpa < 2ULL << GIGA_SHIFT; gpa += 4096) {
+        freed += guest_memory_release(gm, gpa, (uint64_t)(base + gpa));
+        if (gpa == (2ULL << GIGA_SHIFT) - 8192) {
+            CHECK(freed == 0, "1GB page held while in use, freed %lld", (long long)freed);
+        }
+    }
+    CHECK(freed == 1LL << GIGA_SHIFT, "1GB page released once, got %lld", (long long)freed);
+    CHECK(released_bytes == (1ULL << GIGA_SHIFT) + (2ULL << 20) + 4096, "released %llu",
+          (unsigned long long)released_bytes);
+
+    report("after", gm, 0);
+    guest_memory_destroy(gm);
+    free((void*)frame);
+
+    // Lazy: nothing until touched, then the largest page that fits
+    start = now_ms();
+    gm = guest_memory_create(64ULL << 30, GUEST_MEMORY_EPT, GUEST_MEMORY_PAGES_ALL | GUEST_MEMORY_LAZY, &test_ops);
+    CHECK(gm, "create 64GB lazily");
+    if (gm) {
+        report("lazy 64GB", gm, now_ms() - start);
+        guest_memory_destroy(gm);
+    }
+
+    gm = guest_memory_create(size, GUEST_MEMORY_EPT, GUEST_MEMORY_PAGES_ALL | GUEST_MEMORY_LAZY, &test_ops);
+    CHECK(gm, "create lazily");
+    if (!gm) {
+        return 1;
+    }
+    base = guest_memory_base(gm);
+    CHECK(guest_memory_lookup(gm, 0x12345000, NULL) == 0, "nothing mapped before the first touch");
+    CHECK(guest_memory_fault(gm, 0x12345678) == 1, "first touch");
+    CHECK(guest_memory_fault(gm, 0x12345000) == 0, "second touch");
+    guest_memory_lookup(gm, 0x12345000, &leaf);
+    CHECK(leaf == 1ULL << UNIT_SHIFT, "touched page gets a 2MB leaf, got %llu", (unsigned long long)leaf);
+    CHECK(base[0x12345678] == 0 && base[0x12200000] == 0, "populated memory reads as zero");
+
+    // A whole 2MB page given back goes without a split, and the unit is untouched again
+    uint64_t unit_phys = 0;
+    base[0x12345678] = 1;
+    CHECK(guest_memory_unmap_unit(gm, 0x12200000, &unit_phys) == 2LL << 20 && unit_phys == (uint64_t)base + 0x12200000,
+          "unmap a 2MB unit");
+    CHECK(guest_memory_lookup(gm, 0x12345000, NULL) == 0, "unmapped unit is untouched");
+    CHECK(guest_memory_unmap_unit(gm, 0x12200000, &unit_phys) == 0, "unmap of an untouched unit");
+    test_release(NULL, unit_phys, 2ULL << 20);
+    CHECK(guest_memory_fault(gm, 0x12345000) == 1, "touch after unmap");
+    guest_memory_lookup(gm, 0x12345000, &leaf);
+    CHECK(leaf == 1ULL << UNIT_SHIFT && base[0x12345678] == 0, "fresh zeroed 2MB page, leaf %llu",
+          (unsigned long long)leaf);
+    CHECK(guest_memory_unmap_unit(gm, 0x12201000, &unit_phys) == -1, "unaligned unit");
+
+    // A page given back before it was touched keeps its 2MB unit on 4KB pages
+    uint64_t untouched = 0x20000000;
+    CHECK(guest_memory_map(gm, untouched, frame = (uint64_t)test_alloc_table(NULL), 4096, false) == 0,
+          "map into an untouched unit");
+    CHECK(guest_memory_release(gm, untouched, 0) == 0, "release of an untouched page");
+    CHECK(guest_memory_fault(gm, untouched + 4096) == 1, "touch beside it");
+    guest_memory_lookup(gm, untouched + 4096, &leaf);
+    CHECK(leaf == 4096, "beside a remapped page the leaf is 4KB, got %llu", (unsigned long long)leaf);
+    CHECK(guest_memory_lookup(gm, untouched, NULL) == frame, "remapped page left alone");
+
+    // Boot memory prefaulted, 1GB pages included
+    CHECK(guest_memory_prefault(gm, 1ULL << GIGA_SHIFT, (1ULL << GIGA_SHIFT) + (6ULL << 20) + 8192) == 0,
+          "prefault");
+    guest_memory_lookup(gm, (1ULL << GIGA_SHIFT) + 4096, &leaf);
+    CHECK(leaf == 1ULL << GIGA_SHIFT, "prefault uses a 1GB leaf, got %llu", (unsigned long long)leaf);
+    guest_memory_lookup(gm, size - 8192, &leaf);
+    CHECK(leaf == 4096, "the tail is 4KB, got %llu", (unsigned long long)leaf);
+    CHECK(guest_memory_lookup(gm, size - 4096, NULL) == 0, "past the prefault still untouched");
+    CHECK(guest_memory_fault(gm, size) == -1, "fault outside the guest");
+    CHECK(guest_memory_unmap_unit(gm, untouched, &unit_phys) == -1, "a unit on 4KB pages goes a page at a time");
+    CHECK(guest_memory_unmap_unit(gm, (1ULL << GIGA_SHIFT) + (2ULL << 20), &unit_phys) == -1,
+          "a unit inside a 1GB page stays");
+    report("lazy", gm, 0);
+    guest_memory_destroy(gm);
+    free((void*)frame);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+#endif /* GUEST_MEMORY_TEST */
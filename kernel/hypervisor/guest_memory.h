@@ -0,0 +1,99 @@
+/*
+ * QENEX Hypervisor - Guest Physical Memory
+ *
+ * Backs a guest's RAM and builds the second-level page tables (Intel EPT
+ * or AMD NPT) that translate it:
+ *
+ *   - RAM is allocated in the largest pages available: 1GB pages while at
+ *     least 1GB is left, then 2MB pages, then 4KB pages. A page size the
+ *     host cannot supply is dropped for the rest of the guest, so the
+ *     fallback costs one failed attempt, not one per page.
+ *   - Each backing page is mapped by one leaf of the same size. A 1GB
+ *     guest needs one PDPTE instead of 262144 PTEs, and a TLB entry (and
+ *     a two-dimensional walk) covers the whole leaf.
+ *   - The host sees the same memory at guest_memory_base(), one
+ *     contiguous window aligned to 1GB so that host mappings can use
+ *     large pages too.
+ *   - Remapping or protecting a single 4KB page inside a large leaf
+ *     splits that leaf into a table of smaller leaves, only along the path
+ *     to that page.
+ *   - Pages handed back to the host are released a backing page at a
+ *     time: a 4KB page at once, a huge page when none of it is mapped any
+ *     more. A whole 2MB page given back at once is unmapped without a
+ *     split, which frees it straight away.
+ *   - With GUEST_MEMORY_LAZY nothing is allocated up front. The tables
+ *     start empty and guest_memory_fault() backs the page on first touch,
+ *     zero-filled, with a 2MB page where the whole 2MB is still untouched.
+ *     guest_memory_prefault() populates a range ahead of time, 1GB pages
+ *     included.
+ *
+ * Table pages and backing come from guest_memory_ops_t, so the code runs
+ * unchanged in userspace. Build with -DGUEST_MEMORY_TEST for a test that
+ * walks the tables it built.
+ */
+
+#ifndef QENEX_GUEST_MEMORY_H
+#define QENEX_GUEST_MEMORY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GUEST_MEMORY_PAGE_SHIFT 12
+#define GUEST_MEMORY_2M_SHIFT 21
+#define GUEST_MEMORY_1G_SHIFT 30
+
+// guest_memory_create() flags: page sizes it may use besides 4KB, and when to populate
+#define GUEST_MEMORY_PAGES_2M (1 << 0)
+#define GUEST_MEMORY_PAGES_1G (1 << 1)
+#define GUEST_MEMORY_PAGES_ALL (GUEST_MEMORY_PAGES_2M | GUEST_MEMORY_PAGES_1G)
+#define GUEST_MEMORY_LAZY (1 << 2)             // On first touch, not at creation
+
+typedef enum {
+    GUEST_MEMORY_EPT,       // Intel: R/W/X bits, write-back memory type
+    GUEST_MEMORY_NPT        // AMD: x86-64 page table format
+} guest_memory_format_t;
+
+typedef struct {
+    void* ctx;
+    // Reserve a host window of size bytes, aligned to 1GB
+    void* (*reserve)(void* ctx, uint64_t size);
+    void (*unreserve)(void* ctx, void* base, uint64_t size);
+    // Back [addr, addr + size) with zeroed pages of 1 << page_shift; all or nothing
+    int (*populate)(void* ctx, void* addr, uint64_t size, uint32_t page_shift);
+    // Free backing that nothing maps any more
+    void (*release)(void* ctx, uint64_t phys, uint64_t size);
+    // Zeroed 4KB page for a table
+    void* (*alloc_table)(void* ctx);
+    void (*free_table)(void* ctx, void* table);
+    uint64_t (*virt_to_phys)(void* ctx, const void* addr);
+    void* (*phys_to_virt)(void* ctx, uint64_t phys);
+} guest_memory_ops_t;
+
+typedef struct {
+    uint64_t bytes_1g;          // Populated with 1GB pages
+    uint64_t bytes_2m;
+    uint64_t bytes_4k;
+    uint64_t tables;            // Table pages
+    uint64_t splits;            // Large leaves split to map a smaller page
+    uint64_t faults;            // Pages populated on first touch
+    uint64_t released;          // Bytes of backing freed
+} guest_memory_stats_t;
+
+typedef struct guest_memory guest_memory_t;
+
+/* Function prototypes */
+guest_memory_t* guest_memory_create(uint64_t size, guest_memory_format_t format,
+                                    uint32_t flags, const guest_memory_ops_t* ops);
+void guest_memory_destroy(guest_memory_t* gm);
+void* guest_memory_base(guest_memory_t* gm);
+uint64_t* guest_memory_table(guest_memory_t* gm);
+int guest_memory_map(guest_memory_t* gm, uint64_t gpa, uint64_t phys, uint64_t size, bool writable);
+int guest_memory_protect(guest_memory_t* gm, uint64_t gpa, bool writable);
+uint64_t guest_memory_lookup(guest_memory_t* gm, uint64_t gpa, uint64_t* leaf_size);
+int guest_memory_fault(guest_memory_t* gm, uint64_t gpa);
+int guest_memory_prefault(guest_memory_t* gm, uint64_t gpa, uint64_t size);
+int64_t guest_memory_release(guest_memory_t* gm, uint64_t gpa, uint64_t phys);
+int64_t guest_memory_unmap_unit(guest_memory_t* gm, uint64_t gpa, uint64_t* phys);
+void guest_memory_get_stats(guest_memory_t* gm, guest_memory_stats_t* stats);
+
+#endif /* QENEX_GUEST_MEMORY_H */
@@ -0,0 +1,1640 @@
+/*
+ * QENEX Hypervisor - Live Migration
+ *
+ * Multi-channel pre-copy with XBZRLE and auto-converge, and post-copy
+ * with userfaultfd on the destination. See migration.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#include "migration.h"
+
+#define PS MIGRATION_PAGE_SIZE
+#define OUT_BUFFER (256 * 1024)
+#define IN_BUFFER (256 * 1024)
+#define MIGRATION_MAGIC 0x514D4947          // "QMIG"
+#define XBZRLE_LIMIT (PS - 64)              // Longest delta worth sending
+#define DOWNTIME_MARGIN 50                  // Percent of the downtime target held in reserve
+
+_Static_assert(MIGRATION_CHUNK_PAGES == 64, "a chunk is one dirty bitmap word");
+
+enum {
+    REC_HELLO,              // arg = guest memory size
+    REC_FULL,               // arg = page, PS bytes follow
+    REC_ZERO,               // arg = page
+    REC_XBZRLE,             // arg = page, delta follows
+    REC_STATE,              // Device state follows
+    REC_POSTCOPY,           // Switch; on channel 0 the bitmap of pages still to come follows
+    REC_END,                // Last record of a stream; arg = MIGRATION_MAGIC in the final reply
+    REC_PING,               // Channel 0 only; answered with a REC_PONG carrying arg
+
+    // Destination to source, on channel 0
+    REC_RUNNING,            // Post-copy: the guest runs on the destination
+    REC_REQUEST,            // Post-copy: arg = page the guest faulted on
+    REC_PONG
+};
+
+enum {
+    PHASE_PRECOPY,
+    PHASE_FINAL,            // Paused: last pages, state and end of stream
+    PHASE_POSTCOPY          // Paused here, running there: push what is left
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;           // Payload bytes that follow
+    uint64_t arg;
+} __attribute__((packed)) mig_record_t;
+
+typedef struct {
+    struct migration* m;
+    uint32_t index;
+    int fd;
+    pthread_t thread;
+    int error;
+    bool hello_sent;
+    pthread_mutex_t lock;   // Post-copy: page requests share channel 0
+
+    uint8_t* out;
+    uint32_t out_len;
+    uint64_t limit_start;   // Rate limiting for this round
+    uint64_t limit_bytes;
+
+    // XBZRLE: direct-mapped copies of pages as the destination has them
+    uint64_t* cache_tags;   // Page + 1; 0 if empty
+    uint8_t* cache_data;
+    uint32_t cache_slots;
+    uint8_t page[PS];       // Stable snapshot of the page being sent
+    uint8_t delta[PS];
+
+    migration_stats_t stats;
+} mig_worker_t;
+
+struct migration {
+    uint8_t* memory;
+    uint64_t size;
+    uint64_t pages;
+    uint64_t words;
+    uint64_t* dirty;        // Set by migration_mark_dirty()
+    uint64_t* sending;      // Pages of the current round
+    migration_params_t params;
+    migration_ops_t ops;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    uint32_t round;         // Workers start a round when this changes
+    uint32_t busy;
+    uint32_t phase;
+    bool exiting;
+
+    // Post-copy: pages the destination still lacks, claimed by whoever sends them
+    uint64_t* needed;
+    uint64_t needed_left;
+    uint64_t push_next;     // Next chunk for the background push
+    pthread_t request_thread;
+    int request_result;
+    uint64_t running_at;    // When the destination started the guest
+
+    uint8_t* state;
+    uint32_t state_len;
+
+    mig_worker_t workers[MIGRATION_MAX_CHANNELS];
+    migration_stats_t stats;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+static int read_all(int fd, void* buf, uint64_t len) {
+    uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int write_all(int fd, const void* buf, uint64_t len) {
+    const uint8_t* p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static bool page_is_zero(const uint8_t* page) {
+    const uint64_t* words = (const uint64_t*)page;
+
+    for (uint32_t i = 0; i < PS / 8; i += 4) {
+        if (words[i] | words[i + 1] | words[i + 2] | words[i + 3]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* ==================== XBZRLE ==================== */
+
+static uint32_t uleb_put(uint8_t* out, uint32_t value) {
+    uint32_t n = 0;
+
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out[n++] = byte | (value ? 0x80 : 0);
+    } while (value);
+
+    return n;
+}
+
+static int uleb_get(const uint8_t* in, uint32_t len, uint32_t* pos, uint32_t* value) {
+    *value = 0;
+
+    for (uint32_t shift = 0; shift < 21; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        uint8_t byte = in[(*pos)++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * Encode cur against old as (unchanged run, changed run, changed bytes)
+ * triples; the trailing unchanged run is implied. Returns the length, 0 if
+ * the pages are equal, or -1 if the delta would exceed limit.
+ */
+static int xbzrle_encode(const uint8_t* old, const uint8_t* cur, uint8_t* out, uint32_t limit) {
+    uint32_t i = 0;
+    uint32_t len = 0;
+
+    while (i < PS) {
+        uint32_t start = i;
+        while (i + 8 <= PS && load64(old + i) == load64(cur + i)) {
+            i += 8;
+        }
+        while (i < PS && old[i] == cur[i]) {
+            i++;
+        }
+        if (i == PS) {
+            break;
+        }
+
+        uint32_t zrun = i - start;
+        start = i;
+        while (i < PS && old[i] != cur[i]) {
+            i++;
+        }
+
+        uint32_t nzrun = i - start;
+        if (len + 6 + nzrun > limit) {
+            return -1;
+        }
+        len += uleb_put(out + len, zrun);
+        len += uleb_put(out + len, nzrun);
+        memcpy(out + len, cur + start, nzrun);
+        len += nzrun;
+    }
+
+    return len;
+}
+
+static int xbzrle_decode(const uint8_t* in, uint32_t len, uint8_t* page) {
+    uint32_t pos = 0;
+    uint32_t i = 0;
+
+    while (pos < len) {
+        uint32_t zrun, nzrun;
+        if (uleb_get(in, len, &pos, &zrun) < 0 || uleb_get(in, len, &pos, &nzrun) < 0) {
+            return -1;
+        }
+
+        i += zrun;
+        if (nzrun == 0 || i + nzrun > PS || pos + nzrun > len) {
+            return -1;
+        }
+        memcpy(page + i, in + pos, nzrun);
+        pos += nzrun;
+        i += nzrun;
+    }
+
+    return 0;
+}
+
+/* ==================== SENDING ==================== */
+
+static void worker_write_out(mig_worker_t* w) {
+    if (w->out_len && !w->error && write_all(w->fd, w->out, w->out_len) < 0) {
+        w->error = -1;
+    }
+    w->stats.bytes_sent += w->out_len;
+    w->out_len = 0;
+}
+
+static void worker_flush(mig_worker_t* w) {
+    migration_t* m = w->m;
+    uint32_t len = w->out_len;
+
+    worker_write_out(w);
+
+    // Keep this channel to its share of the bandwidth cap
+    if (m->params.max_bandwidth && len) {
+        uint64_t share = m->params.max_bandwidth / m->params.channels;
+        w->limit_bytes += len;
+        uint64_t due = w->limit_bytes * 1000000000ULL / (share ? share : 1);
+        uint64_t elapsed = now_ns() - w->limit_start;
+        if (due > elapsed) {
+            sleep_ns(due - elapsed);
+        }
+    }
+}
+
+static void worker_emit(mig_worker_t* w, uint32_t type, uint64_t arg,
+                        const void* payload, uint32_t len) {
+    mig_record_t rec = { .type = type, .len = len, .arg = arg };
+
+    if (w->out_len + sizeof(rec) + len > OUT_BUFFER) {
+        worker_flush(w);
+    }
+
+    // Device state and the post-copy bitmap can be larger than the buffer
+    if (sizeof(rec) + len > OUT_BUFFER) {
+        if (!w->error && (write_all(w->fd, &rec, sizeof(rec)) < 0 ||
+                          write_all(w->fd, payload, len) < 0)) {
+            w->error = -1;
+        }
+        w->stats.bytes_sent += sizeof(rec) + len;
+        return;
+    }
+
+    memcpy(w->out + w->out_len, &rec, sizeof(rec));
+    memcpy(w->out + w->out_len + sizeof(rec), payload, len);
+    w->out_len += sizeof(rec) + len;
+}
+
+static void send_page(mig_worker_t* w, uint64_t page, uint64_t local) {
+    migration_t* m = w->m;
+    const uint8_t* src = m->memory + page * PS;
+
+    // Untouched memory reads as zero; a first write after this check redirties the page
+    if (m->ops.populated && !m->ops.populated(m->ops.ctx, page)) {
+        worker_emit(w, REC_ZERO, page, NULL, 0);
+        w->stats.zero_pages++;
+        w->stats.pages_sent++;
+        if (w->cache_slots && m->phase != PHASE_POSTCOPY) {
+            uint32_t slot = local % w->cache_slots;
+            if (w->cache_tags[slot] == page + 1) {
+                memset(w->cache_data + (uint64_t)slot * PS, 0, PS);
+            }
+        }
+        return;
+    }
+
+    // Post-copy sends each page once, to a destination that has no copy of it
+    if (!w->cache_slots || m->phase == PHASE_POSTCOPY) {
+        // A write racing the copy redirties the page; the next round resends it
+        if (page_is_zero(src)) {
+            worker_emit(w, REC_ZERO, page, NULL, 0);
+            w->stats.zero_pages++;
+        } else {
+            worker_emit(w, REC_FULL, page, src, PS);
+        }
+        w->stats.pages_sent++;
+        return;
+    }
+
+    // The cached copy must match what was sent exactly, so work from a snapshot
+    memcpy(w->page, src, PS);
+    uint32_t slot = local % w->cache_slots;
+    uint8_t* cached = w->cache_data + (uint64_t)slot * PS;
+    bool hit = w->cache_tags[slot] == page + 1;
+
+    if (page_is_zero(w->page)) {
+        worker_emit(w, REC_ZERO, page, NULL, 0);
+        w->stats.zero_pages++;
+        w->stats.pages_sent++;
+        if (hit) {
+            memset(cached, 0, PS);
+        }
+        return;
+    }
+
+    if (hit) {
+        int len = xbzrle_encode(cached, w->page, w->delta, XBZRLE_LIMIT);
+        if (len == 0) {
+            w->stats.unchanged_pages++;
+            return;
+        }
+        if (len > 0) {
+            worker_emit(w, REC_XBZRLE, page, w->delta, len);
+            memcpy(cached, w->page, PS);
+            w->stats.xbzrle_pages++;
+            w->stats.pages_sent++;
+            return;
+        }
+        w->stats.xbzrle_overflows++;
+    }
+
+    worker_emit(w, REC_FULL, page, w->page, PS);
+    w->stats.pages_sent++;
+
+    // Pages sent again after the bulk round are the ones likely to be resent
+    if (hit || m->round > 1) {
+        w->cache_tags[slot] = page + 1;
+        memcpy(cached, w->page, PS);
+    }
+}
+
+// Take the next chunk with pages the destination lacks, starting at push_next
+static bool claim_chunk(migration_t* m, uint64_t* chunk, uint64_t* bits) {
+    while (__atomic_load_n(&m->needed_left, __ATOMIC_ACQUIRE) > 0) {
+        uint64_t c = __atomic_fetch_add(&m->push_next, 1, __ATOMIC_RELAXED) % m->words;
+        if (!__atomic_load_n(&m->needed[c], __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        uint64_t b = __atomic_exchange_n(&m->needed[c], 0, __ATOMIC_ACQ_REL);
+        if (b) {
+            __atomic_sub_fetch(&m->needed_left, __builtin_popcountll(b), __ATOMIC_RELEASE);
+            *chunk = c;
+            *bits = b;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void worker_postcopy(mig_worker_t* w) {
+    migration_t* m = w->m;
+    uint64_t chunk, bits;
+
+    // Every channel marks the switch; channel 0 also says which pages are still to come
+    pthread_mutex_lock(&w->lock);
+    if (w->index == 0) {
+        if (m->state_len) {
+            worker_emit(w, REC_STATE, 0, m->state, m->state_len);
+        }
+        worker_emit(w, REC_POSTCOPY, m->pages, m->sending, m->words * sizeof(uint64_t));
+    } else {
+        worker_emit(w, REC_POSTCOPY, 0, NULL, 0);
+    }
+    worker_write_out(w);
+    pthread_mutex_unlock(&w->lock);
+
+    // With more than one channel, channel 0 is kept free for requested pages
+    if (w->index == 0 && m->params.channels > 1) {
+        return;
+    }
+
+    while (!w->error && claim_chunk(m, &chunk, &bits)) {
+        pthread_mutex_lock(&w->lock);
+        while (bits) {
+            uint32_t bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            send_page(w, chunk * MIGRATION_CHUNK_PAGES + bit, 0);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    worker_emit(w, REC_END, 0, NULL, 0);
+    worker_flush(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void worker_round(mig_worker_t* w, uint32_t phase) {
+    migration_t* m = w->m;
+    uint32_t channels = m->params.channels;
+
+    w->limit_start = now_ns();
+    w->limit_bytes = 0;
+
+    if (!w->hello_sent) {
+        worker_emit(w, REC_HELLO, m->size, NULL, 0);
+        w->hello_sent = true;
+    }
+
+    if (phase == PHASE_POSTCOPY) {
+        worker_postcopy(w);
+        return;
+    }
+
+    // Chunk c is bitmap word c; this channel owns every channels-th chunk
+    for (uint64_t chunk = w->index; chunk < m->words && !w->error; chunk += channels) {
+        uint64_t bits = m->sending[chunk];
+        uint64_t local_base = (chunk / channels) * MIGRATION_CHUNK_PAGES;
+
+        while (bits) {
+            uint32_t bit = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            send_page(w, chunk * MIGRATION_CHUNK_PAGES + bit, local_base + bit);
+        }
+    }
+
+    if (phase == PHASE_FINAL) {
+        if (w->index == 0 && m->state_len) {
+            worker_emit(w, REC_STATE, 0, m->state, m->state_len);
+        }
+        worker_emit(w, REC_END, 0, NULL, 0);
+    }
+    worker_flush(w);
+}
+
+static void* worker_main(void* arg) {
+    mig_worker_t* w = arg;
+    migration_t* m = w->m;
+    uint32_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&m->lock);
+        while (m->round == seen && !m->exiting) {
+            pthread_cond_wait(&m->start_cond, &m->lock);
+        }
+        if (m->exiting) {
+            pthread_mutex_unlock(&m->lock);
+            break;
+        }
+        seen = m->round;
+        uint32_t phase = m->phase;
+        pthread_mutex_unlock(&m->lock);
+
+        worker_round(w, phase);
+
+        pthread_mutex_lock(&m->lock);
+        if (--m->busy == 0) {
+            pthread_cond_signal(&m->done_cond);
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+
+    return NULL;
+}
+
+static uint64_t bytes_sent(migration_t* m) {
+    uint64_t total = 0;
+
+    // The post-copy request thread also writes on channel 0
+    for (uint32_t i = 0; i < m->params.channels; i++) {
+        pthread_mutex_lock(&m->workers[i].lock);
+        total += m->workers[i].stats.bytes_sent;
+        pthread_mutex_unlock(&m->workers[i].lock);
+    }
+    return total;
+}
+
+// Send every page in m->sending on all channels; returns bytes sent
+static uint64_t run_round(migration_t* m, uint32_t phase) {
+    uint64_t before = bytes_sent(m);
+
+    pthread_mutex_lock(&m->lock);
+    m->phase = phase;
+    m->busy = m->params.channels;
+    m->round++;
+    pthread_cond_broadcast(&m->start_cond);
+    while (m->busy) {
+        pthread_cond_wait(&m->done_cond, &m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    return bytes_sent(m) - before;
+}
+
+// Move the pages dirtied since the last harvest into m->sending
+static uint64_t harvest_dirty(migration_t* m) {
+    uint64_t count = 0;
+
+    if (m->ops.sync_dirty_log) {
+        m->ops.sync_dirty_log(m->ops.ctx);
+    }
+
+    for (uint64_t i = 0; i < m->words; i++) {
+        uint64_t bits = __atomic_load_n(&m->dirty[i], __ATOMIC_RELAXED) ? __atomic_exchange_n(&m->dirty[i], 0, __ATOMIC_ACQ_REL) : 0;
+        m->sending[i] |= bits;
+        count += __builtin_popcountll(m->sending[i]);
+    }
+
+    return count;
+}
+
+/* ==================== SOURCE ==================== */
+
+void migration_default_params(migration_params_t* params) {
+    memset(params, 0, sizeof(*params));
+    params->channels = 4;
+    params->downtime_target_ns = 300000000ULL;         // 300ms
+    params->xbzrle_cache_bytes = 64ULL * 1024 * 1024;
+    params->max_rounds = 30;
+    params->throttle_initial = 20;
+    params->throttle_step = 10;
+    params->throttle_max = 99;
+    params->postcopy_after_rounds = 2;
+}
+
+migration_t* migration_create(void* memory, uint64_t size, const int* fds,
+                              const migration_params_t* params, const migration_ops_t* ops) {
+    if (params->channels == 0 || params->channels > MIGRATION_MAX_CHANNELS || size % PS) {
+        return NULL;
+    }
+
+    migration_t* m = calloc(1, sizeof(migration_t));
+    if (!m) {
+        return NULL;
+    }
+
+    m->memory = memory;
+    m->size = size;
+    m->pages = size / PS;
+    m->words = (m->pages + 63) / 64;
+    m->params = *params;
+    m->ops = *ops;
+    m->dirty = calloc(m->words, sizeof(uint64_t));
+    m->sending = calloc(m->words, sizeof(uint64_t));
+    m->needed = calloc(m->words, sizeof(uint64_t));
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->start_cond, NULL);
+    pthread_cond_init(&m->done_cond, NULL);
+    if (!m->dirty || !m->sending || !m->needed) {
+        migration_destroy(m);
+        return NULL;
+    }
+
+    uint64_t slots = params->xbzrle_cache_bytes / params->channels / PS;
+    for (uint32_t i = 0; i < params->channels; i++) {
+        mig_worker_t* w = &m->workers[i];
+        w->m = m;
+        w->index = i;
+        w->fd = fds[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->out = malloc(OUT_BUFFER);
+        if (!w->out) {
+            migration_destroy(m);
+            return NULL;
+        }
+
+        if (slots) {
+            w->cache_slots = slots;
+            w->cache_tags = calloc(slots, sizeof(uint64_t));
+            w->cache_data = malloc(slots * PS);
+            if (!w->cache_tags || !w->cache_data) {
+                migration_destroy(m);
+                return NULL;
+            }
+        }
+    }
+
+    return m;
+}
+
+void migration_destroy(migration_t* m) {
+    if (!m) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < MIGRATION_MAX_CHANNELS; i++) {
+        if (m->workers[i].m) {
+            pthread_mutex_destroy(&m->workers[i].lock);
+        }
+        free(m->workers[i].out);
+        free(m->workers[i].cache_tags);
+        free(m->workers[i].cache_data);
+    }
+    free(m->dirty);
+    free(m->sending);
+    free(m->needed);
+    free(m->state);
+    pthread_mutex_destroy(&m->lock);
+    pthread_cond_destroy(&m->start_cond);
+    pthread_cond_destroy(&m->done_cond);
+    free(m);
+}
+
+// Record guest writes; called from write faults and dirty log harvesting
+void migration_mark_dirty(migration_t* m, uint64_t gpa, uint64_t length) {
+    if (length == 0 || gpa >= m->size) {
+        return;
+    }
+
+    uint64_t first = gpa / PS;
+    uint64_t last = (gpa + length - 1) / PS;
+    if (last >= m->pages) {
+        last = m->pages - 1;
+    }
+
+    for (uint64_t page = first; page <= last; ) {
+        uint64_t word = page / 64;
+        uint32_t lo = page % 64;
+        uint32_t hi = (last / 64 == word) ? last % 64 : 63;
+        uint64_t mask = (hi == 63 ? ~0ULL : (1ULL << (hi + 1)) - 1) & ~((1ULL << lo) - 1);
+
+        if ((__atomic_load_n(&m->dirty[word], __ATOMIC_RELAXED) & mask) != mask) {
+            __atomic_fetch_or(&m->dirty[word], mask, __ATOMIC_RELEASE);
+        }
+        page = (word + 1) * 64;
+    }
+}
+
+/*
+ * Post-copy: serve pages the destination guest faulted on, ahead of the
+ * background push, and steer the push to continue next to them.
+ */
+static void* request_main(void* arg) {
+    migration_t* m = arg;
+    mig_worker_t* w = &m->workers[0];
+    mig_record_t rec;
+
+    m->request_result = -1;
+    while (read_all(w->fd, &rec, sizeof(rec)) == 0) {
+        if (rec.type == REC_END) {
+            m->request_result = rec.arg == MIGRATION_MAGIC ? 0 : -1;
+            break;
+        }
+        if (rec.type == REC_RUNNING) {
+            m->running_at = now_ns();
+            continue;
+        }
+        if (rec.type != REC_REQUEST || rec.arg >= m->pages) {
+            break;
+        }
+
+        uint64_t page = rec.arg;
+        uint64_t bit = 1ULL << (page % 64);
+        m->stats.postcopy_requests++;
+        __atomic_store_n(&m->push_next, page / 64, __ATOMIC_RELAXED);
+
+        // Claim under the channel lock so the end of stream cannot overtake the page
+        pthread_mutex_lock(&w->lock);
+        if (__atomic_fetch_and(&m->needed[page / 64], ~bit, __ATOMIC_ACQ_REL) & bit) {
+            __atomic_sub_fetch(&m->needed_left, 1, __ATOMIC_RELEASE);
+            send_page(w, page, 0);
+            worker_write_out(w);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return NULL;
+}
+
+// Time a round trip on channel 0, before any page is queued behind it
+static int measure_rtt(migration_t* m) {
+    mig_worker_t* w = &m->workers[0];
+    mig_record_t rec;
+    uint64_t start = now_ns();
+
+    worker_emit(w, REC_HELLO, m->size, NULL, 0);
+    worker_emit(w, REC_PING, MIGRATION_MAGIC, NULL, 0);
+    worker_write_out(w);
+    w->hello_sent = true;
+
+    if (w->error || read_all(w->fd, &rec, sizeof(rec)) < 0 ||
+        rec.type != REC_PONG || rec.arg != MIGRATION_MAGIC) {
+        return -1;
+    }
+    m->stats.rtt_ns = now_ns() - start;
+    return 0;
+}
+
+// Wait for the destination's confirmation on channel 0
+static int read_ack(migration_t* m) {
+    mig_record_t rec;
+
+    if (read_all(m->workers[0].fd, &rec, sizeof(rec)) < 0 ||
+        rec.type != REC_END || rec.arg != MIGRATION_MAGIC) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Migrate guest memory and device state. Dirty tracking must already be on
+ * so that no write after this call is missed. Returns 0 once the
+ * destination confirmed it has everything; the guest is then paused here.
+ *
+ * With params.postcopy, pre-copy stops after postcopy_after_rounds rounds
+ * unless it converged first. The destination then starts the guest right
+ * away and every page still missing is sent exactly once, so the total
+ * time is bounded by memory size over bandwidth. A failure after the
+ * switch cannot be undone: neither side has the whole guest.
+ */
+int migration_run(migration_t* m) {
+    migration_params_t* p = &m->params;
+    uint64_t start = now_ns();
+    uint64_t bytes_per_page = PS;
+    uint64_t state_bytes = m->ops.save_state ? MIGRATION_STATE_MAX : 0;   // Size unknown until paused
+    uint32_t hot_rounds = 0;
+    bool postcopy = false;
+    int result = -1;
+
+    // Before the workers start, so channel 0 is still idle
+    if (measure_rtt(m) < 0) {
+        p->channels = 0;
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < p->channels; i++) {
+        if (pthread_create(&m->workers[i].thread, NULL, worker_main, &m->workers[i]) != 0) {
+            p->channels = i;
+            goto out;
+        }
+    }
+
+    // The first round sends everything
+    memset(m->sending, 0xFF, m->words * sizeof(uint64_t));
+    if (m->pages % 64) {
+        m->sending[m->words - 1] = (1ULL << (m->pages % 64)) - 1;
+    }
+    uint64_t round_pages = m->pages;
+
+    for (;;) {
+        if (p->postcopy && m->round >= p->postcopy_after_rounds) {
+            postcopy = true;
+            break;
+        }
+
+        uint64_t round_start = now_ns();
+        uint64_t bytes = run_round(m, PHASE_PRECOPY);
+        uint64_t round_ns = now_ns() - round_start + 1;
+
+        memset(m->sending, 0, m->words * sizeof(uint64_t));
+        migration_get_stats(m, &m->stats);
+        if (m->stats.rounds > 1 && round_pages) {
+            bytes_per_page = bytes / round_pages > sizeof(mig_record_t) ?
+                             bytes / round_pages : sizeof(mig_record_t);
+        }
+        for (uint32_t i = 0; i < p->channels; i++) {
+            if (m->workers[i].error) {
+                goto out;
+            }
+        }
+
+        // What the guest dirtied while that round was on the wire
+        round_pages = harvest_dirty(m);
+        m->stats.bandwidth = bytes * 1000000000ULL / round_ns;
+        m->stats.dirty_rate = round_pages * PS * 1000000000ULL / round_ns;
+        m->stats.expected_downtime_ns = m->stats.bandwidth ?
+            (round_pages * bytes_per_page + state_bytes) * 1000000000ULL / m->stats.bandwidth +
+            m->stats.rtt_ns : UINT64_MAX;
+
+        // The margin absorbs a slower final round and pages dirtied between harvest and pause
+        if (m->stats.expected_downtime_ns <= p->downtime_target_ns * 100 / (100 + DOWNTIME_MARGIN) ||
+            (p->max_rounds && m->stats.rounds >= p->max_rounds)) {
+            break;
+        }
+
+        // Auto-converge: the guest dirties faster than half of what we can send
+        if (m->stats.dirty_rate > m->stats.bandwidth / 2 && m->ops.set_throttle && !p->postcopy) {
+            if (++hot_rounds >= 2 && m->stats.throttle < p->throttle_max) {
+                uint32_t throttle = m->stats.throttle ? m->stats.throttle + p->throttle_step
+                                                      : p->throttle_initial;
+                m->stats.throttle = throttle < p->throttle_max ? throttle : p->throttle_max;
+                m->ops.set_throttle(m->ops.ctx, m->stats.throttle);
+                hot_rounds = 0;
+            }
+        } else {
+            hot_rounds = 0;
+        }
+    }
+
+    // Stop and copy, or stop and switch
+    m->ops.pause(m->ops.ctx);
+    uint64_t paused = now_ns();
+
+    harvest_dirty(m);
+    if (m->ops.save_state) {
+        m->state = malloc(MIGRATION_STATE_MAX);
+        if (!m->state) {
+            goto out;
+        }
+        m->state_len = m->ops.save_state(m->ops.ctx, m->state, MIGRATION_STATE_MAX);
+    }
+
+    if (postcopy) {
+        uint64_t left = 0;
+        for (uint64_t i = 0; i < m->words; i++) {
+            m->needed[i] = m->sending[i];
+            left += __builtin_popcountll(m->sending[i]);
+        }
+        m->needed_left = left;
+        m->push_next = 0;
+        m->stats.postcopy = true;
+
+        if (pthread_create(&m->request_thread, NULL, request_main, m) != 0) {
+            goto out;
+        }
+        run_round(m, PHASE_POSTCOPY);
+
+        // Every page is claimed now, so channel 0 can be closed off
+        if (p->channels > 1) {
+            mig_worker_t* w = &m->workers[0];
+            pthread_mutex_lock(&w->lock);
+            worker_emit(w, REC_END, 0, NULL, 0);
+            worker_write_out(w);
+            pthread_mutex_unlock(&w->lock);
+        }
+
+        pthread_join(m->request_thread, NULL);
+        result = m->request_result;
+    } else {
+        run_round(m, PHASE_FINAL);
+        result = read_ack(m);
+    }
+
+    for (uint32_t i = 0; i < p->channels; i++) {
+        if (m->workers[i].error) {
+            result = -1;
+        }
+    }
+
+    migration_get_stats(m, &m->stats);
+    if (postcopy) {
+        uint64_t running = m->running_at ? m->running_at : now_ns();
+        m->stats.downtime_ns = running - paused;
+        m->stats.postcopy_ns = now_ns() - running;
+    } else {
+        m->stats.downtime_ns = now_ns() - paused;
+    }
+
+out:
+    pthread_mutex_lock(&m->lock);
+    m->exiting = true;
+    pthread_cond_broadcast(&m->start_cond);
+    pthread_mutex_unlock(&m->lock);
+    for (uint32_t i = 0; i < p->channels; i++) {
+        pthread_join(m->workers[i].thread, NULL);
+    }
+
+    m->stats.total_ns = now_ns() - start;
+    return result;
+}
+
+// Counters are summed over the workers; rates and timings are the last run's
+void migration_get_stats(migration_t* m, migration_stats_t* stats) {
+    migration_stats_t s = m->stats;
+
+    s.pages_sent = s.zero_pages = s.xbzrle_pages = 0;
+    s.xbzrle_overflows = s.unchanged_pages = s.bytes_sent = 0;
+    for (uint32_t i = 0; i < m->params.channels; i++) {
+        pthread_mutex_lock(&m->workers[i].lock);
+        migration_stats_t* w = &m->workers[i].stats;
+        s.pages_sent += w->pages_sent;
+        s.zero_pages += w->zero_pages;
+        s.xbzrle_pages += w->xbzrle_pages;
+        s.xbzrle_overflows += w->xbzrle_overflows;
+        s.unchanged_pages += w->unchanged_pages;
+        s.bytes_sent += w->bytes_sent;
+        pthread_mutex_unlock(&m->workers[i].lock);
+    }
+    s.rounds = m->round;
+
+    *stats = s;
+}
+
+/* ==================== DESTINATION ==================== */
+
+typedef struct {
+    uint8_t* memory;
+    uint64_t size;
+    uint64_t pages;
+    uint64_t words;
+    uint32_t channels;
+    int fd;                         // Channel 0, for replies to the source
+    pthread_mutex_t send_lock;
+    void (*start)(void* ctx);
+    void* ctx;
+
+    // Channels meet before and after the switch to post-copy
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t arrived;
+    uint32_t generation;
+    bool aborted;
+    int switch_result;
+
+    // Post-copy
+    int uffd;
+    uint64_t* missing;              // Pages not placed yet
+    uint64_t missing_left;
+    uint64_t* requested;
+    bool stop_faults;
+    bool fault_thread_started;
+    pthread_t fault_thread;
+} mig_dest_t;
+
+typedef struct {
+    mig_dest_t* dest;
+    uint32_t index;
+    int fd;
+    void* state;
+    uint32_t* state_len;
+    pthread_t thread;
+    int result;
+    bool postcopy;
+
+    uint8_t* buf;
+    uint32_t len;
+    uint32_t pos;
+    uint8_t page[PS];
+} mig_receiver_t;
+
+static int dest_barrier(mig_dest_t* d) {
+    pthread_mutex_lock(&d->lock);
+    uint32_t generation = d->generation;
+    if (++d->arrived == d->channels) {
+        d->arrived = 0;
+        d->generation++;
+        pthread_cond_broadcast(&d->cond);
+    } else {
+        while (generation == d->generation && !d->aborted) {
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+    }
+    int result = d->aborted ? -1 : 0;
+    pthread_mutex_unlock(&d->lock);
+    return result;
+}
+
+static void dest_abort(mig_dest_t* d) {
+    pthread_mutex_lock(&d->lock);
+    d->aborted = true;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static int dest_send(mig_dest_t* d, uint32_t type, uint64_t arg) {
+    mig_record_t rec = { .type = type, .len = 0, .arg = arg };
+
+    pthread_mutex_lock(&d->send_lock);
+    int result = write_all(d->fd, &rec, sizeof(rec));
+    pthread_mutex_unlock(&d->send_lock);
+    return result;
+}
+
+// Ask for pages the guest faulted on; arrival wakes every thread waiting on them
+static void* fault_main(void* arg) {
+    mig_dest_t* d = arg;
+    struct uffd_msg msgs[16];
+
+    while (!__atomic_load_n(&d->stop_faults, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = d->uffd, .events = POLLIN };
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+
+        ssize_t n = read(d->uffd, msgs, sizeof(msgs));
+        for (ssize_t i = 0; i < n / (ssize_t)sizeof(msgs[0]); i++) {
+            if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                continue;
+            }
+
+            uint64_t page = (msgs[i].arg.pagefault.address - (uintptr_t)d->memory) / PS;
+            uint64_t bit = 1ULL << (page % 64);
+            if (page >= d->pages ||
+                (__atomic_fetch_or(&d->requested[page / 64], bit, __ATOMIC_RELAXED) & bit)) {
+                continue;
+            }
+            if (__atomic_load_n(&d->missing[page / 64], __ATOMIC_ACQUIRE) & bit) {
+                dest_send(d, REC_REQUEST, page);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Called on channel 0 with every channel stopped at the switch: drop the
+ * stale copies of pages still to come so that the guest faults on them,
+ * then start it.
+ */
+static int postcopy_begin(mig_dest_t* d) {
+    if ((uintptr_t)d->memory % PS) {
+        return -1;
+    }
+
+    d->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (d->uffd < 0) {
+        return -1;
+    }
+
+    struct uffdio_api api = { .api = UFFD_API };
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t)d->memory, .len = d->size },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    if (ioctl(d->uffd, UFFDIO_API, &api) < 0 || ioctl(d->uffd, UFFDIO_REGISTER, &reg) < 0) {
+        return -1;
+    }
+
+    uint64_t left = 0;
+    for (uint64_t page = 0; page < d->pages; ) {
+        uint64_t word = d->missing[page / 64] >> (page % 64);
+        if (!word) {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+        page += __builtin_ctzll(word);
+
+        uint64_t run = page;
+        while (run < d->pages && (d->missing[run / 64] >> (run % 64)) & 1) {
+            run++;
+        }
+        if (madvise(d->memory + page * PS, (run - page) * PS, MADV_DONTNEED) < 0) {
+            return -1;
+        }
+        left += run - page;
+        page = run;
+    }
+    d->missing_left = left;
+
+    if (pthread_create(&d->fault_thread, NULL, fault_main, d) != 0) {
+        return -1;
+    }
+    d->fault_thread_started = true;
+
+    if (d->start) {
+        d->start(d->ctx);
+    }
+    return dest_send(d, REC_RUNNING, 0);
+}
+
+// Post-copy placement: atomic, and wakes the threads faulting on the page
+static int place_page(mig_dest_t* d, uint64_t page, const uint8_t* data) {
+    uint64_t addr = (uintptr_t)d->memory + page * PS;
+    int rc;
+
+    if (data) {
+        struct uffdio_copy copy = { .dst = addr, .src = (uintptr_t)data, .len = PS };
+        while ((rc = ioctl(d->uffd, UFFDIO_COPY, &copy)) < 0 && errno == EAGAIN) {
+            copy.copy = 0;
+        }
+    } else {
+        struct uffdio_zeropage zero = { .range = { .start = addr, .len = PS } };
+        while ((rc = ioctl(d->uffd, UFFDIO_ZEROPAGE, &zero)) < 0 && errno == EAGAIN) {
+            zero.zeropage = 0;
+        }
+    }
+    if (rc < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    uint64_t bit = 1ULL << (page % 64);
+    if (__atomic_fetch_and(&d->missing[page / 64], ~bit, __ATOMIC_ACQ_REL) & bit) {
+        __atomic_sub_fetch(&d->missing_left, 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static int read_exact(mig_receiver_t* r, void* dst, uint64_t len) {
+    uint8_t* out = dst;
+
+    while (len > 0) {
+        if (r->pos == r->len) {
+            ssize_t n = read(r->fd, r->buf, IN_BUFFER);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return -1;
+            }
+            r->len = n;
+            r->pos = 0;
+        }
+
+        uint32_t chunk = r->len - r->pos;
+        if (chunk > len) {
+            chunk = len;
+        }
+        if (out) {
+            memcpy(out, r->buf + r->pos, chunk);
+            out += chunk;
+        }
+        r->pos += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int receive_channel(mig_receiver_t* r) {
+    mig_dest_t* d = r->dest;
+    mig_record_t rec;
+
+    if (read_exact(r, &rec, sizeof(rec)) < 0 || rec.type != REC_HELLO || rec.arg != d->size) {
+        return -1;
+    }
+
+    for (;;) {
+        if (read_exact(r, &rec, sizeof(rec)) < 0) {
+            return -1;
+        }
+
+        uint8_t* page = d->memory + rec.arg * PS;
+        switch (rec.type) {
+        case REC_FULL:
+            if (rec.arg >= d->pages || rec.len != PS) {
+                return -1;
+            }
+            if (r->postcopy) {
+                if (read_exact(r, r->page, PS) < 0 || place_page(d, rec.arg, r->page) < 0) {
+                    return -1;
+                }
+            } else if (read_exact(r, page, PS) < 0) {
+                return -1;
+            }
+            break;
+
+        case REC_ZERO:
+            if (rec.arg >= d->pages || rec.len != 0) {
+                return -1;
+            }
+            if (r->postcopy) {
+                if (place_page(d, rec.arg, NULL) < 0) {
+                    return -1;
+                }
+            } else {
+                memset(page, 0, PS);
+            }
+            break;
+
+        case REC_XBZRLE:
+            if (rec.arg >= d->pages || rec.len > PS || r->postcopy ||
+                read_exact(r, r->page, rec.len) < 0 || xbzrle_decode(r->page, rec.len, page) < 0) {
+                return -1;
+            }
+            break;
+
+        case REC_STATE:
+            if (rec.len > MIGRATION_STATE_MAX ||
+                read_exact(r, r->state_len ? r->state : NULL, rec.len) < 0) {
+                return -1;
+            }
+            if (r->state_len) {
+                *r->state_len = rec.len;
+            }
+            break;
+
+        case REC_POSTCOPY:
+            if (r->index == 0) {
+                if (rec.arg != d->pages || rec.len != d->words * sizeof(uint64_t) ||
+                    read_exact(r, d->missing, rec.len) < 0) {
+                    return -1;
+                }
+            } else if (rec.len != 0) {
+                return -1;
+            }
+
+            // Pre-copy pages on every channel are in place before any page goes missing
+            if (dest_barrier(d) < 0) {
+                return -1;
+            }
+            if (r->index == 0) {
+                d->switch_result = postcopy_begin(d);
+            }
+            if (dest_barrier(d) < 0 || d->switch_result < 0) {
+                return -1;
+            }
+            r->postcopy = true;
+            break;
+
+        case REC_END:
+            return 0;
+
+        case REC_PING:
+            if (r->index != 0 || rec.len != 0 || dest_send(d, REC_PONG, rec.arg) < 0) {
+                return -1;
+            }
+            break;
+
+        default:
+            return -1;
+        }
+    }
+}
+
+static void* receiver_main(void* arg) {
+    mig_receiver_t* r = arg;
+    r->result = receive_channel(r);
+    if (r->result < 0) {
+        dest_abort(r->dest);
+    }
+    return NULL;
+}
+
+/*
+ * Receive a migration into memory, one thread per channel. state must hold
+ * MIGRATION_STATE_MAX bytes, or be NULL along with state_len.
+ *
+ * If the source switches to post-copy, start(ctx) is called as soon as the
+ * state has arrived, and the guest runs while the rest of its memory
+ * streams in. memory must then be a private anonymous mapping: pages still
+ * missing are dropped and filled through userfaultfd when first touched.
+ * Otherwise the caller starts the guest once this returns.
+ *
+ * Returns 0 once every page is in place and the source was told so.
+ */
+int migration_receive(void* memory, uint64_t size, const int* fds, uint32_t channels,
+                      void* state, uint32_t* state_len, void (*start)(void* ctx), void* ctx) {
+    mig_dest_t d = {
+        .memory = memory,
+        .size = size,
+        .pages = size / PS,
+        .words = (size / PS + 63) / 64,
+        .channels = channels,
+        .fd = fds[0],
+        .start = start,
+        .ctx = ctx,
+        .uffd = -1,
+    };
+    uint32_t started = 0;
+    int result = 0;
+
+    if (channels == 0 || channels > MIGRATION_MAX_CHANNELS || size % PS) {
+        return -1;
+    }
+
+    mig_receiver_t* receivers = calloc(channels, sizeof(mig_receiver_t));
+    d.missing = calloc(d.words, sizeof(uint64_t));
+    d.requested = calloc(d.words, sizeof(uint64_t));
+    if (!receivers || !d.missing || !d.requested) {
+        free(receivers);
+        free(d.missing);
+        free(d.requested);
+        return -1;
+    }
+    pthread_mutex_init(&d.send_lock, NULL);
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+    if (state_len) {
+        *state_len = 0;
+    }
+
+    for (uint32_t i = 0; i < channels; i++) {
+        mig_receiver_t* r = &receivers[i];
+        r->dest = &d;
+        r->index = i;
+        r->fd = fds[i];
+        r->state = i == 0 ? state : NULL;
+        r->state_len = i == 0 ? state_len : NULL;
+        r->buf = malloc(IN_BUFFER);
+        if (!r->buf || pthread_create(&r->thread, NULL, receiver_main, r) != 0) {
+            dest_abort(&d);
+            result = -1;
+            break;
+        }
+        started++;
+    }
+
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(receivers[i].thread, NULL);
+        if (receivers[i].result < 0) {
+            result = -1;
+        }
+    }
+
+    if (d.fault_thread_started) {
+        __atomic_store_n(&d.stop_faults, true, __ATOMIC_RELEASE);
+        pthread_join(d.fault_thread, NULL);
+    }
+    if (d.uffd >= 0) {
+        if (d.missing_left) {
+            result = -1;
+        }
+        struct uffdio_range range = { .start = (uintptr_t)memory, .len = size };
+        ioctl(d.uffd, UFFDIO_UNREGISTER, &range);
+        close(d.uffd);
+    }
+
+    if (result == 0) {
+        result = dest_send(&d, REC_END, MIGRATION_MAGIC);
+    }
+
+    for (uint32_t i = 0; i < channels; i++) {
+        free(receivers[i].buf);
+    }
+    free(receivers);
+    free(d.missing);
+    free(d.requested);
+    pthread_mutex_destroy(&d.send_lock);
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+    return result;
+}
+
+#ifdef MIGRATION_LOOPBACK
+/* Loopback self-test: cc -O2 -DMIGRATION_LOOPBACK migration.c -lpthread */
+#include <stdio.h>
+#include <sys/socket.h>
+
+typedef struct {
+    migration_t* m;
+    uint8_t* memory;
+    uint64_t hot_pages;
+    uint32_t rewrite_percent;   // Writes that rewrite a whole page
+    uint32_t throttle;
+    bool pause;
+    bool paused;
+} guest_t;
+
+// Synthetic guest: random writes to a hot set, honoring the throttle
+static void* guest_main(void* arg) {
+    guest_t* g = arg;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+    while (!__atomic_load_n(&g->pause, __ATOMIC_ACQUIRE)) {
+        uint64_t slice_start = now_ns();
+
+        while (now_ns() - slice_start < 1000000ULL * (100 - __atomic_load_n(&g->throttle, __ATOMIC_RELAXED)) / 100) {
+            for (int i = 0; i < 64; i++) {
+                seed ^= seed << 13;
+                seed ^= seed >> 7;
+                seed ^= seed << 17;
+                uint64_t page = seed % g->hot_pages;
+                uint8_t* p = g->memory + page * PS;
+
+                if ((seed >> 40) % 100 < g->rewrite_percent) {
+                    memset(p, (int)(seed >> 32), PS);
+                } else {
+                    p[(seed >> 20) % PS] = (uint8_t)seed;
+                }
+                migration_mark_dirty(g->m, page * PS, 1);
+            }
+        }
+
+        uint32_t throttle = __atomic_load_n(&g->throttle, __ATOMIC_RELAXED);
+        if (throttle) {
+            sleep_ns(10000ULL * throttle);
+        }
+    }
+
+    __atomic_store_n(&g->paused, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void guest_set_throttle(void* ctx, uint32_t percent) {
+    guest_t* g = ctx;
+    __atomic_store_n(&g->throttle, percent, __ATOMIC_RELAXED);
+}
+
+static void guest_pause(void* ctx) {
+    guest_t* g = ctx;
+    __atomic_store_n(&g->pause, true, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&g->paused, __ATOMIC_ACQUIRE)) {
+        sleep_ns(100000);
+    }
+}
+
+// Pages of the anonymous mapping the guest never touched are not resident
+static bool guest_populated(void* ctx, uint64_t page) {
+    guest_t* g = ctx;
+    unsigned char resident = 1;
+    mincore(g->memory + page * PS, PS, &resident);
+    return resident & 1;
+}
+
+static uint64_t resident_pages(const uint8_t* memory, uint64_t from, uint64_t to) {
+    uint64_t count = 0;
+    for (uint64_t page = from; page < to; page++) {
+        unsigned char resident = 0;
+        mincore((void*)(memory + page * PS), PS, &resident);
+        count += resident & 1;
+    }
+    return count;
+}
+
+static uint32_t guest_save_state(void* ctx, void* buf, uint32_t max) {
+    (void)ctx;
+    uint32_t len = max < 8192 ? max : 8192;
+    for (uint32_t i = 0; i < len; i++) {
+        ((uint8_t*)buf)[i] = (uint8_t)(i * 7);
+    }
+    return len;
+}
+
+typedef struct {
+    uint8_t* memory;
+    uint64_t size;
+    int fds[MIGRATION_MAX_CHANNELS];
+    uint32_t channels;
+    uint8_t* state;
+    uint32_t state_len;
+    int result;
+
+    // Resumed guest, reading pages as they fault in
+    const uint8_t* source;
+    pthread_t reader;
+    bool running;
+    bool stop;
+    uint64_t reads;
+    uint64_t mismatches;
+    uint64_t max_read_ns;
+} destination_t;
+
+// Post-copy: compare random pages against the paused source
+static void* reader_main(void* arg) {
+    destination_t* d = arg;
+    uint64_t seed = 0xD1B54A32D192ED03ULL;
+
+    while (!__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE)) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t offset = seed % (d->size / PS) * PS;
+
+        uint64_t start = now_ns();
+        volatile uint8_t first = d->memory[offset];
+        uint64_t elapsed = now_ns() - start;
+        (void)first;
+
+        if (memcmp(d->memory + offset, d->source + offset, PS) != 0) {
+            d->mismatches++;
+        }
+        if (elapsed > d->max_read_ns) {
+            d->max_read_ns = elapsed;
+        }
+        d->reads++;
+    }
+
+    return NULL;
+}
+
+static void destination_start(void* ctx) {
+    destination_t* d = ctx;
+    d->running = pthread_create(&d->reader, NULL, reader_main, d) == 0;
+}
+
+static void* destination_main(void* arg) {
+    destination_t* d = arg;
+    d->result = migration_receive(d->memory, d->size, d->fds, d->channels, d->state, &d->state_len,
+                                  destination_start, d);
+    __atomic_store_n(&d->stop, true, __ATOMIC_RELEASE);
+    if (d->running) {
+        pthread_join(d->reader, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    uint64_t size = (argc > 1 ? strtoull(argv[1], NULL, 0) : 256) << 20;
+    uint64_t hot = (argc > 2 ? strtoull(argv[2], NULL, 0) : 32) << 20;
+    uint32_t rewrite = argc > 3 ? (uint32_t)atoi(argv[3]) : 10;
+    migration_params_t params;
+    migration_default_params(&params);
+    params.max_bandwidth = (argc > 4 ? strtoull(argv[4], NULL, 0) : 1000) << 20;
+    params.downtime_target_ns = (argc > 5 ? strtoull(argv[5], NULL, 0) : 50) * 1000000ULL;
+    if (argc > 6) {
+        params.channels = atoi(argv[6]);
+    }
+    if (argc > 7) {
+        params.postcopy = true;
+        params.postcopy_after_rounds = atoi(argv[7]);
+    }
+
+    if (hot > size || params.channels == 0 || params.channels > MIGRATION_MAX_CHANNELS) {
+        fprintf(stderr, "usage: %s [mem MB] [hot MB] [rewrite %%] [bandwidth MB/s] "
+                "[downtime ms] [channels] [post-copy after rounds]\n", argv[0]);
+        return 2;
+    }
+
+    guest_t guest = { .hot_pages = hot / PS, .rewrite_percent = rewrite };
+    destination_t dest = { .size = size, .channels = params.channels };
+    int src_fds[MIGRATION_MAX_CHANNELS];
+
+    guest.memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    dest.memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    dest.state = malloc(MIGRATION_STATE_MAX);
+    dest.source = guest.memory;
+    if (guest.memory == MAP_FAILED || dest.memory == MAP_FAILED || !dest.state) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    // Half the guest is untouched but for the hot set, the rest is data
+    for (uint64_t i = size / 2; i < size; i += 8) {
+        uint64_t v = i * 0x9E3779B97F4A7C15ULL;
+        memcpy(guest.memory + i, &v, 8);
+    }
+    memset(dest.memory, 0xAA, size);
+
+    for (uint32_t i = 0; i < params.channels; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        src_fds[i] = pair[0];
+        dest.fds[i] = pair[1];
+    }
+
+    migration_ops_t ops = {
+        .ctx = &guest,
+        .set_throttle = guest_set_throttle,
+        .pause = guest_pause,
+        .save_state = guest_save_state,
+        .populated = guest_populated,
+    };
+    migration_t* m = migration_create(guest.memory, size, src_fds, &params, &ops);
+    if (!m) {
+        fprintf(stderr, "migration_create failed\n");
+        return 1;
+    }
+    guest.m = m;
+
+    pthread_t guest_thread, dest_thread;
+    pthread_create(&guest_thread, NULL, guest_main, &guest);
+    pthread_create(&dest_thread, NULL, destination_main, &dest);
+    sleep_ns(100000000ULL);
+
+    int result = migration_run(m);
+    pthread_join(dest_thread, NULL);
+    pthread_join(guest_thread, NULL);
+
+    // Past the hot set (and a huge page it may have spilled into), nothing was read
+    uint64_t untouched_from = (hot + (2ULL << 20)) / PS;
+    uint64_t committed = untouched_from < size / 2 / PS ?
+                         resident_pages(guest.memory, untouched_from, size / 2 / PS) : 0;
+
+    migration_stats_t s;
+    migration_get_stats(m, &s);
+    bool same = memcmp(guest.memory, dest.memory, size) == 0 && dest.state_len == 8192;
+    for (uint32_t i = 0; i < dest.state_len && same; i++) {
+        same = dest.state[i] == (uint8_t)(i * 7);
+    }
+
+    bool on_time = s.downtime_ns <= params.downtime_target_ns;
+
+    printf("result %d/%d, memory %s\n", result, dest.result, same ? "identical" : "DIFFERS");
+    printf("untouched source pages read: %llu\n", (unsigned long long)committed);
+    printf("rounds %u, throttle %u%%, total %.1f ms, downtime %.1f ms (expected %.1f, target %.1f%s)\n",
+           s.rounds, s.throttle, s.total_ns / 1e6, s.downtime_ns / 1e6,
+           s.expected_downtime_ns / 1e6, params.downtime_target_ns / 1e6,
+           on_time ? "" : ", MISSED");
+    printf("pages %llu: %llu zero, %llu xbzrle (%llu overflows), %llu unchanged; %.1f MB sent\n",
+           (unsigned long long)s.pages_sent, (unsigned long long)s.zero_pages,
+           (unsigned long long)s.xbzrle_pages, (unsigned long long)s.xbzrle_overflows,
+           (unsigned long long)s.unchanged_pages, s.bytes_sent / 1048576.0);
+    printf("bandwidth %.1f MB/s, dirty rate %.1f MB/s, rtt %.2f ms\n",
+           s.bandwidth / 1048576.0, s.dirty_rate / 1048576.0, s.rtt_ns / 1e6);
+    if (s.postcopy) {
+        printf("post-copy %.1f ms, %llu requests; guest read %llu pages, %llu wrong, slowest %.2f ms\n",
+               s.postcopy_ns / 1e6, (unsigned long long)s.postcopy_requests,
+               (unsigned long long)dest.reads, (unsigned long long)dest.mismatches,
+               dest.max_read_ns / 1e6);
+        same = same && dest.mismatches == 0;
+    }
+
+    migration_destroy(m);
+    return result == 0 && dest.result == 0 && same && on_time && committed == 0 ? 0 : 1;
+}
+#endif
@@ -0,0 +1,106 @@
+/*
+ * QENEX Hypervisor - Live Migration
+ *
+ * Pre-copy migration of guest memory over one or more byte streams:
+ *
+ *   - Writes to guest memory are tracked in a dirty bitmap, one bit per
+ *     page. The first round sends every page; each later round sends the
+ *     pages dirtied while the previous one was on the wire.
+ *   - Pages travel on MIGRATION_MAX_CHANNELS worker threads, each with its
+ *     own connection. A given page always uses the same channel, so the
+ *     destination applies its copies in order without coordination.
+ *   - All-zero pages are sent as a header only. So are pages the guest
+ *     never touched, which ops.populated() reports; they are not read, as
+ *     reading guest memory populated on first touch would commit it. Pages
+ *     sent again are sent as an XBZRLE delta against the copy the
+ *     destination already has, when that is smaller than the page.
+ *   - Rounds end once the remaining dirty memory, the device state and
+ *     one round trip for the confirmation fit within the downtime target,
+ *     less a margin, at the measured bandwidth. If the guest dirties
+ *     memory faster than it can be sent, vCPUs are throttled in steps
+ *     (auto-converge) until it can.
+ *   - The guest is then paused, the last dirty pages and the device state
+ *     are sent, and the destination confirms before migration_run()
+ *     returns.
+ *
+ * Guests too large or too busy to converge can switch to post-copy after a
+ * fixed number of rounds instead. The device state goes first and the
+ * guest resumes on the destination at once; pages it has not received yet
+ * are fetched when it faults on them (userfaultfd), ahead of a background
+ * push of the rest from the faulting address onwards. Downtime no longer
+ * depends on the dirty rate and total time is bounded by one pass over the
+ * remaining memory, but from the switch on neither side holds a complete
+ * guest: a lost connection loses the guest.
+ *
+ * The destination side is migration_receive(). Any connected stream
+ * works, so both ends can run in one process over socketpairs; build with
+ * -DMIGRATION_LOOPBACK for a self-test against a synthetic guest.
+ */
+
+#ifndef QENEX_MIGRATION_H
+#define QENEX_MIGRATION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MIGRATION_PAGE_SIZE 4096
+#define MIGRATION_MAX_CHANNELS 16
+#define MIGRATION_CHUNK_PAGES 64            // Consecutive pages kept on one channel
+#define MIGRATION_STATE_MAX (1024 * 1024)   // Device state sent after the last pages
+
+typedef struct {
+    uint32_t channels;                  // Worker threads, one stream each
+    uint64_t max_bandwidth;             // Bytes per second over all channels; 0 = unlimited
+    uint64_t downtime_target_ns;        // Longest acceptable pause
+    uint64_t xbzrle_cache_bytes;        // Copies of resent pages kept for deltas; 0 = off
+    uint32_t max_rounds;                // Stop iterating after this many, whatever the estimate
+    uint32_t throttle_initial;          // Percent of vCPU time taken on the first step
+    uint32_t throttle_step;
+    uint32_t throttle_max;
+    bool postcopy;                      // Switch to post-copy instead of converging
+    uint32_t postcopy_after_rounds;     // Pre-copy rounds before the switch
+} migration_params_t;
+
+typedef struct {
+    void* ctx;
+    void (*sync_dirty_log)(void* ctx);                          // Report hardware dirty bits; may be NULL
+    void (*set_throttle)(void* ctx, uint32_t percent);
+    void (*pause)(void* ctx);
+    uint32_t (*save_state)(void* ctx, void* buf, uint32_t max); // After pause; may be NULL
+    bool (*populated)(void* ctx, uint64_t page);                // False: never touched; may be NULL
+} migration_ops_t;
+
+typedef struct {
+    uint32_t rounds;
+    uint64_t pages_sent;
+    uint64_t zero_pages;
+    uint64_t xbzrle_pages;              // Sent as a delta
+    uint64_t xbzrle_overflows;          // Delta was no smaller than the page
+    uint64_t unchanged_pages;           // Dirtied, but equal to the copy already sent
+    uint64_t bytes_sent;
+    uint64_t bandwidth;                 // Last round, bytes per second
+    uint64_t dirty_rate;                // Bytes per second dirtied during the last round
+    uint64_t rtt_ns;                    // Channel 0 round trip, measured before the first round
+    uint32_t throttle;                  // Percent
+    uint64_t expected_downtime_ns;      // Estimate when the guest was paused
+    uint64_t downtime_ns;               // Pause until the destination confirmed, or resumed
+    uint64_t total_ns;
+    bool postcopy;                      // Switched; the guest runs on the destination
+    uint64_t postcopy_requests;         // Pages the destination faulted on
+    uint64_t postcopy_ns;               // Destination resumed until the last page arrived
+} migration_stats_t;
+
+typedef struct migration migration_t;
+
+/* Function prototypes */
+void migration_default_params(migration_params_t* params);
+migration_t* migration_create(void* memory, uint64_t size, const int* fds,
+                              const migration_params_t* params, const migration_ops_t* ops);
+void migration_destroy(migration_t* m);
+void migration_mark_dirty(migration_t* m, uint64_t gpa, uint64_t length);
+int migration_run(migration_t* m);
+void migration_get_stats(migration_t* m, migration_stats_t* stats);
+int migration_receive(void* memory, uint64_t size, const int* fds, uint32_t channels,
+                      void* state, uint32_t* state_len, void (*start)(void* ctx), void* ctx);
+
+#endif /* QENEX_MIGRATION_H */
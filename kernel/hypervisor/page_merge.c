@@ -0,0 +1,956 @@
+/*
+ * QENEX Hypervisor - Page Merging
+ *
+ * Content-based merging of guest pages into shared copy-on-write frames.
+ * See page_merge.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "page_merge.h"
+
+#define PS PAGE_MERGE_PAGE_SIZE
+#define NO_REGION UINT32_MAX
+#define DISCARDED UINT32_MAX        // frame[] of a page the guest gave back
+
+typedef struct {
+    uint8_t* memory;
+    uint64_t pages;
+    void* owner;
+    bool active;
+    uint32_t* frame;        // Shared frame + 1 mapped at each page; 0 if private, or DISCARDED
+    uint32_t* checksum;     // Hash at the previous pass, low half
+} merge_region_t;
+
+typedef struct {
+    uint8_t* data;          // NULL when on the free list
+    uint64_t hash;
+    uint32_t refs;
+    uint32_t next;          // Hash chain or free list, frame + 1
+} merge_frame_t;
+
+// A page seen once this pass, waiting for a twin
+typedef struct {
+    uint64_t hash;
+    uint64_t page;
+    uint32_t region;
+    uint32_t pass;          // Pass + 1; older entries are stale
+} unstable_entry_t;
+
+struct page_merge {
+    page_merge_params_t params;
+    page_merge_ops_t ops;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t scanner;
+    bool exiting;
+
+    merge_region_t regions[PAGE_MERGE_MAX_REGIONS];
+    uint32_t active_regions;
+    uint32_t hashing;       // Region the scanner reads without the lock
+    uint32_t cursor_region;
+    uint64_t cursor_page;
+    uint32_t pass;
+
+    // Stable table: shared frames by content hash
+    merge_frame_t* frames;
+    uint32_t frame_cap;
+    uint32_t frame_used;
+    uint32_t free_frames;
+    uint32_t* buckets;      // frame_cap of them
+    unstable_entry_t* unstable;
+    uint32_t unstable_mask;
+
+    page_merge_stats_t stats;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Four independent multiply-rotate lanes, folded and avalanched at the end
+static uint64_t page_hash(const uint8_t* page) {
+    const uint64_t* w = (const uint64_t*)page;
+    const uint64_t p1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t p2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t a = p1 + p2, b = p2, c = 0, d = -p1;
+
+    for (uint32_t i = 0; i < PS / 8; i += 4) {
+        a = rotl64(a + w[i] * p2, 31) * p1;
+        b = rotl64(b + w[i + 1] * p2, 31) * p1;
+        c = rotl64(c + w[i + 2] * p2, 31) * p1;
+        d = rotl64(d + w[i + 3] * p2, 31) * p1;
+    }
+
+    uint64_t h = rotl64(a, 1) + rotl64(b, 7) + rotl64(c, 12) + rotl64(d, 18);
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= 0x165667B19E3779F9ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* ==================== STABLE TABLE ==================== */
+
+static int frames_grow(page_merge_t* pm) {
+    uint32_t cap = pm->frame_cap ? pm->frame_cap * 2 : 1024;
+    merge_frame_t* frames = realloc(pm->frames, cap * sizeof(merge_frame_t));
+    if (!frames) {
+        return -1;
+    }
+    pm->frames = frames;
+
+    uint32_t* buckets = calloc(cap, sizeof(uint32_t));
+    if (!buckets) {
+        return -1;
+    }
+
+    // Rehash every live frame into the larger table
+    for (uint32_t i = 0; i < pm->frame_used; i++) {
+        if (frames[i].data) {
+            uint32_t b = frames[i].hash & (cap - 1);
+            frames[i].next = buckets[b];
+            buckets[b] = i + 1;
+        }
+    }
+    free(pm->buckets);
+    pm->buckets = buckets;
+    pm->frame_cap = cap;
+    return 0;
+}
+
+// Returns frame + 1 holding a copy of contents, or 0
+static uint32_t frame_new(page_merge_t* pm, const uint8_t* contents) {
+    if (pm->params.max_frames && pm->stats.pages_shared >= pm->params.max_frames) {
+        return 0;
+    }
+
+    uint32_t f = pm->free_frames;
+    if (f) {
+        pm->free_frames = pm->frames[f - 1].next;
+    } else {
+        if (pm->frame_used == pm->frame_cap && frames_grow(pm) < 0) {
+            return 0;
+        }
+        f = ++pm->frame_used;
+    }
+
+    merge_frame_t* fr = &pm->frames[f - 1];
+    fr->data = pm->ops.frame_alloc(pm->ops.ctx);
+    if (!fr->data) {
+        fr->next = pm->free_frames;
+        pm->free_frames = f;
+        return 0;
+    }
+    memcpy(fr->data, contents, PS);
+    fr->hash = page_hash(fr->data);
+    fr->refs = 0;
+
+    uint32_t b = fr->hash & (pm->frame_cap - 1);
+    fr->next = pm->buckets[b];
+    pm->buckets[b] = f;
+    pm->stats.pages_shared++;
+    return f;
+}
+
+// Take an unreferenced frame out of the table
+static void frame_release(page_merge_t* pm, uint32_t f, bool free_data) {
+    merge_frame_t* fr = &pm->frames[f - 1];
+
+    uint32_t* link = &pm->buckets[fr->hash & (pm->frame_cap - 1)];
+    while (*link != f) {
+        link = &pm->frames[*link - 1].next;
+    }
+    *link = fr->next;
+
+    if (free_data) {
+        pm->ops.frame_free(pm->ops.ctx, fr->data);
+    }
+    fr->data = NULL;
+    fr->next = pm->free_frames;
+    pm->free_frames = f;
+    pm->stats.pages_shared--;
+}
+
+static void frame_put(page_merge_t* pm, uint32_t f, bool free_data) {
+    pm->stats.pages_sharing--;
+    if (--pm->frames[f - 1].refs == 0) {
+        frame_release(pm, f, free_data);
+    }
+}
+
+static uint32_t stable_lookup(page_merge_t* pm, uint64_t hash, const uint8_t* contents) {
+    if (!pm->frame_cap) {
+        return 0;
+    }
+
+    for (uint32_t f = pm->buckets[hash & (pm->frame_cap - 1)]; f; f = pm->frames[f - 1].next) {
+        merge_frame_t* fr = &pm->frames[f - 1];
+        if (fr->hash == hash && memcmp(fr->data, contents, PS) == 0) {
+            return f;
+        }
+    }
+    return 0;
+}
+
+/* ==================== MERGING ==================== */
+
+static bool protect(page_merge_t* pm, merge_region_t* r, uint64_t page) {
+    return pm->ops.write_protect(pm->ops.ctx, r->owner, page, true) == 0;
+}
+
+static void unprotect(page_merge_t* pm, merge_region_t* r, uint64_t page) {
+    pm->ops.write_protect(pm->ops.ctx, r->owner, page, false);
+}
+
+static bool map_shared(page_merge_t* pm, merge_region_t* r, uint64_t page, uint32_t f) {
+    if (pm->ops.merge(pm->ops.ctx, r->owner, page, pm->frames[f - 1].data) < 0) {
+        return false;
+    }
+    r->frame[page] = f;
+    pm->frames[f - 1].refs++;
+    pm->stats.pages_sharing++;
+    return true;
+}
+
+static void merge_into(page_merge_t* pm, merge_region_t* r, uint64_t page, uint32_t f) {
+    if (!protect(pm, r, page)) {
+        return;
+    }
+    if (memcmp(r->memory + page * PS, pm->frames[f - 1].data, PS) != 0) {
+        pm->stats.merge_races++;
+        unprotect(pm, r, page);
+        return;
+    }
+    if (!map_shared(pm, r, page, f)) {
+        unprotect(pm, r, page);
+    }
+}
+
+// Two private pages with equal hashes become the first users of a new frame
+static bool merge_pair(page_merge_t* pm, merge_region_t* r1, uint64_t p1,
+                       merge_region_t* r2, uint64_t p2) {
+    if (!protect(pm, r1, p1)) {
+        return false;
+    }
+    if (!protect(pm, r2, p2)) {
+        unprotect(pm, r1, p1);
+        return false;
+    }
+
+    uint32_t f = 0;
+    if (memcmp(r1->memory + p1 * PS, r2->memory + p2 * PS, PS) != 0) {
+        pm->stats.merge_races++;
+    } else {
+        f = frame_new(pm, r1->memory + p1 * PS);
+    }
+
+    if (f && map_shared(pm, r1, p1, f)) {
+        if (!map_shared(pm, r2, p2, f)) {
+            unprotect(pm, r2, p2);
+        }
+        return true;
+    }
+
+    if (f) {
+        frame_release(pm, f, true);
+    }
+    unprotect(pm, r1, p1);
+    unprotect(pm, r2, p2);
+    return false;
+}
+
+// Called with the lock held, with a hash taken without it
+static void scan_page(page_merge_t* pm, uint32_t index, uint64_t page, uint64_t hash) {
+    merge_region_t* r = &pm->regions[index];
+    uint8_t* contents = r->memory + page * PS;
+
+    if (!r->active || r->frame[page]) {
+        return;
+    }
+
+    uint32_t f = stable_lookup(pm, hash, contents);
+    if (f) {
+        merge_into(pm, r, page, f);
+        return;
+    }
+
+    // Only pages that held still for a whole pass are worth a slot
+    if (r->checksum[page] != (uint32_t)hash) {
+        if (r->checksum[page]) {
+            pm->stats.pages_volatile++;
+        }
+        r->checksum[page] = (uint32_t)hash;
+        return;
+    }
+
+    unstable_entry_t* slot = &pm->unstable[hash & pm->unstable_mask];
+    if (slot->pass == pm->pass + 1 && slot->hash == hash &&
+        (slot->region != index || slot->page != page)) {
+        merge_region_t* other = &pm->regions[slot->region];
+        if (other->active && slot->page < other->pages && !other->frame[slot->page] &&
+            merge_pair(pm, other, slot->page, r, page)) {
+            slot->pass = 0;
+            return;
+        }
+    }
+
+    slot->hash = hash;
+    slot->page = page;
+    slot->region = index;
+    slot->pass = pm->pass + 1;
+}
+
+// Hash and merge the next page in scan order; false when there is nothing to scan
+static bool scan_next(page_merge_t* pm) {
+    pthread_mutex_lock(&pm->lock);
+    if (pm->active_regions == 0) {
+        pthread_mutex_unlock(&pm->lock);
+        return false;
+    }
+
+    merge_region_t* r = &pm->regions[pm->cursor_region];
+    while (!r->active || pm->cursor_page >= r->pages) {
+        pm->cursor_page = 0;
+        if (++pm->cursor_region == PAGE_MERGE_MAX_REGIONS) {
+            pm->cursor_region = 0;
+            pm->pass++;
+            pm->stats.full_scans++;
+        }
+        r = &pm->regions[pm->cursor_region];
+    }
+
+    uint32_t index = pm->cursor_region;
+    uint64_t page = pm->cursor_page++;
+    pm->stats.pages_scanned++;
+    // Reading an untouched page would back it; a zero page merges nothing anyway
+    if (r->frame[page] ||
+        (pm->ops.populated && !pm->ops.populated(pm->ops.ctx, r->owner, page))) {
+        pthread_mutex_unlock(&pm->lock);
+        return true;
+    }
+    pm->hashing = index;
+    pthread_mutex_unlock(&pm->lock);
+
+    uint64_t hash = page_hash(r->memory + page * PS);
+
+    pthread_mutex_lock(&pm->lock);
+    pm->hashing = NO_REGION;
+    pthread_cond_broadcast(&pm->cond);
+    scan_page(pm, index, page, hash);
+    pthread_mutex_unlock(&pm->lock);
+    return true;
+}
+
+static void* scanner_main(void* arg) {
+    page_merge_t* pm = arg;
+
+    pthread_mutex_lock(&pm->lock);
+    while (!pm->exiting) {
+        page_merge_params_t params = pm->params;
+        pthread_mutex_unlock(&pm->lock);
+
+        uint64_t start = thread_cpu_ns();
+        for (uint32_t i = 0; i < params.pages_per_batch && scan_next(pm); i++) {
+        }
+        uint64_t busy = thread_cpu_ns() - start;
+
+        // Stretch the pause so the batch stays within its CPU share
+        uint64_t pause = params.batch_interval_ns;
+        if (params.cpu_percent && params.cpu_percent < 100) {
+            uint64_t floor = busy * (100 - params.cpu_percent) / params.cpu_percent;
+            if (floor > pause) {
+                pause = floor;
+            }
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pause / 1000000000ULL;
+        deadline.tv_nsec += pause % 1000000000ULL;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_mutex_lock(&pm->lock);
+        pm->stats.scan_ns += busy;
+        if (!pm->exiting) {
+            pthread_cond_timedwait(&pm->cond, &pm->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    return NULL;
+}
+
+/* ==================== COPY ON WRITE ==================== */
+
+// Give the page a private copy; with the lock held
+static int break_cow(page_merge_t* pm, merge_region_t* r, uint64_t page) {
+    uint32_t f = r->frame[page];
+    merge_frame_t* fr = &pm->frames[f - 1];
+
+    // The last user keeps the frame itself
+    uint8_t* copy = fr->refs == 1 ? fr->data : pm->ops.frame_alloc(pm->ops.ctx);
+    if (!copy) {
+        return -1;
+    }
+    if (copy != fr->data) {
+        memcpy(copy, fr->data, PS);
+    }
+
+    if (pm->ops.unmerge(pm->ops.ctx, r->owner, page, copy) < 0) {
+        if (copy != fr->data) {
+            pm->ops.frame_free(pm->ops.ctx, copy);
+        }
+        return -1;
+    }
+
+    r->frame[page] = 0;
+    r->checksum[page] = 0;
+    frame_put(pm, f, copy != fr->data);
+    pm->stats.cow_breaks++;
+    return 0;
+}
+
+static merge_region_t* find_region(page_merge_t* pm, const uint8_t* addr, uint64_t* page) {
+    for (uint32_t i = 0; i < PAGE_MERGE_MAX_REGIONS; i++) {
+        merge_region_t* r = &pm->regions[i];
+        if (r->active && addr >= r->memory && addr < r->memory + r->pages * PS) {
+            *page = (uint64_t)(addr - r->memory) / PS;
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Resolve a write fault at addr. Returns 1 if the page was merged and now
+ * has a private copy, 0 if it was not merged (the fault is someone else's,
+ * or it hit a page the scanner had protected for a moment and has already
+ * released), -1 if no private copy could be made.
+ */
+int page_merge_write_fault(page_merge_t* pm, void* addr) {
+    uint64_t page;
+    int result = 0;
+
+    pthread_mutex_lock(&pm->lock);
+    merge_region_t* r = find_region(pm, addr, &page);
+    if (r && r->frame[page] && r->frame[page] != DISCARDED) {
+        result = break_cow(pm, r, page) < 0 ? -1 : 1;
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    return result;
+}
+
+/* ==================== DISCARDED PAGES ==================== */
+
+/*
+ * The guest gave [addr, addr + len) back. Each page, merged or its own, is
+ * handed to ops.discard and then left alone until page_merge_populate().
+ * Returns the pages newly discarded, or -1 if the range is not in one
+ * region.
+ */
+int64_t page_merge_discard(page_merge_t* pm, void* addr, uint64_t len) {
+    uint64_t first;
+    int64_t count = 0;
+
+    pthread_mutex_lock(&pm->lock);
+    merge_region_t* r = find_region(pm, addr, &first);
+    if (!r || (uintptr_t)addr % PS || len % PS || len / PS > r->pages - first) {
+        pthread_mutex_unlock(&pm->lock);
+        return -1;
+    }
+
+    for (uint64_t page = first; page < first + len / PS; page++) {
+        uint32_t f = r->frame[page];
+        if (f == DISCARDED || pm->ops.discard(pm->ops.ctx, r->owner, page, f != 0) < 0) {
+            continue;
+        }
+
+        // Unmapped first, so a frame freed here is no longer visible to the guest
+        r->frame[page] = DISCARDED;
+        r->checksum[page] = 0;
+        if (f) {
+            frame_put(pm, f, true);
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    return count;
+}
+
+// A discarded page has a private frame again and may be merged
+void page_merge_populate(page_merge_t* pm, void* addr) {
+    uint64_t page;
+
+    pthread_mutex_lock(&pm->lock);
+    merge_region_t* r = find_region(pm, addr, &page);
+    if (r && r->frame[page] == DISCARDED) {
+        r->frame[page] = 0;
+    }
+    pthread_mutex_unlock(&pm->lock);
+}
+
+/* ==================== SETUP ==================== */
+
+void page_merge_default_params(page_merge_params_t* params) {
+    memset(params, 0, sizeof(*params));
+    params->pages_per_batch = 1024;
+    params->batch_interval_ns = 20000000ULL;           // 20ms: up to 200MB/s
+    params->cpu_percent = 10;
+    params->unstable_slots = 1 << 20;
+}
+
+page_merge_t* page_merge_create(const page_merge_params_t* params, const page_merge_ops_t* ops) {
+    uint32_t slots = params->unstable_slots;
+    if (slots == 0 || (slots & (slots - 1))) {
+        return NULL;
+    }
+
+    page_merge_t* pm = calloc(1, sizeof(page_merge_t));
+    if (!pm) {
+        return NULL;
+    }
+
+    pm->params = *params;
+    pm->ops = *ops;
+    pm->hashing = NO_REGION;
+    pm->unstable_mask = slots - 1;
+    pm->unstable = calloc(slots, sizeof(unstable_entry_t));
+    if (!pm->unstable || frames_grow(pm) < 0) {
+        free(pm->unstable);
+        free(pm->frames);
+        free(pm);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pm->lock, NULL);
+    pthread_cond_init(&pm->cond, NULL);
+    if (pthread_create(&pm->scanner, NULL, scanner_main, pm) != 0) {
+        pthread_mutex_destroy(&pm->lock);
+        pthread_cond_destroy(&pm->cond);
+        free(pm->unstable);
+        free(pm->frames);
+        free(pm->buckets);
+        free(pm);
+        return NULL;
+    }
+
+    return pm;
+}
+
+// Regions must be removed first; frames still mapped somewhere are not freed
+void page_merge_destroy(page_merge_t* pm) {
+    pthread_mutex_lock(&pm->lock);
+    pm->exiting = true;
+    pthread_cond_broadcast(&pm->cond);
+    pthread_mutex_unlock(&pm->lock);
+    pthread_join(pm->scanner, NULL);
+
+    pthread_mutex_destroy(&pm->lock);
+    pthread_cond_destroy(&pm->cond);
+    free(pm->unstable);
+    free(pm->frames);
+    free(pm->buckets);
+    free(pm);
+}
+
+int page_merge_add_region(page_merge_t* pm, void* memory, uint64_t size, void* owner) {
+    if ((uintptr_t)memory % PS || size % PS || size == 0) {
+        return -1;
+    }
+
+    uint64_t pages = size / PS;
+    uint32_t* frame = calloc(pages, sizeof(uint32_t));
+    uint32_t* checksum = calloc(pages, sizeof(uint32_t));
+    if (!frame || !checksum) {
+        free(frame);
+        free(checksum);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pm->lock);
+    for (uint32_t i = 0; i < PAGE_MERGE_MAX_REGIONS; i++) {
+        merge_region_t* r = &pm->regions[i];
+        if (r->active || r->frame) {
+            continue;
+        }
+
+        r->memory = memory;
+        r->pages = pages;
+        r->owner = owner;
+        r->frame = frame;
+        r->checksum = checksum;
+        r->active = true;
+        pm->active_regions++;
+        pthread_mutex_unlock(&pm->lock);
+        return i;
+    }
+    pthread_mutex_unlock(&pm->lock);
+
+    free(frame);
+    free(checksum);
+    return -1;
+}
+
+/*
+ * Stop merging a region and give each of its merged pages a private copy
+ * again. Pages that cannot get one stay mapped to their shared frame, which
+ * is then kept for good.
+ */
+void page_merge_remove_region(page_merge_t* pm, int region) {
+    merge_region_t* r = &pm->regions[region];
+
+    pthread_mutex_lock(&pm->lock);
+    r->active = false;
+    pm->active_regions--;
+    while (pm->hashing == (uint32_t)region) {
+        pthread_cond_wait(&pm->cond, &pm->lock);
+    }
+
+    for (uint64_t page = 0; page < r->pages; page++) {
+        if (r->frame[page] && r->frame[page] != DISCARDED) {
+            break_cow(pm, r, page);
+        }
+    }
+
+    free(r->frame);
+    free(r->checksum);
+    r->frame = NULL;
+    r->checksum = NULL;
+    pthread_mutex_unlock(&pm->lock);
+}
+
+void page_merge_set_params(page_merge_t* pm, const page_merge_params_t* params) {
+    pthread_mutex_lock(&pm->lock);
+    pm->params.pages_per_batch = params->pages_per_batch;
+    pm->params.batch_interval_ns = params->batch_interval_ns;
+    pm->params.cpu_percent = params->cpu_percent;
+    pm->params.max_frames = params->max_frames;
+    pthread_cond_broadcast(&pm->cond);
+    pthread_mutex_unlock(&pm->lock);
+}
+
+void page_merge_get_stats(page_merge_t* pm, page_merge_stats_t* stats) {
+    pthread_mutex_lock(&pm->lock);
+    *stats = pm->stats;
+    pthread_mutex_unlock(&pm->lock);
+}
+
+#ifdef PAGE_MERGE_BENCH
+/* Userspace test: cc -O2 -DPAGE_MERGE_BENCH page_merge.c -lpthread */
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BENCH_MAX_VMS 16
+
+// Frames live in a memfd so they can be mapped into any guest at any page
+typedef struct {
+    int fd;
+    uint8_t* view;
+    uint32_t* free_list;
+    uint32_t free_count;
+} frame_pool_t;
+
+typedef struct {
+    uint8_t* memory;
+    uint8_t* expected;          // What the guest wrote, kept privately
+    uint8_t* discarded;         // Per page: given back, reads as zero until written
+    uint64_t pages;
+    uint64_t untouched;         // Pages past `pages` that nothing ever writes
+    uint64_t hot_pages;
+    bool stop;
+    uint64_t writes;
+} bench_vm_t;
+
+static frame_pool_t pool;
+static page_merge_t* bench_pm;
+static bench_vm_t vms[BENCH_MAX_VMS];
+static uint32_t vm_count;
+
+static void* pool_alloc(void* ctx) {
+    (void)ctx;
+    return pool.free_count ? pool.view + (uint64_t)pool.free_list[--pool.free_count] * PS : NULL;
+}
+
+static void pool_free(void* ctx, void* frame) {
+    (void)ctx;
+    pool.free_list[pool.free_count++] = ((uint8_t*)frame - pool.view) / PS;
+    fallocate(pool.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (uint8_t*)frame - pool.view, PS);
+}
+
+static int bench_protect(void* ctx, void* owner, uint64_t page, bool protect) {
+    (void)ctx;
+    bench_vm_t* vm = owner;
+    return mprotect(vm->memory + page * PS, PS, protect ? PROT_READ : PROT_READ | PROT_WRITE);
+}
+
+static int map_frame(bench_vm_t* vm, uint64_t page, void* frame, int prot) {
+    void* p = mmap(vm->memory + page * PS, PS, prot, MAP_SHARED | MAP_FIXED, pool.fd,
+                   (uint8_t*)frame - pool.view);
+    return p == MAP_FAILED ? -1 : 0;
+}
+
+static int bench_merge(void* ctx, void* owner, uint64_t page, void* frame) {
+    (void)ctx;
+    return map_frame(owner, page, frame, PROT_READ);
+}
+
+static int bench_unmerge(void* ctx, void* owner, uint64_t page, void* frame) {
+    (void)ctx;
+    return map_frame(owner, page, frame, PROT_READ | PROT_WRITE);
+}
+
+// A read-only anonymous page reads as zero; the first write makes it private again
+static int bench_discard(void* ctx, void* owner, uint64_t page, bool merged) {
+    (void)ctx;
+    (void)merged;
+    bench_vm_t* vm = owner;
+    void* p = mmap(vm->memory + page * PS, PS, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    vm->discarded[page] = 1;
+    return 0;
+}
+
+// Anonymous pages nobody touched are not resident; reading one would map it
+static bool bench_populated(void* ctx, void* owner, uint64_t page) {
+    (void)ctx;
+    bench_vm_t* vm = owner;
+    unsigned char resident = 1;
+    mincore(vm->memory + page * PS, PS, &resident);
+    return resident & 1;
+}
+
+// Skips the first 2MB, which a transparent huge page for the data may cover
+static uint64_t untouched_resident(const bench_vm_t* vm) {
+    uint64_t count = 0;
+    for (uint64_t page = vm->pages + 512; page < vm->pages + vm->untouched; page++) {
+        unsigned char resident = 0;
+        mincore(vm->memory + page * PS, PS, &resident);
+        count += resident & 1;
+    }
+    return count;
+}
+
+static void bench_fault(int sig, siginfo_t* info, void* uctx) {
+    (void)sig;
+    (void)uctx;
+    for (uint32_t i = 0; i < vm_count; i++) {
+        uint8_t* p = info->si_addr;
+        if (p >= vms[i].memory && p < vms[i].memory + vms[i].pages * PS) {
+            uint64_t page = (p - vms[i].memory) / PS;
+            int result = page_merge_write_fault(bench_pm, p);
+            if (result < 0) {
+                abort();
+            }
+            if (result == 0 && vms[i].discarded[page]) {
+                mprotect(vms[i].memory + page * PS, PS, PROT_READ | PROT_WRITE);
+                vms[i].discarded[page] = 0;
+                page_merge_populate(bench_pm, vms[i].memory + page * PS);
+            }
+            return;
+        }
+    }
+    signal(SIGSEGV, SIG_DFL);
+}
+
+// Writes mostly to a hot subset of the guest, now and then anywhere
+static void* writer_main(void* arg) {
+    bench_vm_t* vm = arg;
+    uint64_t seed = 0x9E3779B97F4A7C15ULL ^ (uintptr_t)vm;
+
+    while (!__atomic_load_n(&vm->stop, __ATOMIC_ACQUIRE)) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        uint64_t span = (seed >> 32) % 16384 ? vm->hot_pages : vm->pages;
+        uint64_t offset = (seed % span) * PS + (seed >> 40) % (PS - 8);
+        memcpy(vm->expected + offset, &seed, 8);
+        memcpy(vm->memory + offset, &seed, 8);
+        vm->writes++;
+        if ((vm->writes & 1023) == 0) {
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+static bool verify(const char* when) {
+    for (uint32_t i = 0; i < vm_count; i++) {
+        if (memcmp(vms[i].memory, vms[i].expected, vms[i].pages * PS) != 0) {
+            printf("%s: VM %u memory DIFFERS\n", when, i);
+            return false;
+        }
+    }
+    printf("%s: memory of %u VMs intact\n", when, vm_count);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    vm_count = argc > 1 ? (uint32_t)atoi(argv[1]) : 4;
+    uint64_t size = (argc > 2 ? strtoull(argv[2], NULL, 0) : 16) << 20;
+    uint32_t cpu = argc > 3 ? (uint32_t)atoi(argv[3]) : 25;
+    uint32_t passes = argc > 4 ? (uint32_t)atoi(argv[4]) : 3;
+
+    if (vm_count == 0 || vm_count > BENCH_MAX_VMS || size == 0) {
+        fprintf(stderr, "usage: %s [VMs] [MB each] [cpu %%] [passes]\n", argv[0]);
+        return 2;
+    }
+
+    uint64_t pages = size / PS;
+    uint64_t total = pages * vm_count;
+    pool.fd = memfd_create("page-merge-frames", 0);
+    pool.view = MAP_FAILED;
+    if (pool.fd >= 0 && ftruncate(pool.fd, total * PS) == 0) {
+        pool.view = mmap(NULL, total * PS, PROT_READ | PROT_WRITE, MAP_SHARED, pool.fd, 0);
+    }
+    pool.free_list = malloc(total * sizeof(uint32_t));
+    if (pool.view == MAP_FAILED || !pool.free_list) {
+        perror("frame pool");
+        return 1;
+    }
+    for (uint64_t i = 0; i < total; i++) {
+        pool.free_list[pool.free_count++] = total - 1 - i;
+    }
+
+    // Each guest: 60% the same "kernel and libraries", 20% zero, 20% its own data,
+    // and past that a quarter as much again that it never touches
+    for (uint32_t i = 0; i < vm_count; i++) {
+        bench_vm_t* vm = &vms[i];
+        vm->pages = pages;
+        vm->untouched = pages / 4;
+        vm->hot_pages = pages / 10;
+        vm->memory = mmap(NULL, (pages + vm->untouched) * PS, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        vm->expected = malloc(size);
+        vm->discarded = calloc(pages, 1);
+        if (vm->memory == MAP_FAILED || !vm->expected || !vm->discarded) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (uint64_t p = 0; p < pages; p++) {
+            uint64_t* w = (uint64_t*)(vm->memory + p * PS);
+            uint64_t kind = p * 10 / pages;
+            for (uint32_t j = 0; j < PS / 8; j++) {
+                w[j] = kind < 6 ? p * 0x9E3779B97F4A7C15ULL + j :
+                       kind < 8 ? 0 : (p << 20 | i) * 0xC2B2AE3D27D4EB4FULL + j;
+            }
+        }
+        memcpy(vm->expected, vm->memory, size);
+    }
+
+    struct sigaction sa = { .sa_sigaction = bench_fault, .sa_flags = SA_SIGINFO | SA_NODEFER };
+    sigaction(SIGSEGV, &sa, NULL);
+
+    page_merge_params_t params;
+    page_merge_default_params(&params);
+    params.pages_per_batch = 4096;
+    params.batch_interval_ns = 1000000ULL;
+    params.cpu_percent = cpu;
+    page_merge_ops_t ops = {
+        .write_protect = bench_protect,
+        .merge = bench_merge,
+        .unmerge = bench_unmerge,
+        .discard = bench_discard,
+        .frame_alloc = pool_alloc,
+        .frame_free = pool_free,
+        .populated = bench_populated,
+    };
+    bench_pm = page_merge_create(&params, &ops);
+    if (!bench_pm) {
+        fprintf(stderr, "page_merge_create failed\n");
+        return 1;
+    }
+
+    int regions[BENCH_MAX_VMS];
+    pthread_t writers[BENCH_MAX_VMS];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (uint32_t i = 0; i < vm_count; i++) {
+        regions[i] = page_merge_add_region(bench_pm, vms[i].memory,
+                                           (vms[i].pages + vms[i].untouched) * PS, &vms[i]);
+        pthread_create(&writers[i], NULL, writer_main, &vms[i]);
+    }
+
+    page_merge_stats_t s;
+    do {
+        usleep(50000);
+        page_merge_get_stats(bench_pm, &s);
+    } while (s.full_scans < passes);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    for (uint32_t i = 0; i < vm_count; i++) {
+        __atomic_store_n(&vms[i].stop, true, __ATOMIC_RELEASE);
+        pthread_join(writers[i], NULL);
+    }
+
+    printf("%u passes over %u x %llu MB in %.2f s, scanner CPU %.1f%% (cap %u%%)\n",
+           (unsigned)s.full_scans, vm_count, (unsigned long long)(size >> 20), wall,
+           s.scan_ns / 1e7 / wall, cpu);
+    printf("shared %llu frames for %llu pages: %.1f MB of %.1f MB saved\n",
+           (unsigned long long)s.pages_shared, (unsigned long long)s.pages_sharing,
+           (s.pages_sharing - s.pages_shared) * PS / 1048576.0, total * PS / 1048576.0);
+    printf("volatile %llu, merge races %llu, COW breaks %llu\n",
+           (unsigned long long)s.pages_volatile, (unsigned long long)s.merge_races,
+           (unsigned long long)s.cow_breaks);
+
+    bool ok = verify("merged");
+
+    // The scanner must not have backed what the guests never touched
+    uint64_t committed = 0;
+    for (uint32_t i = 0; i < vm_count; i++) {
+        committed += untouched_resident(&vms[i]);
+    }
+    printf("untouched pages read by the scanner: %llu\n", (unsigned long long)committed);
+    ok = ok && committed == 0;
+
+    // Hand back half the shared template and half the zero pages, then reuse some
+    int64_t discarded = 0;
+    for (uint32_t i = 0; i < vm_count; i++) {
+        uint64_t first = pages / 2, count = pages / 5;
+        discarded += page_merge_discard(bench_pm, vms[i].memory + first * PS, count * PS);
+        memset(vms[i].expected + first * PS, 0, count * PS);
+        for (uint64_t p = first; p < first + count; p += 7) {
+            vms[i].memory[p * PS + 100] = 0x5A;
+            vms[i].expected[p * PS + 100] = 0x5A;
+        }
+    }
+    page_merge_get_stats(bench_pm, &s);
+    printf("discarded %lld pages; now %llu frames for %llu pages\n", (long long)discarded,
+           (unsigned long long)s.pages_shared, (unsigned long long)s.pages_sharing);
+    ok = verify("discarded") && ok;
+    for (uint32_t i = 0; i < vm_count; i++) {
+        page_merge_remove_region(bench_pm, regions[i]);
+    }
+    page_merge_get_stats(bench_pm, &s);
+    ok = verify("unmerged") && ok && s.pages_shared == 0 && s.pages_sharing == 0;
+    page_merge_destroy(bench_pm);
+
+    return ok ? 0 : 1;
+}
+#endif
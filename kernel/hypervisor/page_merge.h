@@ -0,0 +1,95 @@
+/*
+ * QENEX Hypervisor - Page Merging
+ *
+ * Finds guest pages with identical contents, across all VMs, and backs
+ * them with one shared read-only frame:
+ *
+ *   - A background scanner walks the registered guest memory a batch of
+ *     pages at a time and hashes each page with a fast 64-bit hash.
+ *   - Pages matching an existing shared frame are merged into it. Other
+ *     pages whose hash did not change since the previous pass go into an
+ *     "unstable" table, rebuilt every pass; a second page with the same
+ *     hash becomes a new shared frame. Pages that keep changing are never
+ *     candidates.
+ *   - Hashes only select candidates. Both pages are write-protected and
+ *     compared in full before they are merged.
+ *   - A write to a merged page faults. page_merge_write_fault() gives the
+ *     writer a private copy and drops its reference to the shared frame.
+ *   - The scanner sleeps between batches, and longer if a batch took more
+ *     than its share of cpu_percent of one CPU.
+ *   - Pages the guest hands back (balloon, free page reporting) go through
+ *     page_merge_discard(), which drops any sharing and keeps the scanner
+ *     off them until page_merge_populate().
+ *   - Guest memory populated on first touch would be committed by the
+ *     scanner's reads. Pages ops.populated() reports untouched are skipped
+ *     without being read; the hypervisor reports huge-page backed pages
+ *     the same way, so merging never splits a large leaf.
+ *
+ * Mapping changes go through page_merge_ops_t. Each region is a view of
+ * guest memory that the callbacks remap page by page, in the second-level
+ * page tables and in the host's own mapping, so that devices and the
+ * scanner see what the guest sees. Host writes to a merged page must also
+ * go through page_merge_write_fault(). Build with -DPAGE_MERGE_BENCH for a
+ * userspace test that emulates the mappings with mmap().
+ */
+
+#ifndef QENEX_PAGE_MERGE_H
+#define QENEX_PAGE_MERGE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PAGE_MERGE_PAGE_SIZE 4096
+#define PAGE_MERGE_MAX_REGIONS 64           // Matches MAX_VMS
+
+typedef struct {
+    uint32_t pages_per_batch;
+    uint64_t batch_interval_ns;         // Sleep between batches
+    uint32_t cpu_percent;               // Of one CPU, at most
+    uint32_t unstable_slots;            // Candidates remembered per pass; power of two
+    uint64_t max_frames;                // Shared frames; 0 = unlimited
+} page_merge_params_t;
+
+typedef struct {
+    void* ctx;
+    // Make the page read-only (protect) or writable again
+    int (*write_protect)(void* ctx, void* owner, uint64_t page, bool protect);
+    // Map frame read-only in place of the guest's own page, which is released
+    int (*merge)(void* ctx, void* owner, uint64_t page, void* frame);
+    // Map a private, writable frame in place of the shared one
+    int (*unmerge)(void* ctx, void* owner, uint64_t page, void* frame);
+    // Unmap a page the guest gave back; its own page is released, a shared frame is not
+    int (*discard)(void* ctx, void* owner, uint64_t page, bool merged);
+    void* (*frame_alloc)(void* ctx);
+    void (*frame_free)(void* ctx, void* frame);
+    // False for a page the scanner must not read: one the guest never touched,
+    // or one the hypervisor keeps out of merging. May be NULL
+    bool (*populated)(void* ctx, void* owner, uint64_t page);
+} page_merge_ops_t;
+
+typedef struct {
+    uint64_t pages_scanned;
+    uint64_t full_scans;
+    uint64_t pages_shared;              // Shared frames in use
+    uint64_t pages_sharing;             // Guest pages mapped to them
+    uint64_t pages_volatile;            // Changed since the last pass
+    uint64_t merge_races;               // Contents differed after protecting
+    uint64_t cow_breaks;
+    uint64_t scan_ns;                   // Scanner CPU time
+} page_merge_stats_t;
+
+typedef struct page_merge page_merge_t;
+
+/* Function prototypes */
+void page_merge_default_params(page_merge_params_t* params);
+page_merge_t* page_merge_create(const page_merge_params_t* params, const page_merge_ops_t* ops);
+void page_merge_destroy(page_merge_t* pm);
+int page_merge_add_region(page_merge_t* pm, void* memory, uint64_t size, void* owner);
+void page_merge_remove_region(page_merge_t* pm, int region);
+int page_merge_write_fault(page_merge_t* pm, void* addr);
+int64_t page_merge_discard(page_merge_t* pm, void* addr, uint64_t len);
+void page_merge_populate(page_merge_t* pm, void* addr);
+void page_merge_set_params(page_merge_t* pm, const page_merge_params_t* params);
+void page_merge_get_stats(page_merge_t* pm, page_merge_stats_t* stats);
+
+#endif /* QENEX_PAGE_MERGE_H */
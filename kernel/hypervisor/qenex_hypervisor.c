@@ -24,10 +24,28 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "../universal_kernel.h"
+#include "virtqueue.h"
+#include "disk_image.h"
+#include "blk_engine.h"
+#include "block_cache.h"
+#include "vswitch.h"
+#include "migration.h"
+#include "page_merge.h"
+#include "guest_memory.h"
+#include "vcpu_sched.h"
+#include "sched_policy.h"
 
 #define MAX_VMS 64
 #define MAX_VCPUS_PER_VM 256
 #define PAGE_SIZE 4096
+#define HOST_BLOCK_CACHE_MAX (4ULL * 1024 * 1024 * 1024)  // Shared disk cache ceiling
+#define HOST_VSWITCH_PACKETS 32768                          // Switch buffers, ~50MB
+#define MEMORY_OVERCOMMIT_PERCENT 150                       // Guest memory admitted, of host RAM
+#define MEMORY_LOW_WATERMARK 32                             // Reclaim from guests below 1/32 free
+#define MEMORY_RECLAIM_INTERVAL_NS 1000000000ULL
+#define GUEST_BOOT_PREFAULT (16ULL * 1024 * 1024)           // Firmware, boot loader and kernel image
+#define PLE_GAP 128                                         // Cycles between PAUSEs of one spin loop
+#define PLE_WINDOW 4096                                     // Cycles of spinning before a pause-loop exit
 
 /* ==================== HARDWARE VIRTUALIZATION SUPPORT ==================== */
 
@@ -57,6 +75,8 @@ typedef struct {
     bool is_running;
     uint64_t exit_reason;
     uint64_t quantum_state;  // Quantum acceleration for VM
+    void* vm;               // Owning vm_t
+    sched_vcpu_t* sched;    // In hypervisor.scheduler while the VM runs
 } vcpu_t;
 
 /* ==================== VIRTUAL MACHINE STRUCTURE ==================== */
@@ -82,7 +102,13 @@ typedef struct {
     // Memory management
     uint64_t* ept;         // Extended Page Tables (Intel)
     uint64_t* npt;         // Nested Page Tables (AMD)
+    guest_memory_t* memory;  // Backing pages and the tables above
     void* memory_base;     // Guest physical memory
+    int merge_region;      // Page merging region, -1 if not merged
+    uint64_t* discarded;   // Bit per page given back to the host; reads as zeros
+    uint64_t discarded_pages;
+    uint64_t reclaimed_bytes;  // Host memory freed by what the guest gave back
+    uint64_t populated_bytes;  // Host RAM backing it privately; memory_usage follows it
     
     // Devices
     struct {
@@ -91,6 +117,7 @@ typedef struct {
         void* display;     // Virtual GPU
         void* audio;       // Virtual sound
         void* usb;         // Virtual USB controller
+        void* balloon;     // Memory balloon
     } devices;
     
     // State
@@ -109,7 +136,15 @@ typedef struct {
     
     // AI optimization
     void* ai_optimizer;
-    double predicted_load;
+    
+    // Scheduling
+    int sched_vm;               // VM in hypervisor.scheduler
+    vm_load_t load;             // Load prediction and the time slice it gives
+    bool co_schedule;           // Dispatch its vCPUs together
+    
+    // Live migration
+    migration_t* migration;     // Outgoing, while it runs
+    uint32_t throttle_percent;  // vCPU time withheld so pre-copy converges
 } vm_t;
 
 /* ==================== HYPERVISOR CORE ==================== */
@@ -129,19 +164,601 @@ typedef struct {
     // Resource pools
     uint64_t total_memory;
     uint64_t available_memory;
+    uint64_t committed_memory;     // Guest memory sizes; backed only as it is touched
+    uint64_t last_reclaim_ns;
+    uint64_t memory_paused_vms;    // Bit per vm_id paused until host memory comes back
     uint32_t total_cpus;
     
+    // Block cache shared by every virtual disk
+    block_cache_t* block_cache;
+    
+    // L2 switch connecting every virtual NIC
+    vswitch_t* vswitch;
+    
+    // Shares identical pages between guests
+    page_merge_t* page_merge;
+    void* zero_page;       // Read-only behind every discarded guest page
+    
     // Quantum resources
     uint32_t quantum_cores;
     bool quantum_enabled;
     
     // Scheduling
-    void* scheduler;
-    uint64_t schedule_quantum_ns;
+    vcpu_sched_t* scheduler;
+    uint64_t schedule_quantum_ns;  // How often a VM's load prediction is refreshed
 } hypervisor_t;
 
 static hypervisor_t hypervisor = {0};
 
+/* ==================== GUEST MEMORY ==================== */
+
+// Guest memory is populated lazily, so what it uses is counted as backing comes and goes
+static void account_guest_memory(vm_t* vm, int64_t bytes) {
+    vm->memory_usage = __atomic_add_fetch(&vm->populated_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+// Guest RAM lives in its own host window, aligned so host mappings can use large pages
+static void* guest_window_reserve(void* ctx, uint64_t size) {
+    return reserve_host_window(size, 1ULL << GUEST_MEMORY_1G_SHIFT);
+}
+
+static void guest_window_unreserve(void* ctx, void* base, uint64_t size) {
+    release_host_window(base, size);
+}
+
+static int guest_window_populate(void* ctx, void* addr, uint64_t size, uint32_t page_shift) {
+    uint64_t page_size = 1ULL << page_shift;
+    
+    for (uint64_t offset = 0; offset < size; offset += page_size) {
+        // Physically contiguous and aligned to its own size
+        uint64_t hpa = allocate_host_pages(page_size);
+        
+        if (!hpa) {
+            while (offset > 0) {
+                offset -= page_size;
+                hpa = virt_to_phys((uint8_t*)addr + offset);
+                unmap_host_range((uint8_t*)addr + offset, page_size);
+                free_host_pages(hpa, page_size);
+            }
+            return -1;
+        }
+        map_host_range((uint8_t*)addr + offset, hpa, page_size);
+        memset((uint8_t*)addr + offset, 0, page_size);
+    }
+    __atomic_sub_fetch(&hypervisor.available_memory, size, __ATOMIC_RELAXED);
+    account_guest_memory(ctx, size);
+    return 0;
+}
+
+static void guest_window_release(void* ctx, uint64_t phys, uint64_t size) {
+    free_host_pages(phys, size);
+    __atomic_add_fetch(&hypervisor.available_memory, size, __ATOMIC_RELAXED);
+    account_guest_memory(ctx, -(int64_t)size);
+}
+
+static void* guest_table_alloc(void* ctx) {
+    void* table = allocate_host_page();
+    if (table) {
+        memset(table, 0, PAGE_SIZE);
+    }
+    return table;
+}
+
+static void guest_table_free(void* ctx, void* table) {
+    free_host_page(virt_to_phys(table));
+}
+
+static uint64_t guest_virt_to_phys(void* ctx, const void* addr) {
+    return virt_to_phys(addr);
+}
+
+static void* guest_phys_to_virt(void* ctx, uint64_t phys) {
+    return phys_to_virt(phys);
+}
+
+static const guest_memory_ops_t guest_memory_ops = {
+    .reserve = guest_window_reserve,
+    .unreserve = guest_window_unreserve,
+    .populate = guest_window_populate,
+    .release = guest_window_release,
+    .alloc_table = guest_table_alloc,
+    .free_table = guest_table_free,
+    .virt_to_phys = guest_virt_to_phys,
+    .phys_to_virt = guest_phys_to_virt,
+};
+
+/*
+ * Guest RAM is populated on first touch, in 2MB pages where it can be, with
+ * EPT/NPT tables built to match. Only the boot region is backed up front
+ * (1GB, then 2MB, then 4KB pages), so creating a VM costs next to nothing
+ * whatever its size.
+ */
+static int allocate_guest_memory(vm_t* vm) {
+    guest_memory_format_t format = hypervisor.has_ept ? GUEST_MEMORY_EPT : GUEST_MEMORY_NPT;
+    uint64_t prefault = vm->memory_size < GUEST_BOOT_PREFAULT ? vm->memory_size : GUEST_BOOT_PREFAULT;
+    guest_memory_ops_t ops = guest_memory_ops;
+    guest_memory_stats_t stats;
+    
+    ops.ctx = vm;
+    vm->memory = guest_memory_create(vm->memory_size, format, GUEST_MEMORY_PAGES_ALL | GUEST_MEMORY_LAZY, &ops);
+    if (!vm->memory) {
+        return -1;
+    }
+    if (guest_memory_prefault(vm->memory, 0, prefault) < 0) {
+        guest_memory_destroy(vm->memory);
+        vm->memory = NULL;
+        return -1;
+    }
+    vm->memory_base = guest_memory_base(vm->memory);
+    
+    if (hypervisor.has_ept) {
+        vm->ept = guest_memory_table(vm->memory);
+    } else if (hypervisor.has_npt) {
+        vm->npt = guest_memory_table(vm->memory);
+    }
+    
+    guest_memory_get_stats(vm->memory, &stats);
+    printk("VM %s memory: %luMB on demand, %luKB prefaulted (%luMB in 2MB pages or larger)\n", vm->name,
+           vm->memory_size >> 20, (stats.bytes_1g + stats.bytes_2m + stats.bytes_4k) >> 10,
+           (stats.bytes_1g + stats.bytes_2m) >> 20);
+    return 0;
+}
+
+/*
+ * The frame at gpa was replaced; give it back, whether it is RAM backing or
+ * a frame of our own. Returns the bytes freed: a huge page backing it is
+ * only freed with the last of its 4KB pages.
+ */
+static uint64_t release_guest_frame(vm_t* vm, uint64_t gpa, uint64_t hpa) {
+    int64_t freed = guest_memory_release(vm->memory, gpa, hpa);
+    
+    if (freed < 0) {
+        free_host_page(hpa);
+        __atomic_add_fetch(&hypervisor.available_memory, PAGE_SIZE, __ATOMIC_RELAXED);
+        account_guest_memory(vm, -(int64_t)PAGE_SIZE);
+        freed = PAGE_SIZE;
+    }
+    return freed;
+}
+
+int reclaim_vm_memory(vm_t* vm);
+int resume_vm(vm_t* vm);
+
+// Host memory is running low: ask every guest's balloon for what it can spare
+static void reclaim_host_memory(void) {
+    uint64_t now = get_time_ns();
+    uint64_t last = __atomic_load_n(&hypervisor.last_reclaim_ns, __ATOMIC_RELAXED);
+    
+    if (now - last < MEMORY_RECLAIM_INTERVAL_NS ||
+        !__atomic_compare_exchange_n(&hypervisor.last_reclaim_ns, &last, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    for (uint32_t i = 0; i < MAX_VMS; i++) {
+        vm_t* vm = hypervisor.vms[i];
+        if (vm && vm->is_running) {
+            reclaim_vm_memory(vm);
+        }
+    }
+}
+
+// Host memory is back above the low watermark: resume the VMs paused for want of it
+static void resume_memory_paused_vms(void) {
+    if (!__atomic_load_n(&hypervisor.memory_paused_vms, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&hypervisor.available_memory, __ATOMIC_RELAXED) <
+        hypervisor.total_memory / MEMORY_LOW_WATERMARK) {
+        return;
+    }
+    
+    uint64_t paused = __atomic_exchange_n(&hypervisor.memory_paused_vms, 0, __ATOMIC_ACQ_REL);
+    while (paused) {
+        vm_t* vm = hypervisor.vms[__builtin_ctzll(paused)];
+        paused &= paused - 1;
+        if (vm && resume_vm(vm) == 0) {
+            printk("Host memory recovered, resumed %s\n", vm->name);
+        }
+    }
+}
+
+/*
+ * First touch of guest memory: a vCPU through an EPT/NPT violation on a
+ * page that is not present, or device emulation through the host's view of
+ * guest memory, from the host page-fault handler. Guests are admitted up
+ * to MEMORY_OVERCOMMIT_PERCENT of host RAM, so memory can run short here:
+ * balloons are asked to give some back well before that, and a guest that
+ * still cannot be served is paused, not failed. reclaim_guest_range()
+ * resumes it once balloons have brought memory back above the watermark.
+ */
+bool resolve_guest_memory_fault(vm_t* vm, uint64_t gpa) {
+    if (gpa >= vm->memory_size) {
+        return false;
+    }
+    
+    int result = guest_memory_fault(vm->memory, gpa);
+    if (hypervisor.available_memory < hypervisor.total_memory / MEMORY_LOW_WATERMARK) {
+        reclaim_host_memory();
+    }
+    if (result < 0 && !vm->is_paused) {
+        // Paused before it is listed, so the reclaim path cannot resume it first
+        printk("ERROR: Out of host memory backing %s at 0x%lx, pausing it\n", vm->name, gpa);
+        pause_vm(vm);
+        __atomic_fetch_or(&hypervisor.memory_paused_vms, 1ULL << vm->vm_id, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Host-side readers of guest memory check this first, since their reads would populate
+static bool guest_page_populated(vm_t* vm, uint64_t gpa) {
+    return guest_memory_lookup(vm->memory, gpa, NULL) != 0;
+}
+
+/* ==================== PAGE MERGING ==================== */
+
+#define EPT_VIOLATION_WRITE (1 << 1)
+#define EPT_VIOLATION_READABLE (1 << 3)     // The entry allowed reads
+#define EPT_VIOLATION_PERMISSIONS (7 << 3)  // R/W/X the entry allowed; none if not present
+#define NPF_PRESENT (1 << 0)
+#define NPF_WRITE (1 << 1)
+
+// Point a guest page at another frame, for vCPUs and for the host's view alike
+static int remap_guest_page(vm_t* vm, uint64_t gpa, void* frame, bool writable) {
+    uint64_t hpa = virt_to_phys(frame);
+    
+    // Splits a large leaf around the page if need be
+    if (guest_memory_map(vm->memory, gpa, hpa, PAGE_SIZE, writable) < 0) {
+        return -1;
+    }
+    map_host_page((uint8_t*)vm->memory_base + gpa, hpa, writable);
+    invalidate_guest_tlb(vm);
+    return 0;
+}
+
+static int page_merge_write_protect(void* ctx, void* owner, uint64_t page, bool protect) {
+    vm_t* vm = owner;
+    uint64_t gpa = page * PAGE_SIZE;
+    
+    if (guest_memory_protect(vm->memory, gpa, !protect) < 0) {
+        return -1;
+    }
+    set_host_page_writable((uint8_t*)vm->memory_base + gpa, !protect);
+    invalidate_guest_tlb(vm);
+    return 0;
+}
+
+static int page_merge_merge(void* ctx, void* owner, uint64_t page, void* frame) {
+    vm_t* vm = owner;
+    uint64_t gpa = page * PAGE_SIZE;
+    uint64_t old = guest_memory_lookup(vm->memory, gpa, NULL);
+    
+    if (remap_guest_page(vm, gpa, frame, false) < 0) {
+        return -1;
+    }
+    release_guest_frame(vm, gpa, old);
+    return 0;
+}
+
+static int page_merge_unmerge(void* ctx, void* owner, uint64_t page, void* frame) {
+    if (remap_guest_page(owner, page * PAGE_SIZE, frame, true) < 0) {
+        return -1;
+    }
+    account_guest_memory(owner, PAGE_SIZE);  // A private copy again
+    return 0;
+}
+
+// Back a page the guest gave away with the shared zero page, read-only
+static int discard_guest_page(vm_t* vm, uint64_t page, bool merged) {
+    uint64_t gpa = page * PAGE_SIZE;
+    uint64_t old = guest_memory_lookup(vm->memory, gpa, NULL);
+    
+    if (remap_guest_page(vm, gpa, hypervisor.zero_page, false) < 0) {
+        return -1;
+    }
+    if (!merged) {
+        __atomic_add_fetch(&vm->reclaimed_bytes, release_guest_frame(vm, gpa, old), __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_or(&vm->discarded[page / 64], 1ULL << (page % 64), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&vm->discarded_pages, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * A whole 2MB unit the guest gave away, on a 2MB page of its own: unmapped
+ * and freed at once rather than split into 512 zero-page mappings, and
+ * populated afresh on the next touch. -1 if it has to go a page at a time.
+ */
+static int64_t discard_guest_unit(vm_t* vm, uint64_t gpa) {
+    uint64_t hpa;
+    int64_t bytes = guest_memory_unmap_unit(vm->memory, gpa, &hpa);
+    
+    if (bytes > 0) {
+        invalidate_guest_tlb(vm);
+        unmap_host_range((uint8_t*)vm->memory_base + gpa, bytes);
+        guest_window_release(vm, hpa, bytes);
+        __atomic_add_fetch(&vm->reclaimed_bytes, bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+static int page_merge_discard_page(void* ctx, void* owner, uint64_t page, bool merged) {
+    return discard_guest_page(owner, page, merged);
+}
+
+static void* page_merge_frame_alloc(void* ctx) {
+    void* frame = allocate_host_page();
+    if (frame) {
+        __atomic_sub_fetch(&hypervisor.available_memory, PAGE_SIZE, __ATOMIC_RELAXED);
+    }
+    return frame;
+}
+
+static void page_merge_frame_free(void* ctx, void* frame) {
+    free_host_page(virt_to_phys(frame));
+    __atomic_add_fetch(&hypervisor.available_memory, PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+// Untouched pages are not read, and pages under a huge leaf are not merged:
+// merging one would split the leaf and cost the guest its TLB reach
+static bool page_merge_populated(void* ctx, void* owner, uint64_t page) {
+    vm_t* vm = owner;
+    uint64_t leaf = 0;
+    
+    return guest_memory_lookup(vm->memory, page * PAGE_SIZE, &leaf) != 0 && leaf == PAGE_SIZE;
+}
+
+static const page_merge_ops_t page_merge_ops = {
+    .write_protect = page_merge_write_protect,
+    .merge = page_merge_merge,
+    .unmerge = page_merge_unmerge,
+    .discard = page_merge_discard_page,
+    .frame_alloc = page_merge_frame_alloc,
+    .frame_free = page_merge_frame_free,
+    .populated = page_merge_populated,
+};
+
+// Scan rate and CPU ceiling of the background page merger
+int hypervisor_set_page_merging(uint32_t pages_per_batch, uint32_t interval_ms, uint32_t cpu_percent) {
+    if (!hypervisor.page_merge || cpu_percent == 0 || cpu_percent > 100) {
+        return -1;
+    }
+    
+    page_merge_params_t params;
+    page_merge_default_params(&params);
+    params.pages_per_batch = pages_per_batch;
+    params.batch_interval_ns = interval_ms * 1000000ULL;
+    params.cpu_percent = cpu_percent;
+    page_merge_set_params(hypervisor.page_merge, &params);
+    return 0;
+}
+
+/* ==================== RECLAIMED GUEST MEMORY ==================== */
+
+// Make guest memory known to the page merger and the reclaim paths
+static int register_guest_memory(vm_t* vm) {
+    uint64_t bitmap_size = (vm->memory_size / PAGE_SIZE + 63) / 64 * sizeof(uint64_t);
+    vm->discarded = allocate_contiguous_memory(bitmap_size);
+    if (!vm->discarded) {
+        return -1;
+    }
+    memset(vm->discarded, 0, bitmap_size);
+    
+    // Identical pages may be shared with other guests. The scanner passes over
+    // pages under a huge leaf (see page_merge_populated()), so only 4KB-backed
+    // ranges are merged and huge pages keep their TLB reach.
+    vm->merge_region = hypervisor.page_merge ?
+        page_merge_add_region(hypervisor.page_merge, vm->memory_base, vm->memory_size, vm) : -1;
+    return 0;
+}
+
+/*
+ * Give [gpa, gpa + len) back to the host. Returns the bytes of host memory
+ * actually freed, which is less than len for pages never touched, pages
+ * shared with other guests, and 4KB pages of a huge page the guest still
+ * uses the rest of. Whole 2MB units go at once without splitting their
+ * leaf. Called from the VM's balloon thread only.
+ */
+static uint64_t reclaim_guest_range(vm_t* vm, uint64_t gpa, uint64_t len) {
+    uint64_t unit = 1ULL << GUEST_MEMORY_2M_SHIFT;
+    uint64_t before = __atomic_load_n(&vm->reclaimed_bytes, __ATOMIC_RELAXED);
+    
+    if (gpa % PAGE_SIZE || len % PAGE_SIZE || gpa >= vm->memory_size || len > vm->memory_size - gpa) {
+        return 0;
+    }
+    
+    for (uint64_t addr = gpa; addr < gpa + len; ) {
+        if (!(addr % unit) && gpa + len - addr >= unit && discard_guest_unit(vm, addr) >= 0) {
+            addr += unit;
+            continue;
+        }
+        
+        // The rest of this unit goes a page at a time
+        uint64_t stop = (addr / unit + 1) * unit;
+        if (stop > gpa + len) {
+            stop = gpa + len;
+        }
+        if (vm->merge_region >= 0) {
+            // The merger drops any sharing and calls back into discard_guest_page()
+            page_merge_discard(hypervisor.page_merge, (uint8_t*)vm->memory_base + addr, stop - addr);
+            addr = stop;
+            continue;
+        }
+        for (; addr < stop; addr += PAGE_SIZE) {
+            uint64_t page = addr / PAGE_SIZE;
+            
+            if (!(vm->discarded[page / 64] & (1ULL << (page % 64)))) {
+                discard_guest_page(vm, page, false);
+            }
+        }
+    }
+    
+    uint64_t freed = __atomic_load_n(&vm->reclaimed_bytes, __ATOMIC_RELAXED) - before;
+    if (freed) {
+        resume_memory_paused_vms();
+    }
+    return freed;
+}
+
+// The guest wrote to a page it had given away: it gets a fresh zeroed one
+static bool populate_discarded_page(vm_t* vm, uint64_t gpa) {
+    uint64_t page = gpa / PAGE_SIZE;
+    uint64_t bit = 1ULL << (page % 64);
+    
+    if (!(__atomic_load_n(&vm->discarded[page / 64], __ATOMIC_ACQUIRE) & bit)) {
+        return false;
+    }
+    
+    void* frame = allocate_host_page();
+    if (!frame) {
+        return false;
+    }
+    memset(frame, 0, PAGE_SIZE);
+    
+    // Another vCPU got there first; retry once it has mapped the page
+    if (!(__atomic_fetch_and(&vm->discarded[page / 64], ~bit, __ATOMIC_ACQ_REL) & bit)) {
+        free_host_page(virt_to_phys(frame));
+        return true;
+    }
+    
+    remap_guest_page(vm, page * PAGE_SIZE, frame, true);
+    __atomic_sub_fetch(&hypervisor.available_memory, PAGE_SIZE, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&vm->discarded_pages, 1, __ATOMIC_RELAXED);
+    account_guest_memory(vm, PAGE_SIZE);
+    if (vm->merge_region >= 0) {
+        page_merge_populate(hypervisor.page_merge, (uint8_t*)vm->memory_base + page * PAGE_SIZE);
+    }
+    return true;
+}
+
+/*
+ * A write to a present, read-only guest page: a discarded page or a merged
+ * one. Device emulation writing through the host's view of guest memory
+ * faults the same way and comes here from the host page-fault handler.
+ */
+bool resolve_guest_write_fault(vm_t* vm, uint64_t gpa) {
+    if (gpa >= vm->memory_size) {
+        return false;
+    }
+    if (populate_discarded_page(vm, gpa)) {
+        return true;
+    }
+    
+    // 0: the scanner had it read-only for a moment and let go; just retry
+    return vm->merge_region >= 0 &&
+           page_merge_write_fault(hypervisor.page_merge, (uint8_t*)vm->memory_base + gpa) >= 0;
+}
+
+static bool handle_unpopulated_page(vcpu_t* vcpu) {
+    uint64_t gpa;
+    bool present;
+    
+    if (hypervisor.has_vt_x) {
+        present = (vmread(EXIT_QUALIFICATION) & EPT_VIOLATION_PERMISSIONS) != 0;
+        gpa = vmread(GUEST_PHYSICAL_ADDRESS);
+    } else {
+        present = (read_vmcb_exitinfo1(vcpu->vmcb) & NPF_PRESENT) != 0;
+        gpa = read_vmcb_exitinfo2(vcpu->vmcb);
+    }
+    
+    // Beyond RAM it is MMIO, for handle_ept_violation()
+    return !present && resolve_guest_memory_fault(vcpu->vm, gpa);
+}
+
+static bool handle_protected_page_write(vcpu_t* vcpu) {
+    uint64_t gpa;
+    bool protected_write;
+    
+    if (hypervisor.has_vt_x) {
+        uint64_t qualification = vmread(EXIT_QUALIFICATION);
+        protected_write = (qualification & EPT_VIOLATION_WRITE) &&
+                          (qualification & EPT_VIOLATION_READABLE);
+        gpa = vmread(GUEST_PHYSICAL_ADDRESS);
+    } else {
+        uint64_t info = read_vmcb_exitinfo1(vcpu->vmcb);
+        protected_write = (info & NPF_WRITE) && (info & NPF_PRESENT);
+        gpa = read_vmcb_exitinfo2(vcpu->vmcb);
+    }
+    
+    return protected_write && resolve_guest_write_fault(vcpu->vm, gpa);
+}
+
+/* ==================== vCPU SCHEDULING ==================== */
+
+/*
+ * Slice for the next dispatch of one of the VM's vCPUs. The load
+ * prediction behind it is refreshed here, by whichever pCPU first picks
+ * the VM once it is stale, so no pass over all VMs is needed. The policy
+ * itself is in sched_policy.c, shared with sched_sim.c.
+ */
+static uint64_t sched_time_slice(void* ctx, void* owner, uint64_t now) {
+    vm_t* vm = owner;
+    
+    if (vm_load_refresh(&vm->load, vcpu_sched_vm_runtime(hypervisor.scheduler, vm->sched_vm), now,
+                        hypervisor.schedule_quantum_ns)) {
+        update_vm_metrics(vm);
+    }
+    return vm_load_slice(&vm->load);
+}
+
+// Preempt what cpu runs, or wake it from idle, so it picks again
+static void sched_kick(void* ctx, uint32_t cpu) {
+    send_reschedule_ipi(cpu);
+}
+
+static const vcpu_sched_ops_t vcpu_sched_ops = {
+    .time_slice = sched_time_slice,
+    .kick = sched_kick,
+};
+
+/*
+ * An interrupt was posted to the vCPU (device completion, IPI, timer).
+ * Called by the interrupt injection path; a halted vCPU becomes runnable,
+ * boosted if it has credit left.
+ */
+void wake_vm_vcpu(vcpu_t* vcpu) {
+    if (vcpu->sched) {
+        vcpu_sched_wake(hypervisor.scheduler, vcpu->sched, get_time_ns());
+    }
+}
+
+// HLT: nothing to do until an interrupt, so the pCPU goes to someone else
+static void handle_hlt(vcpu_t* vcpu) {
+    if (!guest_interrupt_pending(vcpu)) {
+        // Back in the pCPU's scheduler loop; resumes here once woken and picked
+        return_to_scheduler(vcpu, VCPU_SCHED_BLOCKED);
+    }
+}
+
+/*
+ * Pause-loop exit: the vCPU has spun past PLE_WINDOW, most likely on a
+ * lock whose holder is not running. Boost the likely holder and give up
+ * the pCPU rather than spin out the slice.
+ */
+static void handle_pause_loop(vcpu_t* vcpu) {
+    vcpu_sched_yield_to(hypervisor.scheduler, vcpu->sched, get_time_ns());
+    return_to_scheduler(vcpu, VCPU_SCHED_YIELDED);
+}
+
+// Co-schedule a VM's vCPUs, for guests that spin on each other's locks
+int set_vm_co_scheduling(vm_t* vm, bool enable) {
+    if (!vm) {
+        return -1;
+    }
+    vm->co_schedule = enable;
+    if (vm->is_running) {
+        vcpu_sched_set_gang(hypervisor.scheduler, vm->sched_vm, enable);
+    }
+    return 0;
+}
+
+// CPU share of the VM relative to others; VCPU_SCHED_DEFAULT_WEIGHT is the norm
+int set_vm_cpu_weight(vm_t* vm, uint32_t weight) {
+    if (!vm || !vm->is_running || weight == 0) {
+        return -1;
+    }
+    vcpu_sched_set_weight(hypervisor.scheduler, vm->sched_vm, weight);
+    return 0;
+}
+
 /* ==================== INITIALIZATION ==================== */
 
 int hypervisor_init(void) {
@@ -176,13 +793,39 @@ int hypervisor_init(void) {
     hypervisor.available_memory = hypervisor.total_memory;
     hypervisor.total_cpus = get_cpu_count();
     
+    // 1/16 of RAM caches disk blocks for all guests; templates are shared
+    uint64_t cache_size = hypervisor.total_memory / 16;
+    if (cache_size > HOST_BLOCK_CACHE_MAX) {
+        cache_size = HOST_BLOCK_CACHE_MAX;
+    }
+    hypervisor.block_cache = block_cache_create(cache_size, BLOCK_CACHE_WRITEBACK);
+    if (hypervisor.block_cache) {
+        hypervisor.available_memory -= cache_size;
+    }
+    
+    hypervisor.vswitch = vswitch_create(HOST_VSWITCH_PACKETS);
+    if (hypervisor.vswitch) {
+        hypervisor.available_memory -= (uint64_t)HOST_VSWITCH_PACKETS * sizeof(vswitch_pkt_t);
+    }
+    
+    // Discarded guest pages all read from this one
+    hypervisor.zero_page = allocate_host_page();
+    memset(hypervisor.zero_page, 0, PAGE_SIZE);
+    
+    page_merge_params_t merge_params;
+    page_merge_default_params(&merge_params);
+    hypervisor.page_merge = page_merge_create(&merge_params, &page_merge_ops);
+    
     // Initialize quantum acceleration
     hypervisor.quantum_cores = detect_quantum_cores();
     hypervisor.quantum_enabled = hypervisor.quantum_cores > 0;
     
-    // Initialize scheduler
-    hypervisor.scheduler = create_vm_scheduler();
-    hypervisor.schedule_quantum_ns = 1000000;  // 1ms time slice
+    // Initialize scheduler: a runqueue per physical CPU
+    vcpu_sched_params_t sched_params;
+    vcpu_sched_default_params(&sched_params, hypervisor.total_cpus < VCPU_SCHED_MAX_CPUS ?
+                                             hypervisor.total_cpus : VCPU_SCHED_MAX_CPUS);
+    hypervisor.scheduler = vcpu_sched_create(&sched_params, &vcpu_sched_ops);
+    hypervisor.schedule_quantum_ns = 1000000;  // Refresh load predictions every 1ms
     
     hypervisor.initialized = true;
     
@@ -194,12 +837,18 @@ int hypervisor_init(void) {
            hypervisor.has_ept ? "yes" : "no",
            hypervisor.has_npt ? "yes" : "no");
     printk("  Quantum cores: %d\n", hypervisor.quantum_cores);
+    printk("  Block cache: %llu MB\n",
+           hypervisor.block_cache ? cache_size / (1024*1024) : 0ULL);
+    printk("  Virtual switch: %s\n", hypervisor.vswitch ? "yes" : "no");
+    printk("  Page merging: %s\n", hypervisor.page_merge ? "yes" : "no");
     
     return 0;
 }
 
 /* ==================== CREATE UNIX VM ==================== */
 
+struct virtio_balloon* create_virtual_balloon(vm_t* vm);
+
 vm_t* create_unix_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     if (hypervisor.num_vms >= MAX_VMS) {
         printk("ERROR: Maximum VMs reached\n");
@@ -215,30 +864,31 @@ vm_t* create_unix_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     vm->memory_size = memory_gb * 1024 * 1024 * 1024;
     vm->num_vcpus = cpus;
     
-    if (vm->memory_size > hypervisor.available_memory) {
+    // Memory is backed as it is touched, so admission is against a commit limit
+    if (hypervisor.committed_memory + vm->memory_size >
+        hypervisor.total_memory / 100 * MEMORY_OVERCOMMIT_PERCENT) {
         printk("ERROR: Not enough memory for VM\n");
         free_vm(vm);
         return NULL;
     }
     
-    // Allocate guest physical memory
-    vm->memory_base = allocate_contiguous_memory(vm->memory_size);
-    if (!vm->memory_base) {
+    // Allocate guest physical memory, with EPT/NPT tables to match
+    if (allocate_guest_memory(vm) < 0) {
         printk("ERROR: Failed to allocate VM memory\n");
         free_vm(vm);
         return NULL;
     }
     
-    // Set up Extended Page Tables for memory virtualization
-    if (hypervisor.has_ept) {
-        vm->ept = setup_ept_tables(vm->memory_base, vm->memory_size);
-    } else if (hypervisor.has_npt) {
-        vm->npt = setup_npt_tables(vm->memory_base, vm->memory_size);
+    if (register_guest_memory(vm) < 0) {
+        printk("ERROR: Failed to allocate VM memory\n");
+        free_vm(vm);
+        return NULL;
     }
     
     // Create vCPUs
     for (uint32_t i = 0; i < cpus; i++) {
         vm->vcpus[i] = create_vcpu(vm, i);
+        vm->vcpus[i]->vm = vm;
         
         // Set up UNIX-specific CPU state
         vm->vcpus[i]->state.cr0 = 0x80000001;  // Protected mode + paging
@@ -253,16 +903,17 @@ vm_t* create_unix_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     }
     
     // Create virtual devices
-    vm->devices.disk = create_virtio_disk(vm, 100 * 1024 * 1024 * 1024);  // 100GB
+    vm->devices.disk = create_virtio_disk(vm, 100ULL * 1024 * 1024 * 1024);  // 100GB
     vm->devices.network = create_virtio_net(vm, "eth0");
     vm->devices.display = create_virtual_vga(vm);
+    vm->devices.balloon = create_virtual_balloon(vm);
     
     // Set up UNIX boot environment
     setup_unix_boot_environment(vm);
     
     // Add to hypervisor
     hypervisor.vms[vm->vm_id] = vm;
-    hypervisor.available_memory -= vm->memory_size;
+    hypervisor.committed_memory += vm->memory_size;
     
     printk("Created UNIX VM: %s (Memory: %luGB, CPUs: %u)\n", 
            name, memory_gb, cpus);
@@ -286,26 +937,33 @@ vm_t* create_windows_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     // Windows requires more resources
     vm->memory_size = memory_gb * 1024 * 1024 * 1024;
     vm->num_vcpus = cpus;
+    vm->co_schedule = cpus > 1;  // Its vCPUs spin on each other's locks
     
-    if (vm->memory_size > hypervisor.available_memory) {
+    // Memory is backed as it is touched, so admission is against a commit limit
+    if (hypervisor.committed_memory + vm->memory_size >
+        hypervisor.total_memory / 100 * MEMORY_OVERCOMMIT_PERCENT) {
         printk("ERROR: Not enough memory for VM\n");
         free_vm(vm);
         return NULL;
     }
     
-    // Allocate guest physical memory
-    vm->memory_base = allocate_contiguous_memory(vm->memory_size);
+    // Allocate guest physical memory and set up memory virtualization
+    if (allocate_guest_memory(vm) < 0) {
+        printk("ERROR: Failed to allocate VM memory\n");
+        free_vm(vm);
+        return NULL;
+    }
     
-    // Set up memory virtualization
-    if (hypervisor.has_ept) {
-        vm->ept = setup_ept_tables(vm->memory_base, vm->memory_size);
-    } else if (hypervisor.has_npt) {
-        vm->npt = setup_npt_tables(vm->memory_base, vm->memory_size);
+    if (register_guest_memory(vm) < 0) {
+        printk("ERROR: Failed to allocate VM memory\n");
+        free_vm(vm);
+        return NULL;
     }
     
     // Create vCPUs with Windows-specific setup
     for (uint32_t i = 0; i < cpus; i++) {
         vm->vcpus[i] = create_vcpu(vm, i);
+        vm->vcpus[i]->vm = vm;
         
         // Windows-specific CPU state
         vm->vcpus[i]->state.cr0 = 0x80000001;
@@ -320,11 +978,12 @@ vm_t* create_windows_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     }
     
     // Create Windows-specific devices
-    vm->devices.disk = create_ahci_disk(vm, 250 * 1024 * 1024 * 1024);  // 250GB
+    vm->devices.disk = create_ahci_disk(vm, 250ULL * 1024 * 1024 * 1024);  // 250GB
     vm->devices.network = create_e1000_nic(vm);  // Windows prefers e1000
     vm->devices.display = create_vga_with_vbe(vm);  // VGA with VESA
     vm->devices.audio = create_ac97_audio(vm);  // AC'97 audio
     vm->devices.usb = create_ehci_controller(vm);  // USB 2.0
+    vm->devices.balloon = create_virtual_balloon(vm);  // virtio-win balloon driver
     
     // Set up Windows boot environment
     setup_windows_boot_environment(vm);
@@ -337,7 +996,7 @@ vm_t* create_windows_vm(const char* name, uint64_t memory_gb, uint32_t cpus) {
     
     // Add to hypervisor
     hypervisor.vms[vm->vm_id] = vm;
-    hypervisor.available_memory -= vm->memory_size;
+    hypervisor.committed_memory += vm->memory_size;
     
     printk("Created Windows VM: %s (Memory: %luGB, CPUs: %u)\n", 
            name, memory_gb, cpus);
@@ -395,7 +1054,17 @@ void handle_vm_exit(vcpu_t* vcpu) {
             break;
             
         case EXIT_REASON_EPT_VIOLATION:
-            handle_ept_violation(vcpu);
+            if (!handle_unpopulated_page(vcpu) && !handle_protected_page_write(vcpu)) {
+                handle_ept_violation(vcpu);
+            }
+            break;
+            
+        case EXIT_REASON_HLT:
+            handle_hlt(vcpu);
+            break;
+            
+        case EXIT_REASON_PAUSE_INSTRUCTION:
+            handle_pause_loop(vcpu);
             break;
             
         case EXIT_REASON_HYPERCALL:
@@ -414,55 +1083,980 @@ void handle_vm_exit(vcpu_t* vcpu) {
 
 /* ==================== DEVICE EMULATION ==================== */
 
+// Guest-physical to host-virtual for device rings and buffers
+static void* vm_translate_gpa(void* ctx, uint64_t gpa, uint32_t len) {
+    vm_t* vm = ctx;
+    
+    if (gpa >= vm->memory_size || len > vm->memory_size - gpa) {
+        return NULL;
+    }
+    return (uint8_t*)vm->memory_base + gpa;
+}
+
 // Emulate block device for disk
-typedef struct {
-    uint64_t size;
-    void* backing_file;
-    uint64_t read_ops;
-    uint64_t write_ops;
-    bool use_quantum;  // Quantum acceleration for I/O
-} virtual_disk_t;
+#define VM_IMAGE_DIR "/var/lib/qenex/images"
+
+#define VIRTIO_BLK_QUEUE_SIZE 128
+#define VIRTIO_BLK_MAX_QUEUES 64
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+#define VIRTIO_BLK_F_MQ 12          // num_queues in config space
+
+// virtio-blk request types and status codes
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_DISCARD 11
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+typedef struct {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_outhdr_t;
+
+typedef struct {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __attribute__((packed)) virtio_blk_discard_t;
+
+// One guest request from pop to completion
+typedef struct virtio_blk_req {
+    vq_elem_t elem;
+    blk_request_t io;
+    uint8_t* status;
+    struct virtio_blk_req* next_free;
+} virtio_blk_req_t;
+
+struct virtual_disk;
+
+/*
+ * One request queue per vCPU. The guest's blk-mq layer maps each CPU to its
+ * own queue and steers the queue's MSI-X vector back to that CPU. Each
+ * queue has its own virtqueue, kick eventfd, device thread and io_uring, so
+ * nothing on the submit path is shared with another queue.
+ */
+typedef struct {
+    struct virtual_disk* disk;
+    uint16_t index;
+    uint16_t msix_vector;
+    
+    // Owned by the queue's device thread
+    virtqueue_t vq;
+    blk_engine_t* engine;
+    int kick_fd;            // ioeventfd on this queue's notify address
+    virtio_blk_req_t requests[VIRTIO_BLK_QUEUE_SIZE];
+    virtio_blk_req_t* free_requests;
+    uint32_t completed;     // Filled into the used ring, not yet flushed
+    bool running;
+    
+    uint64_t read_ops;
+    uint64_t write_ops;
+} __attribute__((aligned(64))) virtio_blk_queue_t;
+
+typedef struct virtual_disk {
+    uint64_t size;
+    disk_image_t* image;    // Sparse; grows with what the guest writes
+    vm_t* vm;
+    uint64_t features;      // Negotiated with the guest driver
+    
+    // Offered through VIRTIO_BLK_F_MQ; the guest may set up fewer
+    uint16_t num_queues;
+    virtio_blk_queue_t* queues[VIRTIO_BLK_MAX_QUEUES];
+    
+    bool use_quantum;  // Quantum acceleration for I/O
+} virtual_disk_t;
+
+// Template images guests of each type are cloned from, if installed
+static const char* disk_templates[] = {
+    [VM_TYPE_UNIX] = VM_IMAGE_DIR "/template-unix.qxdi",
+    [VM_TYPE_WINDOWS] = VM_IMAGE_DIR "/template-windows.qxdi",
+    [VM_TYPE_MACOS] = VM_IMAGE_DIR "/template-macos.qxdi",
+    [VM_TYPE_ANDROID] = VM_IMAGE_DIR "/template-android.qxdi",
+    [VM_TYPE_CUSTOM] = NULL,
+};
+
+// Undo create_virtual_disk() from whatever point it got to
+static void free_virtual_disk(virtual_disk_t* disk) {
+    for (uint16_t i = 0; i < VIRTIO_BLK_MAX_QUEUES; i++) {
+        virtio_blk_queue_t* q = disk->queues[i];
+        
+        if (q) {
+            if (q->kick_fd >= 0) {
+                close_ioeventfd(q->kick_fd);
+            }
+            free_contiguous_memory(q);
+        }
+    }
+    if (disk->image) {
+        disk_image_close(disk->image);
+    }
+    free_virtual_device(disk);
+}
 
 virtual_disk_t* create_virtual_disk(vm_t* vm, uint64_t size) {
+    char path[DISK_IMAGE_PATH_MAX];
     virtual_disk_t* disk = allocate_virtual_device();
+    if (!disk) {
+        printk("ERROR: No memory for a disk of %s\n", vm->name);
+        return NULL;
+    }
     disk->size = size;
-    disk->backing_file = create_backing_file(size);
     disk->use_quantum = hypervisor.quantum_enabled;
     
+    // Only the header and L1 table are written now, whatever the size
+    snprintf(path, sizeof(path), VM_IMAGE_DIR "/%s-%u.qxdi", vm->name, vm->vm_id);
+    disk->image = disk_image_create(path, size, disk_templates[vm->type]);
+    if (!disk->image) {
+        // No template installed; start from an empty disk
+        disk->image = disk_image_create(path, size, NULL);
+    }
+    if (!disk->image) {
+        printk("ERROR: Failed to create disk image %s\n", path);
+        free_virtual_disk(disk);
+        return NULL;
+    }
+    
+    // Uncached disks still work, just with every read going to the file
+    if (hypervisor.block_cache &&
+        disk_image_set_cache(disk->image, hypervisor.block_cache, vm->vm_id) < 0) {
+        printk("WARNING: Disk %s is not using the block cache\n", path);
+    }
+    
+    disk->vm = vm;
+    
+    // One queue per vCPU
+    disk->num_queues = vm->num_vcpus < VIRTIO_BLK_MAX_QUEUES ? vm->num_vcpus : VIRTIO_BLK_MAX_QUEUES;
+    if (disk->num_queues == 0) {
+        disk->num_queues = 1;
+    }
+    for (uint16_t i = 0; i < disk->num_queues; i++) {
+        virtio_blk_queue_t* q = allocate_contiguous_memory(sizeof(virtio_blk_queue_t));
+        if (!q) {
+            printk("ERROR: No memory for queue %u of disk %s\n", i, path);
+            free_virtual_disk(disk);
+            return NULL;
+        }
+        memset(q, 0, sizeof(*q));
+        q->disk = disk;
+        q->index = i;
+        disk->queues[i] = q;
+        
+        q->kick_fd = create_ioeventfd(vm);
+        if (q->kick_fd < 0) {
+            printk("ERROR: No ioeventfd for queue %u of disk %s\n", i, path);
+            free_virtual_disk(disk);
+            return NULL;
+        }
+        for (uint32_t r = 0; r < VIRTIO_BLK_QUEUE_SIZE; r++) {
+            q->requests[r].next_free = q->free_requests;
+            q->free_requests = &q->requests[r];
+        }
+    }
+    
     // Register with VM
     vm->devices.disk = disk;
     
     return disk;
 }
 
+static void virtio_blk_finish(virtio_blk_queue_t* q, virtio_blk_req_t* req, uint8_t status) {
+    *req->status = status;
+    req->elem.used_len += 1;  // Status byte
+    virtqueue_fill(&q->vq, &req->elem);
+    q->completed++;
+    
+    req->next_free = q->free_requests;
+    q->free_requests = req;
+}
+
+// Block engine completion; runs in the queue's device thread
+static void virtio_blk_complete(void* ctx, blk_request_t* io) {
+    virtio_blk_queue_t* q = ctx;
+    virtio_blk_req_t* req = io->opaque;
+    
+    if (io->type == BLK_REQ_READ && io->status == 0) {
+        for (uint32_t i = 0; i < io->iov_count; i++) {
+            req->elem.used_len += io->iov[i].iov_len;
+        }
+    }
+    virtio_blk_finish(q, req, io->status == 0 ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR);
+}
+
+// Turn a popped chain into a block request; false if it completed inline
+static bool virtio_blk_parse(virtio_blk_queue_t* q, virtio_blk_req_t* req) {
+    vq_elem_t* elem = &req->elem;
+    uint32_t segs = elem->out_num + elem->in_num;
+    
+    // Header in the first readable segment, status in the last writable byte
+    if (elem->out_num == 0 || elem->in_num == 0 ||
+        elem->segs[0].len < sizeof(virtio_blk_outhdr_t) || elem->segs[segs - 1].len == 0) {
+        q->vq.broken = true;
+        req->next_free = q->free_requests;
+        q->free_requests = req;
+        return false;
+    }
+    
+    virtio_blk_outhdr_t* hdr = elem->segs[0].base;
+    vq_seg_t* last = &elem->segs[segs - 1];
+    req->status = (uint8_t*)last->base + last->len - 1;
+    elem->used_len = 0;
+    
+    blk_request_t* io = &req->io;
+    io->opaque = req;
+    io->offset = hdr->sector * VIRTIO_BLK_SECTOR_SIZE;
+    io->iov_count = 0;
+    
+    switch (hdr->type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT: {
+            bool read = hdr->type == VIRTIO_BLK_T_IN;
+            uint32_t first = read ? elem->out_num : 1;
+            uint32_t end = read ? segs : elem->out_num;
+            
+            io->type = read ? BLK_REQ_READ : BLK_REQ_WRITE;
+            for (uint32_t i = first; i < end && io->iov_count < BLK_MAX_SEGS; i++) {
+                uint32_t len = elem->segs[i].len - (i == segs - 1 ? 1 : 0);
+                if (len > 0) {
+                    io->iov[io->iov_count].iov_base = elem->segs[i].base;
+                    io->iov[io->iov_count].iov_len = len;
+                    io->iov_count++;
+                }
+            }
+            if (read) {
+                q->read_ops++;
+            } else {
+                q->write_ops++;
+            }
+            return true;
+        }
+        
+        case VIRTIO_BLK_T_FLUSH:
+            io->type = BLK_REQ_FLUSH;
+            return true;
+        
+        case VIRTIO_BLK_T_DISCARD: {
+            // Metadata only; done inline for every range
+            uint8_t status = VIRTIO_BLK_S_OK;
+            for (uint32_t i = 1; i < elem->out_num; i++) {
+                virtio_blk_discard_t* range = elem->segs[i].base;
+                for (uint32_t n = 0; n < elem->segs[i].len / sizeof(*range); n++) {
+                    if (disk_image_discard(q->disk->image,
+                                           range[n].sector * VIRTIO_BLK_SECTOR_SIZE,
+                                           (uint64_t)range[n].num_sectors *
+                                           VIRTIO_BLK_SECTOR_SIZE) < 0) {
+                        status = VIRTIO_BLK_S_IOERR;
+                    }
+                }
+            }
+            virtio_blk_finish(q, req, status);
+            return false;
+        }
+        
+        default:
+            virtio_blk_finish(q, req, VIRTIO_BLK_S_UNSUPP);
+            return false;
+    }
+}
+
+// Everything the guest queued before kicking goes out in one submission
+static void virtio_blk_submit(virtio_blk_queue_t* q) {
+    virtqueue_t* vq = &q->vq;
+    
+    do {
+        virtqueue_disable_notify(vq);
+        
+        while (q->free_requests) {
+            virtio_blk_req_t* req = q->free_requests;
+            if (virtqueue_pop_burst(vq, &req->elem, 1) == 0) {
+                break;
+            }
+            q->free_requests = req->next_free;
+            
+            if (virtio_blk_parse(q, req)) {
+                blk_engine_queue(q->engine, &req->io);
+            }
+        }
+        
+        blk_engine_kick(q->engine);
+        
+        // Out of request slots: completions will pick the rest up
+        if (!q->free_requests) {
+            break;
+        }
+    } while (virtqueue_enable_notify(vq));
+}
+
+static void virtio_blk_flush_completions(virtio_blk_queue_t* q) {
+    if (q->completed == 0) {
+        return;
+    }
+    
+    virtqueue_flush(&q->vq);
+    q->completed = 0;
+    
+    if (virtqueue_should_notify(&q->vq)) {
+        inject_virtio_interrupt(q->disk->vm, q->disk, q->msix_vector);
+    }
+}
+
+// Queue device thread: guest kicks and disk completions arrive through one ring
+void virtio_blk_queue_thread(virtio_blk_queue_t* q) {
+    while (q->running) {
+        bool kicked = false;
+        bool had_slots = q->free_requests != NULL;
+        
+        blk_engine_poll(q->engine, true, &kicked);
+        
+        // A kick, or slots freed after the ring had backed up
+        if (kicked || (!had_slots && q->free_requests)) {
+            virtio_blk_submit(q);
+        }
+        virtio_blk_flush_completions(q);
+    }
+    
+    blk_engine_destroy(q->engine);
+    q->engine = NULL;
+}
+
+// Guest wrote a queue's ring addresses and MSI-X vector and enabled it
+int virtual_disk_setup_queue(virtual_disk_t* disk, uint16_t index, uint16_t size,
+                             uint64_t desc_gpa, uint64_t driver_gpa, uint64_t device_gpa,
+                             uint16_t msix_vector) {
+    if (index >= disk->num_queues) {
+        printk("virtio-blk: %s enabled queue %u of %u\n", disk->vm->name, index,
+               disk->num_queues);
+        return -1;
+    }
+    
+    virtio_blk_queue_t* q = disk->queues[index];
+    if (virtqueue_init(&q->vq, size ? size : VIRTIO_BLK_QUEUE_SIZE, disk->features,
+                       vm_translate_gpa, disk->vm) != 0 ||
+        virtqueue_set_rings(&q->vq, desc_gpa, driver_gpa, device_gpa) != 0) {
+        printk("virtio-blk: bad queue %u setup on %s\n", index, disk->vm->name);
+        return -1;
+    }
+    q->msix_vector = msix_vector;
+    
+    /*
+     * Each queue submits through its own ring; no lock is shared between
+     * them. Guest RAM is not pinned: it is populated on first touch and
+     * pages are remapped by merging and ballooning, so I/O goes through
+     * the iovecs translated for each request.
+     */
+    q->engine = blk_engine_create(disk->image, disk->vm->memory_base,
+                                  disk->vm->memory_size, 0, q->kick_fd,
+                                  virtio_blk_complete, q);
+    if (!q->engine) {
+        return -1;
+    }
+    
+    if (index == 0) {
+        printk("virtio-blk: %s using %s I/O, %u queues\n", disk->vm->name,
+               blk_engine_async(q->engine) ? "io_uring" : "synchronous", disk->num_queues);
+    }
+    
+    q->running = true;
+    create_device_thread(virtio_blk_queue_thread, q);
+    
+    return 0;
+}
+
 // Network device emulation
+#define VIRTIO_NET_QUEUE_SIZE 256
+#define VIRTIO_NET_BURST 32
+#define VIRTIO_NET_HDR_LEN 12       // struct virtio_net_hdr with num_buffers (virtio 1.0)
+
 typedef struct {
     uint8_t mac_addr[6];
-    void* tx_queue;
-    void* rx_queue;
+    vm_t* vm;
+    uint64_t features;      // Negotiated with the guest driver
+    virtqueue_t tx_queue;
+    virtqueue_t rx_queue;
+    uint32_t queues_ready;  // Bit per queue set up by the guest
+    int kick_fd;            // Guest kicks on either queue, and switch wakeups
+    uint16_t switch_port;
+    vq_elem_t tx_burst[VIRTIO_NET_BURST];
+    vq_elem_t rx_burst[VIRTIO_NET_BURST];
+    vswitch_pkt_t* tx_pkts[VIRTIO_NET_BURST];
+    vswitch_pkt_t* rx_pending[VIRTIO_NET_BURST];   // Taken from the switch, waiting for guest buffers
+    uint32_t rx_pending_count;
     uint64_t packets_sent;
     uint64_t packets_received;
+    uint64_t tx_dropped;    // Switch out of packet buffers
     bool connected;
 } virtual_nic_t;
 
+// Frames arrived at this NIC's switch port
+static void virtual_nic_switch_notify(void* ctx) {
+    virtual_nic_t* nic = ctx;
+    signal_device_event(nic->kick_fd);
+}
+
 virtual_nic_t* create_virtual_nic(vm_t* vm) {
+    if (!hypervisor.vswitch) {
+        printk("virtio-net: no virtual switch for %s\n", vm->name);
+        return NULL;
+    }
+    
     virtual_nic_t* nic = allocate_virtual_device();
+    nic->vm = vm;
+    nic->kick_fd = create_ioeventfd(vm);
     
     // Generate MAC address
     generate_mac_address(nic->mac_addr);
     
-    // Create packet queues
-    nic->tx_queue = create_packet_queue();
-    nic->rx_queue = create_packet_queue();
-    
-    // Connect to virtual switch
-    connect_to_virtual_switch(nic);
+    // Connect to virtual switch; ports start untagged on VLAN 1
+    int port = vswitch_add_port(hypervisor.vswitch, virtual_nic_switch_notify, nic);
+    if (port < 0) {
+        printk("virtio-net: virtual switch full, %s has no network\n", vm->name);
+        return NULL;
+    }
+    nic->switch_port = port;
+    nic->connected = true;
     
     vm->devices.network = nic;
     
     return nic;
 }
 
+uint32_t virtual_nic_process_tx(virtual_nic_t* nic);
+uint32_t virtual_nic_process_rx(virtual_nic_t* nic);
+
+// Moves frames both ways between the guest and its switch port
+void virtual_nic_thread(virtual_nic_t* nic) {
+    while (nic->connected) {
+        wait_for_device_event(nic->kick_fd);
+        virtual_nic_process_tx(nic);
+        virtual_nic_process_rx(nic);
+    }
+    
+    vswitch_pkt_free(hypervisor.vswitch, nic->switch_port, nic->rx_pending, nic->rx_pending_count);
+    nic->rx_pending_count = 0;
+    vswitch_remove_port(hypervisor.vswitch, nic->switch_port);
+}
+
+// Guest wrote a queue's ring addresses and set DRIVER_OK
+int virtual_nic_setup_queue(virtual_nic_t* nic, uint32_t queue, uint16_t size,
+                            uint64_t desc_gpa, uint64_t driver_gpa, uint64_t device_gpa) {
+    // virtio-net: queue 0 is receive, queue 1 is transmit
+    virtqueue_t* vq = queue == 0 ? &nic->rx_queue : &nic->tx_queue;
+    
+    if (virtqueue_init(vq, size ? size : VIRTIO_NET_QUEUE_SIZE, nic->features,
+                       vm_translate_gpa, nic->vm) != 0 ||
+        virtqueue_set_rings(vq, desc_gpa, driver_gpa, device_gpa) != 0) {
+        printk("virtio-net: bad queue %u setup on %s\n", queue, nic->vm->name);
+        return -1;
+    }
+    
+    // The port thread starts once both directions exist
+    nic->queues_ready |= 1u << (queue == 0 ? 0 : 1);
+    if (nic->queues_ready == 3) {
+        vswitch_rx_arm(hypervisor.vswitch, nic->switch_port);
+        create_device_thread(virtual_nic_thread, nic);
+    }
+    
+    return 0;
+}
+
+/*
+ * Guest kicked the transmit queue. Kicks stay off while we drain, and each
+ * burst is completed with one used-ring update and at most one interrupt.
+ * Frames are copied once, without their virtio-net header, into switch
+ * packets and switched as a burst.
+ */
+uint32_t virtual_nic_process_tx(virtual_nic_t* nic) {
+    virtqueue_t* vq = &nic->tx_queue;
+    uint32_t total = 0;
+    
+    do {
+        virtqueue_disable_notify(vq);
+        
+        uint32_t count;
+        do {
+            count = virtqueue_pop_burst(vq, nic->tx_burst, VIRTIO_NET_BURST);
+            if (count == 0) {
+                break;
+            }
+            
+            uint32_t pkts = vswitch_pkt_alloc(hypervisor.vswitch, nic->switch_port,
+                                              nic->tx_pkts, count);
+            for (uint32_t i = 0; i < pkts; i++) {
+                vswitch_pkt_t* pkt = nic->tx_pkts[i];
+                pkt->len = vq_elem_copy_from_at(&nic->tx_burst[i], VIRTIO_NET_HDR_LEN,
+                                                vswitch_pkt_frame(pkt), VSWITCH_PKT_DATA);
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                nic->tx_burst[i].used_len = 0;
+            }
+            
+            // Guest buffers go back before the switch touches the packets
+            virtqueue_push_burst(vq, nic->tx_burst, count);
+            if (virtqueue_should_notify(vq)) {
+                inject_virtio_interrupt(nic->vm, nic, 1);
+            }
+            
+            vswitch_tx_burst(hypervisor.vswitch, nic->switch_port, nic->tx_pkts, pkts);
+            nic->tx_dropped += count - pkts;
+            total += pkts;
+        } while (count == VIRTIO_NET_BURST);
+        
+        // Re-arm kicks, then catch anything queued while they were off
+    } while (virtqueue_enable_notify(vq));
+    
+    if (vq->broken) {
+        printk("virtio-net: transmit queue broken on %s\n", nic->vm->name);
+    }
+    
+    nic->packets_sent += total;
+    return total;
+}
+
+/*
+ * Drain the switch port into posted receive buffers, each frame behind a
+ * zeroed virtio-net header. When the guest runs out of buffers, frames
+ * stay queued on the port and its ring pushes back on the senders; the
+ * guest's next receive kick resumes delivery.
+ */
+uint32_t virtual_nic_process_rx(virtual_nic_t* nic) {
+    static const uint8_t net_hdr[VIRTIO_NET_HDR_LEN] = {0};
+    virtqueue_t* vq = &nic->rx_queue;
+    uint32_t total = 0;
+    
+    for (;;) {
+        bool stalled = false;
+        
+        for (;;) {
+            uint32_t pending = nic->rx_pending_count;
+            pending += vswitch_rx_burst(hypervisor.vswitch, nic->switch_port,
+                                        nic->rx_pending + pending, VIRTIO_NET_BURST - pending);
+            nic->rx_pending_count = pending;
+            if (pending == 0) {
+                break;
+            }
+            
+            uint32_t got = virtqueue_pop_burst(vq, nic->rx_burst, pending);
+            for (uint32_t i = 0; i < got; i++) {
+                struct iovec iov[4] = {{(void*)net_hdr, VIRTIO_NET_HDR_LEN}};
+                uint32_t n = vswitch_pkt_egress(hypervisor.vswitch, nic->switch_port,
+                                                nic->rx_pending[i], &iov[1]);
+                vq_elem_copy_to_iov(&nic->rx_burst[i], iov, n + 1);
+            }
+            virtqueue_push_burst(vq, nic->rx_burst, got);
+            
+            vswitch_pkt_free(hypervisor.vswitch, nic->switch_port, nic->rx_pending, got);
+            memmove(nic->rx_pending, nic->rx_pending + got,
+                    (pending - got) * sizeof(nic->rx_pending[0]));
+            nic->rx_pending_count = pending - got;
+            total += got;
+            
+            if (got < pending) {
+                stalled = true;
+                break;
+            }
+        }
+        
+        // Re-arm whichever side we are waiting on, then catch a late arrival
+        if (stalled ? !virtqueue_enable_notify(vq)
+                    : !vswitch_rx_arm(hypervisor.vswitch, nic->switch_port)) {
+            break;
+        }
+    }
+    
+    // One interrupt for everything delivered in this pass
+    if (total && virtqueue_should_notify(vq)) {
+        inject_virtio_interrupt(nic->vm, nic, 0);
+    }
+    
+    nic->packets_received += total;
+    return total;
+}
+
+// Memory balloon and free page reporting
+#define VIRTIO_BALLOON_QUEUE_SIZE 128
+#define VIRTIO_BALLOON_BURST 16
+#define VIRTIO_BALLOON_PFN_SHIFT 12         // PFNs are in 4KB units whatever the guest's page size
+#define VIRTIO_BALLOON_PFN_CHUNK 256        // PFNs read from a buffer at a time
+#define VIRTIO_BALLOON_STATS_MAX 16
+#define VIRTIO_BALLOON_HEADROOM 10          // Percent of the guest left free when reclaiming
+#define VIRTIO_BALLOON_STEP 8               // At most 1/8 of the guest per reclaim
+
+#define VIRTIO_BALLOON_F_STATS_VQ 1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM 2
+#define VIRTIO_BALLOON_F_PAGE_REPORTING 5
+
+// Statistics tags
+#define VIRTIO_BALLOON_S_MEMFREE 4
+#define VIRTIO_BALLOON_S_MEMTOT 5
+#define VIRTIO_BALLOON_S_AVAIL 6
+
+// Config space offsets
+#define VIRTIO_BALLOON_CFG_NUM_PAGES 0      // Target, set by the host
+#define VIRTIO_BALLOON_CFG_ACTUAL 4         // Pages in the balloon, set by the guest
+
+enum {
+    BALLOON_INFLATE,
+    BALLOON_DEFLATE,
+    BALLOON_STATS,
+    BALLOON_REPORTING,
+    BALLOON_QUEUES
+};
+
+typedef struct {
+    uint16_t tag;
+    uint64_t val;
+} __attribute__((packed)) virtio_balloon_stat_t;
+
+typedef struct virtio_balloon {
+    vm_t* vm;
+    uint64_t features;      // Negotiated with the guest driver
+    virtqueue_t queues[BALLOON_QUEUES];
+    uint32_t queues_ready;  // Bit per role set up by the guest
+    int kick_fd;            // Guest kicks, and host requests for statistics
+    bool running;
+    
+    // Config space
+    uint32_t target_pages;
+    uint32_t actual_pages;
+    
+    // The guest's own view of its memory, from the statistics queue
+    vq_elem_t stats_elem;   // Held until fresh numbers are wanted
+    bool stats_held;
+    bool stats_wanted;
+    uint64_t guest_free;
+    uint64_t guest_available;
+    
+    // Bit per page inflated but held until its 2MB unit is complete
+    uint64_t* held;
+    
+    vq_elem_t burst[VIRTIO_BALLOON_BURST];
+    uint64_t inflated_pages;    // As the guest counts them
+    uint64_t deflated_pages;
+    uint64_t reported_pages;
+    uint64_t reclaimed_bytes;   // Host memory those actually freed
+} virtio_balloon_t;
+
+// NULL if it cannot be set up; the guest then runs without a balloon
+virtio_balloon_t* create_virtual_balloon(vm_t* vm) {
+    virtio_balloon_t* balloon = allocate_virtual_device();
+    if (!balloon) {
+        return NULL;
+    }
+    balloon->vm = vm;
+    
+    uint64_t bitmap_size = (vm->memory_size / PAGE_SIZE + 63) / 64 * sizeof(uint64_t);
+    balloon->held = allocate_contiguous_memory(bitmap_size);
+    if (!balloon->held) {
+        printk("ERROR: No memory for the balloon of %s\n", vm->name);
+        free_virtual_device(balloon);
+        return NULL;
+    }
+    memset(balloon->held, 0, bitmap_size);
+    balloon->kick_fd = create_ioeventfd(vm);
+    
+    vm->devices.balloon = balloon;
+    
+    return balloon;
+}
+
+// Queues are numbered in order, skipping those whose feature was not negotiated
+static int virtio_balloon_queue_role(virtio_balloon_t* balloon, uint32_t queue) {
+    bool stats = balloon->features & (1ULL << VIRTIO_BALLOON_F_STATS_VQ);
+    bool reporting = balloon->features & (1ULL << VIRTIO_BALLOON_F_PAGE_REPORTING);
+    
+    if (queue < BALLOON_STATS) {
+        return queue;
+    }
+    if (stats && queue == 2) {
+        return BALLOON_STATS;
+    }
+    if (reporting && queue == (stats ? 3u : 2u)) {
+        return BALLOON_REPORTING;
+    }
+    return -1;
+}
+
+uint32_t virtio_balloon_config_read(virtio_balloon_t* balloon, uint32_t offset) {
+    switch (offset) {
+        case VIRTIO_BALLOON_CFG_NUM_PAGES:
+            return balloon->target_pages;
+        case VIRTIO_BALLOON_CFG_ACTUAL:
+            return balloon->actual_pages;
+        default:
+            return 0;
+    }
+}
+
+void virtio_balloon_config_write(virtio_balloon_t* balloon, uint32_t offset, uint32_t value) {
+    if (offset == VIRTIO_BALLOON_CFG_ACTUAL) {
+        balloon->actual_pages = value;
+    }
+}
+
+/*
+ * An inflated page. On 4KB backing the host takes it back at once. Under a
+ * huge leaf, or not yet populated, it is held until the rest of its 2MB
+ * unit is in the balloon too: taking it alone would split the leaf and free
+ * nothing until the guest gave up all 512 pages anyway. The guest inflates
+ * a few hundred scattered pages per buffer, so that is never soon.
+ */
+static uint64_t virtio_balloon_inflate_page(virtio_balloon_t* balloon, uint64_t gpa) {
+    vm_t* vm = balloon->vm;
+    uint64_t page = gpa / PAGE_SIZE;
+    uint64_t leaf = 0;
+    uint64_t freed = 0;
+    
+    // A partial unit at the end of memory has no huge page to wait for
+    if ((gpa | ((1ULL << GUEST_MEMORY_2M_SHIFT) - 1)) >= vm->memory_size) {
+        return reclaim_guest_range(vm, gpa, PAGE_SIZE);
+    }
+    if (guest_memory_lookup(vm->memory, gpa, &leaf) && leaf == PAGE_SIZE) {
+        freed = reclaim_guest_range(vm, gpa, PAGE_SIZE);
+    }
+    
+    // Counted either way, so a unit already split still completes
+    balloon->held[page / 64] |= 1ULL << (page % 64);
+    
+    uint64_t* unit = &balloon->held[(gpa >> GUEST_MEMORY_2M_SHIFT) * 8];
+    for (uint32_t i = 0; i < 8; i++) {
+        if (unit[i] != ~0ULL) {
+            return freed;
+        }
+    }
+    memset(unit, 0, 8 * sizeof(uint64_t));
+    return freed + reclaim_guest_range(vm, gpa & ~((1ULL << GUEST_MEMORY_2M_SHIFT) - 1),
+                                       1ULL << GUEST_MEMORY_2M_SHIFT);
+}
+
+// A deflated page still held is simply the guest's again, mapped as it was
+static void virtio_balloon_deflate_page(virtio_balloon_t* balloon, uint64_t gpa) {
+    uint64_t page = gpa / PAGE_SIZE;
+    
+    if (gpa < balloon->vm->memory_size) {
+        balloon->held[page / 64] &= ~(1ULL << (page % 64));
+    }
+}
+
+/*
+ * Inflate: every PFN is a page the guest no longer uses, and the host takes
+ * it back, at once or with the rest of its huge page. Deflate: the guest
+ * wants pages back. Nothing is mapped yet; each page gets a fresh frame on
+ * the guest's first write to it.
+ */
+static uint32_t virtio_balloon_process_pfns(virtio_balloon_t* balloon, virtqueue_t* vq, bool inflate) {
+    uint32_t pfns[VIRTIO_BALLOON_PFN_CHUNK];
+    uint32_t total = 0;
+    uint64_t reclaimed = 0;
+    
+    do {
+        virtqueue_disable_notify(vq);
+        
+        uint32_t count;
+        while ((count = virtqueue_pop_burst(vq, balloon->burst, VIRTIO_BALLOON_BURST)) > 0) {
+            for (uint32_t i = 0; i < count; i++) {
+                vq_elem_t* elem = &balloon->burst[i];
+                
+                for (uint32_t skip = 0; skip < elem->out_len; ) {
+                    uint32_t n = vq_elem_copy_from_at(elem, skip, pfns, sizeof(pfns)) / sizeof(uint32_t);
+                    if (n == 0) {
+                        break;
+                    }
+                    for (uint32_t j = 0; j < n; j++) {
+                        uint64_t gpa = (uint64_t)pfns[j] << VIRTIO_BALLOON_PFN_SHIFT;
+                        
+                        if (inflate) {
+                            reclaimed += virtio_balloon_inflate_page(balloon, gpa);
+                        } else {
+                            virtio_balloon_deflate_page(balloon, gpa);
+                        }
+                    }
+                    skip += n * sizeof(uint32_t);
+                }
+                
+                total += elem->out_len / sizeof(uint32_t);
+                elem->used_len = 0;
+            }
+            
+            virtqueue_push_burst(vq, balloon->burst, count);
+            if (virtqueue_should_notify(vq)) {
+                inject_virtio_interrupt(balloon->vm, balloon, inflate ? 0 : 1);
+            }
+        }
+    } while (virtqueue_enable_notify(vq));
+    
+    if (inflate) {
+        balloon->inflated_pages += total;
+        balloon->reclaimed_bytes += reclaimed;
+    } else {
+        balloon->deflated_pages += total;
+    }
+    return total;
+}
+
+/*
+ * Free page reporting: each buffer segment is a block the guest's allocator
+ * has free, 2MB or more and aligned to its size with the usual reporting
+ * order, so huge pages go whole. Reported pages are the guest's again once
+ * the buffer is returned, so none are held back.
+ */
+static uint32_t virtio_balloon_process_reports(virtio_balloon_t* balloon) {
+    virtqueue_t* vq = &balloon->queues[BALLOON_REPORTING];
+    vm_t* vm = balloon->vm;
+    uint32_t total = 0;
+    uint64_t reclaimed = 0;
+    
+    do {
+        virtqueue_disable_notify(vq);
+        
+        uint32_t count;
+        while ((count = virtqueue_pop_burst(vq, balloon->burst, VIRTIO_BALLOON_BURST)) > 0) {
+            for (uint32_t i = 0; i < count; i++) {
+                vq_elem_t* elem = &balloon->burst[i];
+                
+                for (uint32_t s = elem->out_num; s < elem->out_num + elem->in_num; s++) {
+                    uint64_t gpa = (uint8_t*)elem->segs[s].base - (uint8_t*)vm->memory_base;
+                    reclaimed += reclaim_guest_range(vm, gpa, elem->segs[s].len);
+                    total += elem->segs[s].len / PAGE_SIZE;
+                }
+                elem->used_len = 0;
+            }
+            
+            virtqueue_push_burst(vq, balloon->burst, count);
+            if (virtqueue_should_notify(vq)) {
+                inject_virtio_interrupt(vm, balloon, BALLOON_REPORTING);
+            }
+        }
+    } while (virtqueue_enable_notify(vq));
+    
+    balloon->reported_pages += total;
+    balloon->reclaimed_bytes += reclaimed;
+    return total;
+}
+
+/*
+ * The guest posts its statistics in a buffer that we hold on to. Returning
+ * it asks for the next update.
+ */
+static void virtio_balloon_process_stats(virtio_balloon_t* balloon) {
+    virtqueue_t* vq = &balloon->queues[BALLOON_STATS];
+    virtio_balloon_stat_t stats[VIRTIO_BALLOON_STATS_MAX];
+    
+    if (!balloon->stats_held && virtqueue_pop_burst(vq, &balloon->stats_elem, 1) == 1) {
+        uint32_t n = vq_elem_copy_from(&balloon->stats_elem, stats, sizeof(stats)) / sizeof(stats[0]);
+        for (uint32_t i = 0; i < n; i++) {
+            if (stats[i].tag == VIRTIO_BALLOON_S_MEMFREE) {
+                balloon->guest_free = stats[i].val;
+            } else if (stats[i].tag == VIRTIO_BALLOON_S_AVAIL) {
+                balloon->guest_available = stats[i].val;
+            }
+        }
+        balloon->stats_held = true;
+    }
+    
+    if (balloon->stats_held && __atomic_exchange_n(&balloon->stats_wanted, false, __ATOMIC_ACQ_REL)) {
+        balloon->stats_elem.used_len = 0;
+        virtqueue_push_burst(vq, &balloon->stats_elem, 1);
+        balloon->stats_held = false;
+        if (virtqueue_should_notify(vq)) {
+            inject_virtio_interrupt(balloon->vm, balloon, BALLOON_STATS);
+        }
+    }
+}
+
+void virtio_balloon_thread(virtio_balloon_t* balloon) {
+    while (balloon->running) {
+        wait_for_device_event(balloon->kick_fd);
+        virtio_balloon_process_pfns(balloon, &balloon->queues[BALLOON_INFLATE], true);
+        virtio_balloon_process_pfns(balloon, &balloon->queues[BALLOON_DEFLATE], false);
+        if (balloon->queues_ready & (1u << BALLOON_STATS)) {
+            virtio_balloon_process_stats(balloon);
+        }
+        if (balloon->queues_ready & (1u << BALLOON_REPORTING)) {
+            virtio_balloon_process_reports(balloon);
+        }
+    }
+}
+
+// Guest wrote a queue's ring addresses and set DRIVER_OK
+int virtio_balloon_setup_queue(virtio_balloon_t* balloon, uint32_t queue, uint16_t size,
+                               uint64_t desc_gpa, uint64_t driver_gpa, uint64_t device_gpa) {
+    int role = virtio_balloon_queue_role(balloon, queue);
+    if (role < 0) {
+        return -1;
+    }
+    
+    virtqueue_t* vq = &balloon->queues[role];
+    if (virtqueue_init(vq, size ? size : VIRTIO_BALLOON_QUEUE_SIZE, balloon->features,
+                       vm_translate_gpa, balloon->vm) != 0 ||
+        virtqueue_set_rings(vq, desc_gpa, driver_gpa, device_gpa) != 0) {
+        printk("virtio-balloon: bad queue %u setup on %s\n", queue, balloon->vm->name);
+        return -1;
+    }
+    
+    // The device thread starts once every negotiated queue exists
+    uint32_t wanted = (1u << BALLOON_INFLATE) | (1u << BALLOON_DEFLATE);
+    if (balloon->features & (1ULL << VIRTIO_BALLOON_F_STATS_VQ)) {
+        wanted |= 1u << BALLOON_STATS;
+    }
+    if (balloon->features & (1ULL << VIRTIO_BALLOON_F_PAGE_REPORTING)) {
+        wanted |= 1u << BALLOON_REPORTING;
+    }
+    balloon->queues_ready |= 1u << role;
+    if (balloon->queues_ready == wanted && !balloon->running) {
+        balloon->running = true;
+        create_device_thread(virtio_balloon_thread, balloon);
+    }
+    
+    return 0;
+}
+
+// Ask the guest to hold bytes of its memory in the balloon
+int set_vm_balloon_target(vm_t* vm, uint64_t bytes) {
+    virtio_balloon_t* balloon = vm->devices.balloon;
+    if (!balloon || !balloon->running) {
+        return -1;
+    }
+    
+    if (bytes > vm->memory_size) {
+        bytes = vm->memory_size;
+    }
+    balloon->target_pages = bytes >> VIRTIO_BALLOON_PFN_SHIFT;
+    inject_virtio_config_interrupt(vm, balloon);
+    
+    printk("virtio-balloon: %s target %llu MB\n", vm->name, bytes / (1024*1024));
+    return 0;
+}
+
+/*
+ * Take memory back from a guest without stopping it: inflate the balloon by
+ * what the guest last reported it could spare, keeping some headroom, and
+ * ask for fresh statistics for the next round. Pages the guest frees on its
+ * own come back through free page reporting whatever the target.
+ */
+int reclaim_vm_memory(vm_t* vm) {
+    virtio_balloon_t* balloon = vm->devices.balloon;
+    if (!balloon || !balloon->running) {
+        return -1;
+    }
+    
+    __atomic_store_n(&balloon->stats_wanted, true, __ATOMIC_RELEASE);
+    signal_device_event(balloon->kick_fd);
+    
+    uint64_t headroom = vm->memory_size / 100 * VIRTIO_BALLOON_HEADROOM;
+    uint64_t spare = balloon->guest_available > headroom ? balloon->guest_available - headroom : 0;
+    if (spare > vm->memory_size / VIRTIO_BALLOON_STEP) {
+        spare = vm->memory_size / VIRTIO_BALLOON_STEP;
+    }
+    if (spare < PAGE_SIZE) {
+        return 0;
+    }
+    
+    return set_vm_balloon_target(vm, ((uint64_t)balloon->target_pages << VIRTIO_BALLOON_PFN_SHIFT) + spare);
+}
+
 /* ==================== INTER-VM COMMUNICATION ==================== */
 
 typedef struct {
@@ -522,6 +2116,19 @@ int start_vm(vm_t* vm) {
     vm->is_running = true;
     vm->uptime_ns = 0;
     
+    // vCPUs run when the scheduler on some pCPU picks them
+    vm_load_init(&vm->load, vm->num_vcpus);
+    vm->sched_vm = vcpu_sched_add_vm(hypervisor.scheduler, vm, VCPU_SCHED_DEFAULT_WEIGHT);
+    vcpu_sched_set_gang(hypervisor.scheduler, vm->sched_vm, vm->co_schedule);
+    for (uint32_t i = 0; i < vm->num_vcpus; i++) {
+        vm->vcpus[i]->sched = vcpu_sched_add_vcpu(hypervisor.scheduler, vm->sched_vm, vm->vcpus[i]);
+        if (vm->num_vcpus > 1) {
+            // A spinning vCPU exits instead of burning its slice (pause filter on AMD)
+            enable_pause_loop_exiting(vm->vcpus[i], PLE_GAP, PLE_WINDOW);
+        }
+        wake_vm_vcpu(vm->vcpus[i]);
+    }
+    
     // Start quantum acceleration if available
     if (hypervisor.quantum_enabled && vm->use_quantum) {
         vm->quantum_accelerator = init_quantum_accelerator(vm);
@@ -551,6 +2158,22 @@ int pause_vm(vm_t* vm) {
     return 0;
 }
 
+int resume_vm(vm_t* vm) {
+    if (!vm || !vm->is_running || !vm->is_paused) {
+        return -1;
+    }
+    
+    vm->is_paused = false;
+    
+    for (uint32_t i = 0; i < vm->num_vcpus; i++) {
+        resume_vcpu(vm->vcpus[i]);
+        wake_vm_vcpu(vm->vcpus[i]);
+    }
+    
+    printk("VM resumed: %s\n", vm->name);
+    return 0;
+}
+
 int stop_vm(vm_t* vm) {
     if (!vm) {
         return -1;
@@ -562,6 +2185,15 @@ int stop_vm(vm_t* vm) {
     for (uint32_t i = 0; i < vm->num_vcpus; i++) {
         vm->vcpus[i]->is_running = false;
         stop_vcpu_thread(vm->vcpus[i]);
+        vcpu_sched_remove_vcpu(hypervisor.scheduler, vm->vcpus[i]->sched);
+        vm->vcpus[i]->sched = NULL;
+    }
+    vcpu_sched_remove_vm(hypervisor.scheduler, vm->sched_vm);
+    
+    // Merged pages get private copies back before the memory goes
+    if (vm->merge_region >= 0) {
+        page_merge_remove_region(hypervisor.page_merge, vm->merge_region);
+        vm->merge_region = -1;
     }
     
     // Cleanup devices
@@ -580,33 +2212,120 @@ int stop_vm(vm_t* vm) {
 
 /* ==================== LIVE MIGRATION ==================== */
 
+#define MIGRATION_POSTCOPY_MIN_MEMORY (64ULL << 30)   // Larger guests switch to post-copy
+#define MIGRATION_POSTCOPY_ROUNDS 2
+
+// Pages written since the last round, by vCPUs (PML / EPT dirty bits) and by device DMA
+static void migration_sync_dirty_log(void* ctx) {
+    vm_t* vm = ctx;
+    collect_dirty_pages(vm, (void (*)(void*, uint64_t, uint64_t))migration_mark_dirty,
+                        vm->migration);
+}
+
+static void migration_set_throttle(void* ctx, uint32_t percent) {
+    vm_t* vm = ctx;
+    vm->throttle_percent = percent;
+    vcpu_sched_set_cap(hypervisor.scheduler, vm->sched_vm, percent ? 100 - percent : 0);
+    printk("Migration of %s: throttling vCPUs by %u%%\n", vm->name, percent);
+}
+
+static void migration_pause(void* ctx) {
+    pause_vm(ctx);
+}
+
+static uint32_t migration_save_state(void* ctx, void* buf, uint32_t max) {
+    return save_vm_state(ctx, buf, max);
+}
+
+static bool migration_page_populated(void* ctx, uint64_t page) {
+    return guest_page_populated(ctx, page * PAGE_SIZE);
+}
+
+/*
+ * Pre-copy until what is left fits in the downtime target, throttling the
+ * guest if it dirties memory faster than we can send it, then pause and
+ * send the rest with the device state. On failure the guest resumes here.
+ *
+ * Large guests would take too long to converge (or need heavy throttling),
+ * so after a couple of rounds they switch to post-copy: the destination
+ * starts the guest and pulls the pages it faults on while the rest
+ * streams in. Once switched, a failure loses the guest.
+ */
 int migrate_vm(vm_t* vm, const char* destination_host) {
     printk("Starting live migration of %s to %s\n", vm->name, destination_host);
     
-    // Phase 1: Pre-copy memory
-    while (vm->is_running) {
-        copy_dirty_pages(vm, destination_host);
-        
-        if (get_dirty_page_count(vm) < 1000) {
-            break;  // Few enough dirty pages to proceed
-        }
+    migration_params_t params;
+    migration_default_params(&params);
+    if (vm->memory_size >= MIGRATION_POSTCOPY_MIN_MEMORY) {
+        params.postcopy = true;
+        params.postcopy_after_rounds = MIGRATION_POSTCOPY_ROUNDS;
     }
     
-    // Phase 2: Stop and copy
-    pause_vm(vm);
+    // One connection per transfer thread
+    int fds[MIGRATION_MAX_CHANNELS];
+    params.channels = connect_migration_channels(destination_host, fds, params.channels);
+    if (params.channels == 0) {
+        printk("ERROR: Cannot reach %s\n", destination_host);
+        return -1;
+    }
     
-    // Copy final state
-    copy_vm_state(vm, destination_host);
-    copy_remaining_pages(vm, destination_host);
+    migration_ops_t ops = {
+        .ctx = vm,
+        .sync_dirty_log = migration_sync_dirty_log,
+        .set_throttle = migration_set_throttle,
+        .pause = migration_pause,
+        .save_state = migration_save_state,
+        .populated = migration_page_populated,
+    };
+    vm->migration = migration_create(vm->memory_base, vm->memory_size, fds, &params, &ops);
+    if (!vm->migration) {
+        close_migration_channels(fds, params.channels);
+        return -1;
+    }
     
-    // Phase 3: Activate on destination
-    activate_vm_on_destination(vm, destination_host);
+    enable_dirty_logging(vm);
+    int result = migration_run(vm->migration);
+    disable_dirty_logging(vm);
+    vm->throttle_percent = 0;
+    vcpu_sched_set_cap(hypervisor.scheduler, vm->sched_vm, 0);
+    close_migration_channels(fds, params.channels);
+    
+    migration_stats_t stats;
+    migration_get_stats(vm->migration, &stats);
+    migration_destroy(vm->migration);
+    vm->migration = NULL;
+    
+    if (result != 0 && stats.postcopy) {
+        // Neither side holds all of memory any more
+        printk("ERROR: Post-copy migration of %s failed, guest lost\n", vm->name);
+        stop_vm(vm);
+        free_vm_resources(vm);
+        return -1;
+    }
+    if (result != 0) {
+        printk("Live migration of %s failed, resuming here\n", vm->name);
+        resume_vm(vm);
+        return -1;
+    }
+    
+    // Activate on destination; after post-copy it is already running there
+    if (!stats.postcopy) {
+        activate_vm_on_destination(vm, destination_host);
+    }
     
-    // Phase 4: Cleanup source
+    // Cleanup source
     stop_vm(vm);
     free_vm_resources(vm);
     
     printk("Live migration completed: %s\n", vm->name);
+    printk("  %u rounds, %llu MB sent, downtime %llu ms\n", stats.rounds,
+           stats.bytes_sent / (1024*1024), stats.downtime_ns / 1000000);
+    printk("  %llu zero pages, %llu XBZRLE pages, throttle %u%%\n",
+           stats.zero_pages, stats.xbzrle_pages, stats.throttle);
+    if (stats.postcopy) {
+        printk("  post-copy %llu ms, %llu pages requested on fault\n",
+               stats.postcopy_ns / 1000000, stats.postcopy_requests);
+    }
     return 0;
 }
 
@@ -639,40 +2358,38 @@ void* init_quantum_accelerator(vm_t* vm) {
 
 /* ==================== HYPERVISOR SCHEDULER ==================== */
 
-void hypervisor_scheduler(void) {
+/*
+ * Runs on every physical CPU. Each picks from its own runqueue, or steals
+ * from another when it runs dry, runs the vCPU for its slice and puts it
+ * back; there is no pass over all VMs.
+ */
+void hypervisor_scheduler(uint32_t cpu) {
+    uint64_t optimized_at = 0;
+    
     while (hypervisor.initialized) {
-        uint64_t start_time = get_time_ns();
+        uint64_t slice;
+        sched_vcpu_t* next = vcpu_sched_pick(hypervisor.scheduler, cpu, get_time_ns(), &slice);
         
-        // Schedule all VMs
-        for (uint32_t i = 0; i < hypervisor.num_vms; i++) {
-            vm_t* vm = hypervisor.vms[i];
-            
-            if (!vm || !vm->is_running || vm->is_paused) {
-                continue;
-            }
-            
-            // Use AI to predict VM load
-            vm->predicted_load = predict_vm_load(vm->ai_optimizer);
-            
-            // Allocate time slice based on prediction
-            uint64_t time_slice = calculate_time_slice(vm, vm->predicted_load);
-            
-            // Schedule vCPUs
-            schedule_vm_vcpus(vm, time_slice);
-            
-            // Update metrics
-            update_vm_metrics(vm);
+        if (!next) {
+            // Until kicked, or until a capped vCPU may run again
+            idle_cpu(cpu, slice);
+            continue;
         }
         
-        // Quantum optimization of resource allocation
-        if (hypervisor.quantum_enabled) {
-            optimize_resource_allocation_quantum();
+        vcpu_t* vcpu = vcpu_sched_owner(next);
+        vm_t* vm = vcpu->vm;
+        vcpu_stop_t why = VCPU_SCHED_BLOCKED;
+        if (vcpu->is_running && !vm->is_paused) {
+            // Preemption timer armed for slice; a kick ends it early
+            why = dispatch_vcpu(vcpu, slice);
         }
+        vcpu_sched_put(hypervisor.scheduler, cpu, next, get_time_ns(), why);
         
-        // Sleep until next scheduling quantum
-        uint64_t elapsed = get_time_ns() - start_time;
-        if (elapsed < hypervisor.schedule_quantum_ns) {
-            sleep_ns(hypervisor.schedule_quantum_ns - elapsed);
+        // Quantum optimization of resource allocation
+        if (cpu == 0 && hypervisor.quantum_enabled &&
+            get_time_ns() - optimized_at >= hypervisor.schedule_quantum_ns) {
+            optimize_resource_allocation_quantum();
+            optimized_at = get_time_ns();
         }
     }
 }
@@ -703,8 +2420,10 @@ int qenex_hypervisor_main(void) {
     start_vm(unix_vm);
     start_vm(windows_vm);
     
-    // Start scheduler
-    create_thread(hypervisor_scheduler);
+    // Start a scheduler on every physical CPU
+    for (uint32_t cpu = 0; cpu < hypervisor.total_cpus && cpu < VCPU_SCHED_MAX_CPUS; cpu++) {
+        create_cpu_thread(cpu, hypervisor_scheduler);
+    }
     
     printk("\n");
     printk("QENEX Hypervisor running\n");
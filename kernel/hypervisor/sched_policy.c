@@ -0,0 +1,76 @@
+/*
+ * QENEX Hypervisor - Scheduling Policy
+ *
+ * Load prediction and time slice selection for a VM. See sched_policy.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "sched_policy.h"
+
+#define LEVEL_GAIN 0.3          // Weight of a new sample in the level
+#define TREND_GAIN 0.1          // Weight of a new level change in the trend
+
+void vm_load_init(vm_load_t* load, uint32_t vcpus) {
+    memset(load, 0, sizeof(*load));
+    load->vcpus = vcpus ? vcpus : 1;
+
+    // Until there is a sample, expect a booting guest: all vCPUs busy
+    load->level = load->predicted = load->vcpus;
+    load->slice_ns = calculate_time_slice(load, load->predicted);
+}
+
+// Busy vCPUs expected over the next interval, from runtime_ns, the VM's CPU time so far
+double predict_vm_load(vm_load_t* load, uint64_t runtime_ns, uint64_t now) {
+    if (!load->sampled_at || now <= load->sampled_at) {
+        load->sampled_at = load->sampled_at ? load->sampled_at : now;
+        load->sampled_runtime = runtime_ns;
+        return load->predicted;
+    }
+
+    double busy = (double)(runtime_ns - load->sampled_runtime) / (now - load->sampled_at);
+    load->sampled_at = now;
+    load->sampled_runtime = runtime_ns;
+    busy = busy > load->vcpus ? load->vcpus : busy;
+
+    double previous = load->level;
+    load->level = LEVEL_GAIN * busy + (1 - LEVEL_GAIN) * (load->level + load->trend);
+    load->trend = TREND_GAIN * (load->level - previous) + (1 - TREND_GAIN) * load->trend;
+
+    double predicted = load->level + load->trend;
+    load->predicted = predicted < 0 ? 0 : predicted > load->vcpus ? load->vcpus : predicted;
+    return load->predicted;
+}
+
+// Grows with the square of how busy each vCPU is, so only VMs that are nearly CPU-bound get long slices
+uint64_t calculate_time_slice(const vm_load_t* load, double predicted_load) {
+    double busy = predicted_load / load->vcpus;
+
+    busy = busy < 0 ? 0 : busy > 1 ? 1 : busy;
+    return SCHED_POLICY_MIN_SLICE_NS +
+           (uint64_t)((SCHED_POLICY_MAX_SLICE_NS - SCHED_POLICY_MIN_SLICE_NS) * busy * busy);
+}
+
+/*
+ * Re-predict if interval_ns has passed since the last time. Any pCPU may
+ * call this; one wins and does the work, the others return false at once.
+ */
+bool vm_load_refresh(vm_load_t* load, uint64_t runtime_ns, uint64_t now, uint64_t interval_ns) {
+    uint64_t last = __atomic_load_n(&load->refreshed_at, __ATOMIC_ACQUIRE);
+
+    if (now - last < interval_ns ||
+        !__atomic_compare_exchange_n(&load->refreshed_at, &last, now, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return false;
+    }
+
+    double predicted = predict_vm_load(load, runtime_ns, now);
+    __atomic_store_n(&load->slice_ns, calculate_time_slice(load, predicted), __ATOMIC_RELAXED);
+    return true;
+}
+
+uint64_t vm_load_slice(const vm_load_t* load) {
+    return __atomic_load_n(&load->slice_ns, __ATOMIC_RELAXED);
+}
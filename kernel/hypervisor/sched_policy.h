@@ -0,0 +1,52 @@
+/*
+ * QENEX Hypervisor - Scheduling Policy
+ *
+ * How long a VM's vCPUs run per dispatch, from a prediction of how busy
+ * the VM is about to be:
+ *
+ *   - predict_vm_load() samples the CPU time the VM's vCPUs used since
+ *     the last sample and smooths it with Holt's linear method (level and
+ *     trend), so a VM that is ramping up is predicted ahead of its
+ *     average. The prediction is in busy vCPUs, 0 to the VM's vCPU count.
+ *   - calculate_time_slice() turns the prediction into a slice. A VM that
+ *     keeps all its vCPUs busy gets long slices, for fewer switches and
+ *     warm caches. One whose vCPUs mostly wait gets short ones, so that
+ *     a burst of computation from it cannot hold a pCPU long; its vCPUs
+ *     usually block well before the slice ends anyway.
+ *   - vm_load_refresh() runs both at most once per interval, by whichever
+ *     pCPU gets there first, and vm_load_slice() reads the result without
+ *     locks.
+ *
+ * The code depends on nothing but the CPU time it is given, so the
+ * hypervisor and the scheduler simulator (sched_sim.c) run the same
+ * policy.
+ */
+
+#ifndef QENEX_SCHED_POLICY_H
+#define QENEX_SCHED_POLICY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SCHED_POLICY_MIN_SLICE_NS 1000000ULL       // 1ms
+#define SCHED_POLICY_MAX_SLICE_NS 10000000ULL      // 10ms
+
+typedef struct {
+    uint32_t vcpus;
+    double level;               // Smoothed busy vCPUs
+    double trend;               // Per sample
+    double predicted;           // Busy vCPUs expected over the next interval
+    uint64_t sampled_at;        // 0 before the first sample
+    uint64_t sampled_runtime;
+    uint64_t refreshed_at;
+    uint64_t slice_ns;
+} vm_load_t;
+
+/* Function prototypes */
+void vm_load_init(vm_load_t* load, uint32_t vcpus);
+double predict_vm_load(vm_load_t* load, uint64_t runtime_ns, uint64_t now);
+uint64_t calculate_time_slice(const vm_load_t* load, double predicted_load);
+bool vm_load_refresh(vm_load_t* load, uint64_t runtime_ns, uint64_t now, uint64_t interval_ns);
+uint64_t vm_load_slice(const vm_load_t* load);
+
+#endif /* QENEX_SCHED_POLICY_H */
@@ -0,0 +1,820 @@
+/*
+ * QENEX Hypervisor - Scheduler Simulator
+ *
+ * Replays per-vCPU demand traces through the vCPU scheduler (vcpu_sched.c)
+ * and the slice policy (sched_policy.c), the same code the hypervisor
+ * runs, on simulated pCPUs in simulated time, and reports fairness,
+ * wake-up latency and utilization. Ten simulated seconds of a few dozen
+ * vCPUs take well under a second, so a policy change can be tried
+ * offline before it goes near a host.
+ *
+ * The simulation is discrete-event: a pCPU only does something when the
+ * vCPU it runs finishes a phase, its slice ends, a pause-loop exit is due
+ * or it is kicked, and an I/O wait ends with a wake-up. It models:
+ *
+ *   - a switch cost on every dispatch, and a cache refill cost when a
+ *     vCPU moves to another pCPU, larger across sockets;
+ *   - a delay between a kick and the pCPU acting on it;
+ *   - one spin lock per VM. A vCPU in a spin phase takes it, or spins
+ *     until it is free; the lock is handed to a spinning sibling that is
+ *     running when it is released. Multi-vCPU VMs get pause-loop exits
+ *     after SIM_PLE_WINDOW_NS of spinning and yield to the likely holder,
+ *     as in the hypervisor;
+ *   - the load prediction sampled every SIM_QUANTUM_NS, the hypervisor's
+ *     schedule_quantum_ns.
+ *
+ * Traces are text, one directive per line, # starts a comment:
+ *
+ *   cpus <n> [sockets <n>]
+ *   vm <name> [weight <n>] [cap <percent>] [gang]
+ *   vcpu <vm> [x<count>] <phase>...
+ *
+ * A phase is cpu:<us> (compute), io:<us> (blocked until a wake-up) or
+ * spin:<us> (compute holding the VM's spin lock, after taking it). A
+ * duration written ~<us> is drawn from an exponential distribution with
+ * that mean each time. A vCPU repeats its phases for as long as the
+ * simulation runs, so a recorded trace is a long list of fixed phases
+ * and a synthetic one a short list of random ones. Without a trace file
+ * the VMs of qenex_hypervisor_main() are simulated next to a batch VM.
+ *
+ * Build: cc -O2 sched_sim.c vcpu_sched.c sched_policy.c -lpthread -lm -o sched_sim
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include "vcpu_sched.h"
+#include "sched_policy.h"
+
+#define SIM_MAX_VCPUS 4096
+#define SIM_SWITCH_NS 1000              // VM exit, entry and state load per dispatch
+#define SIM_MIGRATE_NS 10000            // Cache refill after moving within a socket
+#define SIM_REMOTE_NS 40000             // ... and across sockets
+#define SIM_PLE_WINDOW_NS 2000          // PLE_WINDOW cycles at 2GHz
+#define SIM_KICK_NS 2000                // IPI delivery, and the way out of idle or the guest
+#define SIM_QUANTUM_NS 1000000          // Load prediction interval, as schedule_quantum_ns
+
+static const char* default_trace =
+    "cpus 8\n"
+    "vm ubuntu-server\n"
+    "vcpu ubuntu-server x4 cpu:~200 io:~800         # request/response server\n"
+    "vm windows-11 gang\n"
+    "vcpu windows-11 x8 cpu:~60 spin:~10 io:~500    # lock-heavy desktop\n"
+    "vm batch\n"
+    "vcpu batch x8 cpu:20000                        # CPU-bound\n";
+
+typedef enum {
+    PHASE_CPU,
+    PHASE_IO,
+    PHASE_SPIN
+} phase_kind_t;
+
+typedef struct {
+    phase_kind_t kind;
+    bool random;            // Exponential with mean ns
+    uint64_t ns;
+} phase_t;
+
+typedef struct sim_vcpu sim_vcpu_t;
+
+typedef struct {
+    char name[32];
+    int index;              // In the scheduler
+    uint32_t weight;
+    uint32_t cap;
+    bool gang;
+    uint32_t vcpus;
+    vm_load_t load;
+    sim_vcpu_t* holder;     // Of its spin lock
+    double demand;          // pCPUs it would use unhindered
+
+    // Results
+    uint64_t runtime_ns;
+    uint64_t useful_ns;     // Computing or holding the lock
+    uint64_t spin_ns;
+    uint64_t overhead_ns;   // Switches and cache refills
+    uint64_t ios;
+    uint64_t sections;
+    uint64_t* latency;      // ns from wake-up to dispatch
+    uint64_t latencies;
+    uint64_t latency_max;
+} sim_vm_t;
+
+struct sim_vcpu {
+    sim_vm_t* vm;
+    sched_vcpu_t* sched;
+    phase_t* phases;
+    uint32_t num_phases;
+    uint32_t phase;
+    uint64_t remaining;     // ns of computation left in the phase
+    bool waiting;           // For the lock, spinning when running
+    uint64_t spun;          // ns since the last pause-loop exit
+    uint64_t woke_at;       // 0 once dispatched
+    int last_cpu;           // -1 before its first dispatch
+};
+
+typedef struct {
+    sim_vcpu_t* running;
+    uint64_t since;         // Progress accounted to here
+    uint64_t slice_end;
+    uint64_t stall;         // ns of switch and refill cost left
+    uint32_t seq;           // Only its latest event counts
+    bool kicked;
+    uint64_t busy_ns;
+} sim_cpu_t;
+
+typedef enum {
+    EVENT_CPU,
+    EVENT_WAKE
+} event_kind_t;
+
+typedef struct {
+    uint64_t time;
+    event_kind_t kind;
+    uint32_t id;
+    uint32_t seq;
+} event_t;
+
+typedef struct {
+    vcpu_sched_t* sched;
+    uint32_t cpus;
+    uint32_t sockets;
+    uint64_t fixed_slice;   // Instead of the policy, when set
+    bool ple;
+    uint64_t rng;
+
+    sim_vm_t vms[VCPU_SCHED_MAX_VMS];
+    uint32_t num_vms;
+    sim_vcpu_t vcpus[SIM_MAX_VCPUS];
+    uint32_t num_vcpus;
+    sim_cpu_t cpu[VCPU_SCHED_MAX_CPUS];
+    int active_cpu;         // Being processed; kicks to it are moot
+
+    event_t* events;        // Binary heap on time
+    uint32_t num_events;
+    uint32_t max_events;
+
+    uint64_t switches;
+    uint64_t migrations;
+} sim_t;
+
+static sim_t sim;
+
+/* ==================== EVENTS ==================== */
+
+static void push_event(uint64_t time, event_kind_t kind, uint32_t id, uint32_t seq) {
+    if (sim.num_events == sim.max_events) {
+        sim.max_events = sim.max_events ? sim.max_events * 2 : 1024;
+        sim.events = realloc(sim.events, sizeof(event_t) * sim.max_events);
+        if (!sim.events) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+
+    uint32_t i = sim.num_events++;
+    while (i && sim.events[(i - 1) / 2].time > time) {
+        sim.events[i] = sim.events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    sim.events[i] = (event_t){ .time = time, .kind = kind, .id = id, .seq = seq };
+}
+
+static event_t pop_event(void) {
+    event_t top = sim.events[0];
+    event_t last = sim.events[--sim.num_events];
+    uint32_t i = 0;
+
+    for (;;) {
+        uint32_t child = i * 2 + 1;
+        if (child >= sim.num_events) {
+            break;
+        }
+        if (child + 1 < sim.num_events && sim.events[child + 1].time < sim.events[child].time) {
+            child++;
+        }
+        if (sim.events[child].time >= last.time) {
+            break;
+        }
+        sim.events[i] = sim.events[child];
+        i = child;
+    }
+    sim.events[i] = last;
+    return top;
+}
+
+// Replaces whatever the pCPU had scheduled
+static void schedule_cpu(uint32_t cpu, uint64_t time) {
+    push_event(time, EVENT_CPU, cpu, ++sim.cpu[cpu].seq);
+}
+
+/* ==================== SCHEDULER HOOKS ==================== */
+
+// Same policy and sampling interval as sched_time_slice() in the hypervisor
+static uint64_t sim_time_slice(void* ctx, void* owner, uint64_t now) {
+    sim_vm_t* vm = owner;
+
+    (void)ctx;
+    if (sim.fixed_slice) {
+        return sim.fixed_slice;
+    }
+    vm_load_refresh(&vm->load, vcpu_sched_vm_runtime(sim.sched, vm->index), now, SIM_QUANTUM_NS);
+    return vm_load_slice(&vm->load);
+}
+
+static uint64_t sim_now;
+
+static void sim_kick(void* ctx, uint32_t cpu) {
+    (void)ctx;
+    if ((int)cpu != sim.active_cpu) {
+        sim.cpu[cpu].kicked = true;
+        schedule_cpu(cpu, sim_now + SIM_KICK_NS);
+    }
+}
+
+/* ==================== vCPU PROGRESS ==================== */
+
+static uint64_t random_u64(void) {
+    sim.rng ^= sim.rng << 13;
+    sim.rng ^= sim.rng >> 7;
+    sim.rng ^= sim.rng << 17;
+    return sim.rng;
+}
+
+static uint64_t phase_ns(const phase_t* p) {
+    if (!p->random) {
+        return p->ns;
+    }
+    double u = (random_u64() >> 11) * (1.0 / 9007199254740992.0);
+    uint64_t ns = (uint64_t)(-log(1 - u) * p->ns);
+    return ns ? ns : 1;
+}
+
+static bool take_lock(sim_vcpu_t* v) {
+    if (v->vm->holder) {
+        return false;
+    }
+    v->vm->holder = v;
+    v->waiting = false;
+    return true;
+}
+
+// Waiting for the lock, which it spins on while running
+static inline bool spinning(sim_vcpu_t* v) {
+    return v->phases[v->phase].kind == PHASE_SPIN && v->waiting;
+}
+
+// Account what the vCPU on cpu did since the last look
+static void advance(uint32_t cpu, uint64_t now) {
+    sim_cpu_t* c = &sim.cpu[cpu];
+    sim_vcpu_t* v = c->running;
+    uint64_t elapsed = now - c->since;
+
+    c->since = now;
+    if (!v || !elapsed) {
+        return;
+    }
+    c->busy_ns += elapsed;
+    v->vm->runtime_ns += elapsed;
+
+    uint64_t stall = elapsed < c->stall ? elapsed : c->stall;
+    c->stall -= stall;
+    v->vm->overhead_ns += stall;
+    elapsed -= stall;
+
+    if (spinning(v)) {
+        v->spun += elapsed;
+        v->vm->spin_ns += elapsed;
+    } else {
+        uint64_t work = elapsed < v->remaining ? elapsed : v->remaining;
+        v->remaining -= work;
+        v->vm->useful_ns += work;
+    }
+}
+
+static void release_lock(sim_vcpu_t* v, uint64_t now) {
+    v->vm->holder = NULL;
+    v->vm->sections++;
+
+    // A sibling spinning on a pCPU gets it at once
+    for (uint32_t cpu = 0; cpu < sim.cpus; cpu++) {
+        sim_vcpu_t* s = sim.cpu[cpu].running;
+
+        if (s && s != v && s->vm == v->vm && spinning(s)) {
+            advance(cpu, now);
+            take_lock(s);
+            if ((int)cpu != sim.active_cpu) {
+                schedule_cpu(cpu, now);
+            }
+            return;
+        }
+    }
+}
+
+// Start the vCPU's current phase; false if it is an I/O wait. The lock is only tried once it runs.
+static bool start_phase(sim_vcpu_t* v, uint64_t now) {
+    phase_t* p = &v->phases[v->phase];
+
+    if (p->kind == PHASE_IO) {
+        push_event(now + phase_ns(p), EVENT_WAKE, v - sim.vcpus, 0);
+        return false;
+    }
+    v->remaining = phase_ns(p);
+    if (p->kind == PHASE_SPIN) {
+        v->waiting = true;
+        v->spun = 0;
+    }
+    return true;
+}
+
+// Move past finished phases, taking the lock if running; false if the vCPU blocks
+static bool finish_phases(sim_vcpu_t* v, uint64_t now, bool running) {
+    for (;;) {
+        if (running && spinning(v)) {
+            take_lock(v);
+        }
+        if (spinning(v) || v->remaining) {
+            return true;
+        }
+        if (v->phases[v->phase].kind == PHASE_SPIN) {
+            release_lock(v, now);
+        }
+        v->phase = (v->phase + 1) % v->num_phases;
+        if (!start_phase(v, now)) {
+            return false;
+        }
+    }
+}
+
+/* ==================== pCPU EVENTS ==================== */
+
+static void dispatch(uint32_t cpu, sched_vcpu_t* next, uint64_t now, uint64_t slice) {
+    sim_cpu_t* c = &sim.cpu[cpu];
+    sim_vcpu_t* v = vcpu_sched_owner(next);
+
+    c->running = v;
+    c->since = now;
+    c->slice_end = now + slice;
+    c->stall = SIM_SWITCH_NS;
+    sim.switches++;
+
+    if (v->last_cpu >= 0 && (uint32_t)v->last_cpu != cpu) {
+        bool remote = v->last_cpu * sim.sockets / sim.cpus != cpu * sim.sockets / sim.cpus;
+        c->stall += remote ? SIM_REMOTE_NS : SIM_MIGRATE_NS;
+        sim.migrations++;
+    }
+    v->last_cpu = cpu;
+
+    if (v->woke_at) {
+        sim_vm_t* vm = v->vm;
+        uint64_t latency = now - v->woke_at;
+
+        vm->latency[vm->latencies++ % (1 << 20)] = latency;
+        vm->latency_max = latency > vm->latency_max ? latency : vm->latency_max;
+        v->woke_at = 0;
+    }
+    if (spinning(v)) {
+        take_lock(v);
+    }
+}
+
+// The pCPU's next event: end of phase, of slice, or a pause-loop exit
+static void plan_cpu(uint32_t cpu, uint64_t now) {
+    sim_cpu_t* c = &sim.cpu[cpu];
+    sim_vcpu_t* v = c->running;
+    uint64_t next = c->slice_end;
+
+    if (spinning(v)) {
+        if (sim.ple && v->vm->vcpus > 1) {
+            uint64_t left = v->spun < SIM_PLE_WINDOW_NS ? SIM_PLE_WINDOW_NS - v->spun : 0;
+            next = now + c->stall + left < next ? now + c->stall + left : next;
+        }
+    } else if (now + c->stall + v->remaining < next) {
+        next = now + c->stall + v->remaining;
+    }
+    schedule_cpu(cpu, next > now ? next : now);
+}
+
+static void cpu_event(uint32_t cpu, uint64_t now) {
+    sim_cpu_t* c = &sim.cpu[cpu];
+    sim_vcpu_t* v = c->running;
+
+    sim.active_cpu = cpu;
+    if (v) {
+        vcpu_stop_t why = VCPU_SCHED_PREEMPTED;
+        bool stop = false;
+
+        advance(cpu, now);
+        if (!finish_phases(v, now, true)) {
+            why = VCPU_SCHED_BLOCKED;
+            stop = true;
+        } else if (spinning(v) && sim.ple && v->vm->vcpus > 1 && v->spun >= SIM_PLE_WINDOW_NS) {
+            v->spun = 0;
+            vcpu_sched_yield_to(sim.sched, v->sched, now);
+            why = VCPU_SCHED_YIELDED;
+            stop = true;
+        } else if (now >= c->slice_end || c->kicked) {
+            stop = true;
+        }
+
+        if (stop) {
+            c->running = NULL;
+            vcpu_sched_put(sim.sched, cpu, v->sched, now, why);
+        }
+    }
+    c->kicked = false;
+
+    if (!c->running) {
+        uint64_t slice;
+        sched_vcpu_t* next = vcpu_sched_pick(sim.sched, cpu, now, &slice);
+
+        if (!next) {
+            // Idle until kicked, or until a capped vCPU may run
+            if (slice) {
+                schedule_cpu(cpu, now + slice);
+            }
+            sim.active_cpu = -1;
+            return;
+        }
+        dispatch(cpu, next, now, slice);
+    }
+    plan_cpu(cpu, now);
+    sim.active_cpu = -1;
+}
+
+static void wake_event(sim_vcpu_t* v, uint64_t now) {
+    v->vm->ios++;
+    v->phase = (v->phase + 1) % v->num_phases;
+    if (!start_phase(v, now) || !finish_phases(v, now, false)) {
+        return;
+    }
+    v->woke_at = now;
+    vcpu_sched_wake(sim.sched, v->sched, now);
+}
+
+/* ==================== TRACE PARSING ==================== */
+
+static int parse_error(int line, const char* message, const char* token) {
+    fprintf(stderr, "line %d: %s%s%s\n", line, message, token ? ": " : "", token ? token : "");
+    return -1;
+}
+
+static sim_vm_t* find_vm(const char* name) {
+    for (uint32_t i = 0; i < sim.num_vms; i++) {
+        if (strcmp(sim.vms[i].name, name) == 0) {
+            return &sim.vms[i];
+        }
+    }
+    return NULL;
+}
+
+static int parse_phase(const char* token, phase_t* phase) {
+    static const struct { const char* name; phase_kind_t kind; } kinds[] = {
+        { "cpu:", PHASE_CPU }, { "io:", PHASE_IO }, { "spin:", PHASE_SPIN },
+    };
+
+    for (uint32_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+        size_t len = strlen(kinds[i].name);
+
+        if (strncmp(token, kinds[i].name, len) == 0) {
+            const char* value = token + len;
+            char* end;
+
+            phase->kind = kinds[i].kind;
+            phase->random = *value == '~';
+            double us = strtod(value + phase->random, &end);
+            if (*end || end == value + phase->random || us < 0) {
+                return -1;
+            }
+            phase->ns = (uint64_t)(us * 1000);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int parse_trace(FILE* f) {
+    char* line = NULL;
+    size_t size = 0;
+    int number = 0;
+    int result = 0;
+
+    while (result == 0 && getline(&line, &size, f) >= 0) {
+        char* save;
+        number++;
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char* word = strtok_r(line, " \t\r\n", &save);
+        if (!word) {
+            continue;
+        }
+
+        if (strcmp(word, "cpus") == 0) {
+            char* count = strtok_r(NULL, " \t\r\n", &save);
+            sim.cpus = count ? atoi(count) : 0;
+            if (!sim.cpus || sim.cpus > VCPU_SCHED_MAX_CPUS) {
+                result = parse_error(number, "cpus must be 1 to 256", count);
+                break;
+            }
+            char* key = strtok_r(NULL, " \t\r\n", &save);
+            if (key && strcmp(key, "sockets") == 0) {
+                char* sockets = strtok_r(NULL, " \t\r\n", &save);
+                sim.sockets = sockets ? atoi(sockets) : 0;
+            }
+            if (!sim.sockets || sim.sockets > sim.cpus) {
+                result = parse_error(number, "bad socket count", NULL);
+            }
+        } else if (strcmp(word, "vm") == 0) {
+            char* name = strtok_r(NULL, " \t\r\n", &save);
+            if (!name || find_vm(name) || sim.num_vms == VCPU_SCHED_MAX_VMS) {
+                result = parse_error(number, "missing, duplicate or too many VMs", name);
+                break;
+            }
+            sim_vm_t* vm = &sim.vms[sim.num_vms++];
+            snprintf(vm->name, sizeof(vm->name), "%s", name);
+            vm->weight = VCPU_SCHED_DEFAULT_WEIGHT;
+            for (char* key; (key = strtok_r(NULL, " \t\r\n", &save)); ) {
+                if (strcmp(key, "gang") == 0) {
+                    vm->gang = true;
+                    continue;
+                }
+                char* value = strtok_r(NULL, " \t\r\n", &save);
+                if (value && strcmp(key, "weight") == 0 && atoi(value) > 0) {
+                    vm->weight = atoi(value);
+                } else if (value && strcmp(key, "cap") == 0 && atoi(value) >= 0 && atoi(value) <= 100) {
+                    vm->cap = atoi(value);
+                } else {
+                    result = parse_error(number, "bad VM option", key);
+                    break;
+                }
+            }
+        } else if (strcmp(word, "vcpu") == 0) {
+            char* name = strtok_r(NULL, " \t\r\n", &save);
+            sim_vm_t* vm = name ? find_vm(name) : NULL;
+            if (!vm) {
+                result = parse_error(number, "unknown VM", name);
+                break;
+            }
+
+            uint32_t count = 1;
+            phase_t* phases = NULL;
+            uint32_t num_phases = 0;
+            double busy = 0, total = 0;
+            for (char* token; (token = strtok_r(NULL, " \t\r\n", &save)); ) {
+                if (token[0] == 'x' && num_phases == 0) {
+                    count = atoi(token + 1);
+                    continue;
+                }
+                phases = realloc(phases, sizeof(phase_t) * (num_phases + 1));
+                if (!phases || parse_phase(token, &phases[num_phases]) < 0) {
+                    result = parse_error(number, "bad phase", token);
+                    break;
+                }
+                total += phases[num_phases].ns;
+                busy += phases[num_phases].kind == PHASE_IO ? 0 : phases[num_phases].ns;
+                num_phases++;
+            }
+            if (result == 0 && (!num_phases || total == 0 || !count ||
+                                sim.num_vcpus + count > SIM_MAX_VCPUS)) {
+                result = parse_error(number, "vCPU needs phases of some length, and at most 4096 vCPUs", NULL);
+            }
+            if (result < 0) {
+                free(phases);
+                break;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                sim.vcpus[sim.num_vcpus++] = (sim_vcpu_t){ .vm = vm, .phases = phases, .num_phases = num_phases,
+                                                           .last_cpu = -1 };
+            }
+            vm->vcpus += count;
+            vm->demand += count * busy / total;
+        } else {
+            result = parse_error(number, "unknown directive", word);
+        }
+    }
+    free(line);
+
+    if (result == 0 && !sim.num_vcpus) {
+        result = parse_error(number, "no vCPUs", NULL);
+    }
+    return result;
+}
+
+/* ==================== REPORT ==================== */
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t* sorted, uint64_t count, double p) {
+    return count ? sorted[(uint64_t)(p * (count - 1))] / 1000.0 : 0;
+}
+
+/*
+ * Weighted max-min fair share of each VM, in pCPUs: capacity goes out by
+ * weight, no VM gets more than it asks for (or its cap allows), and what
+ * it leaves is shared among the others the same way.
+ */
+static void fair_shares(double* share) {
+    double capacity = sim.cpus;
+    bool done[VCPU_SCHED_MAX_VMS] = { false };
+
+    for (uint32_t i = 0; i < sim.num_vms; i++) {
+        share[i] = 0;
+    }
+    for (;;) {
+        double weights = 0;
+        for (uint32_t i = 0; i < sim.num_vms; i++) {
+            weights += done[i] ? 0 : sim.vms[i].weight;
+        }
+        if (weights == 0 || capacity <= 1e-9) {
+            return;
+        }
+
+        bool saturated = false;
+        for (uint32_t i = 0; i < sim.num_vms; i++) {
+            sim_vm_t* vm = &sim.vms[i];
+            double limit = vm->cap ? fmin(vm->demand, vm->vcpus * vm->cap / 100.0) : vm->demand;
+
+            if (!done[i] && capacity * vm->weight / weights >= limit) {
+                share[i] = limit;
+                capacity -= limit;
+                done[i] = saturated = true;
+            }
+        }
+        if (!saturated) {
+            for (uint32_t i = 0; i < sim.num_vms; i++) {
+                share[i] = done[i] ? share[i] : capacity * sim.vms[i].weight / weights;
+            }
+            return;
+        }
+    }
+}
+
+static void report(uint64_t duration, double elapsed) {
+    double fair[VCPU_SCHED_MAX_VMS];
+    double sum = 0, squares = 0;
+    uint64_t busy = 0;
+
+    fair_shares(fair);
+    printf("%u pCPUs in %u socket%s, %.1fs simulated in %.2fs, slices %s\n\n", sim.cpus, sim.sockets,
+           sim.sockets > 1 ? "s" : "", duration / 1e9, elapsed, sim.fixed_slice ? "fixed" : "from the policy");
+    printf("%-16s %5s %7s %7s %6s %6s %6s %9s %9s %9s %9s %9s %9s %9s\n", "VM", "vCPUs", "pCPUs", "fair",
+           "useful", "spin", "ovhd", "ios/s", "locks/s", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+
+    for (uint32_t i = 0; i < sim.num_vms; i++) {
+        sim_vm_t* vm = &sim.vms[i];
+        double used = (double)vm->runtime_ns / duration;
+        uint64_t count = vm->latencies < (1 << 20) ? vm->latencies : (1 << 20);
+        double runtime = vm->runtime_ns ? vm->runtime_ns : 1;
+
+        qsort(vm->latency, count, sizeof(uint64_t), compare_u64);
+        printf("%-16s %5u %7.2f %7.2f %5.1f%% %5.1f%% %5.1f%% %9.0f %9.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+               vm->name, vm->vcpus, used, fair[i], 100 * vm->useful_ns / runtime, 100 * vm->spin_ns / runtime,
+               100 * vm->overhead_ns / runtime, vm->ios / (duration / 1e9), vm->sections / (duration / 1e9),
+               percentile_us(vm->latency, count, 0.5), percentile_us(vm->latency, count, 0.9),
+               percentile_us(vm->latency, count, 0.99), percentile_us(vm->latency, count, 0.999),
+               vm->latency_max / 1000.0);
+
+        // Jain's index over received / fair, for VMs entitled to anything
+        if (fair[i] > 0) {
+            double x = used / fair[i];
+            sum += x;
+            squares += x * x;
+        }
+    }
+    for (uint32_t cpu = 0; cpu < sim.cpus; cpu++) {
+        busy += sim.cpu[cpu].busy_ns;
+    }
+
+    vcpu_sched_stats_t stats;
+    vcpu_sched_get_stats(sim.sched, &stats);
+    uint32_t entitled = 0;
+    for (uint32_t i = 0; i < sim.num_vms; i++) {
+        entitled += fair[i] > 0;
+    }
+    printf("\nfairness (Jain, received / fair share): %.3f\n", squares > 0 ? sum * sum / (entitled * squares) : 1.0);
+    printf("utilization: %.1f%% busy; %.0f dispatches/s, %.0f migrations/s\n",
+           100.0 * busy / ((double)duration * sim.cpus), sim.switches / (duration / 1e9),
+           sim.migrations / (duration / 1e9));
+    printf("scheduler: %llu steals, %llu boosts, %llu preemptions, %llu parked, %llu gang pulls, "
+           "%llu directed yields\n", (unsigned long long)stats.steals, (unsigned long long)stats.boosts,
+           (unsigned long long)stats.preemptions, (unsigned long long)stats.parked,
+           (unsigned long long)stats.gang_pulls, (unsigned long long)stats.directed_yields);
+}
+
+/* ==================== MAIN ==================== */
+
+static void usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-t seconds] [-c cpus] [-s sockets] [-f slice_ms] [-n] [-r seed] [trace]\n"
+            "  -t  simulated time (default 10)\n"
+            "  -c  pCPUs, -s sockets: override the trace\n"
+            "  -f  fixed slice instead of calculate_time_slice(), to compare against\n"
+            "  -n  no pause-loop exits\n"
+            "  -r  random seed\n", name);
+}
+
+int main(int argc, char** argv) {
+    double seconds = 10;
+    uint32_t cpus = 0, sockets = 0;
+    int opt;
+
+    sim.ple = true;
+    sim.rng = 88172645463325252ULL;
+    while ((opt = getopt(argc, argv, "t:c:s:f:nr:h")) != -1) {
+        switch (opt) {
+            case 't': seconds = atof(optarg); break;
+            case 'c': cpus = atoi(optarg); break;
+            case 's': sockets = atoi(optarg); break;
+            case 'f': sim.fixed_slice = (uint64_t)(atof(optarg) * 1000000); break;
+            case 'n': sim.ple = false; break;
+            case 'r': sim.rng = strtoull(optarg, NULL, 0) | 1; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    FILE* trace = optind < argc ? fopen(argv[optind], "r") :
+                                  fmemopen((void*)default_trace, strlen(default_trace), "r");
+    if (!trace) {
+        perror(argv[optind]);
+        return 1;
+    }
+    sim.cpus = 4;
+    sim.sockets = 1;
+    int parsed = parse_trace(trace);
+    fclose(trace);
+    if (parsed < 0) {
+        return 1;
+    }
+    sim.cpus = cpus ? cpus : sim.cpus;
+    sim.sockets = sockets ? sockets : sim.sockets;
+    if (sim.cpus > VCPU_SCHED_MAX_CPUS || sim.sockets > sim.cpus || seconds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    vcpu_sched_params_t params;
+    vcpu_sched_default_params(&params, sim.cpus);
+    vcpu_sched_ops_t ops = { .time_slice = sim_time_slice, .kick = sim_kick };
+    sim.sched = vcpu_sched_create(&params, &ops);
+    sim.active_cpu = -1;
+
+    for (uint32_t i = 0; i < sim.num_vms; i++) {
+        sim_vm_t* vm = &sim.vms[i];
+
+        vm->index = vcpu_sched_add_vm(sim.sched, vm, vm->weight);
+        vcpu_sched_set_cap(sim.sched, vm->index, vm->cap);
+        vcpu_sched_set_gang(sim.sched, vm->index, vm->gang);
+        vm_load_init(&vm->load, vm->vcpus);
+        vm->latency = malloc(sizeof(uint64_t) << 20);
+    }
+
+    // Every vCPU begins its first phase at once (time 0 means "never" to the scheduler)
+    sim_now = 1;
+    for (uint32_t i = 0; i < sim.num_vcpus; i++) {
+        sim_vcpu_t* v = &sim.vcpus[i];
+
+        v->sched = vcpu_sched_add_vcpu(sim.sched, v->vm->index, v);
+        if (start_phase(v, sim_now) && finish_phases(v, sim_now, false)) {
+            vcpu_sched_wake(sim.sched, v->sched, sim_now);
+        }
+    }
+    for (uint32_t cpu = 0; cpu < sim.cpus; cpu++) {
+        schedule_cpu(cpu, sim_now);
+    }
+
+    uint64_t end = (uint64_t)(seconds * 1e9) + 1;
+    struct timespec start, stop;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sim.num_events) {
+        event_t e = pop_event();
+
+        if (e.time >= end) {
+            break;
+        }
+        sim_now = e.time;
+        if (e.kind == EVENT_WAKE) {
+            wake_event(&sim.vcpus[e.id], sim_now);
+        } else if (e.seq == sim.cpu[e.id].seq) {
+            cpu_event(e.id, sim_now);
+        }
+    }
+    for (uint32_t cpu = 0; cpu < sim.cpus; cpu++) {
+        advance(cpu, end);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    report(end - 1, (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9);
+    vcpu_sched_destroy(sim.sched);
+    return 0;
+}
@@ -0,0 +1,1285 @@
+/*
+ * QENEX Hypervisor - vCPU Scheduler
+ *
+ * Per-pCPU runqueues with credit accounting, wake-up boost, work
+ * stealing, co-scheduling and directed yield. See vcpu_sched.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "vcpu_sched.h"
+
+#define MIN_CAPPED_RUN_NS 100000    // Budget a capped vCPU needs to run, so it does not run in slivers
+
+typedef enum {
+    PRIO_GANG,              // Pulled in to run alongside a sibling
+    PRIO_BOOST,
+    PRIO_UNDER,
+    PRIO_OVER,
+    PRIO_LEVELS
+} prio_t;
+
+typedef enum {
+    RUN_BLOCKED,
+    RUN_QUEUED,
+    RUN_RUNNING,
+    RUN_PARKED,             // Capped and out of budget
+    RUN_DEAD                // Removed while running; freed when put back
+} run_state_t;
+
+struct sched_vcpu {
+    void* owner;
+    uint32_t vm;
+    uint32_t cpu;           // Queue it is on, or pCPU it runs or last ran on
+    run_state_t state;
+    prio_t prio;            // Queue it is on, or was picked from
+    bool wake_pending;      // Woken while still running
+    bool preempted;         // Last stopped mid-slice or for a kick; may hold a guest lock
+    bool spinning;          // Last stopped by yielding from a spin loop
+    int64_t credit;         // ns of CPU it may still use
+    int64_t budget;         // Against the VM's cap
+    uint32_t budget_frac;   // Refill short of 1ns, in hundredths
+    uint64_t accrued_at;    // Credit is up to date to here; 0 before the first wake
+    uint64_t started_at;
+    uint64_t stopped_at;
+    sched_vcpu_t* next;
+    sched_vcpu_t* prev;
+    sched_vcpu_t* all_next;     // Every registered vCPU, under vm_lock
+    sched_vcpu_t* all_prev;
+    sched_vcpu_t* vm_next;      // Its VM's vCPUs, under that VM's lock
+    sched_vcpu_t* vm_prev;
+};
+
+typedef struct {
+    sched_vcpu_t* head;
+    sched_vcpu_t* tail;
+} vcpu_list_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    vcpu_list_t queues[PRIO_LEVELS];
+    vcpu_list_t parked;
+    sched_vcpu_t* current;
+    uint32_t vcpus;         // Homed here, in any state; for placement
+    vcpu_sched_stats_t stats;
+} __attribute__((aligned(64))) sched_cpu_t;
+
+typedef struct {
+    pthread_mutex_t lock;   // members; after vm_lock, before any pCPU's lock
+    void* owner;
+    uint32_t weight;
+    uint32_t cap;           // Percent of its vCPUs' time; 0 = none
+    uint32_t vcpus;
+    uint64_t share;         // Credit it earns, in millionths of a pCPU; see rebalance()
+    bool gang;              // Co-schedule its vCPUs
+    bool active;
+    uint64_t runtime;       // ns its vCPUs have run, up to their last put
+    sched_vcpu_t* members;
+} sched_vm_t;
+
+struct vcpu_sched {
+    vcpu_sched_params_t params;
+    vcpu_sched_ops_t ops;
+
+    pthread_mutex_t vm_lock;    // VM settings, shares and the list of every vCPU
+    sched_vm_t vms[VCPU_SCHED_MAX_VMS];
+    sched_vcpu_t* all;
+
+    sched_cpu_t* cpus;
+    uint64_t idle_mask[VCPU_SCHED_MAX_CPUS / 64];
+};
+
+static void list_append(vcpu_list_t* list, sched_vcpu_t* v) {
+    v->next = NULL;
+    v->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = v;
+    } else {
+        list->head = v;
+    }
+    list->tail = v;
+}
+
+static void list_prepend(vcpu_list_t* list, sched_vcpu_t* v) {
+    v->prev = NULL;
+    v->next = list->head;
+    if (list->head) {
+        list->head->prev = v;
+    } else {
+        list->tail = v;
+    }
+    list->head = v;
+}
+
+static void list_remove(vcpu_list_t* list, sched_vcpu_t* v) {
+    if (v->prev) {
+        v->prev->next = v->next;
+    } else {
+        list->head = v->next;
+    }
+    if (v->next) {
+        v->next->prev = v->prev;
+    } else {
+        list->tail = v->prev;
+    }
+    v->next = v->prev = NULL;
+}
+
+static inline int64_t clip(int64_t value, int64_t limit) {
+    return value > limit ? limit : value < -limit ? -limit : value;
+}
+
+/*
+ * Each VM's share of all pCPUs, by weight. A capped VM that cannot use its
+ * share gets what its cap allows, and the rest is split among the others
+ * by weight, so credit it could never spend does not go unclaimed. Called
+ * with vm_lock held whenever a weight, cap or vCPU count changes.
+ */
+static void rebalance(vcpu_sched_t* sched) {
+    uint64_t cpus = (uint64_t)sched->params.cpus * 1000000;
+    uint64_t weight = 0;
+    bool capped[VCPU_SCHED_MAX_VMS] = { false };
+
+    for (int i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+        weight += sched->vms[i].active ? sched->vms[i].weight : 0;
+    }
+
+    // Capping one VM raises the others' shares, which may put another over its cap
+    for (bool changed = true; changed && weight;) {
+        changed = false;
+        for (int i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+            sched_vm_t* vm = &sched->vms[i];
+            uint64_t limit = (uint64_t)vm->vcpus * vm->cap * 10000;
+
+            if (vm->active && vm->cap && !capped[i] && limit < cpus * vm->weight / weight) {
+                capped[i] = true;
+                cpus -= limit;
+                weight -= vm->weight;
+                changed = true;
+            }
+        }
+    }
+
+    for (int i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+        sched_vm_t* vm = &sched->vms[i];
+        uint64_t share = capped[i] ? (uint64_t)vm->vcpus * vm->cap * 10000 :
+                         weight ? cpus * vm->weight / weight : 0;
+
+        __atomic_store_n(&vm->share, vm->active ? share : 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Bring credit and cap budget up to now: the VM's share of all pCPUs, split among its vCPUs
+static void accrue(vcpu_sched_t* sched, sched_vcpu_t* v, uint64_t now) {
+    sched_vm_t* vm = &sched->vms[v->vm];
+    int64_t period = sched->params.period_ns;
+
+    if (!v->accrued_at || now <= v->accrued_at) {
+        v->accrued_at = v->accrued_at ? v->accrued_at : now;
+        return;
+    }
+    uint64_t elapsed = now - v->accrued_at;
+    v->accrued_at = now;
+
+    uint64_t share = __atomic_load_n(&vm->share, __ATOMIC_RELAXED);
+    uint64_t vcpus = __atomic_load_n(&vm->vcpus, __ATOMIC_RELAXED);
+    if (vcpus) {
+        unsigned __int128 earned = (unsigned __int128)elapsed * share / (1000000 * vcpus);
+        v->credit = clip(v->credit + (earned > (unsigned __int128)period * 2 ? period * 2 : (int64_t)earned), period);
+    }
+
+    uint32_t cap = __atomic_load_n(&vm->cap, __ATOMIC_RELAXED);
+    if (cap) {
+        uint64_t refill = (uint64_t)period * 2 * cap / 100;
+        if (elapsed <= (uint64_t)period * 2) {
+            // Exact however often it is called, so the wait budget_wait() gives is enough
+            uint64_t scaled = elapsed * cap + v->budget_frac;
+            refill = scaled / 100;
+            v->budget_frac = scaled % 100;
+        }
+        v->budget = clip(v->budget + (int64_t)refill, period);
+    }
+}
+
+static inline prio_t credit_prio(sched_vcpu_t* v) {
+    return v->credit > 0 ? PRIO_UNDER : PRIO_OVER;
+}
+
+static void enqueue(sched_cpu_t* c, sched_vcpu_t* v, prio_t prio) {
+    v->state = RUN_QUEUED;
+    v->prio = prio;
+    list_append(&c->queues[prio], v);
+}
+
+static sched_vcpu_t* pop(sched_cpu_t* c, prio_t prio) {
+    sched_vcpu_t* v = c->queues[prio].head;
+
+    if (v) {
+        list_remove(&c->queues[prio], v);
+    }
+    return v;
+}
+
+static inline bool vcpu_capped(vcpu_sched_t* sched, sched_vcpu_t* v) {
+    return __atomic_load_n(&sched->vms[v->vm].cap, __ATOMIC_RELAXED) != 0;
+}
+
+// Capped and short of budget; budget_wait() says for how long
+static inline bool capped_out(sched_vcpu_t* v, uint32_t cap) {
+    return cap && v->budget < MIN_CAPPED_RUN_NS;
+}
+
+static inline uint64_t budget_wait(sched_vcpu_t* v, uint32_t cap) {
+    return (uint64_t)(MIN_CAPPED_RUN_NS - v->budget) * 100 / cap + 1;
+}
+
+static void set_idle(vcpu_sched_t* sched, uint32_t cpu, bool idle) {
+    uint64_t bit = 1ULL << (cpu % 64);
+
+    if (idle) {
+        __atomic_fetch_or(&sched->idle_mask[cpu / 64], bit, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&sched->idle_mask[cpu / 64], __ATOMIC_RELAXED) & bit) {
+        __atomic_fetch_and(&sched->idle_mask[cpu / 64], ~bit, __ATOMIC_RELEASE);
+    }
+}
+
+// Claim an idle pCPU other than cpu, so one wake-up does not rouse them all; -1 if none
+static int claim_idle_cpu(vcpu_sched_t* sched, uint32_t cpu) {
+    for (uint32_t word = 0; word < (sched->params.cpus + 63) / 64; word++) {
+        uint64_t mask = __atomic_load_n(&sched->idle_mask[word], __ATOMIC_ACQUIRE);
+
+        if (word == cpu / 64) {
+            mask &= ~(1ULL << (cpu % 64));
+        }
+        while (mask) {
+            uint64_t bit = mask & -mask;
+
+            if (__atomic_fetch_and(&sched->idle_mask[word], ~bit, __ATOMIC_ACQ_REL) & bit) {
+                return word * 64 + __builtin_ctzll(bit);
+            }
+            mask &= ~bit;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Take a vCPU from another pCPU's queues, holding the local lock. Remote
+ * locks are only tried, so two pCPUs stealing from each other cannot
+ * deadlock; a busy queue is simply skipped this time.
+ */
+static sched_vcpu_t* steal(vcpu_sched_t* sched, uint32_t cpu, uint64_t now, bool idle) {
+    prio_t lowest = idle ? PRIO_OVER : PRIO_UNDER;
+
+    for (uint32_t i = 1; i < sched->params.cpus; i++) {
+        uint32_t victim = (cpu + i) % sched->params.cpus;
+        sched_cpu_t* c = &sched->cpus[victim];
+
+        if (pthread_mutex_trylock(&c->lock) != 0) {
+            continue;
+        }
+        for (prio_t prio = PRIO_GANG; prio <= lowest; prio++) {
+            for (sched_vcpu_t* v = c->queues[prio].head; v; v = v->next) {
+                // Busy pCPUs leave cache-hot vCPUs where they are; idle ones take anything
+                if (!idle && now - v->stopped_at < sched->params.migrate_delay_ns) {
+                    continue;
+                }
+                list_remove(&c->queues[prio], v);
+                __atomic_sub_fetch(&c->vcpus, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&v->cpu, cpu, __ATOMIC_RELEASE);
+                pthread_mutex_unlock(&c->lock);
+                __atomic_add_fetch(&sched->cpus[cpu].vcpus, 1, __ATOMIC_RELAXED);
+                sched->cpus[cpu].stats.steals++;
+                return v;
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    return NULL;
+}
+
+// Parked vCPUs whose budget came back; returns ns until the next one does, 0 if none is parked
+static uint64_t unpark(vcpu_sched_t* sched, sched_cpu_t* c, uint64_t now) {
+    uint64_t next = 0;
+    sched_vcpu_t* v = c->parked.head;
+
+    while (v) {
+        sched_vcpu_t* following = v->next;
+
+        accrue(sched, v, now);
+        uint32_t cap = __atomic_load_n(&sched->vms[v->vm].cap, __ATOMIC_RELAXED);
+        if (!capped_out(v, cap)) {
+            list_remove(&c->parked, v);
+            enqueue(c, v, credit_prio(v));
+        } else {
+            uint64_t wait = budget_wait(v, cap);
+            next = next && next < wait ? next : wait;
+        }
+        v = following;
+    }
+    return next;
+}
+
+// Lock the pCPU a vCPU belongs to; stealing may move it meanwhile
+static sched_cpu_t* lock_vcpu_cpu(vcpu_sched_t* sched, sched_vcpu_t* v) {
+    for (;;) {
+        uint32_t cpu = __atomic_load_n(&v->cpu, __ATOMIC_ACQUIRE);
+        sched_cpu_t* c = &sched->cpus[cpu];
+
+        pthread_mutex_lock(&c->lock);
+        if (__atomic_load_n(&v->cpu, __ATOMIC_RELAXED) == cpu) {
+            return c;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+static inline void mark_kick(uint64_t* kicks, uint32_t cpu) {
+    kicks[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static void send_kicks(vcpu_sched_t* sched, const uint64_t* kicks) {
+    for (uint32_t word = 0; word < VCPU_SCHED_MAX_CPUS / 64; word++) {
+        for (uint64_t mask = kicks[word]; mask && sched->ops.kick; mask &= mask - 1) {
+            sched->ops.kick(sched->ops.ctx, word * 64 + __builtin_ctzll(mask));
+        }
+    }
+}
+
+/*
+ * v was just picked on cpu: pull its queued siblings to the front of
+ * their own pCPUs and kick those, so the VM's vCPUs run at the same time
+ * and a spinning vCPU finds the lock holder running. A sibling that is
+ * overdrawn while its pCPU has work with credit is left where it is, and
+ * so is one queued behind a running sibling; an idle pCPU is kicked to
+ * steal it instead.
+ */
+static void co_schedule(vcpu_sched_t* sched, sched_vcpu_t* v, uint32_t cpu, uint64_t now) {
+    uint64_t kicks[VCPU_SCHED_MAX_CPUS / 64] = { 0 };
+    sched_vm_t* vm = &sched->vms[v->vm];
+
+    pthread_mutex_lock(&vm->lock);
+    for (sched_vcpu_t* s = vm->members; s; s = s->vm_next) {
+        if (s == v) {
+            continue;
+        }
+
+        sched_cpu_t* c = lock_vcpu_cpu(sched, s);
+        if (s->state != RUN_QUEUED || s->prio == PRIO_GANG) {
+            pthread_mutex_unlock(&c->lock);
+            continue;
+        }
+        accrue(sched, s, now);
+        uint32_t cap = __atomic_load_n(&sched->vms[s->vm].cap, __ATOMIC_RELAXED);
+        bool fair = s->credit > 0 || (!c->queues[PRIO_BOOST].head && !c->queues[PRIO_UNDER].head);
+        bool shared = s->cpu == cpu || (c->current && c->current->vm == v->vm);
+
+        if (fair && !capped_out(s, cap)) {
+            list_remove(&c->queues[s->prio], s);
+            enqueue(c, s, PRIO_GANG);
+            c->stats.gang_pulls++;
+            if (shared) {
+                int idle = claim_idle_cpu(sched, s->cpu);
+                if (idle >= 0) {
+                    mark_kick(kicks, idle);
+                }
+            } else if (!c->current || (c->current->prio != PRIO_GANG && c->current->prio >= credit_prio(s))) {
+                // Preempting what runs there only if it has no better claim to the pCPU
+                mark_kick(kicks, s->cpu);
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    pthread_mutex_unlock(&vm->lock);
+    send_kicks(sched, kicks);
+}
+
+void vcpu_sched_default_params(vcpu_sched_params_t* params, uint32_t cpus) {
+    params->cpus = cpus;
+    params->period_ns = 30000000;           // 30ms
+    params->slice_ns = 10000000;
+    params->migrate_delay_ns = 500000;
+}
+
+vcpu_sched_t* vcpu_sched_create(const vcpu_sched_params_t* params, const vcpu_sched_ops_t* ops) {
+    if (!params->cpus || params->cpus > VCPU_SCHED_MAX_CPUS || !params->period_ns || !params->slice_ns) {
+        return NULL;
+    }
+
+    vcpu_sched_t* sched = calloc(1, sizeof(vcpu_sched_t));
+    if (!sched) {
+        return NULL;
+    }
+    sched->params = *params;
+    sched->ops = *ops;
+    pthread_mutex_init(&sched->vm_lock, NULL);
+    for (uint32_t i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+        pthread_mutex_init(&sched->vms[i].lock, NULL);
+    }
+
+    sched->cpus = aligned_alloc(64, sizeof(sched_cpu_t) * params->cpus);
+    if (!sched->cpus) {
+        free(sched);
+        return NULL;
+    }
+    memset(sched->cpus, 0, sizeof(sched_cpu_t) * params->cpus);
+    for (uint32_t i = 0; i < params->cpus; i++) {
+        pthread_mutex_init(&sched->cpus[i].lock, NULL);
+    }
+    return sched;
+}
+
+void vcpu_sched_destroy(vcpu_sched_t* sched) {
+    if (!sched) {
+        return;
+    }
+
+    // vCPUs still registered go with it
+    while (sched->all) {
+        sched_vcpu_t* v = sched->all;
+        sched->all = v->all_next;
+        free(v);
+    }
+    for (uint32_t i = 0; i < sched->params.cpus; i++) {
+        pthread_mutex_destroy(&sched->cpus[i].lock);
+    }
+    for (uint32_t i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+        pthread_mutex_destroy(&sched->vms[i].lock);
+    }
+    pthread_mutex_destroy(&sched->vm_lock);
+    free(sched->cpus);
+    free(sched);
+}
+
+int vcpu_sched_add_vm(vcpu_sched_t* sched, void* vm, uint32_t weight) {
+    int index = -1;
+
+    if (!weight) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&sched->vm_lock);
+    for (int i = 0; i < VCPU_SCHED_MAX_VMS; i++) {
+        sched_vm_t* slot = &sched->vms[i];
+
+        if (!slot->active) {
+            // Field by field: the lock stays initialized
+            slot->owner = vm;
+            slot->weight = weight;
+            slot->cap = 0;
+            slot->share = 0;
+            slot->gang = false;
+            slot->runtime = 0;
+            slot->active = true;
+            rebalance(sched);
+            index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sched->vm_lock);
+    return index;
+}
+
+// Its vCPUs must be removed first
+void vcpu_sched_remove_vm(vcpu_sched_t* sched, int vm) {
+    pthread_mutex_lock(&sched->vm_lock);
+    if (sched->vms[vm].active) {
+        sched->vms[vm].active = false;
+        rebalance(sched);
+    }
+    pthread_mutex_unlock(&sched->vm_lock);
+}
+
+void vcpu_sched_set_weight(vcpu_sched_t* sched, int vm, uint32_t weight) {
+    if (!weight) {
+        return;
+    }
+
+    pthread_mutex_lock(&sched->vm_lock);
+    if (sched->vms[vm].active) {
+        __atomic_store_n(&sched->vms[vm].weight, weight, __ATOMIC_RELAXED);
+        rebalance(sched);
+    }
+    pthread_mutex_unlock(&sched->vm_lock);
+}
+
+// Co-schedule the VM's vCPUs, for guests whose vCPUs spin on each other's locks
+void vcpu_sched_set_gang(vcpu_sched_t* sched, int vm, bool gang) {
+    __atomic_store_n(&sched->vms[vm].gang, gang, __ATOMIC_RELAXED);
+}
+
+// Percent of each vCPU's time, 1-100; 0 lifts the cap
+void vcpu_sched_set_cap(vcpu_sched_t* sched, int vm, uint32_t percent) {
+    pthread_mutex_lock(&sched->vm_lock);
+    __atomic_store_n(&sched->vms[vm].cap, percent > 100 ? 100 : percent, __ATOMIC_RELAXED);
+    rebalance(sched);
+    pthread_mutex_unlock(&sched->vm_lock);
+}
+
+// The vCPU starts blocked; vcpu_sched_wake() makes it runnable
+sched_vcpu_t* vcpu_sched_add_vcpu(vcpu_sched_t* sched, int vm, void* vcpu) {
+    sched_vcpu_t* v = calloc(1, sizeof(sched_vcpu_t));
+    if (!v) {
+        return NULL;
+    }
+    v->owner = vcpu;
+    v->vm = vm;
+    v->state = RUN_BLOCKED;
+
+    // Home it on the pCPU with the fewest vCPUs
+    uint32_t best = 0;
+    for (uint32_t i = 1; i < sched->params.cpus; i++) {
+        if (__atomic_load_n(&sched->cpus[i].vcpus, __ATOMIC_RELAXED) <
+            __atomic_load_n(&sched->cpus[best].vcpus, __ATOMIC_RELAXED)) {
+            best = i;
+        }
+    }
+    pthread_mutex_lock(&sched->cpus[best].lock);
+    v->cpu = best;
+    __atomic_add_fetch(&sched->cpus[best].vcpus, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&sched->cpus[best].lock);
+
+    pthread_mutex_lock(&sched->vm_lock);
+    v->all_next = sched->all;
+    if (sched->all) {
+        sched->all->all_prev = v;
+    }
+    sched->all = v;
+    pthread_mutex_lock(&sched->vms[vm].lock);
+    v->vm_next = sched->vms[vm].members;
+    if (sched->vms[vm].members) {
+        sched->vms[vm].members->vm_prev = v;
+    }
+    sched->vms[vm].members = v;
+    pthread_mutex_unlock(&sched->vms[vm].lock);
+    __atomic_add_fetch(&sched->vms[vm].vcpus, 1, __ATOMIC_RELAXED);
+    rebalance(sched);
+    pthread_mutex_unlock(&sched->vm_lock);
+    return v;
+}
+
+void vcpu_sched_remove_vcpu(vcpu_sched_t* sched, sched_vcpu_t* v) {
+    sched_cpu_t* c = lock_vcpu_cpu(sched, v);
+    bool running = v->state == RUN_RUNNING;
+
+    if (v->state == RUN_QUEUED) {
+        list_remove(&c->queues[v->prio], v);
+    } else if (v->state == RUN_PARKED) {
+        list_remove(&c->parked, v);
+    }
+    v->state = RUN_DEAD;
+    __atomic_sub_fetch(&c->vcpus, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&c->lock);
+
+    pthread_mutex_lock(&sched->vm_lock);
+    if (v->all_prev) {
+        v->all_prev->all_next = v->all_next;
+    } else {
+        sched->all = v->all_next;
+    }
+    if (v->all_next) {
+        v->all_next->all_prev = v->all_prev;
+    }
+    pthread_mutex_lock(&sched->vms[v->vm].lock);
+    if (v->vm_prev) {
+        v->vm_prev->vm_next = v->vm_next;
+    } else {
+        sched->vms[v->vm].members = v->vm_next;
+    }
+    if (v->vm_next) {
+        v->vm_next->vm_prev = v->vm_prev;
+    }
+    pthread_mutex_unlock(&sched->vms[v->vm].lock);
+    __atomic_sub_fetch(&sched->vms[v->vm].vcpus, 1, __ATOMIC_RELAXED);
+    rebalance(sched);
+    pthread_mutex_unlock(&sched->vm_lock);
+    if (!running) {
+        free(v);
+    }
+}
+
+void* vcpu_sched_owner(sched_vcpu_t* v) {
+    return v->owner;
+}
+
+// CPU time the VM's vCPUs have used since it was added, for load prediction
+uint64_t vcpu_sched_vm_runtime(vcpu_sched_t* sched, int vm) {
+    return __atomic_load_n(&sched->vms[vm].runtime, __ATOMIC_RELAXED);
+}
+
+/*
+ * Next vCPU for cpu to run, and for how long. If nothing is runnable,
+ * returns NULL and sets *slice to how long until a parked vCPU may run
+ * again, 0 if none; the pCPU idles until then or until kicked.
+ */
+sched_vcpu_t* vcpu_sched_pick(vcpu_sched_t* sched, uint32_t cpu, uint64_t now, uint64_t* slice) {
+    sched_cpu_t* c = &sched->cpus[cpu];
+    sched_vcpu_t* v;
+
+    pthread_mutex_lock(&c->lock);
+    uint64_t parked_wait = c->parked.head ? unpark(sched, c, now) : 0;
+
+    for (;;) {
+        v = pop(c, PRIO_GANG);
+        if (!v) {
+            v = pop(c, PRIO_BOOST);
+        }
+        if (!v) {
+            v = pop(c, PRIO_UNDER);
+        }
+        if (!v) {
+            v = steal(sched, cpu, now, !c->queues[PRIO_OVER].head);
+        }
+        if (!v) {
+            v = pop(c, PRIO_OVER);
+        }
+        if (!v) {
+            break;
+        }
+
+        // A capped vCPU short of budget waits for it, off the queues
+        accrue(sched, v, now);
+        uint32_t cap = __atomic_load_n(&sched->vms[v->vm].cap, __ATOMIC_RELAXED);
+        if (capped_out(v, cap)) {
+            uint64_t wait = budget_wait(v, cap);
+
+            v->state = RUN_PARKED;
+            list_append(&c->parked, v);
+            c->stats.parked++;
+            parked_wait = parked_wait && parked_wait < wait ? parked_wait : wait;
+            continue;
+        }
+        break;
+    }
+
+    if (!v) {
+        c->stats.idle++;
+        set_idle(sched, cpu, true);
+        pthread_mutex_unlock(&c->lock);
+        *slice = parked_wait;
+        return NULL;
+    }
+
+    v->state = RUN_RUNNING;
+    v->started_at = now;
+    c->current = v;
+    c->stats.picks++;
+    set_idle(sched, cpu, false);
+    int64_t budget = vcpu_capped(sched, v) ? v->budget : 0;
+    void* vm = sched->vms[v->vm].owner;
+    bool lead = v->prio != PRIO_GANG && __atomic_load_n(&sched->vms[v->vm].gang, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&c->lock);
+
+    if (lead) {
+        co_schedule(sched, v, cpu, now);
+    }
+
+    *slice = sched->ops.time_slice ? sched->ops.time_slice(sched->ops.ctx, vm, now) : sched->params.slice_ns;
+    if (budget > 0 && *slice > (uint64_t)budget) {
+        *slice = budget;
+    }
+    return v;
+}
+
+// v stopped running on cpu at now, for the reason given
+void vcpu_sched_put(vcpu_sched_t* sched, uint32_t cpu, sched_vcpu_t* v, uint64_t now, vcpu_stop_t why) {
+    sched_cpu_t* c = &sched->cpus[cpu];
+    int64_t ran = now > v->started_at ? now - v->started_at : 0;
+
+    pthread_mutex_lock(&c->lock);
+    c->current = NULL;
+    if (v->state == RUN_DEAD) {
+        pthread_mutex_unlock(&c->lock);
+        free(v);
+        return;
+    }
+
+    accrue(sched, v, now);
+    v->credit = clip(v->credit - ran, sched->params.period_ns);
+    __atomic_add_fetch(&sched->vms[v->vm].runtime, ran, __ATOMIC_RELAXED);
+    if (vcpu_capped(sched, v)) {
+        v->budget = clip(v->budget - ran, sched->params.period_ns);
+    }
+    v->stopped_at = now;
+    v->preempted = why == VCPU_SCHED_PREEMPTED;
+    v->spinning = why == VCPU_SCHED_YIELDED;
+
+    if (why == VCPU_SCHED_BLOCKED && !v->wake_pending) {
+        v->state = RUN_BLOCKED;
+    } else if (why == VCPU_SCHED_BLOCKED) {
+        // Its wake-up came while it was still on the way out
+        enqueue(c, v, v->credit > 0 ? PRIO_BOOST : PRIO_OVER);
+    } else if (why == VCPU_SCHED_YIELDED) {
+        // Behind everything else on this pCPU, credit untouched
+        enqueue(c, v, PRIO_OVER);
+    } else {
+        enqueue(c, v, credit_prio(v));
+    }
+    v->wake_pending = false;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void vcpu_sched_wake(vcpu_sched_t* sched, sched_vcpu_t* v, uint64_t now) {
+    sched_cpu_t* c = lock_vcpu_cpu(sched, v);
+    uint32_t cpu = v->cpu;
+    int kick = -1;
+
+    if (v->state == RUN_RUNNING) {
+        v->wake_pending = true;
+    } else if (v->state == RUN_BLOCKED) {
+        accrue(sched, v, now);
+
+        // Woken with credit left: ahead of everything that merely has credit
+        prio_t prio = v->credit > 0 ? PRIO_BOOST : PRIO_OVER;
+        enqueue(c, v, prio);
+        if (prio == PRIO_BOOST) {
+            c->stats.boosts++;
+        }
+
+        if (!c->current) {
+            kick = cpu;
+        } else if (prio == PRIO_BOOST && c->current->prio > PRIO_BOOST) {
+            kick = cpu;
+            c->stats.preemptions++;
+        } else {
+            kick = claim_idle_cpu(sched, cpu);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (kick >= 0 && sched->ops.kick) {
+        sched->ops.kick(sched->ops.ctx, kick);
+    }
+}
+
+/*
+ * v, running, is spinning in the guest (a pause-loop exit). Boost the
+ * sibling most likely to hold the lock it waits for: one preempted while
+ * running, not itself spinning, and descheduled the longest. Returns
+ * false if there is none. The caller then puts v with VCPU_SCHED_YIELDED.
+ * Only v's own VM is locked, so spinning guests do not contend with each
+ * other or with VM and vCPU setup.
+ */
+bool vcpu_sched_yield_to(vcpu_sched_t* sched, sched_vcpu_t* v, uint64_t now) {
+    sched_vcpu_t* target = NULL;
+    sched_vm_t* vm = &sched->vms[v->vm];
+    uint64_t oldest = 0;
+    int kick = -1;
+
+    pthread_mutex_lock(&vm->lock);
+    for (sched_vcpu_t* s = vm->members; s; s = s->vm_next) {
+        if (s == v) {
+            continue;
+        }
+
+        sched_cpu_t* c = lock_vcpu_cpu(sched, s);
+        if (s->state == RUN_QUEUED && s->preempted && !s->spinning &&
+            (!target || now - s->stopped_at > oldest)) {
+            target = s;
+            oldest = now - s->stopped_at;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    if (target) {
+        sched_cpu_t* c = lock_vcpu_cpu(sched, target);
+        if (target->state == RUN_QUEUED) {
+            // To the front of BOOST, unless co-scheduling already put it ahead
+            if (target->prio != PRIO_GANG) {
+                list_remove(&c->queues[target->prio], target);
+                target->prio = PRIO_BOOST;
+                list_prepend(&c->queues[PRIO_BOOST], target);
+            }
+            c->stats.directed_yields++;
+            if (target->cpu != __atomic_load_n(&v->cpu, __ATOMIC_RELAXED) &&
+                (!c->current || c->current->prio > PRIO_BOOST)) {
+                kick = target->cpu;
+            }
+        } else {
+            target = NULL;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+    pthread_mutex_unlock(&vm->lock);
+
+    if (kick >= 0 && sched->ops.kick) {
+        sched->ops.kick(sched->ops.ctx, kick);
+    }
+    return target != NULL;
+}
+
+void vcpu_sched_get_stats(vcpu_sched_t* sched, vcpu_sched_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (uint32_t i = 0; i < sched->params.cpus; i++) {
+        sched_cpu_t* c = &sched->cpus[i];
+
+        pthread_mutex_lock(&c->lock);
+        stats->picks += c->stats.picks;
+        stats->steals += c->stats.steals;
+        stats->boosts += c->stats.boosts;
+        stats->preemptions += c->stats.preemptions;
+        stats->parked += c->stats.parked;
+        stats->idle += c->stats.idle;
+        stats->gang_pulls += c->stats.gang_pulls;
+        stats->directed_yields += c->stats.directed_yields;
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+#ifdef VCPU_SCHED_BENCH
+/* Userspace test: cc -O2 -DVCPU_SCHED_BENCH vcpu_sched.c -lpthread */
+#include <stdio.h>
+#include <time.h>
+
+#include "../test_check.h"
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static const vcpu_sched_ops_t no_ops = { 0 };
+
+// Cost of a pick and a put as vCPUs go from one per VM to MAX_VMS x 256
+static void bench_overhead(void) {
+    printf("pick+put cost, 8 pCPUs, 64 VMs:\n");
+    for (uint32_t per_vm = 1; per_vm <= 256; per_vm *= 4) {
+        vcpu_sched_params_t params;
+        vcpu_sched_default_params(&params, 8);
+        vcpu_sched_t* sched = vcpu_sched_create(&params, &no_ops);
+        uint64_t now = 1;
+
+        for (int vm = 0; vm < VCPU_SCHED_MAX_VMS; vm++) {
+            vcpu_sched_add_vm(sched, NULL, VCPU_SCHED_DEFAULT_WEIGHT);
+            for (uint32_t i = 0; i < per_vm; i++) {
+                vcpu_sched_wake(sched, vcpu_sched_add_vcpu(sched, vm, NULL), now);
+            }
+        }
+
+        uint32_t rounds = 400000;
+        uint64_t start = wall_ns();
+        for (uint32_t i = 0; i < rounds; i++) {
+            uint32_t cpu = i % 8;
+            uint64_t slice;
+            sched_vcpu_t* v = vcpu_sched_pick(sched, cpu, now, &slice);
+
+            now += 1000000 / 8;
+            if (v) {
+                vcpu_sched_put(sched, cpu, v, now, i % 5 == 0 ? VCPU_SCHED_BLOCKED : VCPU_SCHED_PREEMPTED);
+                if (i % 5 == 0) {
+                    vcpu_sched_wake(sched, v, now);
+                }
+            }
+        }
+        printf("  %6u vCPUs: %5.0f ns\n", per_vm * VCPU_SCHED_MAX_VMS, (double)(wall_ns() - start) / rounds);
+        vcpu_sched_destroy(sched);
+    }
+}
+
+/*
+ * CPU-bound VMs on 4 pCPUs in virtual time: each pCPU runs what it picks
+ * for the whole slice. Shares should follow the weights, a capped VM
+ * should stay under its cap, and what it leaves should go to the others
+ * by weight.
+ */
+static void bench_shares(const uint32_t* weights, const uint32_t* caps, uint32_t vms, uint32_t vcpus_per_vm,
+                         uint32_t cpus, const char* name) {
+    vcpu_sched_params_t params;
+    vcpu_sched_default_params(&params, cpus);
+    vcpu_sched_t* sched = vcpu_sched_create(&params, &no_ops);
+    uint64_t runtime[8] = { 0 };
+    uint64_t clock[VCPU_SCHED_MAX_CPUS] = { 0 };
+    uint64_t end = 10000000000ULL;          // 10s
+    uint32_t ids[8];
+
+    for (uint32_t vm = 0; vm < vms; vm++) {
+        ids[vm] = vm;
+        vcpu_sched_add_vm(sched, &ids[vm], weights[vm]);
+        vcpu_sched_set_cap(sched, vm, caps ? caps[vm] : 0);
+        for (uint32_t i = 0; i < vcpus_per_vm; i++) {
+            vcpu_sched_wake(sched, vcpu_sched_add_vcpu(sched, vm, &ids[vm]), 1);
+        }
+    }
+    for (uint32_t cpu = 0; cpu < cpus; cpu++) {
+        clock[cpu] = 1;
+    }
+
+    // Events in time order: the pCPU whose slice ends first puts its vCPU back and picks again
+    sched_vcpu_t* running[VCPU_SCHED_MAX_CPUS] = { NULL };
+    for (;;) {
+        uint32_t cpu = 0;
+        for (uint32_t i = 1; i < cpus; i++) {
+            cpu = clock[i] < clock[cpu] ? i : cpu;
+        }
+        if (clock[cpu] >= end) {
+            break;
+        }
+        if (running[cpu]) {
+            vcpu_sched_put(sched, cpu, running[cpu], clock[cpu], VCPU_SCHED_PREEMPTED);
+        }
+
+        uint64_t slice;
+        running[cpu] = vcpu_sched_pick(sched, cpu, clock[cpu], &slice);
+        if (!running[cpu]) {
+            clock[cpu] += slice ? slice : params.slice_ns;
+            continue;
+        }
+        runtime[*(uint32_t*)vcpu_sched_owner(running[cpu])] += slice;
+        clock[cpu] += slice;
+    }
+
+    // Fair shares: by weight, except that a capped VM leaves what it cannot use to the others
+    double limit[8], left = 1;
+    uint64_t total_weight = 0;
+    bool limited[8] = { false };
+    for (uint32_t vm = 0; vm < vms; vm++) {
+        limit[vm] = caps && caps[vm] ? vcpus_per_vm * caps[vm] / 100.0 / cpus : 1;
+        total_weight += weights[vm];
+    }
+    for (bool changed = true; changed && total_weight;) {
+        changed = false;
+        for (uint32_t vm = 0; vm < vms; vm++) {
+            if (!limited[vm] && limit[vm] < left * weights[vm] / total_weight) {
+                limited[vm] = true;
+                left -= limit[vm];
+                total_weight -= weights[vm];
+                changed = true;
+            }
+        }
+    }
+
+    printf("%s:\n", name);
+    for (uint32_t vm = 0; vm < vms; vm++) {
+        double share = (double)runtime[vm] / (end * cpus);
+        double fair = limited[vm] ? limit[vm] : left * weights[vm] / total_weight;
+
+        printf("  VM %u weight %4u cap %3u%%: %5.1f%% of CPU (fair share %5.1f%%)\n", vm, weights[vm],
+               caps ? caps[vm] : 0, share * 100, fair * 100);
+        if (caps && caps[vm]) {
+            CHECK(share * cpus <= vcpus_per_vm * caps[vm] / 100.0 * 1.02, "VM %u over its cap", vm);
+        }
+        CHECK(share > fair * 0.95 && share < fair * 1.05, "VM %u share %.3f, fair %.3f", vm, share, fair);
+    }
+    vcpu_sched_destroy(sched);
+}
+
+/*
+ * A 4-vCPU guest whose vCPUs take one spin lock in turn, next to a 6-vCPU
+ * VM that computes and waits on I/O, on 4 pCPUs in 5us steps. The other
+ * VM's wake-ups preempt guest vCPUs, sometimes the lock holder, and the
+ * rest then spin. Counts critical sections the guest gets through with
+ * plain scheduling, with pause-loop exits yielding to the likely holder,
+ * and with co-scheduling on top.
+ */
+#define LOCK_STEP_NS 5000
+#define LOCK_HOLD 2                 // Steps in the critical section
+#define LOCK_WORK 20                // Steps between them, on average
+#define LOCK_PLE_WINDOW 10          // Spin 50us before a pause-loop exit
+#define LOCK_GUEST_VCPUS 4
+#define LOCK_IO_VCPUS 6
+
+typedef struct {
+    uint32_t vm;
+    uint32_t work;          // Steps left outside the lock, holding it, or before blocking
+    bool waiting;
+    uint32_t spun;
+    uint64_t wake_at;       // Blocked on I/O until then
+} lock_vcpu_t;
+
+static bool lock_kicked[4];
+
+static void lock_kick(void* ctx, uint32_t cpu) {
+    (void)ctx;
+    lock_kicked[cpu] = true;
+}
+
+static uint32_t lock_random(uint32_t* seed, uint32_t range) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) % range;
+}
+
+static uint64_t bench_lock(bool ple, bool gang, const char* name, double* share) {
+    vcpu_sched_params_t params;
+    vcpu_sched_default_params(&params, 4);
+    params.slice_ns = 3000000;
+    vcpu_sched_ops_t ops = { .kick = lock_kick };
+    vcpu_sched_t* sched = vcpu_sched_create(&params, &ops);
+    lock_vcpu_t vcpus[LOCK_GUEST_VCPUS + LOCK_IO_VCPUS];
+    sched_vcpu_t* handles[LOCK_GUEST_VCPUS + LOCK_IO_VCPUS];
+    sched_vcpu_t* running[4] = { NULL };
+    uint64_t slice_end[4] = { 0 };
+    lock_vcpu_t* holder = NULL;
+    uint64_t sections = 0, spins = 0, guest_steps = 0;
+    uint32_t seed = 1;
+
+    vcpu_sched_add_vm(sched, NULL, VCPU_SCHED_DEFAULT_WEIGHT);
+    vcpu_sched_add_vm(sched, NULL, VCPU_SCHED_DEFAULT_WEIGHT);
+    vcpu_sched_set_gang(sched, 0, gang);
+    for (uint32_t i = 0; i < LOCK_GUEST_VCPUS + LOCK_IO_VCPUS; i++) {
+        vcpus[i] = (lock_vcpu_t){ .vm = i >= LOCK_GUEST_VCPUS, .work = 1 + lock_random(&seed, LOCK_WORK * 2) };
+        handles[i] = vcpu_sched_add_vcpu(sched, vcpus[i].vm, &vcpus[i]);
+        vcpu_sched_wake(sched, handles[i], LOCK_STEP_NS);
+    }
+    memset(lock_kicked, 0, sizeof(lock_kicked));
+
+    for (uint64_t now = LOCK_STEP_NS; now < 3000000000ULL; now += LOCK_STEP_NS) {
+        for (uint32_t i = LOCK_GUEST_VCPUS; i < LOCK_GUEST_VCPUS + LOCK_IO_VCPUS; i++) {
+            if (vcpus[i].wake_at && now >= vcpus[i].wake_at) {
+                vcpus[i].wake_at = 0;
+                vcpus[i].work = 20 + lock_random(&seed, 400);
+                vcpu_sched_wake(sched, handles[i], now);
+            }
+        }
+
+        for (uint32_t cpu = 0; cpu < 4; cpu++) {
+            vcpu_stop_t why = VCPU_SCHED_PREEMPTED;
+            bool stop = running[cpu] && (now >= slice_end[cpu] || lock_kicked[cpu]);
+
+            if (running[cpu] && !stop) {
+                lock_vcpu_t* l = vcpu_sched_owner(running[cpu]);
+
+                if (l->vm == 1 && --l->work == 0) {
+                    // Off to wait for I/O
+                    l->wake_at = now + LOCK_STEP_NS * (20 + lock_random(&seed, 200));
+                    why = VCPU_SCHED_BLOCKED;
+                    stop = true;
+                } else if (l->vm == 0) {
+                    guest_steps++;
+                    if (l->waiting && !holder) {
+                        holder = l;
+                        l->waiting = false;
+                        l->work = LOCK_HOLD;
+                    } else if (l->waiting) {
+                        spins++;
+                        if (ple && ++l->spun >= LOCK_PLE_WINDOW) {
+                            l->spun = 0;
+                            vcpu_sched_yield_to(sched, running[cpu], now);
+                            why = VCPU_SCHED_YIELDED;
+                            stop = true;
+                        }
+                    } else if (--l->work == 0 && holder == l) {
+                        holder = NULL;
+                        sections++;
+                        l->work = 1 + lock_random(&seed, LOCK_WORK * 2);
+                    } else if (l->work == 0) {
+                        l->waiting = true;
+                        l->spun = 0;
+                    }
+                }
+            }
+            if (stop) {
+                vcpu_sched_put(sched, cpu, running[cpu], now, why);
+                running[cpu] = NULL;
+            }
+            if (!running[cpu]) {
+                uint64_t slice;
+
+                lock_kicked[cpu] = false;
+                running[cpu] = vcpu_sched_pick(sched, cpu, now, &slice);
+                slice_end[cpu] = now + slice;
+            }
+        }
+    }
+
+    *share = (double)guest_steps * LOCK_STEP_NS / (3000000000ULL * 4);
+    vcpu_sched_stats_t stats;
+    vcpu_sched_get_stats(sched, &stats);
+    printf("  %-32s %6llu sections, %4.1f%% of CPU, %4.1f%% of it spinning, %4llu pulls, %4llu directed yields\n",
+           name, (unsigned long long)sections, *share * 100,
+           guest_steps ? 100.0 * spins / guest_steps : 0.0, (unsigned long long)stats.gang_pulls,
+           (unsigned long long)stats.directed_yields);
+    vcpu_sched_destroy(sched);
+    return sections;
+}
+
+static void bench_lock_holder(void) {
+    printf("spin lock guest, 4 vCPUs, next to an I/O VM with 6 on 4 pCPUs, 3s:\n");
+    double share;
+    uint64_t plain = bench_lock(false, false, "plain", &share);
+    uint64_t gang = bench_lock(false, true, "co-scheduled", &share);
+    CHECK(gang >= plain * 0.99, "co-scheduling should not lose throughput");
+    CHECK(share < 0.52, "co-scheduling should not take more than the guest's share");
+    uint64_t ple = bench_lock(true, false, "pause-loop exit, directed yield", &share);
+    CHECK(ple > plain * 1.05, "directed yield should beat plain scheduling");
+    uint64_t both = bench_lock(true, true, "both", &share);
+    CHECK(both >= ple * 0.99 && share < 0.52, "co-scheduling with directed yield");
+}
+
+// Real threads picking, putting, waking and removing at once; run under -fsanitize=thread
+typedef struct {
+    vcpu_sched_t* sched;
+    uint32_t cpu;
+    uint64_t picks;
+} stress_cpu_t;
+
+static bool stress_stop;
+static sched_vcpu_t* stress_vcpus[512];
+static uint32_t stress_count = 512;
+
+static void* stress_cpu(void* arg) {
+    stress_cpu_t* s = arg;
+    uint32_t seed = s->cpu;
+
+    while (!__atomic_load_n(&stress_stop, __ATOMIC_ACQUIRE)) {
+        uint64_t slice;
+        sched_vcpu_t* v = vcpu_sched_pick(s->sched, s->cpu, wall_ns(), &slice);
+
+        if (v) {
+            s->picks++;
+            seed = seed * 1103515245 + 12345;
+            vcpu_stop_t why = (seed >> 16) % 4 == 0 ? VCPU_SCHED_BLOCKED :
+                              (seed >> 16) % 4 == 1 ? VCPU_SCHED_YIELDED : VCPU_SCHED_PREEMPTED;
+            if (why == VCPU_SCHED_YIELDED) {
+                vcpu_sched_yield_to(s->sched, v, wall_ns());
+            }
+            vcpu_sched_put(s->sched, s->cpu, v, wall_ns(), why);
+        }
+    }
+    return NULL;
+}
+
+static void* stress_waker(void* arg) {
+    vcpu_sched_t* sched = arg;
+    uint32_t seed = 7;
+
+    while (!__atomic_load_n(&stress_stop, __ATOMIC_ACQUIRE)) {
+        seed = seed * 1103515245 + 12345;
+        vcpu_sched_wake(sched, __atomic_load_n(&stress_vcpus[(seed >> 8) % stress_count], __ATOMIC_ACQUIRE),
+                        wall_ns());
+    }
+    return NULL;
+}
+
+static void bench_stress(void) {
+    vcpu_sched_params_t params;
+    vcpu_sched_default_params(&params, 4);
+    params.migrate_delay_ns = 0;
+    vcpu_sched_t* sched = vcpu_sched_create(&params, &no_ops);
+    stress_cpu_t cpus[4];
+    pthread_t threads[5];
+
+    for (uint32_t i = 0; i < stress_count; i++) {
+        int vm = i % 8;
+        if ((uint32_t)vm == i) {
+            vcpu_sched_add_vm(sched, NULL, VCPU_SCHED_DEFAULT_WEIGHT * (vm + 1));
+        }
+        stress_vcpus[i] = vcpu_sched_add_vcpu(sched, vm, NULL);
+        vcpu_sched_wake(sched, stress_vcpus[i], wall_ns());
+    }
+    vcpu_sched_set_cap(sched, 3, 50);
+    vcpu_sched_set_gang(sched, 5, true);
+    vcpu_sched_set_gang(sched, 7, true);
+
+    for (uint32_t i = 0; i < 4; i++) {
+        cpus[i] = (stress_cpu_t){ .sched = sched, .cpu = i };
+        pthread_create(&threads[i], NULL, stress_cpu, &cpus[i]);
+    }
+    pthread_create(&threads[4], NULL, stress_waker, sched);
+
+    // Remove half the vCPUs of one VM while everything runs
+    struct timespec pause = { 0, 100000000 };
+    nanosleep(&pause, NULL);
+    sched_vcpu_t* removed[sizeof(stress_vcpus) / sizeof(stress_vcpus[0])];
+    uint32_t count = 0;
+    for (uint32_t i = 7; i < stress_count; i += 16) {
+        removed[count++] = stress_vcpus[i];
+        __atomic_store_n(&stress_vcpus[i], stress_vcpus[i - 1], __ATOMIC_RELEASE);
+    }
+    nanosleep(&pause, NULL);        // The waker is done with the old pointers
+    for (uint32_t i = 0; i < count; i++) {
+        vcpu_sched_remove_vcpu(sched, removed[i]);
+    }
+    nanosleep(&pause, NULL);
+
+    __atomic_store_n(&stress_stop, true, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < 5; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    vcpu_sched_stats_t stats;
+    vcpu_sched_get_stats(sched, &stats);
+    printf("stress: %llu picks, %llu steals, %llu boosts, %llu parked, %llu pulls, %llu directed yields\n",
+           (unsigned long long)stats.picks, (unsigned long long)stats.steals, (unsigned long long)stats.boosts,
+           (unsigned long long)stats.parked, (unsigned long long)stats.gang_pulls,
+           (unsigned long long)stats.directed_yields);
+    CHECK(stats.picks > 1000 && stats.steals > 0 && stats.boosts > 0 && stats.gang_pulls > 0, "stress made progress");
+    vcpu_sched_destroy(sched);
+}
+
+struct yield_args {
+    vcpu_sched_t* sched;
+    sched_vcpu_t* spinner;
+    bool yielded;
+    bool done;
+};
+
+static void* yield_thread(void* arg) {
+    struct yield_args* y = arg;
+
+    y->yielded = vcpu_sched_yield_to(y->sched, y->spinner, 2000000);
+    __atomic_store_n(&y->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// A pause-loop exit takes only its own VM's lock, not the scheduler's
+static void test_yield_unlocked(void) {
+    vcpu_sched_params_t params;
+    vcpu_sched_default_params(&params, 2);
+    vcpu_sched_t* sched = vcpu_sched_create(&params, &no_ops);
+    int vm = vcpu_sched_add_vm(sched, NULL, VCPU_SCHED_DEFAULT_WEIGHT);
+    sched_vcpu_t* holder = vcpu_sched_add_vcpu(sched, vm, NULL);
+    sched_vcpu_t* spinner = vcpu_sched_add_vcpu(sched, vm, NULL);
+    uint64_t slice;
+
+    // The holder is preempted mid-slice, then the spinner runs and spins
+    vcpu_sched_wake(sched, holder, 1);
+    vcpu_sched_wake(sched, spinner, 1);
+    for (uint32_t cpu = 0; cpu < 2; cpu++) {
+        sched_vcpu_t* v = vcpu_sched_pick(sched, cpu, 1000, &slice);
+        if (v == holder) {
+            vcpu_sched_put(sched, cpu, v, 1000000, VCPU_SCHED_PREEMPTED);
+        }
+    }
+
+    struct yield_args y = { .sched = sched, .spinner = spinner };
+    pthread_t thread;
+    pthread_mutex_lock(&sched->vm_lock);
+    pthread_create(&thread, NULL, yield_thread, &y);
+    for (int i = 0; i < 1000 && !__atomic_load_n(&y.done, __ATOMIC_ACQUIRE); i++) {
+        struct timespec pause = { 0, 1000000 };
+        nanosleep(&pause, NULL);
+    }
+    bool done = __atomic_load_n(&y.done, __ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&sched->vm_lock);
+    pthread_join(thread, NULL);
+
+    CHECK(done, "directed yield waited for the scheduler-wide lock");
+    CHECK(y.yielded, "directed yield found no preempted sibling");
+    vcpu_sched_destroy(sched);
+}
+
+int main(void) {
+    bench_overhead();
+
+    uint32_t weights[] = { 256, 512, 1024 };
+    bench_shares(weights, NULL, 3, 4, 4, "weights 1:2:4, 4 vCPUs each on 4 pCPUs");
+
+    uint32_t even[] = { 256, 256, 256 };
+    uint32_t caps[] = { 0, 0, 25 };
+    bench_shares(even, caps, 3, 2, 4, "third VM capped at 25%");
+
+    bench_lock_holder();
+    test_yield_unlocked();
+
+    bench_stress();
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
+#endif /* VCPU_SCHED_BENCH */
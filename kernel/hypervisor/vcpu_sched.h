@@ -0,0 +1,108 @@
+/*
+ * QENEX Hypervisor - vCPU Scheduler
+ *
+ * Credit scheduling of vCPUs on physical CPUs, decided locally on each
+ * pCPU:
+ *
+ *   - Every pCPU has its own runqueue and lock. vcpu_sched_pick() and
+ *     vcpu_sched_put() touch only the local queue, so their cost does not
+ *     grow with the number of VMs or vCPUs.
+ *   - A VM's vCPUs earn credit, in nanoseconds of CPU, in proportion to
+ *     the VM's weight and spend it while they run. Credit is brought up to
+ *     date whenever a vCPU is queued or picked, not by a periodic pass over
+ *     every vCPU. It is clipped to one accounting period either way, so a
+ *     vCPU can neither hoard time nor be starved for long.
+ *   - Queues are served by priority: BOOST, then UNDER (credit left), then
+ *     OVER (overdrawn). A vCPU woken from a blocked state (HLT, waiting on
+ *     I/O) with credit left is BOOSTed for its next slice and preempts a
+ *     lower-priority vCPU on its pCPU, so I/O-bound guests see low latency
+ *     without getting more than their share.
+ *   - A pCPU that has nothing better than OVER work steals a BOOST or
+ *     UNDER vCPU from another pCPU, leaving alone those that ran within
+ *     migrate_delay_ns and are likely still cache-hot where they are. An
+ *     idle pCPU steals anything, and a wake-up on a busy pCPU kicks an
+ *     idle one to come and take it.
+ *   - A VM may be capped to a share of its vCPUs' time, for example so
+ *     that pre-copy migration converges. A capped vCPU that overdraws is
+ *     parked until its budget refills, and the credit the VM cannot use
+ *     goes to the uncapped VMs by weight.
+ *   - A VM may be co-scheduled. When one of its vCPUs is picked, its
+ *     queued siblings are moved to the front of their own pCPUs, which
+ *     are kicked, so the vCPUs run together and one spinning on a lock
+ *     rarely waits for a holder that is not running. Co-scheduling is
+ *     relaxed: siblings start together but each stops on its own, and a
+ *     sibling without credit does not push aside work that has some.
+ *   - A vCPU that spins in the guest (a pause-loop exit) yields with
+ *     vcpu_sched_yield_to(), which boosts the sibling most likely to hold
+ *     the lock: one that was preempted and is not spinning itself.
+ *
+ * Time is passed in by the caller, and running a vCPU is the caller's
+ * business: pick one, run it for the slice, put it back with the reason it
+ * stopped. Build with -DVCPU_SCHED_BENCH for a userspace test.
+ */
+
+#ifndef QENEX_VCPU_SCHED_H
+#define QENEX_VCPU_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VCPU_SCHED_MAX_VMS 64           // Matches MAX_VMS
+#define VCPU_SCHED_MAX_CPUS 256
+#define VCPU_SCHED_DEFAULT_WEIGHT 256
+
+typedef enum {
+    VCPU_SCHED_PREEMPTED,       // Slice used up, or kicked for a higher priority
+    VCPU_SCHED_BLOCKED,         // Halted or waiting; runnable again on vcpu_sched_wake()
+    VCPU_SCHED_YIELDED          // Gave up the rest of its slice; goes behind everything queued
+} vcpu_stop_t;
+
+typedef struct {
+    uint32_t cpus;
+    uint64_t period_ns;             // Credit accounting period; bounds credit and debt
+    uint64_t slice_ns;              // When ops.time_slice is not set
+    uint64_t migrate_delay_ns;      // Cache-hot window that keeps a vCPU from being stolen
+} vcpu_sched_params_t;
+
+typedef struct {
+    void* ctx;
+    // Slice for a vCPU of this VM; called without scheduler locks held
+    uint64_t (*time_slice)(void* ctx, void* vm, uint64_t now);
+    // Make cpu call vcpu_sched_pick() soon: preempt what it runs, or wake it if idle
+    void (*kick)(void* ctx, uint32_t cpu);
+} vcpu_sched_ops_t;
+
+typedef struct {
+    uint64_t picks;
+    uint64_t steals;
+    uint64_t boosts;
+    uint64_t preemptions;       // Kicks for a boosted vCPU
+    uint64_t parked;            // Capped vCPUs put aside
+    uint64_t idle;              // Picks that found nothing
+    uint64_t gang_pulls;        // Siblings moved up to run with a co-scheduled vCPU
+    uint64_t directed_yields;   // Siblings boosted for a spinning vCPU
+} vcpu_sched_stats_t;
+
+typedef struct vcpu_sched vcpu_sched_t;
+typedef struct sched_vcpu sched_vcpu_t;
+
+/* Function prototypes */
+void vcpu_sched_default_params(vcpu_sched_params_t* params, uint32_t cpus);
+vcpu_sched_t* vcpu_sched_create(const vcpu_sched_params_t* params, const vcpu_sched_ops_t* ops);
+void vcpu_sched_destroy(vcpu_sched_t* sched);
+int vcpu_sched_add_vm(vcpu_sched_t* sched, void* vm, uint32_t weight);
+void vcpu_sched_remove_vm(vcpu_sched_t* sched, int vm);
+void vcpu_sched_set_weight(vcpu_sched_t* sched, int vm, uint32_t weight);
+void vcpu_sched_set_cap(vcpu_sched_t* sched, int vm, uint32_t percent);
+void vcpu_sched_set_gang(vcpu_sched_t* sched, int vm, bool gang);
+sched_vcpu_t* vcpu_sched_add_vcpu(vcpu_sched_t* sched, int vm, void* vcpu);
+void vcpu_sched_remove_vcpu(vcpu_sched_t* sched, sched_vcpu_t* v);
+void* vcpu_sched_owner(sched_vcpu_t* v);
+uint64_t vcpu_sched_vm_runtime(vcpu_sched_t* sched, int vm);
+sched_vcpu_t* vcpu_sched_pick(vcpu_sched_t* sched, uint32_t cpu, uint64_t now, uint64_t* slice);
+void vcpu_sched_put(vcpu_sched_t* sched, uint32_t cpu, sched_vcpu_t* v, uint64_t now, vcpu_stop_t why);
+void vcpu_sched_wake(vcpu_sched_t* sched, sched_vcpu_t* v, uint64_t now);
+bool vcpu_sched_yield_to(vcpu_sched_t* sched, sched_vcpu_t* v, uint64_t now);
+void vcpu_sched_get_stats(vcpu_sched_t* sched, vcpu_sched_stats_t* stats);
+
+#endif /* QENEX_VCPU_SCHED_H */
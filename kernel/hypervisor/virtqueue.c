@@ -0,0 +1,1219 @@
+/*
+ * QENEX Hypervisor - Virtqueue Library
+ *
+ * Split and packed virtqueues, device side. See virtqueue.h.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/uio.h>
+#include "virtqueue.h"
+
+#define vq_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define vq_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define vq_full_barrier()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+/* ==================== SETUP ==================== */
+
+int virtqueue_init(virtqueue_t* vq, uint16_t size, uint64_t features,
+                   vq_translate_fn translate, void* ctx) {
+    memset(vq, 0, sizeof(*vq));
+
+    vq->packed = (features >> VIRTIO_F_RING_PACKED) & 1;
+    vq->event_idx = (features >> VIRTIO_F_RING_EVENT_IDX) & 1;
+    vq->indirect = (features >> VIRTIO_F_INDIRECT_DESC) & 1;
+
+    // Split rings index by masking, so their size must be a power of two
+    if (size == 0 || size > VQ_MAX_SIZE ||
+        (!vq->packed && (size & (size - 1)) != 0)) {
+        return -1;
+    }
+
+    vq->size = size;
+    vq->translate = translate;
+    vq->ctx = ctx;
+    virtqueue_reset(vq);
+
+    return 0;
+}
+
+int virtqueue_set_rings(virtqueue_t* vq, uint64_t desc_gpa, uint64_t driver_gpa,
+                        uint64_t device_gpa) {
+    uint32_t size = vq->size;
+
+    if (vq->packed) {
+        vq->ring.packed.desc = vq->translate(vq->ctx, desc_gpa,
+                                             size * sizeof(vring_packed_desc_t));
+        vq->ring.packed.driver_event = vq->translate(vq->ctx, driver_gpa,
+                                                     sizeof(vring_packed_event_t));
+        vq->ring.packed.device_event = vq->translate(vq->ctx, device_gpa,
+                                                     sizeof(vring_packed_event_t));
+        vq->ready = vq->ring.packed.desc && vq->ring.packed.driver_event &&
+                    vq->ring.packed.device_event;
+    } else {
+        vq->ring.split.desc = vq->translate(vq->ctx, desc_gpa,
+                                            size * sizeof(vring_desc_t));
+        vq->ring.split.avail = vq->translate(vq->ctx, driver_gpa,
+                                             sizeof(vring_avail_t) + (size + 1) * sizeof(uint16_t));
+        vq->ring.split.used = vq->translate(vq->ctx, device_gpa,
+                                            sizeof(vring_used_t) +
+                                            size * sizeof(vring_used_elem_t) + sizeof(uint16_t));
+        vq->ready = vq->ring.split.desc && vq->ring.split.avail && vq->ring.split.used;
+    }
+
+    return vq->ready ? 0 : -1;
+}
+
+void virtqueue_reset(virtqueue_t* vq) {
+    vq->last_avail_idx = 0;
+    vq->used_idx = 0;
+    vq->avail_wrap = true;  // Both wrap counters start at 1
+    vq->used_wrap = true;
+    vq->unsignalled = 0;
+    vq->fill_count = 0;
+    vq->ready = false;
+    vq->broken = false;
+    memset(&vq->ring, 0, sizeof(vq->ring));
+}
+
+/* ==================== DESCRIPTOR CHAINS ==================== */
+
+static void elem_clear(vq_elem_t* elem) {
+    elem->out_num = 0;
+    elem->in_num = 0;
+    elem->out_len = 0;
+    elem->in_len = 0;
+    elem->used_len = 0;
+    elem->ndescs = 0;
+}
+
+static bool elem_add_seg(virtqueue_t* vq, vq_elem_t* elem, uint64_t addr,
+                         uint32_t len, bool writable) {
+    uint32_t index = elem->out_num + elem->in_num;
+
+    if (index >= VQ_MAX_SEGS) {
+        return false;
+    }
+    // Writable segments must follow every readable one
+    if (!writable && elem->in_num > 0) {
+        return false;
+    }
+
+    // Zero-length buffers are refused, as QEMU does; no driver sends them
+    void* base = len ? vq->translate(vq->ctx, addr, len) : NULL;
+    if (!base) {
+        return false;
+    }
+
+    elem->segs[index].base = base;
+    elem->segs[index].len = len;
+
+    if (writable) {
+        elem->in_num++;
+        elem->in_len += len;
+    } else {
+        elem->out_num++;
+        elem->out_len += len;
+    }
+    return true;
+}
+
+// Walk an indirect table; same descriptor layout for both ring types
+static bool map_indirect(virtqueue_t* vq, vq_elem_t* elem, uint64_t addr,
+                         uint32_t len, bool packed) {
+    if (!vq->indirect || len == 0 || len % sizeof(vring_desc_t) != 0) {
+        return false;
+    }
+
+    uint32_t count = len / sizeof(vring_desc_t);
+    vring_desc_t* table = vq->translate(vq->ctx, addr, len);
+    if (!table) {
+        return false;
+    }
+
+    // Packed tables are laid out in order; split tables follow next links
+    uint32_t i = 0;
+    for (uint32_t steps = 0; steps < count; steps++) {
+        vring_desc_t desc = table[i];
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            return false;  // No nested tables
+        }
+        if (!elem_add_seg(vq, elem, desc.addr, desc.len,
+                          desc.flags & VRING_DESC_F_WRITE)) {
+            return false;
+        }
+
+        if (packed) {
+            i++;
+            if (i == count) {
+                return true;
+            }
+        } else {
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                return true;
+            }
+            i = desc.next;
+            if (i >= count) {
+                return false;
+            }
+        }
+    }
+
+    return false;  // Loop in the table
+}
+
+static bool map_split_chain(virtqueue_t* vq, uint16_t head, vq_elem_t* elem) {
+    vring_desc_t* table = vq->ring.split.desc;
+    uint16_t i = head;
+
+    elem_clear(elem);
+    elem->id = head;
+    elem->ndescs = 1;
+
+    for (uint32_t steps = 0; steps < vq->size; steps++) {
+        if (i >= vq->size) {
+            return false;
+        }
+        vring_desc_t desc = table[i];
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            // An indirect descriptor ends the chain
+            if (desc.flags & VRING_DESC_F_NEXT) {
+                return false;
+            }
+            return map_indirect(vq, elem, desc.addr, desc.len, false);
+        }
+
+        if (!elem_add_seg(vq, elem, desc.addr, desc.len,
+                          desc.flags & VRING_DESC_F_WRITE)) {
+            return false;
+        }
+
+        if (!(desc.flags & VRING_DESC_F_NEXT)) {
+            return true;
+        }
+        i = desc.next;
+    }
+
+    return false;  // Loop in the chain
+}
+
+static inline bool packed_desc_avail(uint16_t flags, bool wrap) {
+    bool avail = flags & VRING_PACKED_DESC_F_AVAIL;
+    bool used = flags & VRING_PACKED_DESC_F_USED;
+    return avail == wrap && used != wrap;
+}
+
+static bool map_packed_chain(virtqueue_t* vq, vq_elem_t* elem,
+                             uint16_t* idx, bool* wrap) {
+    vring_packed_desc_t* ring = vq->ring.packed.desc;
+
+    elem_clear(elem);
+
+    for (uint32_t steps = 0; steps < vq->size; steps++) {
+        // The head's flags were read with acquire, which orders the rest
+        vring_packed_desc_t desc = ring[*idx];
+
+        elem->id = desc.id;  // The last descriptor's id names the buffer
+        elem->ndescs++;
+        if (++*idx == vq->size) {
+            *idx = 0;
+            *wrap = !*wrap;
+        }
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.flags & VRING_DESC_F_NEXT) {
+                return false;
+            }
+            return map_indirect(vq, elem, desc.addr, desc.len, true);
+        }
+
+        if (!elem_add_seg(vq, elem, desc.addr, desc.len,
+                          desc.flags & VRING_DESC_F_WRITE)) {
+            return false;
+        }
+
+        if (!(desc.flags & VRING_DESC_F_NEXT)) {
+            return true;
+        }
+    }
+
+    return false;  // Chain longer than the ring
+}
+
+/* ==================== BURST POP / PUSH ==================== */
+
+static uint32_t pop_split(virtqueue_t* vq, vq_elem_t* elems, uint32_t max) {
+    vring_avail_t* avail = vq->ring.split.avail;
+    uint16_t avail_idx = vq_load_acquire(&avail->idx);
+    uint16_t pending = avail_idx - vq->last_avail_idx;
+    uint32_t count = 0;
+
+    if (pending > vq->size) {
+        vq->broken = true;
+        return 0;
+    }
+
+    while (count < max && count < pending) {
+        uint16_t head = avail->ring[vq->last_avail_idx & (vq->size - 1)];
+
+        if (!map_split_chain(vq, head, &elems[count])) {
+            vq->broken = true;
+            break;
+        }
+        vq->last_avail_idx++;
+        count++;
+    }
+
+    return count;
+}
+
+static uint32_t pop_packed(virtqueue_t* vq, vq_elem_t* elems, uint32_t max) {
+    vring_packed_desc_t* ring = vq->ring.packed.desc;
+    uint32_t count = 0;
+
+    while (count < max) {
+        uint16_t flags = vq_load_acquire(&ring[vq->last_avail_idx].flags);
+        if (!packed_desc_avail(flags, vq->avail_wrap)) {
+            break;
+        }
+
+        uint16_t idx = vq->last_avail_idx;
+        bool wrap = vq->avail_wrap;
+        if (!map_packed_chain(vq, &elems[count], &idx, &wrap)) {
+            vq->broken = true;
+            break;
+        }
+        vq->last_avail_idx = idx;
+        vq->avail_wrap = wrap;
+        count++;
+    }
+
+    return count;
+}
+
+uint32_t virtqueue_pop_burst(virtqueue_t* vq, vq_elem_t* elems, uint32_t max) {
+    if (!vq->ready || vq->broken) {
+        return 0;
+    }
+
+    uint32_t count = vq->packed ? pop_packed(vq, elems, max) : pop_split(vq, elems, max);
+
+    if (vq->broken) {
+        vq->stats.errors++;
+    }
+    vq->stats.popped += count;
+    return count;
+}
+
+/*
+ * Completions are filled one at a time, possibly out of order, and become
+ * visible to the driver together at the next flush.
+ */
+void virtqueue_fill(virtqueue_t* vq, const vq_elem_t* elem) {
+    if (!vq->ready) {
+        return;
+    }
+
+    if (!vq->packed) {
+        vring_used_t* used = vq->ring.split.used;
+        uint16_t slot = (uint16_t)(vq->used_idx + vq->fill_count) & (vq->size - 1);
+
+        used->ring[slot].id = elem->id;
+        used->ring[slot].len = elem->used_len;
+        vq->fill_count++;
+        return;
+    }
+
+    if (vq->fill_count == 0) {
+        vq->fill_idx = vq->used_idx;
+        vq->fill_wrap = vq->used_wrap;
+    }
+
+    vring_packed_desc_t* desc = &vq->ring.packed.desc[vq->fill_idx];
+    uint16_t flags = vq->fill_wrap ?
+                     (VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED) : 0;
+
+    desc->id = elem->id;
+    desc->len = elem->used_len;
+
+    // Hold back the first entry's flags so the driver sees the batch at once
+    if (vq->fill_count == 0) {
+        vq->fill_head_flags = flags;
+    } else {
+        vq_store_release(&desc->flags, flags);
+    }
+
+    vq->fill_idx += elem->ndescs;
+    if (vq->fill_idx >= vq->size) {
+        vq->fill_idx -= vq->size;
+        vq->fill_wrap = !vq->fill_wrap;
+    }
+    vq->fill_count++;
+}
+
+// Publish everything filled since the last flush
+void virtqueue_flush(virtqueue_t* vq) {
+    uint16_t count = vq->fill_count;
+
+    if (!vq->ready || count == 0) {
+        return;
+    }
+
+    if (vq->packed) {
+        vq_store_release(&vq->ring.packed.desc[vq->used_idx].flags, vq->fill_head_flags);
+        vq->unsignalled += (uint16_t)(vq->fill_idx - vq->used_idx +
+                                      (vq->fill_wrap != vq->used_wrap ? vq->size : 0));
+        vq->used_idx = vq->fill_idx;
+        vq->used_wrap = vq->fill_wrap;
+    } else {
+        // One index update publishes the whole batch
+        vq->used_idx += count;
+        vq_store_release(&vq->ring.split.used->idx, vq->used_idx);
+        vq->unsignalled += count;
+    }
+
+    vq->fill_count = 0;
+    vq->stats.pushed += count;
+    vq->stats.bursts++;
+}
+
+void virtqueue_push_burst(virtqueue_t* vq, const vq_elem_t* elems, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        virtqueue_fill(vq, &elems[i]);
+    }
+    virtqueue_flush(vq);
+}
+
+/* ==================== NOTIFICATION SUPPRESSION ==================== */
+
+// Decide whether the used entries published since the last call need an interrupt
+bool virtqueue_should_notify(virtqueue_t* vq) {
+    if (!vq->ready || vq->unsignalled == 0) {
+        return false;
+    }
+
+    // The used index store must be visible before we read the driver's threshold
+    vq_full_barrier();
+
+    uint16_t new_idx = vq->used_idx;
+    uint16_t old_idx = new_idx - vq->unsignalled;
+    bool notify;
+
+    if (vq->packed) {
+        vring_packed_event_t* event = vq->ring.packed.driver_event;
+        uint16_t flags = vq_load_acquire(&event->flags);
+
+        if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+            notify = false;
+        } else if (flags == VRING_PACKED_EVENT_FLAG_DESC && vq->event_idx) {
+            uint16_t off_wrap = vq_load_acquire(&event->off_wrap);
+            uint16_t off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+            bool wrap = off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+
+            // Put the event offset on the same lap as used_idx
+            if (wrap != vq->used_wrap) {
+                off -= vq->size;
+            }
+            notify = vring_need_event(off, new_idx, old_idx);
+        } else {
+            notify = true;
+        }
+    } else {
+        vring_avail_t* avail = vq->ring.split.avail;
+
+        if (vq->event_idx) {
+            uint16_t used_event = vq_load_acquire(&avail->ring[vq->size]);
+            notify = vring_need_event(used_event, new_idx, old_idx);
+        } else {
+            notify = !(vq_load_acquire(&avail->flags) & VRING_AVAIL_F_NO_INTERRUPT);
+        }
+    }
+
+    vq->unsignalled = 0;
+    if (notify) {
+        vq->stats.notify_sent++;
+    } else {
+        vq->stats.notify_suppressed++;
+    }
+    return notify;
+}
+
+// Ask the driver not to kick while we are polling the ring
+void virtqueue_disable_notify(virtqueue_t* vq) {
+    if (!vq->ready) {
+        return;
+    }
+
+    if (vq->packed) {
+        vq_store_release(&vq->ring.packed.device_event->flags,
+                         (uint16_t)VRING_PACKED_EVENT_FLAG_DISABLE);
+    } else if (!vq->event_idx) {
+        vring_used_t* used = vq->ring.split.used;
+        vq_store_release(&used->flags, (uint16_t)(used->flags | VRING_USED_F_NO_NOTIFY));
+    }
+    // Split with EVENT_IDX: avail_event stays behind the driver, so no kicks
+}
+
+/*
+ * Ask for a kick on the next buffer. Returns true if buffers arrived while
+ * notifications were off; the caller must poll again or it may miss them.
+ */
+bool virtqueue_enable_notify(virtqueue_t* vq) {
+    if (!vq->ready || vq->broken) {
+        return false;
+    }
+
+    if (vq->packed) {
+        vring_packed_event_t* event = vq->ring.packed.device_event;
+
+        if (vq->event_idx) {
+            uint16_t off_wrap = vq->last_avail_idx |
+                                ((uint16_t)vq->avail_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+            vq_store_release(&event->off_wrap, off_wrap);
+            vq_store_release(&event->flags, (uint16_t)VRING_PACKED_EVENT_FLAG_DESC);
+        } else {
+            vq_store_release(&event->flags, (uint16_t)VRING_PACKED_EVENT_FLAG_ENABLE);
+        }
+
+        vq_full_barrier();
+        uint16_t flags = vq_load_acquire(&vq->ring.packed.desc[vq->last_avail_idx].flags);
+        return packed_desc_avail(flags, vq->avail_wrap);
+    }
+
+    vring_used_t* used = vq->ring.split.used;
+    if (vq->event_idx) {
+        uint16_t* avail_event = (uint16_t*)&used->ring[vq->size];
+        vq_store_release(avail_event, vq->last_avail_idx);
+    } else {
+        vq_store_release(&used->flags, (uint16_t)(used->flags & ~VRING_USED_F_NO_NOTIFY));
+    }
+
+    vq_full_barrier();
+    return vq_load_acquire(&vq->ring.split.avail->idx) != vq->last_avail_idx;
+}
+
+/* ==================== ELEMENT DATA ==================== */
+
+// Copy into the writable segments; records the length for the used entry
+uint32_t vq_elem_copy_to(vq_elem_t* elem, const void* data, uint32_t len) {
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+    return vq_elem_copy_to_iov(elem, &iov, 1);
+}
+
+// Scatter several pieces, back to back, into the writable segments
+uint32_t vq_elem_copy_to_iov(vq_elem_t* elem, const struct iovec* iov, uint32_t iovcnt) {
+    uint16_t seg = elem->out_num;
+    uint32_t seg_off = 0;
+    uint32_t copied = 0;
+
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        const uint8_t* src = iov[i].iov_base;
+        uint32_t left = iov[i].iov_len;
+        
+        while (left > 0 && seg < elem->out_num + elem->in_num) {
+            uint32_t chunk = elem->segs[seg].len - seg_off;
+            if (chunk > left) {
+                chunk = left;
+            }
+            memcpy((uint8_t*)elem->segs[seg].base + seg_off, src, chunk);
+            src += chunk;
+            left -= chunk;
+            copied += chunk;
+            seg_off += chunk;
+            if (seg_off == elem->segs[seg].len) {
+                seg++;
+                seg_off = 0;
+            }
+        }
+    }
+
+    elem->used_len = copied;
+    return copied;
+}
+
+// Gather the readable segments into one buffer
+uint32_t vq_elem_copy_from(const vq_elem_t* elem, void* data, uint32_t len) {
+    return vq_elem_copy_from_at(elem, 0, data, len);
+}
+
+// Gather the readable segments, skipping the first skip bytes (a device header)
+uint32_t vq_elem_copy_from_at(const vq_elem_t* elem, uint32_t skip, void* data, uint32_t len) {
+    uint8_t* dst = data;
+    uint32_t copied = 0;
+
+    for (uint16_t i = 0; i < elem->out_num && copied < len; i++) {
+        const uint8_t* src = elem->segs[i].base;
+        uint32_t chunk = elem->segs[i].len;
+        if (skip >= chunk) {
+            skip -= chunk;
+            continue;
+        }
+        src += skip;
+        chunk -= skip;
+        skip = 0;
+        if (chunk > len - copied) {
+            chunk = len - copied;
+        }
+        memcpy(dst + copied, src, chunk);
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+#ifdef VIRTQUEUE_TEST
+/*
+ * A simulated guest driver on both ring layouts: traffic, indirect tables,
+ * EVENT_IDX suppression and malformed chains.
+ * Userspace test: cc -O2 -DVIRTQUEUE_TEST virtqueue.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TEST_MEMORY (8 << 20)
+#define TEST_QUEUE 256
+#define TEST_CHAIN 3            // Header and payload out, response in
+
+static uint8_t* guest;          // Guest-physical address = offset into this
+static uint64_t guest_next;
+#include "../test_check.h"
+
+static void* test_translate(void* ctx, uint64_t gpa, uint32_t len) {
+    (void)ctx;
+    return gpa && gpa < TEST_MEMORY && len <= TEST_MEMORY - gpa ? guest + gpa : NULL;
+}
+
+static uint64_t guest_alloc(uint64_t len, uint64_t align) {
+    guest_next = (guest_next + align - 1) & ~(align - 1);
+    uint64_t gpa = guest_next;
+    guest_next += len;
+    memset(guest + gpa, 0, len);
+    return gpa;
+}
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    bool write;
+} test_seg_t;
+
+// Driver side of one queue, in either layout
+typedef struct {
+    virtqueue_t vq;
+    uint16_t size;
+    bool packed;
+    bool event_idx;
+    bool indirect;
+
+    uint64_t tables;                // One indirect table per head or id
+    uint64_t buffers;               // One set of data buffers per head or id
+    uint16_t chain_len[VQ_MAX_SIZE];
+    uint16_t num_free;
+    uint16_t last_used;
+    uint64_t kicks;
+
+    // Split
+    vring_desc_t* desc;
+    vring_avail_t* avail;
+    vring_used_t* used;
+    uint16_t free_head;
+    uint16_t avail_idx;
+
+    // Packed
+    vring_packed_desc_t* ring;
+    vring_packed_event_t* driver_event;
+    vring_packed_event_t* device_event;
+    uint16_t next_avail;
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t free_ids[VQ_MAX_SIZE];
+    uint16_t num_ids;
+} driver_t;
+
+static int driver_init(driver_t* d, uint16_t size, bool packed, bool event_idx, bool indirect) {
+    uint64_t features = (packed ? 1ULL << VIRTIO_F_RING_PACKED : 0) |
+                        (event_idx ? 1ULL << VIRTIO_F_RING_EVENT_IDX : 0) |
+                        (indirect ? 1ULL << VIRTIO_F_INDIRECT_DESC : 0);
+    uint64_t desc, driver, device;
+
+    memset(d, 0, sizeof(*d));
+    guest_next = 4096;
+    d->size = size;
+    d->packed = packed;
+    d->event_idx = event_idx;
+    d->indirect = indirect;
+    d->num_free = size;
+    d->tables = guest_alloc((uint64_t)size * TEST_CHAIN * sizeof(vring_desc_t), 16);
+    d->buffers = guest_alloc((uint64_t)size * 4096, 4096);
+
+    if (packed) {
+        desc = guest_alloc(size * sizeof(vring_packed_desc_t), 16);
+        driver = guest_alloc(sizeof(vring_packed_event_t), 4);
+        device = guest_alloc(sizeof(vring_packed_event_t), 4);
+        d->ring = (vring_packed_desc_t*)(guest + desc);
+        d->driver_event = (vring_packed_event_t*)(guest + driver);
+        d->device_event = (vring_packed_event_t*)(guest + device);
+        d->avail_wrap = d->used_wrap = true;
+        for (uint16_t i = 0; i < size; i++) {
+            d->free_ids[d->num_ids++] = size - 1 - i;
+        }
+    } else {
+        desc = guest_alloc(size * sizeof(vring_desc_t), 16);
+        driver = guest_alloc(sizeof(vring_avail_t) + (size + 1) * sizeof(uint16_t), 2);
+        device = guest_alloc(sizeof(vring_used_t) + size * sizeof(vring_used_elem_t) + 2, 4);
+        d->desc = (vring_desc_t*)(guest + desc);
+        d->avail = (vring_avail_t*)(guest + driver);
+        d->used = (vring_used_t*)(guest + device);
+        for (uint16_t i = 0; i < size; i++) {
+            d->desc[i].next = i + 1;
+        }
+    }
+
+    if (virtqueue_init(&d->vq, size, features, test_translate, NULL) < 0 ||
+        virtqueue_set_rings(&d->vq, desc, driver, device) < 0) {
+        return -1;
+    }
+    virtqueue_enable_notify(&d->vq);
+    return 0;
+}
+
+// Should the driver kick after making [old, new) available?
+static bool driver_should_kick(driver_t* d, uint16_t old_idx, uint16_t new_idx, bool new_wrap) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (d->packed) {
+        uint16_t flags = __atomic_load_n(&d->device_event->flags, __ATOMIC_ACQUIRE);
+        if (flags != VRING_PACKED_EVENT_FLAG_DESC) {
+            return flags == VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+        uint16_t off_wrap = __atomic_load_n(&d->device_event->off_wrap, __ATOMIC_ACQUIRE);
+        uint16_t off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        if ((bool)(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != new_wrap) {
+            off -= d->size;
+        }
+        return vring_need_event(off, new_idx, old_idx);
+    }
+
+    if (d->event_idx) {
+        uint16_t avail_event = __atomic_load_n((uint16_t*)&d->used->ring[d->size], __ATOMIC_ACQUIRE);
+        return vring_need_event(avail_event, new_idx, old_idx);
+    }
+    return !(__atomic_load_n(&d->used->flags, __ATOMIC_ACQUIRE) & VRING_USED_F_NO_NOTIFY);
+}
+
+/*
+ * Queue count buffers; each carries its sequence number in the payload and
+ * asks for it back in the response. Returns how many were queued.
+ */
+static uint32_t driver_add(driver_t* d, uint32_t count, uint32_t first_seq) {
+    uint16_t old_idx = d->packed ? d->next_avail : d->avail_idx;
+    uint16_t head_slot = d->next_avail;
+    uint16_t head_flags = 0;
+    uint32_t added = 0;
+
+    for (; added < count; added++) {
+        uint16_t ndescs = d->indirect ? 1 : TEST_CHAIN;
+        if (d->num_free < ndescs) {
+            break;
+        }
+
+        uint16_t id = d->packed ? d->free_ids[d->num_ids - 1] : d->free_head;
+        uint64_t buf = d->buffers + (uint64_t)id * 4096;
+        uint32_t seq = first_seq + added;
+        test_seg_t segs[TEST_CHAIN] = {
+            { buf, 16, false },
+            { buf + 16, sizeof(seq), false },
+            { buf + 1024, 64, true },
+        };
+        memset(guest + buf, 0, 1024 + 64);
+        memcpy(guest + buf + 16, &seq, sizeof(seq));
+
+        vring_desc_t chain[TEST_CHAIN];
+        for (int i = 0; i < TEST_CHAIN; i++) {
+            chain[i].addr = segs[i].addr;
+            chain[i].len = segs[i].len;
+            chain[i].flags = (segs[i].write ? VRING_DESC_F_WRITE : 0) |
+                             (i < TEST_CHAIN - 1 ? VRING_DESC_F_NEXT : 0);
+            chain[i].next = i + 1;
+        }
+
+        // Indirect: the chain goes to this buffer's table, the ring gets one descriptor
+        vring_desc_t* direct = chain;
+        vring_desc_t single;
+        if (d->indirect) {
+            uint64_t table = d->tables + (uint64_t)id * TEST_CHAIN * sizeof(vring_desc_t);
+            memcpy(guest + table, chain, sizeof(chain));
+            single.addr = table;
+            single.len = sizeof(chain);
+            single.flags = VRING_DESC_F_INDIRECT;
+            single.next = 0;
+            direct = &single;
+        }
+
+        if (d->packed) {
+            for (uint16_t i = 0; i < ndescs; i++) {
+                vring_packed_desc_t* desc = &d->ring[d->next_avail];
+                uint16_t flags = (direct[i].flags & ~VRING_DESC_F_NEXT) |
+                                 (i < ndescs - 1 ? VRING_DESC_F_NEXT : 0) |
+                                 (d->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED);
+                desc->addr = direct[i].addr;
+                desc->len = direct[i].len;
+                desc->id = id;
+                // The first buffer's head goes last, so the device sees the batch at once
+                if (added == 0 && i == 0) {
+                    head_flags = flags;
+                } else {
+                    __atomic_store_n(&desc->flags, flags, __ATOMIC_RELEASE);
+                }
+                if (++d->next_avail == d->size) {
+                    d->next_avail = 0;
+                    d->avail_wrap = !d->avail_wrap;
+                }
+            }
+            d->num_ids--;
+            d->num_free -= ndescs;
+            d->chain_len[id] = ndescs;
+        } else {
+            uint16_t slot = d->free_head;
+            for (uint16_t i = 0; i < ndescs; i++) {
+                uint16_t next = d->desc[slot].next;
+                d->desc[slot].addr = direct[i].addr;
+                d->desc[slot].len = direct[i].len;
+                d->desc[slot].flags = direct[i].flags;
+                if (i < ndescs - 1) {
+                    d->desc[slot].next = next;
+                }
+                slot = next;
+            }
+            d->chain_len[id] = ndescs;
+            d->free_head = slot;
+            d->num_free -= ndescs;
+            d->avail->ring[d->avail_idx++ & (d->size - 1)] = id;
+        }
+    }
+
+    if (added == 0) {
+        return 0;
+    }
+
+    if (d->packed) {
+        __atomic_store_n(&d->ring[head_slot].flags, head_flags, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&d->avail->idx, d->avail_idx, __ATOMIC_RELEASE);
+    }
+
+    uint16_t new_idx = d->packed ? d->next_avail : d->avail_idx;
+    if (d->packed && new_idx < old_idx) {
+        old_idx -= d->size;  // Same lap as new_idx for the event check
+    }
+    if (driver_should_kick(d, old_idx, new_idx, d->avail_wrap)) {
+        d->kicks++;
+    }
+    return added;
+}
+
+// Reclaim completed buffers, checking each response; returns how many
+static uint32_t driver_reap(driver_t* d, uint32_t* next_seq) {
+    uint32_t reaped = 0;
+
+    for (;;) {
+        uint16_t id;
+        uint32_t len;
+
+        if (d->packed) {
+            vring_packed_desc_t* desc = &d->ring[d->last_used];
+            uint16_t flags = __atomic_load_n(&desc->flags, __ATOMIC_ACQUIRE);
+            bool avail = flags & VRING_PACKED_DESC_F_AVAIL;
+            bool used = flags & VRING_PACKED_DESC_F_USED;
+            if (avail != d->used_wrap || used != d->used_wrap) {
+                break;
+            }
+            id = desc->id;
+            len = desc->len;
+            if (id >= d->size) {
+                CHECK(false, "used id %u out of range", id);
+                break;
+            }
+            d->last_used += d->chain_len[id];
+            if (d->last_used >= d->size) {
+                d->last_used -= d->size;
+                d->used_wrap = !d->used_wrap;
+            }
+            d->free_ids[d->num_ids++] = id;
+            d->num_free += d->chain_len[id];
+        } else {
+            if (d->last_used == __atomic_load_n(&d->used->idx, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            vring_used_elem_t* elem = &d->used->ring[d->last_used++ & (d->size - 1)];
+            id = elem->id;
+            len = elem->len;
+            if (id >= d->size) {
+                CHECK(false, "used id %u out of range", id);
+                break;
+            }
+
+            // Back on the free list, last descriptor first
+            uint16_t tail = id;
+            for (uint16_t i = 1; i < d->chain_len[id]; i++) {
+                tail = d->desc[tail].next;
+            }
+            d->desc[tail].next = d->free_head;
+            d->free_head = id;
+            d->num_free += d->chain_len[id];
+        }
+
+        uint32_t seq;
+        memcpy(&seq, guest + d->buffers + (uint64_t)id * 4096 + 1024, sizeof(seq));
+        CHECK(len == sizeof(seq) && seq == *next_seq, "buffer %u: response %u (len %u), expected %u",
+              id, seq, len, *next_seq);
+        (*next_seq)++;
+        reaped++;
+    }
+
+    return reaped;
+}
+
+// Ask for an interrupt once the used entry count buffers from now is published
+static void driver_want_interrupt_after(driver_t* d, uint32_t count) {
+    if (!d->event_idx) {
+        return;
+    }
+
+    if (d->packed) {
+        uint32_t off = d->last_used + (count - 1) * (d->indirect ? 1 : TEST_CHAIN);
+        bool wrap = d->used_wrap;
+        if (off >= d->size) {
+            off -= d->size;
+            wrap = !wrap;
+        }
+        __atomic_store_n(&d->driver_event->off_wrap,
+                         (uint16_t)(off | (wrap << VRING_PACKED_EVENT_F_WRAP_CTR)), __ATOMIC_RELEASE);
+        __atomic_store_n(&d->driver_event->flags, (uint16_t)VRING_PACKED_EVENT_FLAG_DESC,
+                         __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&d->avail->ring[d->size], (uint16_t)(d->last_used + count - 1),
+                         __ATOMIC_RELEASE);
+    }
+}
+
+// Device: echo each buffer's sequence number into its response; one burst of at most burst
+static uint32_t device_poll(driver_t* d, uint32_t burst, uint64_t* interrupts) {
+    vq_elem_t elems[64];
+
+    uint32_t count = virtqueue_pop_burst(&d->vq, elems, burst > 64 ? 64 : burst);
+    if (count == 0) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t seq = 0;
+        CHECK(elems[i].out_num == 2 && elems[i].in_num == 1 &&
+              elems[i].out_len == 16 + sizeof(seq) && elems[i].in_len == 64,
+              "element shape %u/%u segments, %u/%u bytes", elems[i].out_num, elems[i].in_num,
+              elems[i].out_len, elems[i].in_len);
+        vq_elem_copy_from_at(&elems[i], 16, &seq, sizeof(seq));
+        vq_elem_copy_to(&elems[i], &seq, sizeof(seq));
+    }
+    virtqueue_push_burst(&d->vq, elems, count);
+    if (virtqueue_should_notify(&d->vq)) {
+        (*interrupts)++;
+    }
+    return count;
+}
+
+// Until the ring is empty
+static void device_drain(driver_t* d, uint64_t* interrupts) {
+    while (device_poll(d, 64, interrupts) > 0) {
+    }
+}
+
+// Many laps of the ring with batches of varying size; every buffer round-trips intact
+static void test_traffic(bool packed, bool indirect) {
+    driver_t* d = calloc(1, sizeof(*d));
+    uint32_t sent = 0, received = 0, next_seq = 0;
+    uint64_t interrupts = 0;
+
+    CHECK(d && driver_init(d, TEST_QUEUE, packed, false, indirect) == 0, "driver_init");
+    while (d && received < 20000 && !failures) {
+        uint32_t batch = 1 + (sent * 7919) % 97;
+        sent += driver_add(d, batch, sent);
+        while (device_poll(d, 1 + sent % 64, &interrupts) > 0) {
+        }
+        received += driver_reap(d, &next_seq);
+    }
+
+    CHECK(!d->vq.broken && d->vq.stats.errors == 0, "queue broke during traffic");
+    CHECK(received == sent && d->num_free == TEST_QUEUE, "%u of %u buffers back, %u slots free",
+          received, sent, d->num_free);
+    printf("%-6s %-8s %6u buffers, %5.2f buffers per burst\n", packed ? "packed" : "split",
+           indirect ? "indirect" : "direct", received, (double)d->vq.stats.pushed / d->vq.stats.bursts);
+    free(d);
+}
+
+// With EVENT_IDX the driver hears once per batch, and not at all while the device polls
+static void test_event_idx(bool packed) {
+    driver_t* d = calloc(1, sizeof(*d));
+    uint32_t seq = 0, next_seq = 0;
+    uint64_t interrupts = 0;
+
+    CHECK(d && driver_init(d, TEST_QUEUE, packed, true, false) == 0, "driver_init");
+    if (!d) {
+        return;
+    }
+
+    // Completed one at a time, the interrupt comes only with the batch's last buffer
+    for (int round = 0; round < 50; round++) {
+        uint32_t batch = 10 + round % 20;
+        uint64_t before = interrupts;
+        driver_want_interrupt_after(d, batch);
+        seq += driver_add(d, batch, seq);
+        for (uint32_t i = 0; i < batch; i++) {
+            device_poll(d, 1, &interrupts);
+            if (i < batch - 1) {
+                CHECK(interrupts == before, "%s: interrupt after %u of %u buffers",
+                      packed ? "packed" : "split", i + 1, batch);
+            }
+        }
+        CHECK(interrupts == before + 1, "%s: %llu interrupts for a batch of %u",
+              packed ? "packed" : "split", (unsigned long long)(interrupts - before), batch);
+        driver_reap(d, &next_seq);
+    }
+
+    // While the device polls it wants no kicks; re-enabling reports what it missed
+    virtqueue_disable_notify(&d->vq);
+    uint64_t kicks = d->kicks;
+    seq += driver_add(d, 5, seq);
+    CHECK(d->kicks == kicks, "%s: kicked while the device was polling", packed ? "packed" : "split");
+    CHECK(virtqueue_enable_notify(&d->vq), "%s: buffers added while polling not reported",
+          packed ? "packed" : "split");
+    device_drain(d, &interrupts);
+    driver_reap(d, &next_seq);
+    CHECK(!virtqueue_enable_notify(&d->vq), "%s: empty ring reported as pending",
+          packed ? "packed" : "split");
+    seq += driver_add(d, 1, seq);
+    CHECK(d->kicks == kicks + 1, "%s: no kick once notifications were re-enabled",
+          packed ? "packed" : "split");
+
+    free(d);
+}
+
+// One interrupt and one kick per batch, so their cost shrinks with the batch
+static void test_batching(bool packed) {
+    static const uint32_t batches[] = { 1, 4, 16, 64 };
+
+    for (uint32_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        driver_t* d = calloc(1, sizeof(*d));
+        uint32_t batch = batches[b], sent = 0, next_seq = 0;
+        uint64_t interrupts = 0;
+        struct timespec start, end;
+
+        CHECK(d && driver_init(d, TEST_QUEUE, packed, true, false) == 0, "driver_init");
+        if (!d) {
+            return;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (sent < 200000) {
+            uint64_t kicks = d->kicks;
+            driver_want_interrupt_after(d, batch);
+            sent += driver_add(d, batch, sent);
+            if (d->kicks != kicks) {
+                virtqueue_disable_notify(&d->vq);
+                do {
+                    device_drain(d, &interrupts);
+                } while (virtqueue_enable_notify(&d->vq));
+            }
+            driver_reap(d, &next_seq);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        CHECK(next_seq == sent, "%u of %u buffers back", next_seq, sent);
+        CHECK(interrupts == sent / batch && d->kicks == sent / batch,
+              "%s batch %u: %llu interrupts, %llu kicks for %u buffers", packed ? "packed" : "split",
+              batch, (unsigned long long)interrupts, (unsigned long long)d->kicks, sent);
+        printf("%-6s batch %2u: %.3f interrupts, %.3f kicks per buffer, %.1f Mbuffers/s\n",
+               packed ? "packed" : "split", batch, (double)interrupts / sent,
+               (double)d->kicks / sent, sent / secs / 1e6);
+        free(d);
+    }
+}
+
+// Write one malformed buffer by hand and check that it breaks the queue
+static void expect_broken(driver_t* d, const char* what) {
+    vq_elem_t elem;
+
+    CHECK(virtqueue_pop_burst(&d->vq, &elem, 1) == 0 && d->vq.broken && d->vq.stats.errors == 1,
+          "%s accepted", what);
+    CHECK(virtqueue_pop_burst(&d->vq, &elem, 1) == 0, "%s: broken queue still pops", what);
+}
+
+static void split_publish(driver_t* d, uint16_t head) {
+    d->avail->ring[d->avail_idx++ & (d->size - 1)] = head;
+    __atomic_store_n(&d->avail->idx, d->avail_idx, __ATOMIC_RELEASE);
+}
+
+static void packed_publish(driver_t* d, uint16_t slot, uint64_t addr, uint32_t len, uint16_t flags) {
+    d->ring[slot].addr = addr;
+    d->ring[slot].len = len;
+    d->ring[slot].id = 0;
+    __atomic_store_n(&d->ring[slot].flags, (uint16_t)(flags | VRING_PACKED_DESC_F_AVAIL),
+                     __ATOMIC_RELEASE);
+}
+
+// A queue with indirect tables and nothing outstanding
+static bool fresh_queue(driver_t* d, bool packed) {
+    bool ok = driver_init(d, 16, packed, false, true) == 0;
+    CHECK(ok, "driver_init");
+    return ok;
+}
+
+static void test_malformed(void) {
+    driver_t* d = calloc(1, sizeof(*d));
+    uint64_t buf, table;
+    vring_desc_t* t;
+
+    if (!d) {
+        return;
+    }
+
+    if (fresh_queue(d, false)) {
+        buf = d->buffers;
+        d->desc[0] = (vring_desc_t){ buf, 64, VRING_DESC_F_NEXT, 1 };
+        d->desc[1] = (vring_desc_t){ buf + 64, 64, VRING_DESC_F_NEXT, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split chain loop");
+    }
+    if (fresh_queue(d, false)) {
+        buf = d->buffers;
+        d->desc[0] = (vring_desc_t){ buf, 64, VRING_DESC_F_NEXT, 1 };
+        d->desc[1] = (vring_desc_t){ buf + 64, 0, VRING_DESC_F_WRITE, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split zero-length segment");
+    }
+    if (fresh_queue(d, false)) {
+        buf = d->buffers;
+        d->desc[0] = (vring_desc_t){ buf, 64, VRING_DESC_F_NEXT, 16 };
+        split_publish(d, 0);
+        expect_broken(d, "split next out of range");
+    }
+    if (fresh_queue(d, false)) {
+        buf = d->buffers;
+        d->desc[0] = (vring_desc_t){ buf, 64, VRING_DESC_F_WRITE | VRING_DESC_F_NEXT, 1 };
+        d->desc[1] = (vring_desc_t){ buf + 64, 64, 0, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split readable after writable");
+    }
+    if (fresh_queue(d, false)) {
+        d->desc[0] = (vring_desc_t){ TEST_MEMORY - 16, 64, 0, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split buffer outside guest memory");
+    }
+    if (fresh_queue(d, false)) {
+        d->avail_idx = 17;
+        __atomic_store_n(&d->avail->idx, d->avail_idx, __ATOMIC_RELEASE);
+        expect_broken(d, "split avail index beyond the ring");
+    }
+    if (fresh_queue(d, false)) {
+        table = d->tables;
+        t = (vring_desc_t*)(guest + table);
+        t[0] = (vring_desc_t){ d->buffers, 64, VRING_DESC_F_NEXT, 1 };
+        t[1] = (vring_desc_t){ d->buffers + 64, 64, VRING_DESC_F_NEXT, 0 };
+        d->desc[0] = (vring_desc_t){ table, 2 * sizeof(vring_desc_t), VRING_DESC_F_INDIRECT, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split indirect table loop");
+    }
+    if (fresh_queue(d, false)) {
+        d->desc[0] = (vring_desc_t){ d->tables, 0, VRING_DESC_F_INDIRECT, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split zero-length indirect table");
+    }
+    if (fresh_queue(d, false)) {
+        table = d->tables;
+        t = (vring_desc_t*)(guest + table);
+        t[0] = (vring_desc_t){ table, sizeof(vring_desc_t), VRING_DESC_F_INDIRECT, 0 };
+        d->desc[0] = (vring_desc_t){ table, sizeof(vring_desc_t), VRING_DESC_F_INDIRECT, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split nested indirect table");
+    }
+    if (fresh_queue(d, false)) {
+        table = d->tables;
+        t = (vring_desc_t*)(guest + table);
+        t[0] = (vring_desc_t){ d->buffers, 64, 0, 0 };
+        d->desc[0] = (vring_desc_t){ table, sizeof(vring_desc_t), VRING_DESC_F_INDIRECT | VRING_DESC_F_NEXT, 1 };
+        d->desc[1] = (vring_desc_t){ d->buffers, 64, 0, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "split indirect descriptor with next");
+    }
+
+    if (fresh_queue(d, true)) {
+        for (uint16_t i = 1; i < 16; i++) {
+            packed_publish(d, i, d->buffers + i * 64, 64, VRING_DESC_F_NEXT);
+        }
+        packed_publish(d, 0, d->buffers, 64, VRING_DESC_F_NEXT);
+        expect_broken(d, "packed chain longer than the ring");
+    }
+    if (fresh_queue(d, true)) {
+        packed_publish(d, 1, d->buffers + 64, 0, VRING_DESC_F_WRITE);
+        packed_publish(d, 0, d->buffers, 64, VRING_DESC_F_NEXT);
+        expect_broken(d, "packed zero-length segment");
+    }
+    if (fresh_queue(d, true)) {
+        packed_publish(d, 0, d->tables, 0, VRING_DESC_F_INDIRECT);
+        expect_broken(d, "packed zero-length indirect table");
+    }
+    if (fresh_queue(d, true)) {
+        packed_publish(d, 0, d->tables, sizeof(vring_desc_t) + 4, VRING_DESC_F_INDIRECT);
+        expect_broken(d, "packed indirect table of partial descriptors");
+    }
+    if (fresh_queue(d, true)) {
+        t = (vring_desc_t*)(guest + d->tables);
+        t[0] = (vring_desc_t){ d->buffers, 64, VRING_DESC_F_WRITE, 0 };
+        t[1] = (vring_desc_t){ d->buffers + 64, 64, 0, 0 };
+        packed_publish(d, 0, d->tables, 2 * sizeof(vring_desc_t), VRING_DESC_F_INDIRECT);
+        expect_broken(d, "packed readable after writable in a table");
+    }
+
+    // Indirect tables without the feature are malformed too
+    if (driver_init(d, 16, false, false, false) == 0) {
+        t = (vring_desc_t*)(guest + d->tables);
+        t[0] = (vring_desc_t){ d->buffers, 64, 0, 0 };
+        d->desc[0] = (vring_desc_t){ d->tables, sizeof(vring_desc_t), VRING_DESC_F_INDIRECT, 0 };
+        split_publish(d, 0);
+        expect_broken(d, "indirect table without VIRTIO_F_INDIRECT_DESC");
+    }
+
+    // A reset queue works again
+    CHECK(driver_init(d, 16, false, false, true) == 0, "driver_init after errors");
+    uint32_t next_seq = 0;
+    uint64_t interrupts = 0;
+    driver_add(d, 4, 0);
+    device_drain(d, &interrupts);
+    CHECK(driver_reap(d, &next_seq) == 4, "reset queue serves buffers");
+
+    free(d);
+}
+
+int main(void) {
+    guest = calloc(1, TEST_MEMORY);
+    if (!guest) {
+        return 1;
+    }
+
+    for (int packed = 0; packed < 2; packed++) {
+        test_traffic(packed, false);
+        test_traffic(packed, true);
+        test_event_idx(packed);
+        test_batching(packed);
+    }
+    test_malformed();
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    free(guest);
+    return failures ? 1 : 0;
+}
+#endif
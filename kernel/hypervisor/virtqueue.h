@@ -0,0 +1,191 @@
+/*
+ * QENEX Hypervisor - Virtqueue Library
+ *
+ * Device side of virtio 1.1 virtqueues, in both layouts:
+ *   - Split ring: descriptor table + available ring + used ring
+ *   - Packed ring: one descriptor ring that the driver and device share,
+ *     with AVAIL/USED wrap bits and event suppression structures
+ *
+ * Buffers are taken off the ring in bursts and returned in bursts. One
+ * burst ends in at most one used-index publish and one interrupt decision,
+ * so the cost of a notification is spread over every packet in the burst.
+ * With VIRTIO_F_RING_EVENT_IDX the driver tells us how far the used index
+ * may advance before it wants an interrupt, and we tell it how far the
+ * available index may advance before it should kick.
+ *
+ * The library only touches guest memory through the translate callback,
+ * so it runs unchanged in userspace against a simulated driver.
+ * Ring fields are little-endian; as with the rest of the hypervisor, the
+ * host is assumed to be x86.
+ */
+
+#ifndef QENEX_VIRTQUEUE_H
+#define QENEX_VIRTQUEUE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+/* ==================== VIRTIO RING DEFINITIONS ==================== */
+
+// Feature bits that change ring behavior
+#define VIRTIO_F_INDIRECT_DESC    28
+#define VIRTIO_F_RING_EVENT_IDX   29
+#define VIRTIO_F_RING_PACKED      34
+
+#define VQ_MAX_SIZE 32768
+#define VQ_MAX_SEGS 32          // Segments per buffer; 64KB TSO + header fits
+
+// Descriptor flags (both layouts)
+#define VRING_DESC_F_NEXT         1
+#define VRING_DESC_F_WRITE        2
+#define VRING_DESC_F_INDIRECT     4
+
+// Packed ring ownership bits
+#define VRING_PACKED_DESC_F_AVAIL (1 << 7)
+#define VRING_PACKED_DESC_F_USED  (1 << 15)
+
+// Split ring notification flags (used without EVENT_IDX)
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY     1
+
+// Packed ring event suppression
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) vring_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];        // ring[size] is used_event
+} __attribute__((packed)) vring_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) vring_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem_t ring[];  // Followed by avail_event
+} __attribute__((packed)) vring_used_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} __attribute__((packed)) vring_packed_desc_t;
+
+typedef struct {
+    uint16_t off_wrap;
+    uint16_t flags;
+} __attribute__((packed)) vring_packed_event_t;
+
+/*
+ * Event index check from the virtio spec: true if event_idx lies in
+ * (old, new], i.e. the other side asked to be told somewhere in this batch.
+ */
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* ==================== VIRTQUEUE STRUCTURES ==================== */
+
+// Map guest-physical [gpa, gpa+len) to a host pointer, or NULL if invalid
+typedef void* (*vq_translate_fn)(void* ctx, uint64_t gpa, uint32_t len);
+
+typedef struct {
+    void* base;
+    uint32_t len;
+} vq_seg_t;
+
+// One buffer popped from the ring. Driver-readable segments come first.
+typedef struct {
+    uint16_t id;            // Head index (split) or buffer id (packed)
+    uint16_t ndescs;        // Ring slots the buffer occupied (packed)
+    uint16_t out_num;       // Driver -> device segments
+    uint16_t in_num;        // Device -> driver segments
+    uint32_t out_len;
+    uint32_t in_len;
+    uint32_t used_len;      // Bytes written, set by the device before push
+    vq_seg_t segs[VQ_MAX_SEGS];
+} vq_elem_t;
+
+typedef struct {
+    uint64_t popped;
+    uint64_t pushed;
+    uint64_t bursts;
+    uint64_t notify_sent;        // Interrupts the driver asked for
+    uint64_t notify_suppressed;  // Bursts that ended without one
+    uint64_t errors;             // Malformed chains; the queue is now broken
+} vq_stats_t;
+
+typedef struct {
+    uint16_t size;
+    bool packed;
+    bool event_idx;
+    bool indirect;
+    bool ready;
+    bool broken;            // Driver violated the spec; needs a reset
+
+    vq_translate_fn translate;
+    void* ctx;
+
+    union {
+        struct {
+            vring_desc_t* desc;
+            vring_avail_t* avail;
+            vring_used_t* used;
+        } split;
+        struct {
+            vring_packed_desc_t* desc;
+            vring_packed_event_t* driver_event;  // Driver -> device
+            vring_packed_event_t* device_event;  // Device -> driver
+        } packed;
+    } ring;
+
+    // Device-side cursors
+    uint16_t last_avail_idx;
+    uint16_t used_idx;
+    bool avail_wrap;        // Packed only
+    bool used_wrap;         // Packed only
+    uint16_t unsignalled;   // Used entries published since the last interrupt decision
+
+    // Completions filled but not yet flushed
+    uint16_t fill_count;
+    uint16_t fill_idx;      // Packed only
+    bool fill_wrap;
+    uint16_t fill_head_flags;
+
+    vq_stats_t stats;
+} virtqueue_t;
+
+/* Function prototypes */
+int virtqueue_init(virtqueue_t* vq, uint16_t size, uint64_t features,
+                   vq_translate_fn translate, void* ctx);
+int virtqueue_set_rings(virtqueue_t* vq, uint64_t desc_gpa, uint64_t driver_gpa,
+                        uint64_t device_gpa);
+void virtqueue_reset(virtqueue_t* vq);
+uint32_t virtqueue_pop_burst(virtqueue_t* vq, vq_elem_t* elems, uint32_t max);
+void virtqueue_fill(virtqueue_t* vq, const vq_elem_t* elem);
+void virtqueue_flush(virtqueue_t* vq);
+void virtqueue_push_burst(virtqueue_t* vq, const vq_elem_t* elems, uint32_t count);
+bool virtqueue_should_notify(virtqueue_t* vq);
+void virtqueue_disable_notify(virtqueue_t* vq);
+bool virtqueue_enable_notify(virtqueue_t* vq);
+uint32_t vq_elem_copy_to(vq_elem_t* elem, const void* data, uint32_t len);
+uint32_t vq_elem_copy_to_iov(vq_elem_t* elem, const struct iovec* iov, uint32_t iovcnt);
+uint32_t vq_elem_copy_from(const vq_elem_t* elem, void* data, uint32_t len);
+uint32_t vq_elem_copy_from_at(const vq_elem_t* elem, uint32_t skip, void* data, uint32_t len);
+
+#endif /* QENEX_VIRTQUEUE_H */
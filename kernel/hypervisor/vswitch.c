@@ -0,0 +1,789 @@
+/*
+ * QENEX Hypervisor - Virtual L2 Switch
+ *
+ * Learning switch with lock-free port rings and VLANs. See vswitch.h.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "vswitch.h"
+
+#define MAC_WAYS 4
+#define MAC_BUCKET_BITS __builtin_ctz(VSWITCH_MAC_BUCKETS)
+#define MAC_REFRESH_SEC (VSWITCH_MAC_AGE_SEC / 2)
+#define PORT_NONE 0xFFFF
+#define VLAN_WORDS (VSWITCH_MAX_PORTS / 64)
+#define OUT_DESTS 16                // Destinations batched per flush
+#define ETH_HLEN 14
+#define ETH_ALEN 6
+#define ETH_P_8021Q 0x8100
+
+/* ==================== RINGS ==================== */
+
+// Bounded ring of pointers, any number of producers and consumers
+typedef struct {
+    uint32_t size;
+    uint32_t mask;
+
+    struct {
+        uint32_t head;      // Next slot to reserve
+        uint32_t tail;      // Slots before this are visible
+    } prod __attribute__((aligned(64)));
+
+    struct {
+        uint32_t head;
+        uint32_t tail;
+    } cons __attribute__((aligned(64)));
+
+    void* slots[] __attribute__((aligned(64)));
+} vswitch_ring_t;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static vswitch_ring_t* ring_create(uint32_t size) {
+    size_t bytes = (sizeof(vswitch_ring_t) + size * sizeof(void*) + 63) & ~63UL;
+    vswitch_ring_t* ring = aligned_alloc(64, bytes);
+    if (!ring) {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->size = size;
+    ring->mask = size - 1;
+    return ring;
+}
+
+static inline uint32_t ring_count(vswitch_ring_t* ring) {
+    return __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE);
+}
+
+// Enqueue as many of objs as fit with one reservation; returns how many
+static uint32_t ring_enqueue(vswitch_ring_t* ring, void* const* objs, uint32_t count) {
+    uint32_t head, next, n;
+
+    do {
+        head = __atomic_load_n(&ring->prod.head, __ATOMIC_RELAXED);
+        uint32_t space = ring->size + __atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE) - head;
+        n = count < space ? count : space;
+        if (n == 0) {
+            return 0;
+        }
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&ring->prod.head, &head, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (uint32_t i = 0; i < n; i++) {
+        ring->slots[(head + i) & ring->mask] = objs[i];
+    }
+
+    // Publish in reservation order; acquiring the tail carries earlier writers' slots along
+    while (__atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE) != head) {
+        cpu_relax();
+    }
+    __atomic_store_n(&ring->prod.tail, next, __ATOMIC_RELEASE);
+    return n;
+}
+
+static uint32_t ring_dequeue(vswitch_ring_t* ring, void** objs, uint32_t count) {
+    uint32_t head, next, n;
+
+    do {
+        head = __atomic_load_n(&ring->cons.head, __ATOMIC_RELAXED);
+        uint32_t avail = __atomic_load_n(&ring->prod.tail, __ATOMIC_ACQUIRE) - head;
+        n = count < avail ? count : avail;
+        if (n == 0) {
+            return 0;
+        }
+        next = head + n;
+    } while (!__atomic_compare_exchange_n(&ring->cons.head, &head, next, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (uint32_t i = 0; i < n; i++) {
+        objs[i] = ring->slots[(head + i) & ring->mask];
+    }
+
+    while (__atomic_load_n(&ring->cons.tail, __ATOMIC_ACQUIRE) != head) {
+        cpu_relax();
+    }
+    __atomic_store_n(&ring->cons.tail, next, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* ==================== SWITCH STATE ==================== */
+
+typedef struct {
+    uint64_t key;           // (VLAN + 1) << 48 | MAC; 0 if unused
+    uint64_t value;         // Last seen (seconds) << 32 | port + 1; 0 while being replaced
+} mac_entry_t;
+
+typedef struct {
+    mac_entry_t way[MAC_WAYS];
+} __attribute__((aligned(64))) mac_bucket_t;
+
+typedef struct {
+    bool active;
+    vswitch_port_mode_t mode;
+    uint16_t pvid;
+    vswitch_notify_fn notify;
+    void* ctx;
+    vswitch_ring_t* ring;
+
+    // Written by senders on other threads
+    uint32_t armed __attribute__((aligned(64)));
+
+    // Owned by the thread driving the port
+    uint32_t cache_count __attribute__((aligned(64)));
+    vswitch_pkt_t* cache[VSWITCH_PORT_CACHE];
+    vswitch_port_stats_t stats;
+} __attribute__((aligned(64))) vswitch_port_t;
+
+struct vswitch {
+    vswitch_ring_t* pool;           // Free packets beyond the port caches
+    vswitch_pkt_t* packets;
+    uint32_t pool_packets;
+    mac_bucket_t* macs;
+    pthread_mutex_t config_lock;    // Port and VLAN changes
+
+    uint64_t vlan_members[VSWITCH_VLANS][VLAN_WORDS];
+    vswitch_port_t ports[VSWITCH_MAX_PORTS];
+};
+
+// Coarse clock for MAC ageing; read once per burst
+static uint32_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+/* ==================== MAC TABLE ==================== */
+
+static inline uint64_t mac_key(uint16_t vlan, const uint8_t* mac) {
+    uint64_t key = 0;
+    memcpy(&key, mac, ETH_ALEN);
+    return key | ((uint64_t)(vlan + 1) << 48);
+}
+
+static inline mac_bucket_t* mac_bucket(vswitch_t* sw, uint64_t key) {
+    return &sw->macs[(key * 0x9E3779B97F4A7C15ULL) >> (64 - MAC_BUCKET_BITS)];
+}
+
+// Port the station was last seen on, or PORT_NONE
+static uint16_t mac_lookup(vswitch_t* sw, uint64_t key, uint32_t now) {
+    mac_bucket_t* bucket = mac_bucket(sw, key);
+
+    for (int w = 0; w < MAC_WAYS; w++) {
+        mac_entry_t* entry = &bucket->way[w];
+        if (__atomic_load_n(&entry->key, __ATOMIC_ACQUIRE) != key) {
+            continue;
+        }
+
+        // Re-check the key: the slot may have been handed to another station
+        uint64_t value = __atomic_load_n(&entry->value, __ATOMIC_ACQUIRE);
+        if (!value || __atomic_load_n(&entry->key, __ATOMIC_RELAXED) != key) {
+            return PORT_NONE;
+        }
+
+        uint16_t port = (uint16_t)(value & 0xFFFF) - 1;
+        if (now - (uint32_t)(value >> 32) > VSWITCH_MAC_AGE_SEC ||
+            !__atomic_load_n(&sw->ports[port].active, __ATOMIC_ACQUIRE)) {
+            return PORT_NONE;
+        }
+        return port;
+    }
+
+    return PORT_NONE;
+}
+
+static void mac_learn(vswitch_t* sw, uint64_t key, uint16_t port, uint32_t now) {
+    mac_bucket_t* bucket = mac_bucket(sw, key);
+    uint64_t value = ((uint64_t)now << 32) | (uint32_t)(port + 1);
+    mac_entry_t* victim = NULL;
+    uint32_t victim_age = 0;
+
+    for (int w = 0; w < MAC_WAYS; w++) {
+        mac_entry_t* entry = &bucket->way[w];
+        uint64_t k = __atomic_load_n(&entry->key, __ATOMIC_RELAXED);
+        uint64_t v = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+
+        if (k == key) {
+            // Leave the line shared unless the station moved or is ageing out
+            if ((uint16_t)v != port + 1 || now - (uint32_t)(v >> 32) >= MAC_REFRESH_SEC) {
+                __atomic_store_n(&entry->value, value, __ATOMIC_RELEASE);
+            }
+            return;
+        }
+
+        // Prefer an empty slot, then the stalest one
+        uint32_t age = k ? now - (uint32_t)(v >> 32) : UINT32_MAX;
+        if (!victim || age > victim_age) {
+            victim = entry;
+            victim_age = age;
+        }
+    }
+
+    // Retire the old entry first so no reader pairs its key with our port
+    uint64_t old = __atomic_load_n(&victim->key, __ATOMIC_RELAXED);
+    __atomic_store_n(&victim->value, 0, __ATOMIC_RELEASE);
+    if (__atomic_compare_exchange_n(&victim->key, &old, key, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&victim->value, value, __ATOMIC_RELEASE);
+    }
+}
+
+/* ==================== VLANS ==================== */
+
+static inline bool vlan_member(vswitch_t* sw, uint16_t vlan, uint16_t port) {
+    return (__atomic_load_n(&sw->vlan_members[vlan][port / 64], __ATOMIC_RELAXED) >> (port % 64)) & 1;
+}
+
+static void vlan_set_member(vswitch_t* sw, uint16_t vlan, uint16_t port, bool member) {
+    uint64_t bit = 1ULL << (port % 64);
+    if (member) {
+        __atomic_fetch_or(&sw->vlan_members[vlan][port / 64], bit, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&sw->vlan_members[vlan][port / 64], ~bit, __ATOMIC_RELEASE);
+    }
+}
+
+static void vlan_clear_port(vswitch_t* sw, uint16_t port) {
+    for (uint32_t vlan = 0; vlan < VSWITCH_VLANS; vlan++) {
+        vlan_set_member(sw, vlan, port, false);
+    }
+}
+
+/*
+ * Classify a frame arriving on a port and strip any 802.1Q tag, keeping it
+ * in pkt->tag for trunk egress. Returns the VLAN, or 0 to drop the frame.
+ */
+static uint16_t vlan_ingress(vswitch_t* sw, vswitch_port_t* in, uint16_t port, vswitch_pkt_t* pkt) {
+    uint8_t* frame = vswitch_pkt_frame(pkt);
+    uint16_t tci = 0;
+    uint16_t vlan = in->pvid;
+
+    if (((frame[12] << 8) | frame[13]) == ETH_P_8021Q) {
+        if (pkt->len < ETH_HLEN + 4) {
+            return 0;
+        }
+        tci = (frame[14] << 8) | frame[15];
+        if (tci & 0xFFF) {
+            vlan = tci & 0xFFF;     // VID 0 is priority-only and stays on pvid
+        }
+        memmove(frame + 4, frame, 2 * ETH_ALEN);
+        pkt->head += 4;
+        pkt->len -= 4;
+    }
+
+    if (vlan == 0 || vlan >= VSWITCH_VLANS - 1 || !vlan_member(sw, vlan, port)) {
+        return 0;
+    }
+
+    tci = (tci & 0xF000) | vlan;
+    pkt->tag[0] = ETH_P_8021Q >> 8;
+    pkt->tag[1] = ETH_P_8021Q & 0xFF;
+    pkt->tag[2] = tci >> 8;
+    pkt->tag[3] = tci & 0xFF;
+    return vlan;
+}
+
+/* ==================== PACKET POOL ==================== */
+
+uint32_t vswitch_pkt_alloc(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count) {
+    vswitch_port_t* p = &sw->ports[port];
+
+    if (p->cache_count < count) {
+        p->cache_count += ring_dequeue(sw->pool, (void**)&p->cache[p->cache_count],
+                                       VSWITCH_PORT_CACHE - p->cache_count);
+    }
+
+    uint32_t n = count < p->cache_count ? count : p->cache_count;
+    for (uint32_t i = 0; i < n; i++) {
+        vswitch_pkt_t* pkt = p->cache[--p->cache_count];
+        pkt->refcnt = 1;
+        pkt->head = 0;
+        pkt->len = 0;
+        pkts[i] = pkt;
+    }
+
+    return n;
+}
+
+// Drop one reference to each packet; the last holder returns it to its cache
+void vswitch_pkt_free(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count) {
+    vswitch_port_t* p = &sw->ports[port];
+
+    for (uint32_t i = 0; i < count; i++) {
+        vswitch_pkt_t* pkt = pkts[i];
+        if (__atomic_load_n(&pkt->refcnt, __ATOMIC_ACQUIRE) != 1 &&
+            __atomic_sub_fetch(&pkt->refcnt, 1, __ATOMIC_ACQ_REL) != 0) {
+            continue;
+        }
+
+        if (p->cache_count == VSWITCH_PORT_CACHE) {
+            uint32_t spill = VSWITCH_PORT_CACHE / 2;
+            p->cache_count -= spill;
+            ring_enqueue(sw->pool, (void**)&p->cache[p->cache_count], spill);
+        }
+        p->cache[p->cache_count++] = pkt;
+    }
+}
+
+static void port_release_packets(vswitch_t* sw, uint16_t port) {
+    vswitch_port_t* p = &sw->ports[port];
+    vswitch_pkt_t* pkts[VSWITCH_MAX_BURST];
+    uint32_t n;
+
+    while ((n = ring_dequeue(p->ring, (void**)pkts, VSWITCH_MAX_BURST)) > 0) {
+        vswitch_pkt_free(sw, port, pkts, n);
+    }
+
+    ring_enqueue(sw->pool, (void**)p->cache, p->cache_count);
+    p->cache_count = 0;
+}
+
+/* ==================== FORWARDING ==================== */
+
+// Packets headed for one destination, enqueued with a single reservation
+typedef struct {
+    uint16_t port;
+    uint16_t count;
+    vswitch_pkt_t* pkts[VSWITCH_MAX_BURST];
+} out_batch_t;
+
+typedef struct {
+    uint32_t used;
+    out_batch_t batch[OUT_DESTS];
+} out_t;
+
+static void out_send(vswitch_t* sw, uint16_t from, out_batch_t* batch) {
+    vswitch_port_t* src = &sw->ports[from];
+    vswitch_port_t* dst = &sw->ports[batch->port];
+    uint32_t n = ring_enqueue(dst->ring, (void* const*)batch->pkts, batch->count);
+
+    if (n < batch->count) {
+        src->stats.ring_drops += batch->count - n;
+        vswitch_pkt_free(sw, from, &batch->pkts[n], batch->count - n);
+    }
+    batch->count = 0;
+
+    if (n == 0) {
+        return;
+    }
+
+    // Pairs with the fence in vswitch_rx_arm(): either we see armed or it sees the packets
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (dst->notify && __atomic_load_n(&dst->armed, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&dst->armed, 0, __ATOMIC_ACQ_REL)) {
+        src->stats.notifies++;
+        dst->notify(dst->ctx);
+    }
+}
+
+static void out_flush(vswitch_t* sw, uint16_t from, out_t* out) {
+    for (uint32_t i = 0; i < out->used; i++) {
+        if (out->batch[i].count) {
+            out_send(sw, from, &out->batch[i]);
+        }
+    }
+    out->used = 0;
+}
+
+static void out_add(vswitch_t* sw, uint16_t from, out_t* out, uint16_t port, vswitch_pkt_t* pkt) {
+    out_batch_t* batch = NULL;
+
+    for (uint32_t i = 0; i < out->used; i++) {
+        if (out->batch[i].port == port) {
+            batch = &out->batch[i];
+            break;
+        }
+    }
+
+    if (!batch) {
+        if (out->used == OUT_DESTS) {
+            out_flush(sw, from, out);
+        }
+        batch = &out->batch[out->used++];
+        batch->port = port;
+        batch->count = 0;
+    } else if (batch->count == VSWITCH_MAX_BURST) {
+        out_send(sw, from, batch);
+    }
+
+    batch->pkts[batch->count++] = pkt;
+}
+
+// Replicate by reference to every member of the VLAN except the sender
+static void flood(vswitch_t* sw, uint16_t from, out_t* out, vswitch_pkt_t* pkt) {
+    uint64_t members[VLAN_WORDS];
+    uint32_t targets = 0;
+
+    for (int w = 0; w < VLAN_WORDS; w++) {
+        members[w] = __atomic_load_n(&sw->vlan_members[pkt->vlan][w], __ATOMIC_ACQUIRE);
+    }
+    members[from / 64] &= ~(1ULL << (from % 64));
+    for (int w = 0; w < VLAN_WORDS; w++) {
+        targets += __builtin_popcountll(members[w]);
+    }
+
+    sw->ports[from].stats.flooded++;
+    if (targets == 0) {
+        vswitch_pkt_free(sw, from, &pkt, 1);
+        return;
+    }
+
+    // Every reference exists before the first receiver can drop one
+    pkt->refcnt = targets;
+    for (int w = 0; w < VLAN_WORDS; w++) {
+        while (members[w]) {
+            uint16_t port = w * 64 + __builtin_ctzll(members[w]);
+            members[w] &= members[w] - 1;
+            out_add(sw, from, out, port, pkt);
+        }
+    }
+}
+
+/*
+ * Switch a burst of frames sent by a port. Every packet is consumed:
+ * forwarded, or freed if it is dropped.
+ */
+uint32_t vswitch_tx_burst(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count) {
+    vswitch_port_t* in = &sw->ports[port];
+    uint32_t now = now_sec();
+    out_t out;
+
+    out.used = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        vswitch_pkt_t* pkt = pkts[i];
+        uint16_t vlan = 0;
+
+        if (pkt->len >= ETH_HLEN && pkt->len <= VSWITCH_FRAME_MAX + 4) {
+            vlan = vlan_ingress(sw, in, port, pkt);
+        }
+        if (vlan == 0 || pkt->len > VSWITCH_FRAME_MAX) {
+            in->stats.filtered++;
+            vswitch_pkt_free(sw, port, &pkt, 1);
+            continue;
+        }
+
+        uint8_t* frame = vswitch_pkt_frame(pkt);
+        pkt->vlan = vlan;
+        pkt->in_port = port;
+        in->stats.tx_packets++;
+
+        if (!(frame[ETH_ALEN] & 1)) {
+            mac_learn(sw, mac_key(vlan, frame + ETH_ALEN), port, now);
+        }
+
+        if (frame[0] & 1) {
+            flood(sw, port, &out, pkt);
+            continue;
+        }
+
+        uint16_t dest = mac_lookup(sw, mac_key(vlan, frame), now);
+        if (dest == PORT_NONE) {
+            flood(sw, port, &out, pkt);
+        } else if (dest == port || !vlan_member(sw, vlan, dest)) {
+            vswitch_pkt_free(sw, port, &pkt, 1);
+        } else {
+            out_add(sw, port, &out, dest, pkt);
+        }
+    }
+
+    out_flush(sw, port, &out);
+    return count;
+}
+
+uint32_t vswitch_rx_burst(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count) {
+    vswitch_port_t* p = &sw->ports[port];
+    uint32_t n = ring_dequeue(p->ring, (void**)pkts, count);
+    p->stats.rx_packets += n;
+    return n;
+}
+
+/*
+ * Ask for a notification when packets arrive. Returns true if some are
+ * already waiting, in which case the caller should keep receiving.
+ */
+bool vswitch_rx_arm(vswitch_t* sw, uint16_t port) {
+    vswitch_port_t* p = &sw->ports[port];
+    __atomic_store_n(&p->armed, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return ring_count(p->ring) != 0;
+}
+
+// Describe the frame as this port sends it; trunks get the tag back
+uint32_t vswitch_pkt_egress(vswitch_t* sw, uint16_t port, vswitch_pkt_t* pkt, struct iovec iov[3]) {
+    vswitch_port_t* p = &sw->ports[port];
+    uint8_t* frame = vswitch_pkt_frame(pkt);
+
+    if (p->mode == VSWITCH_PORT_TRUNK && pkt->vlan != p->pvid) {
+        iov[0].iov_base = frame;
+        iov[0].iov_len = 2 * ETH_ALEN;
+        iov[1].iov_base = pkt->tag;
+        iov[1].iov_len = 4;
+        iov[2].iov_base = frame + 2 * ETH_ALEN;
+        iov[2].iov_len = pkt->len - 2 * ETH_ALEN;
+        return 3;
+    }
+
+    iov[0].iov_base = frame;
+    iov[0].iov_len = pkt->len;
+    return 1;
+}
+
+/* ==================== SETUP ==================== */
+
+vswitch_t* vswitch_create(uint32_t pool_packets) {
+    vswitch_t* sw = aligned_alloc(64, (sizeof(vswitch_t) + 63) & ~63UL);
+    if (!sw) {
+        return NULL;
+    }
+    memset(sw, 0, sizeof(*sw));
+    pthread_mutex_init(&sw->config_lock, NULL);
+
+    uint32_t pool_size = 1;
+    while (pool_size < pool_packets) {
+        pool_size <<= 1;
+    }
+
+    sw->pool_packets = pool_packets;
+    sw->pool = ring_create(pool_size);
+    sw->packets = aligned_alloc(64, (size_t)pool_packets * sizeof(vswitch_pkt_t));
+    sw->macs = aligned_alloc(64, VSWITCH_MAC_BUCKETS * sizeof(mac_bucket_t));
+    if (!sw->pool || !sw->packets || !sw->macs) {
+        vswitch_destroy(sw);
+        return NULL;
+    }
+    memset(sw->macs, 0, VSWITCH_MAC_BUCKETS * sizeof(mac_bucket_t));
+
+    for (uint32_t i = 0; i < pool_packets; i++) {
+        void* pkt = &sw->packets[i];
+        ring_enqueue(sw->pool, &pkt, 1);
+    }
+
+    return sw;
+}
+
+void vswitch_destroy(vswitch_t* sw) {
+    if (!sw) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+        free(sw->ports[i].ring);
+    }
+    free(sw->pool);
+    free(sw->packets);
+    free(sw->macs);
+    pthread_mutex_destroy(&sw->config_lock);
+    free(sw);
+}
+
+// New ports start as access ports on VLAN 1
+int vswitch_add_port(vswitch_t* sw, vswitch_notify_fn notify, void* ctx) {
+    pthread_mutex_lock(&sw->config_lock);
+
+    for (uint16_t i = 0; i < VSWITCH_MAX_PORTS; i++) {
+        vswitch_port_t* p = &sw->ports[i];
+        if (p->active) {
+            continue;
+        }
+
+        if (!p->ring) {
+            p->ring = ring_create(VSWITCH_RING_SIZE);
+            if (!p->ring) {
+                break;
+            }
+        }
+
+        p->mode = VSWITCH_PORT_ACCESS;
+        p->pvid = 1;
+        p->notify = notify;
+        p->ctx = ctx;
+        p->armed = 0;
+        port_release_packets(sw, i);
+        memset(&p->stats, 0, sizeof(p->stats));
+        vlan_set_member(sw, 1, i, true);
+        __atomic_store_n(&p->active, true, __ATOMIC_RELEASE);
+
+        pthread_mutex_unlock(&sw->config_lock);
+        return i;
+    }
+
+    pthread_mutex_unlock(&sw->config_lock);
+    return -1;
+}
+
+/*
+ * Detach a port. The caller must have stopped its thread; senders that
+ * already looked it up may still enqueue, so its packets are released
+ * again if the slot is reused.
+ */
+void vswitch_remove_port(vswitch_t* sw, uint16_t port) {
+    vswitch_port_t* p = &sw->ports[port];
+
+    pthread_mutex_lock(&sw->config_lock);
+    if (p->active) {
+        vlan_clear_port(sw, port);
+        __atomic_store_n(&p->active, false, __ATOMIC_RELEASE);
+        port_release_packets(sw, port);
+    }
+    pthread_mutex_unlock(&sw->config_lock);
+}
+
+int vswitch_port_set_vlan(vswitch_t* sw, uint16_t port, vswitch_port_mode_t mode,
+                          uint16_t pvid, const uint16_t* allowed, uint32_t count) {
+    vswitch_port_t* p = &sw->ports[port];
+
+    if (pvid >= VSWITCH_VLANS - 1 || (mode == VSWITCH_PORT_ACCESS && pvid == 0)) {
+        return -1;
+    }
+    for (uint32_t i = 0; mode == VSWITCH_PORT_TRUNK && i < count; i++) {
+        if (allowed[i] == 0 || allowed[i] >= VSWITCH_VLANS - 1) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&sw->config_lock);
+    if (!p->active) {
+        pthread_mutex_unlock(&sw->config_lock);
+        return -1;
+    }
+
+    vlan_clear_port(sw, port);
+    p->mode = mode;
+    p->pvid = pvid;
+    if (pvid) {
+        vlan_set_member(sw, pvid, port, true);
+    }
+    for (uint32_t i = 0; mode == VSWITCH_PORT_TRUNK && i < count; i++) {
+        vlan_set_member(sw, allowed[i], port, true);
+    }
+    pthread_mutex_unlock(&sw->config_lock);
+
+    return 0;
+}
+
+void vswitch_get_port_stats(vswitch_t* sw, uint16_t port, vswitch_port_stats_t* stats) {
+    *stats = sw->ports[port].stats;
+}
+
+#ifdef VSWITCH_BENCH
+/* Userspace benchmark: cc -O2 -DVSWITCH_BENCH vswitch.c -lpthread */
+#include <stdio.h>
+
+#define BENCH_FRAME 64
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_frame(vswitch_pkt_t* pkt, uint32_t dst, uint32_t src, bool broadcast) {
+    uint8_t* frame = vswitch_pkt_frame(pkt);
+    uint8_t mac[ETH_ALEN] = { 0x02, 0, 0, 0, 0, 0 };
+
+    memset(frame, 0, BENCH_FRAME);
+    if (broadcast) {
+        memset(frame, 0xFF, ETH_ALEN);
+    } else {
+        mac[4] = dst >> 8;
+        mac[5] = dst & 0xFF;
+        memcpy(frame, mac, ETH_ALEN);
+    }
+    mac[4] = src >> 8;
+    mac[5] = src & 0xFF;
+    memcpy(frame + ETH_ALEN, mac, ETH_ALEN);
+    frame[12] = 0x08;
+    pkt->len = BENCH_FRAME;
+}
+
+// Every port sends a burst to its neighbour, then every port drains its ring
+static uint64_t bench_run(vswitch_t* sw, uint32_t ports, uint32_t burst, bool broadcast, double seconds) {
+    vswitch_pkt_t* pkts[VSWITCH_MAX_BURST];
+    uint64_t delivered = 0;
+    uint64_t checksum = 0;
+    double start = bench_now();
+
+    while (bench_now() - start < seconds) {
+        for (int round = 0; round < 64; round++) {
+            for (uint32_t p = 0; p < ports; p++) {
+                uint32_t n = vswitch_pkt_alloc(sw, p, pkts, burst);
+                for (uint32_t i = 0; i < n; i++) {
+                    bench_frame(pkts[i], (p + 1) % ports, p, broadcast);
+                }
+                vswitch_tx_burst(sw, p, pkts, n);
+            }
+
+            for (uint32_t p = 0; p < ports; p++) {
+                uint32_t n;
+                while ((n = vswitch_rx_burst(sw, p, pkts, burst)) > 0) {
+                    for (uint32_t i = 0; i < n; i++) {
+                        struct iovec iov[3];
+                        uint32_t cnt = vswitch_pkt_egress(sw, p, pkts[i], iov);
+                        checksum += cnt + ((uint8_t*)iov[0].iov_base)[5];
+                    }
+                    vswitch_pkt_free(sw, p, pkts, n);
+                    delivered += n;
+                }
+            }
+        }
+    }
+
+    double elapsed = bench_now() - start;
+    printf("%-10s %3u ports, burst %2u: %6.2f Mpps delivered (checksum %llu)\n",
+           broadcast ? "broadcast" : "unicast", ports, burst,
+           delivered / elapsed / 1e6, (unsigned long long)checksum);
+    return delivered;
+}
+
+int main(int argc, char** argv) {
+    uint32_t ports = argc > 1 ? (uint32_t)atoi(argv[1]) : 8;
+    uint32_t burst = argc > 2 ? (uint32_t)atoi(argv[2]) : 32;
+
+    if (ports < 2 || ports > VSWITCH_MAX_PORTS || burst == 0 || burst > VSWITCH_MAX_BURST) {
+        fprintf(stderr, "usage: %s [ports 2-%d] [burst 1-%d]\n", argv[0],
+                VSWITCH_MAX_PORTS, VSWITCH_MAX_BURST);
+        return 2;
+    }
+
+    vswitch_t* sw = vswitch_create(ports * (VSWITCH_RING_SIZE + VSWITCH_PORT_CACHE * 2));
+    if (!sw) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (uint32_t p = 0; p < ports; p++) {
+        vswitch_add_port(sw, NULL, NULL);
+    }
+
+    // Warm up: every station announces itself once and gets learned
+    bench_run(sw, ports, 1, true, 0.1);
+    bench_run(sw, ports, burst, false, 2.0);
+    bench_run(sw, ports, burst, true, 2.0);
+
+    for (uint32_t p = 0; p < ports; p++) {
+        vswitch_port_stats_t stats;
+        vswitch_get_port_stats(sw, p, &stats);
+        if (stats.ring_drops || stats.filtered) {
+            printf("port %u: %llu ring drops, %llu filtered\n", p,
+                   (unsigned long long)stats.ring_drops, (unsigned long long)stats.filtered);
+        }
+    }
+
+    vswitch_destroy(sw);
+    return 0;
+}
+#endif
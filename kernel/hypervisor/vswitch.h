@@ -0,0 +1,92 @@
+/*
+ * QENEX Hypervisor - Virtual L2 Switch
+ *
+ * Connects virtual NICs on one host. Every NIC is a port; frames move
+ * between ports as pointers to reference-counted packet buffers:
+ *
+ *   - A frame is copied once into a packet when it leaves a guest and once
+ *     out of it into each receiving guest. Broadcast, multicast and unknown
+ *     unicast frames are replicated by reference, never by copying.
+ *   - Each port has a bounded lock-free ring of packets waiting to be
+ *     received. Senders on any thread enqueue whole bursts with one
+ *     reservation; the port's own thread drains it in bursts.
+ *   - Source MACs are learned per VLAN into a hash table of cache-line
+ *     buckets. Lookups take no lock, and learning only writes when a
+ *     station moves or its entry is about to age out.
+ *   - Access ports carry one untagged VLAN. Trunk ports carry 802.1Q
+ *     tagged frames for their allowed VLANs, and their native VLAN
+ *     untagged. Packets are stored untagged; the tag is added when a
+ *     frame is copied out to a trunk.
+ *
+ * Each port must be driven by one thread at a time: the thread that
+ * transmits on it, receives from it and frees its packets. Any number of
+ * ports can be driven concurrently. Build with -DVSWITCH_BENCH for a
+ * userspace benchmark with synthetic ports.
+ */
+
+#ifndef QENEX_VSWITCH_H
+#define QENEX_VSWITCH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define VSWITCH_MAX_PORTS 256
+#define VSWITCH_MAX_BURST 64
+#define VSWITCH_RING_SIZE 1024              // Packets queued per port
+#define VSWITCH_PORT_CACHE 128              // Free packets kept per port
+#define VSWITCH_MAC_BUCKETS 4096            // 4 entries each, one cache line
+#define VSWITCH_MAC_AGE_SEC 300
+#define VSWITCH_FRAME_MAX 1514              // Untagged, without FCS
+#define VSWITCH_PKT_DATA 1536
+#define VSWITCH_VLANS 4096
+
+typedef enum {
+    VSWITCH_PORT_ACCESS,    // Untagged frames on pvid
+    VSWITCH_PORT_TRUNK      // Tagged allowed VLANs; pvid is native (0 = none)
+} vswitch_port_mode_t;
+
+typedef struct vswitch_pkt {
+    uint32_t refcnt;
+    uint16_t head;          // Frame starts at data + head
+    uint16_t len;           // Frame length, untagged once switched
+    uint16_t vlan;
+    uint16_t in_port;
+    uint8_t tag[4];         // 802.1Q header for trunk egress, ingress priority kept
+    uint8_t data[VSWITCH_PKT_DATA] __attribute__((aligned(64)));
+} vswitch_pkt_t;
+
+// The port's receive ring went from empty to non-empty while armed
+typedef void (*vswitch_notify_fn)(void* ctx);
+
+typedef struct {
+    uint64_t tx_packets;        // Accepted from this port
+    uint64_t rx_packets;        // Received by this port
+    uint64_t flooded;           // Sent to every port in the VLAN
+    uint64_t ring_drops;        // A destination ring was full
+    uint64_t filtered;          // Malformed, or VLAN not allowed on this port
+    uint64_t notifies;
+} vswitch_port_stats_t;
+
+typedef struct vswitch vswitch_t;
+
+static inline uint8_t* vswitch_pkt_frame(vswitch_pkt_t* pkt) {
+    return pkt->data + pkt->head;
+}
+
+/* Function prototypes */
+vswitch_t* vswitch_create(uint32_t pool_packets);
+void vswitch_destroy(vswitch_t* sw);
+int vswitch_add_port(vswitch_t* sw, vswitch_notify_fn notify, void* ctx);
+void vswitch_remove_port(vswitch_t* sw, uint16_t port);
+int vswitch_port_set_vlan(vswitch_t* sw, uint16_t port, vswitch_port_mode_t mode,
+                          uint16_t pvid, const uint16_t* allowed, uint32_t count);
+uint32_t vswitch_pkt_alloc(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count);
+void vswitch_pkt_free(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count);
+uint32_t vswitch_tx_burst(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count);
+uint32_t vswitch_rx_burst(vswitch_t* sw, uint16_t port, vswitch_pkt_t** pkts, uint32_t count);
+bool vswitch_rx_arm(vswitch_t* sw, uint16_t port);
+uint32_t vswitch_pkt_egress(vswitch_t* sw, uint16_t port, vswitch_pkt_t* pkt, struct iovec iov[3]);
+void vswitch_get_port_stats(vswitch_t* sw, uint16_t port, vswitch_port_stats_t* stats);
+
+#endif /* QENEX_VSWITCH_H */
@@ -0,0 +1,18 @@
+#ifndef QENEX_TEST_CHECK_H
+#define QENEX_TEST_CHECK_H
+
+#include <stdio.h>
+
+/*
+ * Shared harness for the userspace self-tests built with -D<MODULE>_TEST.
+ *
+ * CHECK() prints the failure and counts it; the test's main() reports
+ * "FAILED" and returns nonzero when failures is set. Include it once,
+ * inside the test block of the file under test.
+ */
+
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+#endif /* QENEX_TEST_CHECK_H */